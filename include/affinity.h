@@ -0,0 +1,15 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <sched.h>
+#include <stddef.h>
+
+#define CTD_NUMA_NODE_UNSET	-1
+#define CTD_NUMA_NODE_AUTO	-2
+
+int affinity_cpu_add(cpu_set_t *set, int cpu);
+int affinity_init(void);
+void affinity_child(void);
+int affinity_snprintf(char *buf, size_t size);
+
+#endif
@@ -13,6 +13,9 @@ enum {
 	TIMER_FEATURE = 0,
 	TIMER = (1 << TIMER_FEATURE),
 
+	MSG_FEATURE = 1,
+	MSG = (1 << MSG_FEATURE),
+
 	__CACHE_MAX_FEATURE
 };
 #define CACHE_MAX_FEATURE __CACHE_MAX_FEATURE
@@ -32,6 +35,9 @@ struct cache_object {
 	struct	cache *cache;
 	int	status;
 	int	refcnt;
+	uint32_t gen;		/* last resync dump that saw this object */
+	uint16_t delta;		/* NTA_C_* sent as deltas since it was
+				 * sent in full, see DeltaUpdates */
 	long	lifetime;
 	long	lastupdate;
 	void    *owner;
@@ -47,6 +53,16 @@ struct cache_feature {
 };
 
 extern struct cache_feature timer_feature;
+extern struct cache_feature msg_feature;
+
+/* last network message built from the object, see cache_msg.c */
+struct cache_msg {
+	void		*buf;		/* payload, without the header */
+	uint16_t	len;
+	uint8_t		version;	/* header version it was built with */
+	uint8_t		compact;	/* STATE_SYNC(compact) it was built with */
+	uint8_t		dirty;
+};
 
 #define CACHE_MAX_NAMELEN 32
 
@@ -94,6 +110,11 @@ struct cache {
 		uint32_t	flush;
 
 		uint32_t	objects;
+
+		uint32_t	msg_hit;
+		uint32_t	msg_miss;
+
+		uint64_t	bytes;		/* memory used by the objects */
 	} stats;
 };
 
@@ -115,8 +136,13 @@ struct cache_ops {
 
 	/* object allocation, copy and release. */
 	void *(*alloc)(void);
-	void (*copy)(void *dst, void *src, unsigned int flags);
+	int (*copy)(void *dst, void *src, unsigned int flags);
 	void (*free)(void *ptr);
+	/* memory held by the object, for statistics. */
+	size_t (*size)(const void *ptr);
+	/* object in its usual form into dst, if it is stored in some
+	 * other one. */
+	void (*unpack)(const void *ptr, void *dst);
 
 	/* dump and commit. */
 	int (*dump_step)(void *data1, void *n);
@@ -124,11 +150,15 @@ struct cache_ops {
 
 	/* build network message from object. */
 	struct nethdr *(*build_msg)(const struct cache_object *obj, int type);
+	/* build batch record from object in place. */
+	struct nethdr *(*build_rec)(const struct cache_object *obj, int type,
+				    struct nethdr *rec);
 };
 
 /* templates to configure conntrack caching. */
 extern struct cache_ops cache_sync_internal_ct_ops;
 extern struct cache_ops cache_sync_external_ct_ops;
+extern struct cache_ops cache_sync_external_compact_ct_ops;
 extern struct cache_ops cache_stats_ct_ops;
 /* templates to configure expectation caching. */
 extern struct cache_ops cache_sync_internal_exp_ops;
@@ -144,6 +174,8 @@ void cache_object_free(struct cache_object *obj);
 void cache_object_get(struct cache_object *obj);
 int cache_object_put(struct cache_object *obj);
 void cache_object_set_status(struct cache_object *obj, int status);
+void *cache_object_ptr(const struct cache_object *obj, void *dst);
+uint32_t cache_object_hash(const struct cache_object *obj);
 
 int cache_add(struct cache *c, struct cache_object *obj, int id);
 void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr);
@@ -153,6 +185,7 @@ struct cache_object *cache_find(struct cache *c, void *ptr, int *pos);
 void cache_stats(const struct cache *c, int fd);
 void cache_stats_extended(const struct cache *c, int fd);
 void *cache_get_extra(struct cache_object *);
+void *cache_get_feature(const struct cache_object *obj, int feature);
 void cache_iterate(struct cache *c, void *data, int (*iterate)(void *data1, void *data2));
 uint32_t cache_iterate_limit(struct cache *c, void *data, uint32_t from, uint32_t steps, int (*iterate)(void *data1, void *data2));
 
@@ -162,6 +195,7 @@ struct nfct_handle;
 struct __dump_container {
 	int fd;
 	int type;
+	void *ptr;	/* to unpack objects, see cache_object_ptr() */
 };
 
 void cache_dump(struct cache *c, int fd, int type);
@@ -169,8 +203,13 @@ void cache_dump(struct cache *c, int fd, int type);
 struct __commit_container {
 	struct nfct_handle	*h;
 	struct cache		*c;
+	void			*ptr;	/* to unpack objects */
 };
 
+struct nethdr;
+int cache_msg_get(const struct cache_object *obj, struct nethdr *net);
+void cache_msg_set(const struct cache_object *obj, const struct nethdr *net);
+
 int cache_commit(struct cache *c, struct nfct_handle *h, int clientfd);
 void cache_flush(struct cache *c);
 void cache_bulk(struct cache *c);
@@ -1,9 +1,13 @@
 #ifndef _CHANNEL_H_
 #define _CHANNEL_H_
 
+#include <time.h>
+
 #include "mcast.h"
 #include "udp.h"
 #include "tcp.h"
+#include "xdp.h"
+#include "shm.h"
 
 struct channel;
 struct nethdr;
@@ -13,6 +17,8 @@ enum {
 	CHANNEL_MCAST,
 	CHANNEL_UDP,
 	CHANNEL_TCP,
+	CHANNEL_XDP,
+	CHANNEL_SHM,
 	CHANNEL_MAX,
 };
 
@@ -31,6 +37,11 @@ struct tcp_channel {
 	struct tcp_sock *server;
 };
 
+struct shm_channel {
+	struct shm_sock *client;	/* ring of the peer, we write to it */
+	struct shm_sock *server;	/* our ring, we read from it */
+};
+
 #define CHANNEL_F_DEFAULT	(1 << 0)
 #define CHANNEL_F_BUFFERED	(1 << 1)
 #define CHANNEL_F_STREAM	(1 << 2)
@@ -42,6 +53,8 @@ union channel_type_conf {
 	struct mcast_conf mcast;
 	struct udp_conf udp;
 	struct tcp_conf tcp;
+	struct xdp_conf xdp;
+	struct shm_conf shm;
 };
 
 struct channel_conf {
@@ -63,7 +76,23 @@ struct channel_ops {
 	void *	(*open)(void *conf);
 	void	(*close)(void *channel);
 	int	(*send)(void *channel, const void *data, int len);
+	/* optional, one datagram per iovec, returns how many were sent. */
+	int	(*sendv)(void *channel, const struct iovec *iov, int n);
 	int	(*recv)(void *channel, char *buf, int len);
+	/* optional, one datagram per iovec, returns how many were received. */
+	int	(*recvv)(void *channel, const struct iovec *iov, int *len,
+			 int *seg, int n);
+	/* optional, largest datagram that recv may return. */
+	int	(*recv_size)(void *channel);
+	/* optional, bytes taken by send that are still to be delivered. */
+	int	(*send_pending)(void *channel);
+	/* optional, cb is called once nothing is pending to be delivered. */
+	void	(*set_drain_cb)(void *channel, void (*cb)(void *data),
+				void *data);
+	/* optional, channels that receive through several sockets: rx_fd
+	 * returns the i-th one or -1, rx_set picks the one recv reads from. */
+	int	(*rx_fd)(void *channel, int i);
+	void	(*rx_set)(void *channel, int i);
 	int	(*accept)(struct channel *c);
 	int	(*get_fd)(void *channel);
 	int	(*isset)(struct channel *c, fd_set *readfds);
@@ -73,7 +102,34 @@ struct channel_ops {
 				  struct nlif_handle *h, int fd);
 };
 
-struct channel_buffer;
+struct channel_buffer {
+	char	*data;
+	int	size;
+	int	len;
+};
+
+struct channel_buffer *channel_buffer_open(int size, int slack);
+void channel_buffer_close(struct channel_buffer *b);
+
+/* Datagrams that could not be delivered, they are sent again before
+ * anything else goes through the channel. Slots are allocated once, the
+ * oldest datagram is dropped if the ring is full. head and tail run free,
+ * num is a power of two so that they still map to the same slot once they
+ * wrap around. */
+struct channel_errq {
+	char		*data;		/* num slots of size bytes */
+	int		*len;
+	int		size;
+	unsigned int	num;
+	unsigned int	mask;		/* num - 1 */
+	unsigned int	head;		/* next slot to fill */
+	unsigned int	tail;		/* next slot to retry */
+	struct {
+		uint64_t	queued;
+		uint64_t	retried;	/* delivered on retry */
+		uint64_t	dropped;
+	} stats;
+};
 
 struct channel {
 	int			channel_type;
@@ -82,6 +138,7 @@ struct channel {
 	int			channel_ifmtu;
 	unsigned int		channel_flags;
 	struct channel_buffer	*buffer;
+	struct channel_errq	*errq;		/* CHANNEL_F_ERRORS */
 	struct channel_ops	*ops;
 	void			*data;
 	
@@ -89,6 +146,11 @@ struct channel {
 	uint32_t last_seq_recv;	/* last sequence number recv */
 	uint8_t seq_set_sent : 1,
 			seq_set_recv : 1;
+
+	/* last control message from a peer that decodes compact messages,
+	 * and from one that does not, see CompactEncoding */
+	time_t			compact_seen;
+	time_t			tlv_seen;
 };
 
 int channel_init(void);
@@ -98,7 +160,19 @@ void channel_close(struct channel *c);
 
 int channel_send(struct channel *c, const struct nethdr *net);
 int channel_send_flush(struct channel *c);
+int channel_send_buffer(struct channel *c, const void *data, int len);
+int channel_send_buffers(struct channel *c, const struct iovec *iov, int n);
+int channel_payload_size(struct channel *c);
+int channel_send_held(struct channel *c);
 int channel_recv(struct channel *c, char *buf, int size);
+int channel_recvv(struct channel *c, const struct iovec *iov, int *len,
+		  int *seg, int n);
+int channel_recv_size(struct channel *c);
+int channel_send_pending(struct channel *c);
+void channel_set_drain_cb(struct channel *c, void (*cb)(void *data),
+			  void *data);
+int channel_rx_fd(struct channel *c, int i);
+void channel_rx_set(struct channel *c, int i);
 int channel_accept(struct channel *c);
 
 int channel_get_fd(struct channel *c);
@@ -116,11 +190,56 @@ int channel_reverse(struct channel *c, uint32_t length);
 int channel_seqfix(struct channel *c, uint32_t length);
 
 #define MULTICHANNEL_MAX	16
+/* receive sockets per channel, see rx_fd in struct channel_ops */
+#define CHANNEL_RX_MAX		16
+/* datagrams that are sent with one syscall, see multichannel_send_begin() */
+#define MULTICHANNEL_STAGE_MAX	32
+
+/* AIMD: the rate grows by 1/MULTICHANNEL_PACE_STEPS of the maximum with
+ * every acknowledgment and it halves on loss, not more often than once
+ * every MULTICHANNEL_PACE_BACKOFF usecs though. */
+#define MULTICHANNEL_PACE_STEPS		64
+#define MULTICHANNEL_PACE_BACKOFF	100000
+
+/* token bucket that paces what we send, see PacingRate */
+struct multichannel_pace {
+	uint64_t	rate;		/* bytes per second, 0 is no pacing */
+	uint64_t	max_rate;
+	int64_t		tokens;		/* bytes that we may send */
+	int64_t		burst;
+	int		charge;		/* see multichannel_pace_begin() */
+	struct timespec	refill;		/* last time tokens were added */
+	struct timespec	backoff;	/* last decrease */
+	struct {
+		uint64_t	bytes;
+		uint64_t	messages;
+		uint64_t	stalls;		/* ran out of tokens */
+		uint64_t	increase;
+		uint64_t	decrease;
+	} stats;
+};
 
 struct multichannel {
 	int		channel_num;
 	struct channel *channel[MULTICHANNEL_MAX];
-	struct channel *current;
+	struct channel *current;	/* we send through */
+	struct channel *rx_current;	/* we are receiving from */
+	struct channel_buffer *buffer;	/* shared by buffered channels */
+
+	int		dgram;		/* offset of the datagram being filled */
+	int		staging;	/* hold full datagrams until flush */
+	int		staged_num;
+	struct iovec	staged[MULTICHANNEL_STAGE_MAX];
+	uint32_t	closed;		/* datagrams closed so far */
+
+	int		relay;		/* some channel relays messages */
+	int		striping;	/* one channel per message */
+	int		rx_shared;	/* the peer numbers the copies alike */
+	unsigned int	down;		/* channels whose link is down */
+	int		alive_num;
+	struct channel	*alive[MULTICHANNEL_MAX];
+
+	struct multichannel_pace pace;
 };
 
 struct multichannel *multichannel_open(struct channel_conf *conf, int len);
@@ -130,9 +249,25 @@ int multichannel_send_allbut(struct multichannel *m, const struct nethdr *net, s
 int multichannel_reverse_allbut(struct multichannel *m, uint32_t length, struct channel* ex);
 int multichannel_seqfix_allbut(struct multichannel *m, uint32_t length, struct channel* ex);
 int multichannel_send(struct multichannel *c, const struct nethdr *net);
+struct nethdr *multichannel_reserve(struct multichannel *m);
+int multichannel_commit(struct multichannel *m, struct nethdr *net);
+void multichannel_send_begin(struct multichannel *m);
 int multichannel_send_flush(struct multichannel *c);
+int multichannel_send_flush_full(struct multichannel *m);
+int multichannel_send_held(struct multichannel *m, int *fill);
+int multichannel_payload_size(struct multichannel *m);
+int multichannel_send_pending(struct multichannel *m);
+void multichannel_set_drain_cb(struct multichannel *m,
+			       void (*cb)(void *data), void *data);
 int multichannel_recv(struct multichannel *c, char *buf, int size);
 
+void multichannel_set_pace(struct multichannel *m, uint64_t rate);
+void multichannel_pace_begin(struct multichannel *m);
+void multichannel_pace_end(struct multichannel *m);
+uint32_t multichannel_pace_wait(struct multichannel *m);
+void multichannel_pace_ack(struct multichannel *m);
+void multichannel_pace_loss(struct multichannel *m);
+
 void multichannel_stats(struct multichannel *m, int fd);
 void multichannel_stats_extended(struct multichannel *m,
 				 struct nlif_handle *h, int fd);
@@ -141,5 +276,10 @@ int multichannel_get_ifindex(struct multichannel *m, int i);
 int multichannel_get_current_ifindex(struct multichannel *m);
 void multichannel_set_current_channel(struct multichannel *m, int i);
 void multichannel_change_current_channel(struct multichannel *m, struct channel *c);
+int multichannel_get_index(struct multichannel *m, struct channel *c);
+
+void multichannel_set_striping(struct multichannel *m, int on);
+int multichannel_set_channel_up(struct multichannel *m, int i, int up);
+struct channel *multichannel_stripe(struct multichannel *m, uint32_t hash);
 
 #endif /* _CHANNEL_H_ */
@@ -7,11 +7,13 @@
 #include "filter.h"
 #include "channel.h"
 #include "internal.h"
+#include "network.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <syslog.h>
+#include <sched.h>
 
 /* UNIX facilities */
 #define CT_FLUSH_MASTER		0	/* flush kernel conntrack table */
@@ -50,6 +52,7 @@
 #define EXP_DUMP_INT_XML	47	/* dump internal cache in XML	*/
 #define EXP_DUMP_EXT_XML	48	/* dump external cache in XML	*/
 #define SEND_BULKEXP		49	/* send a bulk			*/
+#define STATS_PEERS		50	/* multi-peer stats		*/
 
 #define DEFAULT_CONFIGFILE	"/etc/conntrackd/conntrackd.conf"
 #define DEFAULT_LOCKFILE	"/var/lock/conntrackd.lock"
@@ -72,6 +75,14 @@
 #define CTD_EXPECT		(1UL << 6)
 #define CTD_HELPER		(1UL << 7)
 
+/* wire encoding of state messages */
+#define CTD_COMPACT_OFF		0
+#define CTD_COMPACT_ON		1	/* if the peer supports it */
+#define CTD_COMPACT_FORCE	2
+
+/* buckets of the flush size and hold time histograms */
+#define SYNC_FLUSH_HIST		8
+
 /* FILENAME_MAX is 4096 on my system, perhaps too much? */
 #ifndef FILENAME_MAXLEN
 #define FILENAME_MAXLEN 256
@@ -111,6 +122,10 @@ struct ct_conf {
 	int filter_from_kernelspace;
 	int event_iterations_limit;
 	int systemd;
+	struct {
+		int busy_poll;		/* SO_BUSY_POLL in usecs, 0 is off */
+		int latency_target;	/* event to wire, in usecs */
+	} lowlat;
 	struct {
 		int error_queue_length;
 	} channelc;
@@ -118,6 +133,17 @@ struct ct_conf {
 		int internal_cache_disable;
 		int external_cache_disable;
 		int tcp_window_tracking;
+		int compact_encoding;	/* CTD_COMPACT_* */
+		int delta_updates;
+		int batch_messages;
+		int message_cache;
+		int compact_external_cache;
+		int striping;
+		int flush_hold_time;	/* in usecs, 0 is flush at once */
+		int flush_min_fill;	/* percent of a datagram */
+		int selective_ack;	/* FTFW: nack the holes only */
+		unsigned int pacing_rate; /* in Mbit/s, 0 is no pacing */
+		int node_id;		/* multi-peer FTFW, 0 is off */
 	} sync;
 	struct {
 		int subsys_id;
@@ -130,6 +156,9 @@ struct ct_conf {
 	struct {
 		int type;
 		int prio;
+		int numa_node;
+		cpu_set_t cpu_mask;		/* main process */
+		cpu_set_t child_cpu_mask;	/* forked child processes */
 	} sched;
 	struct {
 		char logfile[FILENAME_MAXLEN];
@@ -155,9 +184,12 @@ struct ct_general_state {
 	struct nfct_handle		*event;         /* event handler */
 	struct nfct_filter		*filter;	/* event filter */
 	int				event_iterations_limit;
+	struct timespec			event_ts;	/* event batch arrival */
+	struct timespec			event_real;	/* same, wall clock */
 
 	struct nfct_handle		*dump;		/* dump handler */
 	struct nfct_handle		*resync;	/* resync handler */
+	uint32_t			resync_gen;	/* current resync dump */
 	struct nfct_handle		*get;		/* get handler */
 	int				get_retval;	/* hackish */
 	struct nfct_handle		*flush;		/* flusher */
@@ -204,6 +236,21 @@ struct commit_runqueue {
 
 #define STATE_SYNC(x) state.sync->x
 
+/* other node of the cluster in multi-peer mode, see NodeId */
+struct sync_peer {
+	uint32_t	last_seq_recv;	/* its sequence numbers */
+	int		seq_set_recv;
+	time_t		seen;		/* last message from it */
+	int		compact;	/* it decodes version 2 */
+	uint64_t	msgs;
+	uint64_t	lost;
+	uint32_t	acked_seq;	/* our sequence numbers */
+	int		acked_set;
+	struct timespec	acked;		/* last acknowledgment from it */
+	int		hello;		/* our hello to it, see sync-ftfw.c */
+	int		hello_back;	/* it said hello, answer it */
+};
+
 struct ct_sync_state {
 	struct external_handler *external;
 
@@ -233,6 +280,70 @@ struct ct_sync_state {
 
 	struct sync_mode *sync;		/* sync mode */
 
+	int compact;			/* send version 2 state messages */
+
+	/* event to wire latency */
+	struct {
+		struct timespec	pending;	/* oldest unflushed event */
+		uint64_t	samples;
+		uint64_t	total;		/* in usecs */
+		uint32_t	max;
+		uint32_t	over_target;
+	} latency;
+
+	/* event to apply latency, from the stamp of the peer messages */
+	struct {
+		uint64_t	samples;
+		uint64_t	total;		/* in usecs */
+		uint32_t	max;
+		uint32_t	over_target;
+	} apply;
+
+	/* flush policy, see FlushHoldTime */
+	struct {
+		struct timespec	since;		/* oldest message held */
+		uint32_t	closed;		/* datagrams closed by then */
+		uint64_t	fill;		/* flushed on FlushMinFill */
+		uint64_t	timer;		/* flushed on FlushHoldTime */
+		uint64_t	size[SYNC_FLUSH_HIST];	/* in bytes */
+		uint64_t	hold[SYNC_FLUSH_HIST];	/* in usecs */
+	} flush;
+
+	/* batch messages */
+	struct {
+		uint64_t	sent;
+		uint64_t	records_sent;
+		uint64_t	recv;
+		uint64_t	records_recv;
+	} batch;
+
+	/* delta updates */
+	struct {
+		uint64_t	sent;
+		uint64_t	full;		/* updates sent in full */
+		uint64_t	refresh;	/* in full after deltas */
+		uint64_t	recv;
+		uint32_t	recv_unknown;	/* entry does not exist */
+		uint32_t	resync;		/* requested for unknown ones */
+		time_t		resync_last;
+	} delta;
+
+	/* multi-peer mode, the messages that we are handling come from
+	 * peer[current]. to is the node that their acknowledgments refer
+	 * to, 0 is all of them. */
+	struct {
+		struct sync_peer	peer[NET_NODE_MAX];
+		uint32_t		live;	/* mask of nodes */
+		int			current;
+		int			to;
+	} peers;
+
+	/* copies received through the redundant links */
+	struct {
+		uint64_t	dropped;
+		uint64_t	old;		/* out of the window */
+	} dedup;
+
 	/* statistics */
 	struct {
 		uint64_t	msg_rcv_malformed;
@@ -11,6 +11,8 @@ struct external_handler {
 		void	(*new)(struct nf_conntrack *ct);
 		void	(*upd)(struct nf_conntrack *ct);
 		int 	(*del)(struct nf_conntrack *ct);
+		/* delta update, returns 0 if the entry does not exist */
+		int	(*merge)(struct nf_conntrack *ct);
 
 		void	(*dump)(int fd, int type);
 		void	(*flush)(void);
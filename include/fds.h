@@ -6,7 +6,9 @@
 struct fds {
 	int	maxfd;
 	fd_set	readfds;
+	fd_set	writefds;
 	struct list_head list;
+	struct list_head write_list;
 };
 
 struct fds_item {
@@ -20,5 +22,8 @@ struct fds *create_fds(void);
 void destroy_fds(struct fds *);
 int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds);
 int unregister_fd(int fd, struct fds *fds);
+int register_fd_write(int fd, void (*cb)(void *data), void *data,
+		      struct fds *fds);
+int unregister_fd_write(int fd, struct fds *fds);
 
 #endif
@@ -5,6 +5,7 @@
 #include <netinet/in.h>
 #include <net/if.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 struct mcast_conf {
 	int ipproto;
@@ -27,6 +28,7 @@ struct mcast_stats {
 	uint64_t bytes;
 	uint64_t messages;
 	uint64_t error;
+	uint64_t syscalls;
 };
 
 struct mcast_sock {
@@ -46,7 +48,10 @@ struct mcast_sock *mcast_client_create(struct mcast_conf *conf);
 void mcast_client_destroy(struct mcast_sock *m);
 
 ssize_t mcast_send(struct mcast_sock *m, const void *data, int size);
+int mcast_sendv(struct mcast_sock *m, const struct iovec *iov, int n);
 ssize_t mcast_recv(struct mcast_sock *m, void *data, int size);
+int mcast_recvv(struct mcast_sock *m, const struct iovec *iov, int *len,
+		int *seg, int n);
 
 int mcast_get_fd(struct mcast_sock *m);
 int mcast_isset(struct mcast_sock *m, fd_set *readfds);
@@ -5,6 +5,8 @@
 #include <sys/types.h>
 
 #define CONNTRACKD_PROTOCOL_VERSION	1
+/* same as version 1, but data messages may carry NTA_COMPACT_* */
+#define CONNTRACKD_PROTOCOL_VERSION_COMPACT	2
 
 struct nf_conntrack;
 struct nf_expect;
@@ -32,7 +34,9 @@ enum nethdr_type {
 	NET_T_STATE_EXP_NEW = 3,
 	NET_T_STATE_EXP_UPD,
 	NET_T_STATE_EXP_DEL,
-	NET_T_STATE_MAX = NET_T_STATE_EXP_DEL,
+	NET_T_STATE_CT_DELTA = 6,	/* tuple and changed attributes */
+	NET_T_STATE_BATCH,		/* records of the types above */
+	NET_T_STATE_MAX = NET_T_STATE_BATCH,
 	NET_T_CTL = 10,
 };
 
@@ -41,10 +45,21 @@ int nethdr_size(int len);
 void nethdr_set(struct nethdr *net, int type);
 void nethdr_set_ack(struct nethdr *net);
 void nethdr_set_ctl(struct nethdr *net);
+void nethdr_set_rec(struct nethdr *net, int type);
+
+int nethdr_batch_init(int size);
+void nethdr_batch_fini(void);
+struct nethdr *nethdr_batch_reserve(void);
+struct nethdr *nethdr_batch_commit(struct nethdr *rec);
+void nethdr_batch_flush(void);
 
 struct cache_object;
 int object_status_to_network_type(struct cache_object *obj);
 
+struct channel;
+void nethdr_set_channel(struct channel *c);
+void nethdr_stripe(const struct cache_object *obj);
+
 #define NETHDR_DATA(x)							 \
 	(struct netattr *)(((char *)x) + NETHDR_SIZ)
 #define NETHDR_TAIL(x)							 \
@@ -68,15 +83,41 @@ struct nethdr_ack {
 };
 #define NETHDR_ACK_SIZ nethdr_align(sizeof(struct nethdr_ack))
 
+/* selective nack: bit i of the map tells that from + i was received, the
+ * others are the holes to resend. Peers that do not know about the map
+ * take it as a plain nack of [from, to]. */
+#define NETHDR_SACK_BITS	256
+
+struct nethdr_sack {
+	struct nethdr_ack	ack;
+	uint8_t			map[NETHDR_SACK_BITS / 8];
+};
+#define NETHDR_SACK_SIZ nethdr_align(sizeof(struct nethdr_sack))
+
 enum {
-	NET_F_UNUSED 	= (1 << 0),
+	NET_F_SEQ	= (1 << 0),	/* control only: same seq in all links */
 	NET_F_RESYNC 	= (1 << 1),
 	NET_F_NACK 	= (1 << 2),
 	NET_F_ACK 	= (1 << 3),
 	NET_F_ALIVE 	= (1 << 4),
 	NET_F_HELLO	= (1 << 5),
 	NET_F_HELLO_BACK= (1 << 6),
+	NET_F_COMPACT	= (1 << 7),	/* control only: I decode version 2 */
+};
+
+/* Multi-peer mode, see NodeId. Data messages carry the node of the sender
+ * in the flags that only control messages use, control messages carry it
+ * in a trailer. Node 0 means no node at all. */
+#define NET_F_NODE	(NET_F_SEQ | NET_F_RESYNC | NET_F_NACK | \
+			 NET_F_ACK | NET_F_ALIVE)
+#define NET_NODE_MAX	32
+
+struct nethdr_node {
+	uint8_t		from;		/* the node that sent it */
+	uint8_t		to;		/* acknowledged node, 0 is all */
+	uint16_t	__pad;
 };
+#define NETHDR_NODE_SIZ	sizeof(struct nethdr_node)
 
 enum {
 	MSG_DATA,
@@ -85,10 +126,13 @@ enum {
 	MSG_BAD,
 };
 
-#define BUILD_NETMSG_FROM_CT(ct, query)				\
+/* maximum size of a message built from one object */
+#define NETMSG_MAXSIZ	4096
+
+/* build the message in place, eg. in the multichannel buffer */
+#define BUILD_NETMSG_FROM_CT_AT(hdr, ct, query)			\
 ({								\
-	static char __net[4096];				\
-	struct nethdr *__hdr = (struct nethdr *) __net;		\
+	struct nethdr *__hdr = (hdr);				\
 	memset(__hdr, 0, NETHDR_SIZ);				\
 	nethdr_set(__hdr, query);				\
 	ct2msg(ct, __hdr);					\
@@ -96,10 +140,19 @@ enum {
 	__hdr;							\
 })
 
-#define BUILD_NETMSG_FROM_EXP(exp, query)			\
+#define BUILD_NETMSG_FROM_CT_DELTA_AT(hdr, ct, mask)		\
+({								\
+	struct nethdr *__hdr = (hdr);				\
+	memset(__hdr, 0, NETHDR_SIZ);				\
+	nethdr_set(__hdr, NET_T_STATE_CT_DELTA);		\
+	ct2msg_delta(ct, __hdr, mask);				\
+	HDR_HOST2NETWORK(__hdr);				\
+	__hdr;							\
+})
+
+#define BUILD_NETMSG_FROM_EXP_AT(hdr, exp, query)		\
 ({								\
-	static char __net[4096];				\
-	struct nethdr *__hdr = (struct nethdr *) __net;		\
+	struct nethdr *__hdr = (hdr);				\
 	memset(__hdr, 0, NETHDR_SIZ);				\
 	nethdr_set(__hdr, query);				\
 	exp2msg(exp, __hdr);					\
@@ -107,6 +160,18 @@ enum {
 	__hdr;							\
 })
 
+#define BUILD_NETMSG_FROM_CT(ct, query)				\
+({								\
+	static char __net[NETMSG_MAXSIZ];			\
+	BUILD_NETMSG_FROM_CT_AT((struct nethdr *)__net, ct, query); \
+})
+
+#define BUILD_NETMSG_FROM_EXP(exp, query)			\
+({								\
+	static char __net[NETMSG_MAXSIZ];			\
+	BUILD_NETMSG_FROM_EXP_AT((struct nethdr *)__net, exp, query); \
+})
+
 struct mcast_sock_multi;
 
 enum {
@@ -120,11 +185,15 @@ enum {
 int nethdr_track_seq(uint32_t seq, uint32_t *exp_seq);
 void nethdr_track_update_seq(uint32_t seq);
 int nethdr_track_is_seq_set(void);
+struct channel *nethdr_track_channel(struct channel *c);
+void nethdr_track_shared(int active);
+int nethdr_track_dup(struct channel *c, uint32_t seq);
 
 struct mcast_conf;
 
 #define IS_DATA(x)	(x->type <= NET_T_STATE_MAX && \
-			(x->flags & ~(NET_F_HELLO | NET_F_HELLO_BACK)) == 0)
+			(x->flags & ~(NET_F_HELLO | NET_F_HELLO_BACK | \
+				      NET_F_NODE)) == 0)
 #define IS_ACK(x)	(x->type == NET_T_CTL && x->flags & NET_F_ACK)
 #define IS_NACK(x)	(x->type == NET_T_CTL && x->flags & NET_F_NACK)
 #define IS_RESYNC(x)	(x->type == NET_T_CTL && x->flags & NET_F_RESYNC)
@@ -231,12 +300,46 @@ enum nta_attr {
 	NTA_LABELS,		/* array of uint32_t (variable length) */
 	NTA_SNAT_IPV6,		/* uint32_t * 4 */
 	NTA_DNAT_IPV6,		/* uint32_t * 4 */
+	NTA_STAMP = 31,		/* struct nta_attr_stamp */
+	NTA_COMPACT_IPV4,	/* struct nta_attr_compact + ipv4 group */
+	NTA_COMPACT_IPV6,	/* struct nta_attr_compact + ipv6 group */
 	NTA_MAX
 };
 
 /* allow to serialize/replicate up to 4k labels per flow */
 #define NTA_LABELS_MAX_SIZE	(4096/sizeof(uint32_t))
 
+/* Fixed layout block that replaces the tuple, status, port, protocol
+ * state, timeout and mark attributes of version 1, the original source and
+ * destination addresses follow. Rare attributes are still sent as TLVs. */
+struct nta_attr_compact {
+	uint16_t	present;	/* NTA_C_* */
+	uint8_t		l4proto;
+	uint8_t		state;		/* TCP, SCTP or DCCP state */
+	uint32_t	status;
+	uint32_t	timeout;
+	uint32_t	mark;
+	uint16_t	sport;
+	uint16_t	dport;
+	uint32_t	addr[];
+};
+
+enum {
+	NTA_C_PORT	= (1 << 0),
+	NTA_C_STATE	= (1 << 1),
+	NTA_C_TIMEOUT	= (1 << 2),
+	NTA_C_MARK	= (1 << 3),
+	NTA_C_STATUS	= (1 << 4),
+	NTA_C_ALL	= NTA_C_PORT | NTA_C_STATE | NTA_C_TIMEOUT |
+			  NTA_C_MARK | NTA_C_STATUS,
+};
+
+/* wall clock time when the sender received the event, see LatencyTarget */
+struct nta_attr_stamp {
+	uint32_t	sec;
+	uint32_t	nsec;
+};
+
 struct nta_attr_natseqadj {
 	uint32_t orig_seq_correction_pos;
 	uint32_t orig_seq_offset_before;
@@ -247,7 +350,13 @@ struct nta_attr_natseqadj {
 };
 
 void ct2msg(const struct nf_conntrack *ct, struct nethdr *n);
+void ct2msg_rest(const struct nf_conntrack *ct, struct nethdr *n);
+struct timespec;
+void nethdr_stamp(struct nethdr *n, const struct timespec *ts);
+int ct_delta(const struct nf_conntrack *old, const struct nf_conntrack *ct);
+void ct2msg_delta(const struct nf_conntrack *ct, struct nethdr *n, int mask);
 int msg2ct(struct nf_conntrack *ct, struct nethdr *n, size_t remain);
+int msg2stamp(struct nethdr *n, struct timespec *ts);
 
 enum nta_exp_attr {
 	NTA_EXP_MASTER_IPV4 = 0,	/* struct nfct_attr_grp_ipv4 */
@@ -41,9 +41,15 @@ struct queue {
 	struct list_head	head;
 	struct evfd		*evfd;
 	char			name[QUEUE_NAMELEN];
+	struct list_head	*slots;		/* QUEUE_F_SEQ */
+	uint32_t		slots_mask;
+	uint32_t		seq_first;	/* oldest sequence number in use */
+	uint32_t		seq_last;	/* newest sequence number in use */
 };
 
 #define QUEUE_F_EVFD (1U << 0)
+/* nodes are kept in a ring indexed by sequence number, see queue_add_seq */
+#define QUEUE_F_SEQ  (1U << 1)
 
 struct queue *queue_create(const char *name,
 			   int max_objects, unsigned int flags);
@@ -51,12 +57,17 @@ void queue_destroy(struct queue *b);
 void queue_stats_show(int fd);
 unsigned int queue_len(const struct queue *b);
 int queue_add(struct queue *b, struct queue_node *n);
+int queue_add_front(struct queue *b, struct queue_node *n);
+int queue_add_seq(struct queue *b, struct queue_node *n, uint32_t seq);
 int queue_del(struct queue_node *n);
 struct queue_node *queue_del_head(struct queue *b);
 int queue_in(struct queue *b, struct queue_node *n);
 void queue_iterate(struct queue *b,
 		   const void *data,
 		   int (*iterate)(struct queue_node *n, const void *data2));
+void queue_iterate_seq(struct queue *b, uint32_t from, uint32_t to,
+		       const void *data,
+		       int (*iterate)(struct queue_node *n, const void *data2));
 int queue_get_eventfd(struct queue *b);
 
 #endif
@@ -0,0 +1,87 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifndef UNIX_PATH_MAX
+#define UNIX_PATH_MAX   108
+#endif
+
+/* default size of the ring, it can hold 16 datagrams of the maximum size */
+#define SHM_RING_SIZE	(1 << 20)
+
+struct shm_conf {
+	char	path[UNIX_PATH_MAX];	/* we publish our receive ring here */
+	char	peer_path[UNIX_PATH_MAX]; /* the peer publishes its ring here */
+	int	size;			/* bytes of our receive ring */
+};
+
+struct shm_stats {
+	uint64_t bytes;
+	uint64_t messages;
+	uint64_t error;
+	uint64_t full;		/* sends rejected, the ring was full */
+	uint64_t wakeups;	/* eventfd notifications */
+};
+
+/* Single producer, single consumer ring of [length][data] records that
+ * lives in a memfd shared by two daemons. Indexes are free running, the
+ * producer and the consumer sit in different cache lines. */
+struct shm_ring {
+	uint32_t	producer;
+	uint32_t	closed;		/* the owner went away, attach again */
+	char		__pad1[56];
+	uint32_t	consumer;
+	char		__pad2[60];
+	uint32_t	size;		/* power of two */
+	uint32_t	__pad3[15];
+	char		data[];
+};
+
+enum shm_sock_state {
+	SHM_SERVER,
+	SHM_CLIENT_DISCONNECTED,
+	SHM_CLIENT_CONNECTING,
+	SHM_CLIENT_CONNECTED
+};
+
+struct shm_sock {
+	int state;	/* enum shm_sock_state */
+	int fd;		/* server: unix socket that we publish the ring at */
+	int conn_fd;	/* connection that the ring was handed over through */
+	int mem_fd;
+	int event_fd;	/* written by the producer if the ring was empty */
+	int attached;	/* server: event_fd is in the event loop already */
+	struct shm_ring *ring;
+	uint32_t size;	/* of the ring, not to trust what the peer maps */
+	size_t map_len;
+	struct sockaddr_un addr;
+	struct shm_stats stats;
+};
+
+struct shm_sock *shm_server_create(struct shm_conf *conf);
+void shm_server_destroy(struct shm_sock *m);
+
+struct shm_sock *shm_client_create(struct shm_conf *conf);
+void shm_client_destroy(struct shm_sock *m);
+
+ssize_t shm_send(struct shm_sock *m, const void *data, int size);
+int shm_sendv(struct shm_sock *m, const struct iovec *iov, int n);
+ssize_t shm_recv(struct shm_sock *m, void *data, int size);
+int shm_accept(struct shm_sock *m);
+
+int shm_get_fd(struct shm_sock *m);
+int shm_isset(struct shm_sock *m, fd_set *readfds);
+int shm_accept_isset(struct shm_sock *m, fd_set *readfds);
+
+int shm_snprintf_stats(char *buf, size_t buflen, char *ifname,
+		       struct shm_sock *client, struct shm_sock *server);
+
+int shm_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
+			const char *status, int active,
+			struct shm_stats *s, struct shm_stats *r);
+
+#endif
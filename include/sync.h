@@ -1,10 +1,12 @@
 #ifndef _SYNC_HOOKS_H_
 #define _SYNC_HOOKS_H_
 
+#include <stdint.h>
 #include <sys/select.h>
 
 struct nethdr;
 struct cache_object;
+struct channel;
 struct fds;
 
 struct sync_mode {
@@ -19,8 +21,14 @@ struct sync_mode {
 	int  (*recv)(const struct nethdr *net);
 	void (*enqueue)(struct cache_object *obj, int type);
 	void (*xmit)(void);
+	/* optional, the link of this channel went down in striping mode */
+	void (*link_down)(struct channel *c);
 };
 
+void sync_send_event(struct nethdr *net);
+void sync_latency_flush(void);
+uint32_t sync_peer_expire(int secs);
+
 extern struct sync_mode sync_alarm;
 extern struct sync_mode sync_ftfw;
 extern struct sync_mode sync_notrack;
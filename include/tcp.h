@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 struct tcp_conf {
 	int ipproto;
@@ -31,6 +32,17 @@ struct tcp_stats {
 	uint64_t bytes;
 	uint64_t messages;
 	uint64_t error;
+	uint64_t queued;	/* sends that did not fit in the socket */
+	uint64_t full;		/* sends rejected, the send queue was full */
+};
+
+/* data that the socket did not take yet, in the order it was sent. */
+struct tcp_sndq {
+	char	*data;
+	size_t	size;
+	size_t	head;		/* first pending byte */
+	size_t	len;		/* pending bytes */
+	int	wait;		/* waiting for the socket to become writable */
 };
 
 enum tcp_sock_state {
@@ -51,6 +63,9 @@ struct tcp_sock {
 	socklen_t sockaddr_len;
 	struct tcp_stats stats;
 	struct tcp_conf *conf;
+	struct tcp_sndq sndq;	/* only for the client side */
+	void (*drain_cb)(void *data);
+	void *drain_data;
 };
 
 struct tcp_sock *tcp_server_create(struct tcp_conf *conf);
@@ -60,6 +75,9 @@ struct tcp_sock *tcp_client_create(struct tcp_conf *conf);
 void tcp_client_destroy(struct tcp_sock *m);
 
 ssize_t tcp_send(struct tcp_sock *m, const void *data, int size);
+int tcp_sendv(struct tcp_sock *m, const struct iovec *iov, int n);
+size_t tcp_send_pending(struct tcp_sock *m);
+void tcp_set_drain_cb(struct tcp_sock *m, void (*cb)(void *data), void *data);
 ssize_t tcp_recv(struct tcp_sock *m, void *data, int size);
 int tcp_accept(struct tcp_sock *m);
 
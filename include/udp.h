@@ -4,11 +4,22 @@
 #include <stdint.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+
+/* receive sockets of one channel that share the port, see SO_REUSEPORT */
+#define UDP_RX_MAX	16
+
+enum udp_steering {
+	UDP_STEER_HASH,		/* the kernel hashes the address and port */
+	UDP_STEER_SOURCE,	/* one socket per source address */
+	UDP_STEER_CPU,		/* the socket of the CPU that got the packet */
+};
 
 struct udp_conf {
 	int ipproto;
 	int reuseaddr;
 	int checksum;
+	int segment_offload;
 	unsigned short port;
 	union {
 		struct {
@@ -25,12 +36,16 @@ struct udp_conf {
 	} client;
 	int sndbuf;
 	int rcvbuf;
+	int rx_sockets;
+	int rx_steering;	/* enum udp_steering */
 };
 
 struct udp_stats {
 	uint64_t bytes;
 	uint64_t messages;
 	uint64_t error;
+	uint64_t syscalls;
+	uint64_t truncated;	/* larger than the receive buffer */
 };
 
 struct udp_sock {
@@ -40,7 +55,14 @@ struct udp_sock {
 		struct sockaddr_in6 ipv6;
 	} addr;
 	socklen_t sockaddr_len;
+	int gso;			/* UDP_SEGMENT on send */
+	int gro;			/* UDP_GRO on receive */
 	struct udp_stats stats;
+	int rx_fd[UDP_RX_MAX];		/* server side, rx_fd[0] is fd */
+	int rx_num;
+	int rx_cur;			/* the one that recv reads from */
+	int rx_steering;		/* enum udp_steering, if it is in use */
+	uint64_t rx_messages[UDP_RX_MAX];
 };
 
 struct udp_sock *udp_server_create(struct udp_conf *conf);
@@ -50,9 +72,14 @@ struct udp_sock *udp_client_create(struct udp_conf *conf);
 void udp_client_destroy(struct udp_sock *m);
 
 ssize_t udp_send(struct udp_sock *m, const void *data, int size);
+int udp_sendv(struct udp_sock *m, const struct iovec *iov, int n);
 ssize_t udp_recv(struct udp_sock *m, void *data, int size);
+int udp_recvv(struct udp_sock *m, const struct iovec *iov, int *len,
+	      int *seg, int n);
 
 int udp_get_fd(struct udp_sock *m);
+int udp_get_rx_fd(struct udp_sock *m, int i);
+void udp_set_rx(struct udp_sock *m, int i);
 int udp_isset(struct udp_sock *m, fd_set *readfds);
 
 int udp_snprintf_stats(char *buf, size_t buflen, char *ifname,
@@ -62,4 +89,6 @@ int udp_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
 			const char *status, int active,
 			struct udp_stats *s, struct udp_stats *r);
 
+int udp_snprintf_rx(char *buf, size_t buflen, struct udp_sock *m);
+
 #endif
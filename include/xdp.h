@@ -0,0 +1,75 @@
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <linux/if_ether.h>
+
+/* frames of the dedicated link, IEEE 802 local experimental ethertype */
+#define XDP_ETHERTYPE	0x88b5
+
+struct xdp_conf {
+	int ifindex;
+	int queue;		/* receive queue of the interface */
+	int zerocopy;
+};
+
+struct xdp_stats {
+	uint64_t bytes;
+	uint64_t messages;
+	uint64_t error;
+	uint64_t syscalls;
+};
+
+/* single producer, single consumer ring shared with the kernel */
+struct xdp_ring {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	void		*desc;
+	uint32_t	size;		/* power of two */
+	void		*map;
+	size_t		map_len;
+};
+
+struct xdp_sock {
+	int		fd;
+	int		ifindex;
+	int		queue;
+	uint32_t	link_flags;	/* XDP_FLAGS_* of the program */
+	int		prog_fd;
+	int		map_fd;
+	char		*umem;
+	size_t		umem_len;
+	int		frame_size;
+	struct xdp_ring	fill;
+	struct xdp_ring	comp;
+	struct xdp_ring	rx;
+	struct xdp_ring	tx;
+	uint64_t	*tx_free;	/* frames that we can send from */
+	int		tx_free_num;
+	struct ethhdr	eth;		/* header of the frames we send */
+	struct xdp_stats stats_send;
+	struct xdp_stats stats_recv;
+};
+
+struct xdp_sock *xdp_sock_create(struct xdp_conf *conf);
+void xdp_sock_destroy(struct xdp_sock *m);
+
+ssize_t xdp_send(struct xdp_sock *m, const void *data, int size);
+int xdp_sendv(struct xdp_sock *m, const struct iovec *iov, int n);
+ssize_t xdp_recv(struct xdp_sock *m, void *data, int size);
+int xdp_recvv(struct xdp_sock *m, const struct iovec *iov, int *len,
+	      int *seg, int n);
+
+int xdp_get_fd(struct xdp_sock *m);
+int xdp_isset(struct xdp_sock *m, fd_set *readfds);
+
+int xdp_snprintf_stats(char *buf, size_t buflen, char *ifname,
+		       struct xdp_stats *s, struct xdp_stats *r);
+
+int xdp_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
+			const char *status, int active,
+			struct xdp_stats *s, struct xdp_stats *r);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * CPU and memory placement of the daemon and its child processes.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "conntrackd.h"
+#include "affinity.h"
+#include "log.h"
+
+#define NUMA_NODE_MAX	1024
+
+static struct {
+	int	numa_node;		/* effective node, -1 if none */
+	int	mempolicy;		/* memory is bound to numa_node */
+} placement = {
+	.numa_node = CTD_NUMA_NODE_UNSET,
+};
+
+int affinity_cpu_add(cpu_set_t *set, int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+
+	CPU_SET(cpu, set);
+	return 0;
+}
+
+/* parse a sysfs cpulist, ie. "0-3,8-11" */
+static int cpulist_parse(const char *s, cpu_set_t *set)
+{
+	char *end;
+	long from, to;
+
+	CPU_ZERO(set);
+	while (*s != '\0' && *s != '\n') {
+		from = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+		to = from;
+		if (*end == '-') {
+			s = end + 1;
+			to = strtol(s, &end, 10);
+			if (end == s)
+				return -1;
+		}
+		for (; from <= to; from++) {
+			if (affinity_cpu_add(set, from) == -1)
+				return -1;
+		}
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+	return 0;
+}
+
+static int sysfs_read(const char *path, char *buf, size_t size)
+{
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	if (fgets(buf, size, fp) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* NUMA node of the network device behind the default dedicated link */
+static int numa_node_from_iface(void)
+{
+	char path[PATH_MAX], buf[64];
+	const char *ifname;
+
+	if (!(CONFIG(flags) & CTD_SYNC_MODE) || CONFIG(channel_num) == 0)
+		return CTD_NUMA_NODE_UNSET;
+
+	ifname = CONFIG(channel)[CONFIG(channel_default)].channel_ifname;
+	if (ifname[0] == '\0')
+		return CTD_NUMA_NODE_UNSET;
+
+	snprintf(path, sizeof(path),
+		 "/sys/class/net/%s/device/numa_node", ifname);
+	if (sysfs_read(path, buf, sizeof(buf)) == -1)
+		return CTD_NUMA_NODE_UNSET;
+
+	/* the kernel reports -1 if the device has no NUMA affinity */
+	return atoi(buf) < 0 ? CTD_NUMA_NODE_UNSET : atoi(buf);
+}
+
+static int numa_node_cpus(int node, cpu_set_t *set)
+{
+	char path[PATH_MAX], buf[4096];
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+	if (sysfs_read(path, buf, sizeof(buf)) == -1)
+		return -1;
+
+	return cpulist_parse(buf, set);
+}
+
+static int numa_node_bind(int node)
+{
+	unsigned long nodemask[NUMA_NODE_MAX / (8 * sizeof(unsigned long))];
+
+	if (node >= NUMA_NODE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8 * sizeof(unsigned long))] |=
+		1UL << (node % (8 * sizeof(unsigned long)));
+
+	/* MPOL_PREFERRED falls back to other nodes under memory pressure
+	 * instead of OOMing the daemon. */
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+		       NUMA_NODE_MAX);
+}
+
+int affinity_init(void)
+{
+	int node = CONFIG(sched).numa_node;
+
+	if (node == CTD_NUMA_NODE_AUTO) {
+		node = numa_node_from_iface();
+		if (node == CTD_NUMA_NODE_UNSET) {
+			dlog(LOG_WARNING, "cannot find NUMA node of dedicated "
+			     "link, not binding memory");
+		}
+	}
+
+	if (node >= 0) {
+		/* default to the CPUs that are local to the node */
+		if (CPU_COUNT(&CONFIG(sched).cpu_mask) == 0 &&
+		    numa_node_cpus(node, &CONFIG(sched).cpu_mask) == -1) {
+			dlog(LOG_ERR, "cannot get CPUs of NUMA node %d", node);
+			return -1;
+		}
+		if (numa_node_bind(node) == -1) {
+			dlog(LOG_ERR, "cannot bind memory to NUMA node %d: %s",
+			     node, strerror(errno));
+			return -1;
+		}
+		placement.numa_node = node;
+		placement.mempolicy = 1;
+	}
+
+	if (CPU_COUNT(&CONFIG(sched).cpu_mask) > 0 &&
+	    sched_setaffinity(0, sizeof(cpu_set_t),
+			      &CONFIG(sched).cpu_mask) == -1) {
+		dlog(LOG_ERR, "cannot set CPU affinity: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Called from the child right after fork(). The CPU mask and the memory
+ * policy of the parent are inherited, so only override the CPU mask if
+ * the user wants child processes to run somewhere else. */
+void affinity_child(void)
+{
+	if (CPU_COUNT(&CONFIG(sched).child_cpu_mask) == 0)
+		return;
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t),
+			      &CONFIG(sched).child_cpu_mask) == -1) {
+		dlog(LOG_WARNING, "cannot set CPU affinity of child "
+		     "process: %s", strerror(errno));
+	}
+}
+
+static int cpulist_snprintf(char *buf, size_t size, const cpu_set_t *set)
+{
+	int cpu, from = -1, ret, len = 0;
+
+	if (CPU_COUNT(set) == 0)
+		return snprintf(buf, size, "any");
+
+	for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, set)) {
+			if (from == -1)
+				from = cpu;
+			continue;
+		}
+		if (from == -1)
+			continue;
+
+		if (from == cpu - 1) {
+			ret = snprintf(buf + len, size - len, "%s%d",
+				       len ? "," : "", from);
+		} else {
+			ret = snprintf(buf + len, size - len, "%s%d-%d",
+				       len ? "," : "", from, cpu - 1);
+		}
+		if (ret < 0 || (size_t)ret >= size - len)
+			break;
+		len += ret;
+		from = -1;
+	}
+	return len;
+}
+
+int affinity_snprintf(char *buf, size_t size)
+{
+	char cpus[256], child_cpus[256];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		CPU_ZERO(&set);
+
+	cpulist_snprintf(cpus, sizeof(cpus), &set);
+	cpulist_snprintf(child_cpus, sizeof(child_cpus),
+			 CPU_COUNT(&CONFIG(sched).child_cpu_mask) ?
+			 &CONFIG(sched).child_cpu_mask : &set);
+
+	return snprintf(buf, size,
+			"placement:\n"
+			"\tcurrent CPU:\t\t\t%12d\n"
+			"\tdaemon CPUs:\t\t\t%12s\n"
+			"\tchild process CPUs:\t\t%12s\n"
+			"\tNUMA node:\t\t\t%12d\n"
+			"\tmemory bound to node:\t\t%12s\n\n",
+			sched_getcpu(), cpus, child_cpus,
+			placement.numa_node,
+			placement.mempolicy ? "yes" : "no");
+}
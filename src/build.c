@@ -18,6 +18,7 @@
  */
 
 #include <string.h>
+#include <time.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include "network.h"
 #include "conntrackd.h"
@@ -226,10 +227,116 @@ static struct build_l4proto {
 	[IPPROTO_UDP]		= { .build = build_l4proto_udp },
 };
 
-void ct2msg(const struct nf_conntrack *ct, struct nethdr *n)
+static int ct_state_attr(uint8_t l4proto)
 {
-	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	switch(l4proto) {
+	case IPPROTO_TCP:
+		return ATTR_TCP_STATE;
+	case IPPROTO_SCTP:
+		return ATTR_SCTP_STATE;
+	case IPPROTO_DCCP:
+		return ATTR_DCCP_STATE;
+	}
+	return -1;
+}
+
+static inline int l4proto_has_ports(uint8_t l4proto)
+{
+	return l4proto_fcn[l4proto].build != NULL &&
+	       l4proto_fcn[l4proto].build != build_l4proto_icmp;
+}
+
+/* only the NTA_C_* attributes in mask are sent */
+static uint16_t
+ct_build_compact(const struct nf_conntrack *ct, struct nethdr *n, 
+		 uint8_t l4proto, uint16_t mask)
+{
+	struct nta_attr_compact *c;
+	uint16_t present = 0;
+	int state_attr = ct_state_attr(l4proto);
+
+	if (nfct_attr_grp_is_set(ct, ATTR_GRP_ORIG_IPV6)) {
+		c = put_header(n, NTA_COMPACT_IPV6, sizeof(*c) +
+			       sizeof(struct nfct_attr_grp_ipv6));
+		nfct_get_attr_grp(ct, ATTR_GRP_ORIG_IPV6, c->addr);
+	} else {
+		c = put_header(n, NTA_COMPACT_IPV4, sizeof(*c) +
+			       sizeof(struct nfct_attr_grp_ipv4));
+		nfct_get_attr_grp(ct, ATTR_GRP_ORIG_IPV4, c->addr);
+	}
+	memset(c, 0, sizeof(*c));
+
+	c->l4proto = l4proto;
 
+	if (mask & NTA_C_STATUS) {
+		c->status = htonl(nfct_get_attr_u32(ct, ATTR_STATUS));
+		present |= NTA_C_STATUS;
+	}
+	if ((mask & NTA_C_STATE) &&
+	    state_attr != -1 && nfct_attr_is_set(ct, state_attr)) {
+		c->state = nfct_get_attr_u8(ct, state_attr);
+		present |= NTA_C_STATE;
+	}
+	if ((mask & NTA_C_PORT) && l4proto_has_ports(l4proto) &&
+	    nfct_attr_grp_is_set(ct, ATTR_GRP_ORIG_PORT)) {
+		struct nfct_attr_grp_port port;
+
+		nfct_get_attr_grp(ct, ATTR_GRP_ORIG_PORT, &port);
+		c->sport = port.sport;
+		c->dport = port.dport;
+		present |= NTA_C_PORT;
+	}
+	if ((mask & NTA_C_TIMEOUT) &&
+	    !CONFIG(commit_timeout) && nfct_attr_is_set(ct, ATTR_TIMEOUT)) {
+		c->timeout = htonl(nfct_get_attr_u32(ct, ATTR_TIMEOUT));
+		present |= NTA_C_TIMEOUT;
+	}
+	if ((mask & NTA_C_MARK) && nfct_attr_is_set(ct, ATTR_MARK)) {
+		c->mark = htonl(nfct_get_attr_u32(ct, ATTR_MARK));
+		present |= NTA_C_MARK;
+	}
+	c->present = htons(present);
+
+	return present;
+}
+
+/* the remaining protocol information is rare enough to be a TLV */
+static void
+ct_build_compact_l4proto(const struct nf_conntrack *ct, struct nethdr *n,
+			 uint8_t l4proto, uint16_t present)
+{
+	switch(l4proto) {
+	case IPPROTO_TCP:
+		if ((present & NTA_C_STATE) &&
+		    CONFIG(sync).tcp_window_tracking) {
+			ct_build_u8(ct, ATTR_TCP_WSCALE_ORIG, n,
+				    NTA_TCP_WSCALE_ORIG);
+			ct_build_u8(ct, ATTR_TCP_WSCALE_REPL, n,
+				    NTA_TCP_WSCALE_REPL);
+		}
+		break;
+	case IPPROTO_SCTP:
+		if (present & NTA_C_STATE) {
+			ct_build_u32(ct, ATTR_SCTP_VTAG_ORIG, n,
+				     NTA_SCTP_VTAG_ORIG);
+			ct_build_u32(ct, ATTR_SCTP_VTAG_REPL, n,
+				     NTA_SCTP_VTAG_REPL);
+		}
+		break;
+	case IPPROTO_DCCP:
+		if (present & NTA_C_STATE)
+			ct_build_u8(ct, ATTR_DCCP_ROLE, n, NTA_DCCP_ROLE);
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		build_l4proto_icmp(ct, n);
+		break;
+	}
+}
+
+static void
+ct_build_tlv(const struct nf_conntrack *ct, struct nethdr *n, uint8_t l4proto)
+{
 	if (nfct_attr_grp_is_set(ct, ATTR_GRP_ORIG_IPV4)) {
 		ct_build_group(ct, ATTR_GRP_ORIG_IPV4, n, NTA_IPV4, 
 			      sizeof(struct nfct_attr_grp_ipv4));
@@ -248,7 +355,11 @@ void ct2msg(const struct nf_conntrack *ct, struct nethdr *n)
 		ct_build_u32(ct, ATTR_TIMEOUT, n, NTA_TIMEOUT);
 	if (nfct_attr_is_set(ct, ATTR_MARK))
 		ct_build_u32(ct, ATTR_MARK, n, NTA_MARK);
+}
 
+/* master, NAT, helper and labels, the same in both encodings */
+static void ct_build_rest(const struct nf_conntrack *ct, struct nethdr *n)
+{
 	/* setup the master conntrack */
 	if (nfct_attr_grp_is_set(ct, ATTR_GRP_MASTER_IPV4)) {
 		ct_build_group(ct, ATTR_GRP_MASTER_IPV4, n, NTA_MASTER_IPV4,
@@ -307,6 +418,121 @@ void ct2msg(const struct nf_conntrack *ct, struct nethdr *n)
 		ct_build_clabel(ct, n);
 }
 
+void ct2msg(const struct nf_conntrack *ct, struct nethdr *n)
+{
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+
+	if (STATE_SYNC(compact)) {
+		uint16_t present;
+
+		n->version = CONNTRACKD_PROTOCOL_VERSION_COMPACT;
+		present = ct_build_compact(ct, n, l4proto, NTA_C_ALL);
+		ct_build_compact_l4proto(ct, n, l4proto, present);
+	} else
+		ct_build_tlv(ct, n, l4proto);
+
+	ct_build_rest(ct, n);
+}
+
+/* the attributes that the compact block leaves out, to store conntracks */
+void ct2msg_rest(const struct nf_conntrack *ct, struct nethdr *n)
+{
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	int state_attr = ct_state_attr(l4proto);
+	uint16_t present = 0;
+
+	if (state_attr != -1 && nfct_attr_is_set(ct, state_attr))
+		present |= NTA_C_STATE;
+
+	ct_build_compact_l4proto(ct, n, l4proto, present);
+	ct_build_rest(ct, n);
+}
+
+static inline int
+ct_changed_u32(const struct nf_conntrack *old, const struct nf_conntrack *ct,
+	       int attr)
+{
+	return nfct_attr_is_set(ct, attr) &&
+	       (!nfct_attr_is_set(old, attr) ||
+		nfct_get_attr_u32(old, attr) != nfct_get_attr_u32(ct, attr));
+}
+
+/* Returns the NTA_C_* attributes of the event ct that differ from old, ie.
+ * what we replicated last time, or -1 if a full message has to be sent. */
+int ct_delta(const struct nf_conntrack *old, const struct nf_conntrack *ct)
+{
+	uint8_t l4proto = nfct_get_attr_u8(old, ATTR_L4PROTO);
+	int state_attr = ct_state_attr(l4proto);
+	int mask = 0;
+
+	/* ICMP needs type, code and id to find the entry */
+	if (!l4proto_has_ports(l4proto))
+		return -1;
+
+	/* these may change once the entry is confirmed, but rarely */
+	if (nfct_attr_is_set(ct, ATTR_CONNLABELS) ||
+	    nfct_attr_is_set_array(ct, nat_type, 6))
+		return -1;
+
+	if (ct_changed_u32(old, ct, ATTR_STATUS))
+		mask |= NTA_C_STATUS;
+	if (state_attr != -1 && nfct_attr_is_set(ct, state_attr) &&
+	    (!nfct_attr_is_set(old, state_attr) ||
+	     nfct_get_attr_u8(old, state_attr) !=
+	     nfct_get_attr_u8(ct, state_attr)))
+		mask |= NTA_C_STATE;
+	if (!CONFIG(commit_timeout) && ct_changed_u32(old, ct, ATTR_TIMEOUT))
+		mask |= NTA_C_TIMEOUT;
+	if (ct_changed_u32(old, ct, ATTR_MARK))
+		mask |= NTA_C_MARK;
+
+	return mask;
+}
+
+/* the tuple plus the NTA_C_* attributes in mask */
+void ct2msg_delta(const struct nf_conntrack *ct, struct nethdr *n, int mask)
+{
+	uint8_t l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+	int state_attr = ct_state_attr(l4proto);
+
+	if (STATE_SYNC(compact)) {
+		n->version = CONNTRACKD_PROTOCOL_VERSION_COMPACT;
+		ct_build_compact(ct, n, l4proto, mask | NTA_C_PORT);
+		return;
+	}
+
+	if (nfct_attr_grp_is_set(ct, ATTR_GRP_ORIG_IPV4)) {
+		ct_build_group(ct, ATTR_GRP_ORIG_IPV4, n, NTA_IPV4,
+			      sizeof(struct nfct_attr_grp_ipv4));
+	} else if (nfct_attr_grp_is_set(ct, ATTR_GRP_ORIG_IPV6)) {
+		ct_build_group(ct, ATTR_GRP_ORIG_IPV6, n, NTA_IPV6,
+			      sizeof(struct nfct_attr_grp_ipv6));
+	}
+	ct_build_u8(ct, ATTR_L4PROTO, n, NTA_L4PROTO);
+	ct_build_group(ct, ATTR_GRP_ORIG_PORT, n, NTA_PORT,
+		      sizeof(struct nfct_attr_grp_port));
+
+	if (mask & NTA_C_STATUS)
+		ct_build_u32(ct, ATTR_STATUS, n, NTA_STATUS);
+	if ((mask & NTA_C_STATE) && state_attr != -1) {
+		switch(l4proto) {
+		case IPPROTO_TCP:
+			ct_build_u8(ct, state_attr, n, NTA_TCP_STATE);
+			break;
+		case IPPROTO_SCTP:
+			ct_build_u8(ct, state_attr, n, NTA_SCTP_STATE);
+			break;
+		case IPPROTO_DCCP:
+			ct_build_u8(ct, state_attr, n, NTA_DCCP_STATE);
+			break;
+		}
+	}
+	if (mask & NTA_C_TIMEOUT)
+		ct_build_u32(ct, ATTR_TIMEOUT, n, NTA_TIMEOUT);
+	if (mask & NTA_C_MARK)
+		ct_build_u32(ct, ATTR_MARK, n, NTA_MARK);
+}
+
 static void
 exp_build_l4proto_tcp(const struct nf_conntrack *ct, struct nethdr *n, int a)
 {
@@ -433,3 +659,16 @@ void exp2msg(const struct nf_expect *exp, struct nethdr *n)
 	if (nfexp_attr_is_set(exp, ATTR_EXP_FN))
 		exp_build_str(exp, ATTR_EXP_FN, n, NTA_EXP_FN);
 }
+
+/* append the time when the event was received, the header is already in
+ * network byte order. */
+void nethdr_stamp(struct nethdr *n, const struct timespec *ts)
+{
+	struct nta_attr_stamp *s;
+
+	n->len = ntohs(n->len);
+	s = put_header(n, NTA_STAMP, sizeof(*s));
+	s->sec = htonl(ts->tv_sec);
+	s->nsec = htonl(ts->tv_nsec);
+	n->len = htons(n->len);
+}
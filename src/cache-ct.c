@@ -27,6 +27,7 @@
 #include "network.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
@@ -115,9 +116,284 @@ void cache_ct_free(void *ptr)
 	nfct_destroy(ptr);
 }
 
-void cache_ct_copy(void *dst, void *src, unsigned int flags)
+int cache_ct_copy(void *dst, void *src, unsigned int flags)
 {
 	nfct_copy(dst, src, flags);
+	return 0;
+}
+
+static size_t cache_ct_size(const void *ptr)
+{
+	return nfct_maxsize();
+}
+
+/*
+ * External cache entries can be stored in a compact form, which takes a
+ * fraction of the memory of a conntrack object: the original tuple to look
+ * them up, the attributes that change often as plain fields, and the rest
+ * as the TLVs of the network message. They are turned back into conntrack
+ * objects to dump and commit them.
+ */
+struct ct_blob_key {
+	uint32_t	src[4];
+	uint32_t	dst[4];
+	uint16_t	sport;
+	uint16_t	dport;
+	uint16_t	zone;
+	uint8_t		l3proto;
+	uint8_t		l4proto;
+};
+
+struct ct_blob {
+	struct ct_blob_key	key;
+	uint32_t		id;
+	uint32_t		status;
+	uint32_t		timeout;
+	uint32_t		mark;
+	uint16_t		present;	/* NTA_C_* of the fields above */
+	uint8_t			state;
+	uint16_t		len;
+	uint8_t			*data;		/* rest of the attributes */
+};
+
+static void ct_blob_key(struct ct_blob_key *k, const struct nf_conntrack *ct)
+{
+	memset(k, 0, sizeof(*k));
+	k->l3proto = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	k->l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+
+	switch(k->l3proto) {
+	case AF_INET:
+		k->src[0] = nfct_get_attr_u32(ct, ATTR_IPV4_SRC);
+		k->dst[0] = nfct_get_attr_u32(ct, ATTR_IPV4_DST);
+		break;
+	case AF_INET6:
+		memcpy(k->src, nfct_get_attr(ct, ATTR_IPV6_SRC),
+		       sizeof(k->src));
+		memcpy(k->dst, nfct_get_attr(ct, ATTR_IPV6_DST),
+		       sizeof(k->dst));
+		break;
+	}
+
+	switch(k->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		k->sport = nfct_get_attr_u16(ct, ATTR_ICMP_ID);
+		k->dport = nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << 8 |
+			   nfct_get_attr_u8(ct, ATTR_ICMP_CODE);
+		break;
+	default:
+		k->sport = nfct_get_attr_u16(ct, ATTR_PORT_SRC);
+		k->dport = nfct_get_attr_u16(ct, ATTR_PORT_DST);
+		break;
+	}
+	k->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+}
+
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP 132
+#endif
+#ifndef IPPROTO_DCCP
+#define IPPROTO_DCCP 33
+#endif
+
+static int ct_blob_state_attr(uint8_t l4proto)
+{
+	switch(l4proto) {
+	case IPPROTO_TCP:
+		return ATTR_TCP_STATE;
+	case IPPROTO_SCTP:
+		return ATTR_SCTP_STATE;
+	case IPPROTO_DCCP:
+		return ATTR_DCCP_STATE;
+	}
+	return -1;
+}
+
+/* the fields that are set in ct, the others are left as they are */
+static void ct_blob_patch(struct ct_blob *b, const struct nf_conntrack *ct)
+{
+	int state_attr = ct_blob_state_attr(b->key.l4proto);
+
+	if (nfct_attr_is_set(ct, ATTR_ID))
+		b->id = nfct_get_attr_u32(ct, ATTR_ID);
+	if (nfct_attr_is_set(ct, ATTR_STATUS)) {
+		b->status = nfct_get_attr_u32(ct, ATTR_STATUS);
+		b->present |= NTA_C_STATUS;
+	}
+	if (state_attr != -1 && nfct_attr_is_set(ct, state_attr)) {
+		b->state = nfct_get_attr_u8(ct, state_attr);
+		b->present |= NTA_C_STATE;
+	}
+	if (nfct_attr_is_set(ct, ATTR_TIMEOUT)) {
+		b->timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT);
+		b->present |= NTA_C_TIMEOUT;
+	}
+	if (nfct_attr_is_set(ct, ATTR_MARK)) {
+		b->mark = nfct_get_attr_u32(ct, ATTR_MARK);
+		b->present |= NTA_C_MARK;
+	}
+}
+
+/* the rest of the attributes of ct, as the TLVs of a message */
+static struct nethdr *ct_blob_rest(const struct nf_conntrack *ct)
+{
+	static char __net[NETMSG_MAXSIZ];
+	struct nethdr *net = (struct nethdr *)__net;
+
+	net->len = NETHDR_SIZ;
+	ct2msg_rest(ct, net);
+	return net;
+}
+
+static int ct_blob_rest_same(const struct ct_blob *b, struct nethdr *net)
+{
+	uint16_t len = net->len - NETHDR_SIZ;
+
+	return len == b->len &&
+	       (len == 0 || memcmp(b->data, NETHDR_DATA(net), len) == 0);
+}
+
+static int ct_blob_pack(struct ct_blob *b, struct nethdr *net)
+{
+	uint16_t len = net->len - NETHDR_SIZ;
+	uint8_t *data;
+
+	if (ct_blob_rest_same(b, net))
+		return 0;
+
+	if (len == 0) {
+		free(b->data);
+		b->data = NULL;
+		b->len = 0;
+		return 0;
+	}
+	if (len != b->len) {
+		data = realloc(b->data, len);
+		if (data == NULL)
+			return -1;
+		b->data = data;
+		b->len = len;
+	}
+	memcpy(b->data, NETHDR_DATA(net), len);
+	return 0;
+}
+
+static void ct_blob_unpack(const void *ptr, void *dst)
+{
+	static char __net[NETMSG_MAXSIZ];
+	struct nethdr *net = (struct nethdr *)__net;
+	const struct ct_blob *b = ptr;
+	const struct ct_blob_key *k = &b->key;
+	struct nf_conntrack *ct = dst;
+	int state_attr = ct_blob_state_attr(k->l4proto);
+
+	/* labels are the only attribute that owns memory, see msg2ct() */
+	if (nfct_attr_is_set(ct, ATTR_CONNLABELS)) {
+		nfct_bitmask_destroy((struct nfct_bitmask *)
+				     nfct_get_attr(ct, ATTR_CONNLABELS));
+	}
+	memset(ct, 0, nfct_maxsize());
+
+	nfct_set_attr_u8(ct, ATTR_L3PROTO, k->l3proto);
+	switch(k->l3proto) {
+	case AF_INET:
+		nfct_set_attr_u32(ct, ATTR_IPV4_SRC, k->src[0]);
+		nfct_set_attr_u32(ct, ATTR_IPV4_DST, k->dst[0]);
+		break;
+	case AF_INET6:
+		nfct_set_attr(ct, ATTR_IPV6_SRC, k->src);
+		nfct_set_attr(ct, ATTR_IPV6_DST, k->dst);
+		break;
+	}
+	nfct_set_attr_u8(ct, ATTR_L4PROTO, k->l4proto);
+	/* ICMP type, code and id come with the rest of the attributes */
+	if (k->l4proto != IPPROTO_ICMP && k->l4proto != IPPROTO_ICMPV6) {
+		nfct_set_attr_u16(ct, ATTR_PORT_SRC, k->sport);
+		nfct_set_attr_u16(ct, ATTR_PORT_DST, k->dport);
+	}
+	if (b->id)
+		nfct_set_attr_u32(ct, ATTR_ID, b->id);
+	if (b->present & NTA_C_STATUS)
+		nfct_set_attr_u32(ct, ATTR_STATUS, b->status);
+	if (b->present & NTA_C_STATE)
+		nfct_set_attr_u8(ct, state_attr, b->state);
+	if (b->present & NTA_C_TIMEOUT)
+		nfct_set_attr_u32(ct, ATTR_TIMEOUT, b->timeout);
+	if (b->present & NTA_C_MARK)
+		nfct_set_attr_u32(ct, ATTR_MARK, b->mark);
+
+	/* msg2ct() converts the attributes in place, parse a copy */
+	net->len = NETHDR_SIZ + b->len;
+	memcpy(NETHDR_DATA(net), b->data, b->len);
+	msg2ct(ct, net, net->len);
+}
+
+static void *cache_ct_blob_alloc(void)
+{
+	return calloc(1, sizeof(struct ct_blob));
+}
+
+static void cache_ct_blob_free(void *ptr)
+{
+	struct ct_blob *b = ptr;
+
+	free(b->data);
+	free(b);
+}
+
+static int cache_ct_blob_copy(void *dst, void *src, unsigned int flags)
+{
+	struct ct_blob *b = dst;
+	struct nf_conntrack *ct;
+	struct nethdr *net;
+	int ret;
+
+	if (flags == NFCT_CP_OVERRIDE) {
+		ct_blob_key(&b->key, src);
+		ct_blob_patch(b, src);
+		return ct_blob_pack(b, ct_blob_rest(src));
+	}
+	ct_blob_patch(b, src);
+
+	/* the rest rarely changes, if it does merge it like nfct_copy()
+	 * does, ie. keep the attributes that are not set in src. */
+	net = ct_blob_rest(src);
+	if (net->len == NETHDR_SIZ || ct_blob_rest_same(b, net))
+		return 0;
+
+	ct = nfct_new();
+	if (ct == NULL)
+		return -1;
+
+	ct_blob_unpack(b, ct);
+	nfct_copy(ct, src, flags);
+	ret = ct_blob_pack(b, ct_blob_rest(ct));
+	nfct_destroy(ct);
+	return ret;
+}
+
+static size_t cache_ct_blob_size(const void *ptr)
+{
+	const struct ct_blob *b = ptr;
+
+	return sizeof(struct ct_blob) + b->len;
+}
+
+static int cache_ct_blob_cmp(const void *data1, const void *data2)
+{
+	const struct cache_object *obj = data1;
+	const struct ct_blob *b = obj->ptr;
+	const struct nf_conntrack *ct = data2;
+	struct ct_blob_key k;
+
+	ct_blob_key(&k, ct);
+	if (memcmp(&b->key, &k, sizeof(k)) != 0)
+		return 0;
+
+	/* same as cache_ct_cmp_id() */
+	return nfct_attr_is_set(ct, ATTR_ID) ?
+	       b->id == nfct_get_attr_u32(ct, ATTR_ID) : 1;
 }
 
 static int cache_ct_dump_step(void *data1, void *n)
@@ -126,6 +402,7 @@ static int cache_ct_dump_step(void *data1, void *n)
 	int size;
 	struct __dump_container *container = data1;
 	struct cache_object *obj = n;
+	struct nf_conntrack *ct;
 	char *data = obj->data;
 	unsigned i;
 
@@ -142,14 +419,16 @@ static int cache_ct_dump_step(void *data1, void *n)
 	if (CONFIG(flags) & CTD_SYNC_FTFW && obj->status == C_OBJ_DEAD)
 		return 0;
 
+	ct = cache_object_ptr(obj, container->ptr);
+
 	/* do not show cached timeout, this may confuse users */
-	if (nfct_attr_is_set(obj->ptr, ATTR_TIMEOUT))
-		nfct_attr_unset(obj->ptr, ATTR_TIMEOUT);
+	if (nfct_attr_is_set(ct, ATTR_TIMEOUT))
+		nfct_attr_unset(ct, ATTR_TIMEOUT);
 
 	memset(buf, 0, sizeof(buf));
 	size = nfct_snprintf(buf, 
 			     sizeof(buf), 
-			     obj->ptr,
+			     ct,
 			     NFCT_T_UNKNOWN, 
 			     container->type,
 			     0);
@@ -178,10 +457,10 @@ static int cache_ct_dump_step(void *data1, void *n)
 }
 
 static void
-cache_ct_commit_step(struct __commit_container *tmp, struct cache_object *obj)
+cache_ct_commit_step(struct __commit_container *tmp, struct cache_object *obj,
+		     struct nf_conntrack *ct)
 {
 	int ret, retry = 1, timeout;
-	struct nf_conntrack *ct = obj->ptr;
 
 	if (CONFIG(commit_timeout)) {
 		timeout = CONFIG(commit_timeout);
@@ -226,10 +505,12 @@ retry:
 
 static int cache_ct_commit_related(void *data, void *n)
 {
+	struct __commit_container *tmp = data;
 	struct cache_object *obj = n;
+	struct nf_conntrack *ct = cache_object_ptr(obj, tmp->ptr);
 
-	if (ct_is_related(obj->ptr))
-		cache_ct_commit_step(data, obj);
+	if (ct_is_related(ct))
+		cache_ct_commit_step(data, obj, ct);
 
 	/* keep iterating even if we have found errors */
 	return 0;
@@ -237,22 +518,22 @@ static int cache_ct_commit_related(void *data, void *n)
 
 static int cache_ct_commit_master(void *data, void *n)
 {
+	struct __commit_container *tmp = data;
 	struct cache_object *obj = n;
+	struct nf_conntrack *ct = cache_object_ptr(obj, tmp->ptr);
 
-	if (ct_is_related(obj->ptr))
+	if (ct_is_related(ct))
 		return 0;
 
-	cache_ct_commit_step(data, obj);
+	cache_ct_commit_step(data, obj, ct);
 	return 0;
 }
 
-static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
+static int
+__cache_ct_commit(struct cache *c, struct __commit_container *tmp,
+		  int clientfd)
 {
 	unsigned int commit_ok, commit_fail;
-	struct __commit_container tmp = {
-		.h = h,
-		.c = c,
-	};
 	struct timeval commit_stop, res;
 
 	/* we already have one commit in progress, skip this. The clientfd
@@ -268,7 +549,7 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 		STATE_SYNC(commit).clientfd = clientfd;
 	case COMMIT_STATE_MASTER:
 		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
+			hashtable_iterate_limit(c->h, tmp,
 						STATE_SYNC(commit).current,
 						CONFIG(general).commit_steps,
 						cache_ct_commit_master);
@@ -282,7 +563,7 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 		STATE_SYNC(commit).state = COMMIT_STATE_RELATED;
 	case COMMIT_STATE_RELATED:
 		STATE_SYNC(commit).current =
-			hashtable_iterate_limit(c->h, &tmp,
+			hashtable_iterate_limit(c->h, tmp,
 						STATE_SYNC(commit).current,
 						CONFIG(general).commit_steps,
 						cache_ct_commit_related);
@@ -320,10 +601,60 @@ static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 	return 1;
 }
 
+static int cache_ct_commit(struct cache *c, struct nfct_handle *h, int clientfd)
+{
+	struct __commit_container tmp = {
+		.h = h,
+		.c = c,
+	};
+	int ret;
+
+	if (c->ops->unpack) {
+		tmp.ptr = nfct_new();
+		if (tmp.ptr == NULL)
+			return -1;
+	}
+	ret = __cache_ct_commit(c, &tmp, clientfd);
+
+	if (tmp.ptr)
+		nfct_destroy(tmp.ptr);
+
+	return ret;
+}
+
+/* reuse the payload that we built last time if the object is unchanged */
+static void
+cache_ct_build_payload(const struct cache_object *obj, struct nethdr *net)
+{
+	if (cache_msg_get(obj, net) == 0)
+		return;
+
+	ct2msg(obj->ptr, net);
+	cache_msg_set(obj, net);
+}
+
 static struct nethdr *
 cache_ct_build_msg(const struct cache_object *obj, int type)
 {
-	return BUILD_NETMSG_FROM_CT(obj->ptr, type);
+	static char __net[NETMSG_MAXSIZ];
+	struct nethdr *net = (struct nethdr *)__net;
+
+	memset(net, 0, NETHDR_SIZ);
+	nethdr_set(net, type);
+	cache_ct_build_payload(obj, net);
+	HDR_HOST2NETWORK(net);
+	return net;
+}
+
+static struct nethdr *
+cache_ct_build_rec(const struct cache_object *obj, int type,
+		   struct nethdr *rec)
+{
+	memset(rec, 0, NETHDR_SIZ);
+	nethdr_set_rec(rec, type);
+	cache_ct_build_payload(obj, rec);
+	HDR_HOST2NETWORK(rec);
+	return rec;
 }
 
 /* template to cache conntracks coming from the kernel. */
@@ -333,9 +664,11 @@ struct cache_ops cache_sync_internal_ct_ops = {
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
 	.copy		= cache_ct_copy,
+	.size		= cache_ct_size,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= NULL,
 	.build_msg	= cache_ct_build_msg,
+	.build_rec	= cache_ct_build_rec,
 };
 
 /* template to cache conntracks coming from the network. */
@@ -345,6 +678,21 @@ struct cache_ops cache_sync_external_ct_ops = {
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
 	.copy		= cache_ct_copy,
+	.size		= cache_ct_size,
+	.dump_step	= cache_ct_dump_step,
+	.commit		= cache_ct_commit,
+	.build_msg	= NULL,
+};
+
+/* same as above, but conntracks are stored in their compact form. */
+struct cache_ops cache_sync_external_compact_ct_ops = {
+	.hash		= cache_ct_hash,
+	.cmp		= cache_ct_blob_cmp,
+	.alloc		= cache_ct_blob_alloc,
+	.free		= cache_ct_blob_free,
+	.copy		= cache_ct_blob_copy,
+	.size		= cache_ct_blob_size,
+	.unpack		= ct_blob_unpack,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= cache_ct_commit,
 	.build_msg	= NULL,
@@ -357,6 +705,7 @@ struct cache_ops cache_stats_ct_ops = {
 	.alloc		= cache_ct_alloc,
 	.free		= cache_ct_free,
 	.copy		= cache_ct_copy,
+	.size		= cache_ct_size,
 	.dump_step	= cache_ct_dump_step,
 	.commit		= NULL,
 	.build_msg	= NULL,
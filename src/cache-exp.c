@@ -107,10 +107,16 @@ static void cache_exp_free(void *ptr)
 	nfexp_destroy(ptr);
 }
 
-static void cache_exp_copy(void *dst, void *src, unsigned int flags)
+static int cache_exp_copy(void *dst, void *src, unsigned int flags)
 {
 	/* XXX: add nfexp_copy(...) to libnetfilter_conntrack. */
 	memcpy(dst, src, nfexp_maxsize());
+	return 0;
+}
+
+static size_t cache_exp_size(const void *ptr)
+{
+	return nfexp_maxsize();
 }
 
 static int cache_exp_dump_step(void *data1, void *n)
@@ -277,10 +283,39 @@ cache_exp_commit(struct cache *c, struct nfct_handle *h, int clientfd)
 	return 1;
 }
 
+/* reuse the payload that we built last time if the object is unchanged */
+static void
+cache_exp_build_payload(const struct cache_object *obj, struct nethdr *net)
+{
+	if (cache_msg_get(obj, net) == 0)
+		return;
+
+	exp2msg(obj->ptr, net);
+	cache_msg_set(obj, net);
+}
+
 static struct nethdr *
 cache_exp_build_msg(const struct cache_object *obj, int type)
 {
-	return BUILD_NETMSG_FROM_EXP(obj->ptr, type);
+	static char __net[NETMSG_MAXSIZ];
+	struct nethdr *net = (struct nethdr *)__net;
+
+	memset(net, 0, NETHDR_SIZ);
+	nethdr_set(net, type);
+	cache_exp_build_payload(obj, net);
+	HDR_HOST2NETWORK(net);
+	return net;
+}
+
+static struct nethdr *
+cache_exp_build_rec(const struct cache_object *obj, int type,
+		    struct nethdr *rec)
+{
+	memset(rec, 0, NETHDR_SIZ);
+	nethdr_set_rec(rec, type);
+	cache_exp_build_payload(obj, rec);
+	HDR_HOST2NETWORK(rec);
+	return rec;
 }
 
 /* template to cache expectations coming from the kernel. */
@@ -290,9 +325,11 @@ struct cache_ops cache_sync_internal_exp_ops = {
 	.alloc		= cache_exp_alloc,
 	.free		= cache_exp_free,
 	.copy		= cache_exp_copy,
+	.size		= cache_exp_size,
 	.dump_step	= cache_exp_dump_step,
 	.commit		= NULL,
 	.build_msg	= cache_exp_build_msg,
+	.build_rec	= cache_exp_build_rec,
 };
 
 /* template to cache expectations coming from the network. */
@@ -302,6 +339,7 @@ struct cache_ops cache_sync_external_exp_ops = {
 	.alloc		= cache_exp_alloc,
 	.free		= cache_exp_free,
 	.copy		= cache_exp_copy,
+	.size		= cache_exp_size,
 	.dump_step	= cache_exp_dump_step,
 	.commit		= cache_exp_commit,
 	.build_msg	= NULL,
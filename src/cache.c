@@ -31,6 +31,7 @@
 
 struct cache_feature *cache_feature[CACHE_MAX_FEATURE] = {
 	[TIMER_FEATURE]		= &timer_feature,
+	[MSG_FEATURE]		= &msg_feature,
 };
 
 struct cache *cache_create(const char *name, enum cache_type type,
@@ -123,6 +124,11 @@ void cache_destroy(struct cache *c)
 	free(c);
 }
 
+static inline size_t cache_ptr_size(const struct cache *c, const void *ptr)
+{
+	return c->ops->size ? c->ops->size(ptr) : 0;
+}
+
 struct cache_object *cache_object_new(struct cache *c, void *ptr)
 {
 	struct cache_object *obj;
@@ -142,9 +148,16 @@ struct cache_object *cache_object_new(struct cache *c, void *ptr)
 		c->stats.add_fail_enomem++;
 		return NULL;
 	}
-	c->ops->copy(obj->ptr, ptr, NFCT_CP_OVERRIDE);
+	if (c->ops->copy(obj->ptr, ptr, NFCT_CP_OVERRIDE) == -1) {
+		c->ops->free(obj->ptr);
+		free(obj);
+		errno = ENOMEM;
+		c->stats.add_fail_enomem++;
+		return NULL;
+	}
 	obj->status = C_OBJ_NONE;
 	c->stats.objects++;
+	c->stats.bytes += c->object_size + cache_ptr_size(c, obj->ptr);
 
 	return obj;
 }
@@ -152,6 +165,8 @@ struct cache_object *cache_object_new(struct cache *c, void *ptr)
 void cache_object_free(struct cache_object *obj)
 {
 	obj->cache->stats.objects--;
+	obj->cache->stats.bytes -= obj->cache->object_size +
+				   cache_ptr_size(obj->cache, obj->ptr);
 	obj->cache->ops->free(obj->ptr);
 
 	free(obj);
@@ -181,6 +196,36 @@ void cache_object_set_status(struct cache_object *obj, int status)
 	obj->status = status;
 }
 
+/* some caches store objects in a more compact form, see cache-ct.c. Those
+ * are unpacked into dst, that the caller owns, and dst is returned. */
+void *cache_object_ptr(const struct cache_object *obj, void *dst)
+{
+	if (obj->cache->ops->unpack) {
+		obj->cache->ops->unpack(obj->ptr, dst);
+		return dst;
+	}
+	return obj->ptr;
+}
+
+/* stable hash of the object, eg. to spread objects among several channels */
+uint32_t cache_object_hash(const struct cache_object *obj)
+{
+	struct nf_conntrack *ct;
+	uint32_t hash;
+
+	if (obj->cache->ops->unpack == NULL)
+		return hashtable_hash(obj->cache->h, obj->ptr);
+
+	/* only conntracks are stored in some other form */
+	ct = nfct_new();
+	if (ct == NULL)
+		return 0;
+
+	hash = hashtable_hash(obj->cache->h, cache_object_ptr(obj, ct));
+	nfct_destroy(ct);
+	return hash;
+}
+
 static int __add(struct cache *c, struct cache_object *obj, int id)
 {
 	int ret;
@@ -210,7 +255,7 @@ int cache_add(struct cache *c, struct cache_object *obj, int id)
 {
 	int ret;
 
-	obj->owner = STATE_SYNC(channel)->current;
+	obj->owner = STATE_SYNC(channel)->rx_current;
 	ret = __add(c, obj, id);
 	if (ret == -1) {
 		c->stats.add_fail++;
@@ -226,8 +271,11 @@ void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr)
 {
 	char *data = obj->data;
 	unsigned int i;
+	int ret;
 
-	c->ops->copy(obj->ptr, ptr, NFCT_CP_META);
+	c->stats.bytes -= cache_ptr_size(c, obj->ptr);
+	ret = c->ops->copy(obj->ptr, ptr, NFCT_CP_META);
+	c->stats.bytes += cache_ptr_size(c, obj->ptr);
 
 	for (i = 0; i < c->num_features; i++) {
 		c->features[i]->update(obj, data);
@@ -237,10 +285,15 @@ void cache_update(struct cache *c, struct cache_object *obj, int id, void *ptr)
 	if (c->extra && c->extra->update)
 		c->extra->update(obj, ((char *) obj) + c->extra_offset);
 
-	c->stats.upd_ok++;
+	/* the object is left as it was, but the entry is still there */
+	if (ret == -1)
+		c->stats.upd_fail++;
+	else
+		c->stats.upd_ok++;
+
 	obj->lastupdate = time_cached();
 	obj->status = C_OBJ_ALIVE;
-	obj->owner = STATE_SYNC(channel)->current;
+	obj->owner = STATE_SYNC(channel)->rx_current;
 }
 
 static void __del(struct cache *c, struct cache_object *obj)
@@ -311,6 +364,24 @@ void *cache_get_extra(struct cache_object *obj)
 	return (char*)obj + obj->cache->extra_offset;
 }
 
+static int cache_has_feature(const struct cache *c, int feature)
+{
+	unsigned int i = c->feature_type[feature];
+
+	return i < c->num_features && c->features[i] == cache_feature[feature];
+}
+
+/* returns NULL if this feature is not enabled in the cache */
+void *cache_get_feature(const struct cache_object *obj, int feature)
+{
+	const struct cache *c = obj->cache;
+
+	if (!cache_has_feature(c, feature))
+		return NULL;
+
+	return (char *)obj + c->feature_offset[c->feature_type[feature]];
+}
+
 void cache_stats(const struct cache *c, int fd)
 {
 	char buf[512];
@@ -334,7 +405,7 @@ void cache_stats(const struct cache *c, int fd)
 
 void cache_stats_extended(const struct cache *c, int fd)
 {
-	char buf[512];
+	char buf[1024];
 	int size;
 
 	size = snprintf(buf, sizeof(buf),
@@ -346,7 +417,7 @@ void cache_stats_extended(const struct cache *c, int fd)
 			    "\tupdate OK/failed:\t\t%12u/%12u\n"
 			    "\t\tentry not found:\t%12u\n"
 			    "\tdeletion created/failed:\t%12u/%12u\n"
-			    "\t\tentry not found:\t%12u\n\n",
+			    "\t\tentry not found:\t%12u\n",
 			    c->name, c->stats.objects,
 			    c->stats.active, hashtable_counter(c->h),
 			    c->stats.add_ok,
@@ -360,6 +431,25 @@ void cache_stats_extended(const struct cache *c, int fd)
 			    c->stats.del_fail,
 			    c->stats.del_fail_enoent);
 
+	size += snprintf(buf + size, sizeof(buf) - size,
+			 "\tmemory used:\t\t\t%12llu\n"
+			 "\tbytes per entry:\t\t%12llu\n",
+			 (unsigned long long)c->stats.bytes,
+			 c->stats.objects ? (unsigned long long)
+			 (c->stats.bytes / c->stats.objects) : 0);
+
+	if (cache_has_feature(c, MSG_FEATURE)) {
+		uint64_t total = (uint64_t)c->stats.msg_hit + c->stats.msg_miss;
+
+		size += snprintf(buf + size, sizeof(buf) - size,
+				 "\tmessage cache hit/miss:\t\t%12u/%12u\n"
+				 "\tmessage cache hit rate:\t\t%11u%%\n",
+				 c->stats.msg_hit, c->stats.msg_miss,
+				 total ? (unsigned int)
+				 (c->stats.msg_hit * 100 / total) : 0);
+	}
+	size += snprintf(buf + size, sizeof(buf) - size, "\n");
+
 	send(fd, buf, size, 0);
 }
 
@@ -383,7 +473,17 @@ void cache_dump(struct cache *c, int fd, int type)
 		.fd	= fd,
 		.type	= type
 	};
+
+	/* only conntracks are stored in some other form */
+	if (c->ops->unpack) {
+		tmp.ptr = nfct_new();
+		if (tmp.ptr == NULL)
+			return;
+	}
 	hashtable_iterate(c->h, (void *) &tmp, c->ops->dump_step);
+
+	if (tmp.ptr)
+		nfct_destroy(tmp.ptr);
 }
 
 int cache_commit(struct cache *c, struct nfct_handle *h, int clientfd)
@@ -0,0 +1,105 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Keeps the payload of the last network message built from each object,
+ * so bulk sends and resyncs of unchanged objects don't build it again.
+ */
+
+#include "cache.h"
+#include "conntrackd.h"
+#include "network.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void msg_add(struct cache_object *obj, void *data)
+{
+	struct cache_msg *m = data;
+
+	m->dirty = 1;
+}
+
+static void msg_update(struct cache_object *obj, void *data)
+{
+	struct cache_msg *m = data;
+
+	m->dirty = 1;
+}
+
+static void msg_destroy(struct cache_object *obj, void *data)
+{
+	struct cache_msg *m = data;
+
+	free(m->buf);
+	m->buf = NULL;
+	m->len = 0;
+	m->dirty = 1;
+}
+
+struct cache_feature msg_feature = {
+	.size		= sizeof(struct cache_msg),
+	.add		= msg_add,
+	.update		= msg_update,
+	.destroy	= msg_destroy,
+};
+
+/* append the cached payload to the header, -1 if it has to be built. */
+int cache_msg_get(const struct cache_object *obj, struct nethdr *net)
+{
+	struct cache_msg *m;
+
+	m = cache_get_feature(obj, MSG_FEATURE);
+	if (m == NULL)
+		return -1;
+
+	/* the peers may have switched the encoding in the meantime */
+	if (m->dirty || m->compact != STATE_SYNC(compact)) {
+		obj->cache->stats.msg_miss++;
+		return -1;
+	}
+	memcpy((char *)net + net->len, m->buf, m->len);
+	net->len += m->len;
+	net->version = m->version;
+	obj->cache->stats.msg_hit++;
+	return 0;
+}
+
+/* store the payload of a message that was just built, in host byte order */
+void cache_msg_set(const struct cache_object *obj, const struct nethdr *net)
+{
+	struct cache_msg *m;
+	uint16_t len = net->len - NETHDR_SIZ;
+	void *buf;
+
+	m = cache_get_feature(obj, MSG_FEATURE);
+	if (m == NULL)
+		return;
+
+	if (len != m->len) {
+		buf = realloc(m->buf, len);
+		if (buf == NULL && len > 0) {
+			m->dirty = 1;
+			return;
+		}
+		m->buf = buf;
+		m->len = len;
+	}
+	memcpy(m->buf, (const char *)net + NETHDR_SIZ, len);
+	m->version = net->version;
+	m->compact = STATE_SYNC(compact);
+	m->dirty = 0;
+}
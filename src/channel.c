@@ -7,52 +7,45 @@
  * (at your option) any later version.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <errno.h>
 
 #include "conntrackd.h"
 #include "channel.h"
 #include "network.h"
-#include "queue.h"
 
 static struct channel_ops *ops[CHANNEL_MAX];
 extern struct channel_ops channel_mcast;
 extern struct channel_ops channel_udp;
 extern struct channel_ops channel_tcp;
-
-static struct queue *errorq;
+extern struct channel_ops channel_xdp;
+extern struct channel_ops channel_shm;
 
 int channel_init(void)
 {
 	ops[CHANNEL_MCAST] = &channel_mcast;
 	ops[CHANNEL_UDP] = &channel_udp;
 	ops[CHANNEL_TCP] = &channel_tcp;
-
-	errorq = queue_create("errorq", CONFIG(channelc).error_queue_length, 0);
-	if (errorq == NULL) {
-		return -1;
-	}
+	ops[CHANNEL_XDP] = &channel_xdp;
+	ops[CHANNEL_SHM] = &channel_shm;
 	return 0;
 }
 
 void channel_end(void)
 {
-	queue_destroy(errorq);
 }
 
-struct channel_buffer {
-	char	*data;
-	int	size;
-	int	len;
-};
-
-static struct channel_buffer *
-channel_buffer_open(int mtu, int headersiz)
+/* slack is extra room past the end of the buffer, so that a message can
+ * be built in place before we know whether it fits in this datagram. */
+struct channel_buffer *
+channel_buffer_open(int size, int slack)
 {
 	struct channel_buffer *b;
 
@@ -60,9 +53,9 @@ channel_buffer_open(int mtu, int headersiz)
 	if (b == NULL)
 		return NULL;
 
-	b->size = mtu - headersiz;
+	b->size = size;
 
-	b->data = malloc(b->size);
+	b->data = malloc(b->size + slack);
 	if (b->data == NULL) {
 		free(b);
 		return NULL;
@@ -70,7 +63,7 @@ channel_buffer_open(int mtu, int headersiz)
 	return b;
 }
 
-static void
+void
 channel_buffer_close(struct channel_buffer *b)
 {
 	if (b == NULL)
@@ -80,6 +73,42 @@ channel_buffer_close(struct channel_buffer *b)
 	free(b);
 }
 
+static struct channel_errq *channel_errq_open(int size, int len)
+{
+	struct channel_errq *q;
+	unsigned int num = 1;
+
+	while (num < (unsigned int)len)
+		num <<= 1;
+
+	q = calloc(sizeof(struct channel_errq), 1);
+	if (q == NULL)
+		return NULL;
+
+	q->size = size;
+	q->num = num;
+	q->mask = num - 1;
+	q->data = malloc(size * num);
+	q->len = malloc(sizeof(int) * num);
+	if (q->data == NULL || q->len == NULL) {
+		free(q->data);
+		free(q->len);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+static void channel_errq_close(struct channel_errq *q)
+{
+	if (q == NULL)
+		return;
+
+	free(q->data);
+	free(q->len);
+	free(q);
+}
+
 struct channel *
 channel_open(struct channel_conf *cfg)
 {
@@ -125,8 +154,8 @@ channel_open(struct channel_conf *cfg)
 	c->ops = ops[cfg->channel_type];
 
 	if (cfg->channel_flags & CHANNEL_F_BUFFERED) {
-		c->buffer = channel_buffer_open(c->channel_ifmtu,
-						c->ops->headersiz);
+		c->buffer = channel_buffer_open(c->channel_ifmtu -
+						c->ops->headersiz, 0);
 		if (c->buffer == NULL) {
 			free(c);
 			return NULL;
@@ -134,12 +163,32 @@ channel_open(struct channel_conf *cfg)
 	}
 	c->channel_flags = cfg->channel_flags;
 
+	if (cfg->channel_flags & CHANNEL_F_ERRORS) {
+		c->errq = channel_errq_open(c->channel_ifmtu -
+					    c->ops->headersiz,
+					    CONFIG(channelc).error_queue_length);
+		if (c->errq == NULL) {
+			channel_buffer_close(c->buffer);
+			free(c);
+			return NULL;
+		}
+	}
+
 	c->data = c->ops->open(&cfg->u);
 	if (c->data == NULL) {
+		channel_errq_close(c->errq);
 		channel_buffer_close(c->buffer);
 		free(c);
 		return NULL;
 	}
+#ifdef SO_BUSY_POLL
+	if (CONFIG(lowlat).busy_poll) {
+		/* best effort, raising it above net.core.busy_poll requires
+		 * CAP_NET_ADMIN. */
+		setsockopt(c->ops->get_fd(c->data), SOL_SOCKET, SO_BUSY_POLL,
+			   &CONFIG(lowlat).busy_poll, sizeof(int));
+	}
+#endif
 	return c;
 }
 
@@ -149,73 +198,58 @@ channel_close(struct channel *c)
 	c->ops->close(c->data);
 	if (c->channel_flags & CHANNEL_F_BUFFERED)
 		channel_buffer_close(c->buffer);
+	channel_errq_close(c->errq);
 	free(c);
 }
 
-struct channel_error {
-	char			*data;
-	int			len;
-};
-
-static void channel_enqueue_errors(struct channel *c)
+static void __channel_enqueue_errors(struct channel *c, const char *data,
+				     int len)
 {
-	struct queue_object *qobj;
-	struct channel_error *error;
+	struct channel_errq *q = c->errq;
+	unsigned int slot;
 
-	qobj = queue_object_new(Q_ELEM_ERR, sizeof(struct channel_error));
-	if (qobj == NULL)
+	if (q == NULL)
 		return;
 
-	error		= (struct channel_error *)qobj->data;
-	error->len	= c->buffer->len;
-
-	error->data = malloc(c->buffer->len);
-	if (error->data == NULL) {
-		queue_object_free(qobj);
+	/* larger than the MTU, it should not ever happen, but it might. */
+	if (len > q->size) {
+		q->stats.dropped++;
 		return;
 	}
-	memcpy(error->data, c->buffer->data, c->buffer->len);
-	if (queue_add(errorq, &qobj->qnode) < 0) {
-		if (errno == ENOSPC) {
-			struct queue_node *tail;
-			struct channel_error *tmp;
-
-			tail = queue_del_head(errorq);
-			tmp = queue_node_data(tail);
-			free(tmp->data);
-			queue_object_free((struct queue_object *)tail);
-
-			queue_add(errorq, &qobj->qnode);
-		}
+	if (q->head - q->tail == q->num) {
+		/* full, drop the oldest one. */
+		q->tail++;
+		q->stats.dropped++;
 	}
+	slot = q->head++ & q->mask;
+	memcpy(q->data + slot * q->size, data, len);
+	q->len[slot] = len;
+	q->stats.queued++;
 }
 
-static int channel_handle_error_step(struct queue_node *n, const void *data2)
+static void channel_enqueue_errors(struct channel *c)
 {
-	struct channel_error *error;
-	const struct channel *c = data2;
-	int ret;
-
-	error = queue_node_data(n);
-	ret = c->ops->send(c->data, error->data, error->len);
-	if (ret != -1) {
-		/* Success. Delete it from the error queue. */
-		queue_del(n);
-		free(error->data);
-		queue_object_free((struct queue_object *)n);
-	} else {
-		/* We failed to deliver, give up now, try later. */
-		return 1;
-	}
-	return 0;
+	__channel_enqueue_errors(c, c->buffer->data, c->buffer->len);
 }
 
 static int channel_handle_errors(struct channel *c)
 {
+	struct channel_errq *q = c->errq;
+
+	if (q == NULL)
+		return 0;
+
 	/* there are pending errors that we have to handle. */
-	if (c->channel_flags & CHANNEL_F_ERRORS && queue_len(errorq) > 0) {
-		queue_iterate(errorq, c, channel_handle_error_step);
-		return queue_len(errorq) > 0;
+	while (q->head != q->tail) {
+		unsigned int slot = q->tail & q->mask;
+
+		if (c->ops->send(c->data, q->data + slot * q->size,
+				 q->len[slot]) == -1) {
+			/* We failed to deliver, give up now, try later. */
+			return 1;
+		}
+		q->tail++;
+		q->stats.retried++;
 	}
 	return 0;
 }
@@ -317,6 +351,84 @@ int channel_seqfix(struct channel *c, uint32_t length)
 }
 
 
+/* Send a buffer that is owned by the caller, eg. the multichannel buffer
+ * that is shared by all the channels. Only copied on delivery errors. */
+int channel_send_buffer(struct channel *c, const void *data, int len)
+{
+	int ret, pending_errors;
+
+	pending_errors = channel_handle_errors(c);
+
+	/* We still have pending errors to deliver, avoid any re-ordering. */
+	if (pending_errors) {
+		__channel_enqueue_errors(c, data, len);
+		return 0;
+	}
+	ret = c->ops->send(c->data, data, len);
+	if (ret == -1 && (c->channel_flags & CHANNEL_F_ERRORS)) {
+		/* Give it another chance to deliver it. */
+		__channel_enqueue_errors(c, data, len);
+	}
+	return ret;
+}
+
+/* Same as above for several datagrams, with one syscall if the channel
+ * supports it. Datagrams that fail are handled like in channel_send_buffer,
+ * the following ones are queued behind them to keep the order. */
+int channel_send_buffers(struct channel *c, const struct iovec *iov, int n)
+{
+	int ret = 0, i = 0;
+
+	/* We still have pending errors to deliver, avoid any re-ordering. */
+	if (channel_handle_errors(c)) {
+		for (; i < n; i++)
+			__channel_enqueue_errors(c, iov[i].iov_base,
+						 iov[i].iov_len);
+		return 0;
+	}
+
+	while (i < n) {
+		if (c->ops->sendv) {
+			ret = c->ops->sendv(c->data, &iov[i], n - i);
+		} else {
+			ret = c->ops->send(c->data, iov[i].iov_base,
+					   iov[i].iov_len) == -1 ? -1 : 1;
+		}
+		if (ret > 0) {
+			i += ret;
+			continue;
+		}
+		if (c->channel_flags & CHANNEL_F_ERRORS) {
+			/* Give them another chance to deliver. */
+			for (; i < n; i++) {
+				__channel_enqueue_errors(c, iov[i].iov_base,
+							 iov[i].iov_len);
+			}
+			break;
+		}
+		/* no error queue, this datagram is lost. */
+		i++;
+	}
+	return ret;
+}
+
+int channel_payload_size(struct channel *c)
+{
+	if (!(c->channel_flags & CHANNEL_F_BUFFERED))
+		return 0;
+
+	return c->buffer->size;
+}
+
+/* bytes that are waiting in the buffer to be sent */
+int channel_send_held(struct channel *c)
+{
+	if (!(c->channel_flags & CHANNEL_F_BUFFERED))
+		return 0;
+
+	return c->buffer->len;
+}
+
 int channel_send_flush(struct channel *c)
 {
 	int ret, pending_errors;
@@ -345,6 +457,51 @@ int channel_recv(struct channel *c, char *buf, int size)
 	return c->ops->recv(c->data, buf, size);
 }
 
+/* receive up to n datagrams, falls back to one datagram per call if the
+ * channel cannot do better. Datagrams that the kernel has coalesced are
+ * made of segments of seg bytes, the last one may be shorter. */
+int channel_recvv(struct channel *c, const struct iovec *iov, int *len,
+		  int *seg, int n)
+{
+	int ret;
+
+	if (c->ops->recvv)
+		return c->ops->recvv(c->data, iov, len, seg, n);
+
+	ret = c->ops->recv(c->data, iov[0].iov_base, iov[0].iov_len);
+	if (ret == -1)
+		return -1;
+
+	len[0] = seg[0] = ret;
+	return 1;
+}
+
+int channel_recv_size(struct channel *c)
+{
+	int size = 0;
+
+	if (c->ops->recv_size)
+		size = c->ops->recv_size(c->data);
+
+	return size > 0 ? size : c->channel_ifmtu;
+}
+
+/* bytes that the channel has taken but could not deliver yet */
+int channel_send_pending(struct channel *c)
+{
+	if (c->ops->send_pending == NULL)
+		return 0;
+
+	return c->ops->send_pending(c->data);
+}
+
+void channel_set_drain_cb(struct channel *c, void (*cb)(void *data),
+			  void *data)
+{
+	if (c->ops->set_drain_cb)
+		c->ops->set_drain_cb(c->data, cb, data);
+}
+
 int channel_get_fd(struct channel *c)
 {
 	return c->ops->get_fd(c->data);
@@ -358,7 +515,25 @@ void channel_stats(struct channel *c, int fd)
 void channel_stats_extended(struct channel *c, int active,
 			    struct nlif_handle *h, int fd)
 {
-	return c->ops->stats_extended(c, active, h, fd);
+	struct channel_errq *q = c->errq;
+	char buf[512];
+	int size;
+
+	c->ops->stats_extended(c, active, h, fd);
+	if (q == NULL)
+		return;
+
+	size = snprintf(buf, sizeof(buf),
+			"error queue:\n"
+			"%20llu Queued     "
+			"%20llu Retried\n"
+			"%20llu Dropped    "
+			"%20u Pending\n\n",
+			(unsigned long long)q->stats.queued,
+			(unsigned long long)q->stats.retried,
+			(unsigned long long)q->stats.dropped,
+			q->head - q->tail);
+	send(fd, buf, size, 0);
 }
 
 int channel_accept_isset(struct channel *c, fd_set *readfds)
@@ -371,6 +546,20 @@ int channel_isset(struct channel *c, fd_set *readfds)
 	return c->ops->isset(c, readfds);
 }
 
+int channel_rx_fd(struct channel *c, int i)
+{
+	if (c->ops->rx_fd == NULL)
+		return i == 0 ? c->ops->get_fd(c->data) : -1;
+
+	return c->ops->rx_fd(c->data, i);
+}
+
+void channel_rx_set(struct channel *c, int i)
+{
+	if (c->ops->rx_set)
+		c->ops->rx_set(c->data, i);
+}
+
 int channel_accept(struct channel *c)
 {
 	return c->ops->accept(c);
@@ -45,6 +45,13 @@ channel_mcast_send(void *channel, const void *data, int len)
 	return mcast_send(m->client, data, len);
 }
 
+static int
+channel_mcast_sendv(void *channel, const struct iovec *iov, int n)
+{
+	struct mcast_channel *m = channel;
+	return mcast_sendv(m->client, iov, n);
+}
+
 static int
 channel_mcast_recv(void *channel, char *buf, int size)
 {
@@ -52,6 +59,14 @@ channel_mcast_recv(void *channel, char *buf, int size)
 	return mcast_recv(m->server, buf, size);
 }
 
+static int
+channel_mcast_recvv(void *channel, const struct iovec *iov, int *len,
+		   int *seg, int n)
+{
+	struct mcast_channel *m = channel;
+	return mcast_recvv(m->server, iov, len, seg, n);
+}
+
 static void
 channel_mcast_close(void *channel)
 {
@@ -130,7 +145,9 @@ struct channel_ops channel_mcast = {
 	.open		= channel_mcast_open,
 	.close		= channel_mcast_close,
 	.send		= channel_mcast_send,
+	.sendv		= channel_mcast_sendv,
 	.recv		= channel_mcast_recv,
+	.recvv		= channel_mcast_recvv,
 	.get_fd		= channel_mcast_get_fd,
 	.isset		= channel_mcast_isset,
 	.accept_isset	= channel_mcast_accept_isset,
@@ -0,0 +1,151 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <libnfnetlink/libnfnetlink.h>
+
+#include "channel.h"
+#include "shm.h"
+
+static void
+*channel_shm_open(void *conf)
+{
+	struct shm_channel *m;
+	struct shm_conf *c = conf;
+
+	m = calloc(sizeof(struct shm_channel), 1);
+	if (m == NULL)
+		return NULL;
+
+	m->client = shm_client_create(c);
+	if (m->client == NULL) {
+		free(m);
+		return NULL;
+	}
+
+	m->server = shm_server_create(c);
+	if (m->server == NULL) {
+		shm_client_destroy(m->client);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+static int
+channel_shm_send(void *channel, const void *data, int len)
+{
+	struct shm_channel *m = channel;
+	return shm_send(m->client, data, len);
+}
+
+static int
+channel_shm_sendv(void *channel, const struct iovec *iov, int n)
+{
+	struct shm_channel *m = channel;
+	return shm_sendv(m->client, iov, n);
+}
+
+static int
+channel_shm_recv(void *channel, char *buf, int size)
+{
+	struct shm_channel *m = channel;
+	return shm_recv(m->server, buf, size);
+}
+
+static void
+channel_shm_close(void *channel)
+{
+	struct shm_channel *m = channel;
+	shm_client_destroy(m->client);
+	shm_server_destroy(m->server);
+	free(m);
+}
+
+static int
+channel_shm_get_fd(void *channel)
+{
+	struct shm_channel *m = channel;
+	return shm_get_fd(m->server);
+}
+
+static void
+channel_shm_stats(struct channel *c, int fd)
+{
+	struct shm_channel *m = c->data;
+	char ifname[IFNAMSIZ], buf[512];
+	int size;
+
+	if_indextoname(c->channel_ifindex, ifname);
+	size = shm_snprintf_stats(buf, sizeof(buf), ifname,
+				  m->client, m->server);
+	send(fd, buf, size, 0);
+}
+
+static void
+channel_shm_stats_extended(struct channel *c, int active,
+			   struct nlif_handle *h, int fd)
+{
+	struct shm_channel *m = c->data;
+	char ifname[IFNAMSIZ], buf[512];
+	const char *status;
+	int size;
+
+	if_indextoname(c->channel_ifindex, ifname);
+	/* there is no link in between, only whether the peer is there */
+	if (m->client->state == SHM_CLIENT_CONNECTED)
+		status = "RUNNING";
+	else
+		status = "NO-PEER";
+
+	size = shm_snprintf_stats2(buf, sizeof(buf),
+				   ifname, status, active,
+				   &m->client->stats,
+				   &m->server->stats);
+	send(fd, buf, size, 0);
+}
+
+static int
+channel_shm_isset(struct channel *c, fd_set *readfds)
+{
+	struct shm_channel *m = c->data;
+	return shm_isset(m->server, readfds);
+}
+
+static int
+channel_shm_accept_isset(struct channel *c, fd_set *readfds)
+{
+	struct shm_channel *m = c->data;
+	return shm_accept_isset(m->server, readfds);
+}
+
+static int
+channel_shm_accept(struct channel *c)
+{
+	struct shm_channel *m = c->data;
+	return shm_accept(m->server);
+}
+
+/* The ring is handed over through the accept path of stream channels,
+ * records keep the datagram boundaries though. */
+struct channel_ops channel_shm = {
+	.headersiz	= 4, /* length of the record */
+	.type		= CHANNEL_T_STREAM,
+	.open		= channel_shm_open,
+	.close		= channel_shm_close,
+	.send		= channel_shm_send,
+	.sendv		= channel_shm_sendv,
+	.recv		= channel_shm_recv,
+	.accept		= channel_shm_accept,
+	.get_fd		= channel_shm_get_fd,
+	.isset		= channel_shm_isset,
+	.accept_isset	= channel_shm_accept_isset,
+	.stats		= channel_shm_stats,
+	.stats_extended = channel_shm_stats_extended,
+};
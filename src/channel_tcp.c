@@ -47,6 +47,27 @@ channel_tcp_send(void *channel, const void *data, int len)
 	return tcp_send(m->client, data, len);
 }
 
+static int
+channel_tcp_sendv(void *channel, const struct iovec *iov, int n)
+{
+	struct tcp_channel *m = channel;
+	return tcp_sendv(m->client, iov, n);
+}
+
+static int
+channel_tcp_send_pending(void *channel)
+{
+	struct tcp_channel *m = channel;
+	return tcp_send_pending(m->client);
+}
+
+static void
+channel_tcp_set_drain_cb(void *channel, void (*cb)(void *data), void *data)
+{
+	struct tcp_channel *m = channel;
+	tcp_set_drain_cb(m->client, cb, data);
+}
+
 static int
 channel_tcp_recv(void *channel, char *buf, int size)
 {
@@ -141,7 +162,10 @@ struct channel_ops channel_tcp = {
 	.open		= channel_tcp_open,
 	.close		= channel_tcp_close,
 	.send		= channel_tcp_send,
+	.sendv		= channel_tcp_sendv,
 	.recv		= channel_tcp_recv,
+	.send_pending	= channel_tcp_send_pending,
+	.set_drain_cb	= channel_tcp_set_drain_cb,
 	.accept		= channel_tcp_accept,
 	.get_fd		= channel_tcp_get_fd,
 	.isset		= channel_tcp_isset,
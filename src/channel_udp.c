@@ -45,6 +45,13 @@ channel_udp_send(void *channel, const void *data, int len)
 	return udp_send(m->client, data, len);
 }
 
+static int
+channel_udp_sendv(void *channel, const struct iovec *iov, int n)
+{
+	struct udp_channel *m = channel;
+	return udp_sendv(m->client, iov, n);
+}
+
 static int
 channel_udp_recv(void *channel, char *buf, int size)
 {
@@ -52,6 +59,23 @@ channel_udp_recv(void *channel, char *buf, int size)
 	return udp_recv(m->server, buf, size);
 }
 
+static int
+channel_udp_recvv(void *channel, const struct iovec *iov, int *len,
+		  int *seg, int n)
+{
+	struct udp_channel *m = channel;
+	return udp_recvv(m->server, iov, len, seg, n);
+}
+
+static int
+channel_udp_recv_size(void *channel)
+{
+	struct udp_channel *m = channel;
+
+	/* coalesced datagrams may take up to the maximum IP packet size. */
+	return m->server->gro ? 65536 : 0;
+}
+
 static void
 channel_udp_close(void *channel)
 {
@@ -68,6 +92,20 @@ channel_udp_get_fd(void *channel)
 	return udp_get_fd(m->server);
 }
 
+static int
+channel_udp_rx_fd(void *channel, int i)
+{
+	struct udp_channel *m = channel;
+	return udp_get_rx_fd(m->server, i);
+}
+
+static void
+channel_udp_rx_set(void *channel, int i)
+{
+	struct udp_channel *m = channel;
+	udp_set_rx(m->server, i);
+}
+
 static void
 channel_udp_stats(struct channel *c, int fd)
 {
@@ -86,7 +124,7 @@ channel_udp_stats_extended(struct channel *c, int active,
 			     struct nlif_handle *h, int fd)
 {
 	struct udp_channel *m = c->data;
-	char ifname[IFNAMSIZ], buf[512];
+	char ifname[IFNAMSIZ], buf[1024];
 	const char *status;
 	unsigned int flags;
 	int size;
@@ -110,6 +148,11 @@ channel_udp_stats_extended(struct channel *c, int active,
 				     &m->client->stats,
 				     &m->server->stats);
 	send(fd, buf, size, 0);
+
+	if (m->server->rx_num > 1) {
+		size = udp_snprintf_rx(buf, sizeof(buf), m->server);
+		send(fd, buf, size, 0);
+	}
 }
 
 static int
@@ -130,7 +173,12 @@ struct channel_ops channel_udp = {
 	.open		= channel_udp_open,
 	.close		= channel_udp_close,
 	.send		= channel_udp_send,
+	.sendv		= channel_udp_sendv,
 	.recv		= channel_udp_recv,
+	.recvv		= channel_udp_recvv,
+	.recv_size	= channel_udp_recv_size,
+	.rx_fd		= channel_udp_rx_fd,
+	.rx_set		= channel_udp_rx_set,
 	.get_fd		= channel_udp_get_fd,
 	.isset		= channel_udp_isset,
 	.accept_isset	= channel_udp_accept_isset,
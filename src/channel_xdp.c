@@ -0,0 +1,127 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <libnfnetlink/libnfnetlink.h>
+
+#include "channel.h"
+#include "xdp.h"
+
+static void
+*channel_xdp_open(void *conf)
+{
+	return xdp_sock_create(conf);
+}
+
+static int
+channel_xdp_send(void *channel, const void *data, int len)
+{
+	return xdp_send(channel, data, len);
+}
+
+static int
+channel_xdp_sendv(void *channel, const struct iovec *iov, int n)
+{
+	return xdp_sendv(channel, iov, n);
+}
+
+static int
+channel_xdp_recv(void *channel, char *buf, int size)
+{
+	return xdp_recv(channel, buf, size);
+}
+
+static int
+channel_xdp_recvv(void *channel, const struct iovec *iov, int *len,
+		  int *seg, int n)
+{
+	return xdp_recvv(channel, iov, len, seg, n);
+}
+
+static void
+channel_xdp_close(void *channel)
+{
+	xdp_sock_destroy(channel);
+}
+
+static int
+channel_xdp_get_fd(void *channel)
+{
+	return xdp_get_fd(channel);
+}
+
+static void
+channel_xdp_stats(struct channel *c, int fd)
+{
+	struct xdp_sock *m = c->data;
+	char ifname[IFNAMSIZ], buf[512];
+	int size;
+
+	if_indextoname(c->channel_ifindex, ifname);
+	size = xdp_snprintf_stats(buf, sizeof(buf), ifname,
+				  &m->stats_send, &m->stats_recv);
+	send(fd, buf, size, 0);
+}
+
+static void
+channel_xdp_stats_extended(struct channel *c, int active,
+			   struct nlif_handle *h, int fd)
+{
+	struct xdp_sock *m = c->data;
+	char ifname[IFNAMSIZ], buf[512];
+	const char *status;
+	unsigned int flags;
+	int size;
+
+	if_indextoname(c->channel_ifindex, ifname);
+	nlif_get_ifflags(h, c->channel_ifindex, &flags);
+	/*
+	 * IFF_UP shows administrative status
+	 * IFF_RUNNING shows carrier status
+	 */
+	if (flags & IFF_UP) {
+		if (!(flags & IFF_RUNNING))
+			status = "NO-CARRIER";
+		else
+			status = "RUNNING";
+	} else {
+		status = "DOWN";
+	}
+	size = xdp_snprintf_stats2(buf, sizeof(buf),
+				   ifname, status, active,
+				   &m->stats_send, &m->stats_recv);
+	send(fd, buf, size, 0);
+}
+
+static int
+channel_xdp_isset(struct channel *c, fd_set *readfds)
+{
+	return xdp_isset(c->data, readfds);
+}
+
+static int
+channel_xdp_accept_isset(struct channel *c, fd_set *readfds)
+{
+	return 0;
+}
+
+struct channel_ops channel_xdp = {
+	.headersiz	= 0, /* the ethernet header is not part of the MTU */
+	.open		= channel_xdp_open,
+	.close		= channel_xdp_close,
+	.send		= channel_xdp_send,
+	.sendv		= channel_xdp_sendv,
+	.recv		= channel_xdp_recv,
+	.recvv		= channel_xdp_recvv,
+	.get_fd		= channel_xdp_get_fd,
+	.isset		= channel_xdp_isset,
+	.accept_isset	= channel_xdp_accept_isset,
+	.stats		= channel_xdp_stats,
+	.stats_extended = channel_xdp_stats_extended,
+};
@@ -151,18 +151,18 @@ int ctnl_local(int fd, int type, void *data)
 
 static void do_overrun_resync_alarm(struct alarm_block *a, void *data)
 {
+	/* entries that this dump does not report are purged once it is over */
+	STATE(resync_gen)++;
 	nl_send_resync(STATE(resync));
 	STATE(stats).nl_kernel_table_resync++;
 }
 
 static void do_polling_alarm(struct alarm_block *a, void *data)
 {
-	if (STATE(mode)->internal->ct.purge)
-		STATE(mode)->internal->ct.purge();
-
 	if (STATE(mode)->internal->exp.purge)
 		STATE(mode)->internal->exp.purge();
 
+	STATE(resync_gen)++;
 	nl_send_resync(STATE(resync));
 	if (CONFIG(flags) & CTD_EXPECT)
 		nl_send_expect_resync(STATE(resync));
@@ -327,7 +327,18 @@ static void event_cb(void *data)
 {
 	int ret;
 
+	/* used to account the event to wire latency in sync mode. */
+	clock_gettime(CLOCK_MONOTONIC, &STATE(event_ts));
+	/* and to stamp the messages, see LatencyTarget. */
+	if (CONFIG(lowlat).latency_target)
+		clock_gettime(CLOCK_REALTIME, &STATE(event_real));
+
 	ret = nfct_catch(STATE(event));
+	STATE(event_ts).tv_sec = 0;
+	STATE(event_ts).tv_nsec = 0;
+	STATE(event_real).tv_sec = 0;
+	STATE(event_real).tv_nsec = 0;
+
 	/* reset event iteration limit counter */
 	STATE(event_iterations_limit) = CONFIG(event_iterations_limit);
 	if (ret == -1) {
@@ -384,19 +395,18 @@ static void event_cb(void *data)
 	}
 }
 
-/* we previously requested a resync due to buffer overrun. */
+/* we previously requested a resync due to buffer overrun or polling. */
 static void resync_cb(void *data)
 {
-	nfct_catch(STATE(resync));
+	/* the socket is non-blocking, the dump may take several rounds. */
+	if (nfct_catch(STATE(resync)) == -1)
+		return;
+
+	/* the dump is over, purge the entries that it did not report. */
 	if (STATE(mode)->internal->ct.purge)
 		STATE(mode)->internal->ct.purge();
 }
 
-static void poll_cb(void *data)
-{
-	nfct_catch(STATE(resync));
-}
-
 int ctnl_init(void)
 {
 	if (CONFIG(flags) & CTD_STATS_MODE)
@@ -428,13 +438,7 @@ int ctnl_init(void)
 			       NFCT_T_ALL,
 			       STATE(mode)->internal->ct.resync,
 			       NULL);
-	if (CONFIG(flags) & CTD_POLL) {
-		register_fd(nfct_fd(STATE(resync)), poll_cb,
-				NULL, STATE(fds));
-	} else {
-		register_fd(nfct_fd(STATE(resync)), resync_cb,
-				NULL, STATE(fds));
-	}
+	register_fd(nfct_fd(STATE(resync)), resync_cb, NULL, STATE(fds));
 	fcntl(nfct_fd(STATE(resync)), F_SETFL, O_NONBLOCK);
 
 	if (STATE(mode)->internal->flags & INTERNAL_F_POPULATE) {
@@ -28,11 +28,19 @@
 static struct cache *external;
 static struct cache *external_exp;
 
+static struct cache_ops *external_ct_ops(void)
+{
+	if (CONFIG(sync).compact_external_cache)
+		return &cache_sync_external_compact_ct_ops;
+
+	return &cache_sync_external_ct_ops;
+}
+
 static int external_cache_init(void)
 {
 	external = cache_create("external", CACHE_T_CT,
 				STATE_SYNC(sync)->external_cache_flags,
-				NULL, &cache_sync_external_ct_ops);
+				NULL, external_ct_ops());
 	if (external == NULL) {
 		dlog(LOG_ERR, "can't allocate memory for the external cache");
 		return -1;
@@ -82,6 +90,19 @@ static void external_cache_ct_upd(struct nf_conntrack *ct)
 	cache_update_force(external, ct);
 }
 
+static int external_cache_ct_merge(struct nf_conntrack *ct)
+{
+	struct cache_object *obj;
+	int id;
+
+	obj = cache_find(external, ct, &id);
+	if (obj == NULL || obj->status == C_OBJ_DEAD)
+		return 0;
+
+	cache_update(external, obj, id, ct);
+	return 1;
+}
+
 static int external_cache_ct_del(struct nf_conntrack *ct)
 {
 	struct cache_object *obj;
@@ -193,6 +214,7 @@ struct external_handler external_cache = {
 		.new		= external_cache_ct_new,
 		.upd		= external_cache_ct_upd,
 		.del		= external_cache_ct_del,
+		.merge		= external_cache_ct_merge,
 		.dump		= external_cache_ct_dump,
 		.commit		= external_cache_ct_commit,
 		.flush		= external_cache_ct_flush,
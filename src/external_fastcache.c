@@ -58,7 +58,8 @@ static int fast_iterate(void *data1, void *n)
 	} 
 	else if(time_cached() > (obj->lifetime + 300))
 	{
-		id = hashtable_hash(external->h, obj->ptr);
+		/* both caches hash the same way */
+		id = cache_object_hash(obj);
 		cache_del(external_fast, obj);
 		cache_add(external, obj, id);
 	}
@@ -105,11 +106,19 @@ static void do_gc_slow(struct alarm_block *a, void *data)
 	add_alarm(&slow_alarm, 30, 0);
 }
 
+static struct cache_ops *external_ct_ops(void)
+{
+	if (CONFIG(sync).compact_external_cache)
+		return &cache_sync_external_compact_ct_ops;
+
+	return &cache_sync_external_ct_ops;
+}
+
 static int external_cache_init(void)
 {
 	external = cache_create("external", CACHE_T_CT,
 				STATE_SYNC(sync)->external_cache_flags,
-				NULL, &cache_sync_external_ct_ops);
+				NULL, external_ct_ops());
 	if (external == NULL) {
 		dlog(LOG_ERR, "can't allocate memory for the external cache");
 		return -1;
@@ -117,7 +126,7 @@ static int external_cache_init(void)
 	
 	external_fast = cache_create("external_fast", CACHE_T_CT,
 				STATE_SYNC(sync)->external_cache_flags,
-				NULL, &cache_sync_external_ct_ops);
+				NULL, external_ct_ops());
 	if (external == NULL) {
 		dlog(LOG_ERR, "can't allocate memory for the external cache");
 		return -1;
@@ -194,6 +203,24 @@ static void external_cache_ct_upd(struct nf_conntrack *ct)
 	}
 }
 
+static int external_cache_ct_merge(struct nf_conntrack *ct)
+{
+	struct cache_object *obj;
+	struct cache *c = external;
+	int id;
+
+	obj = cache_find(external, ct, &id);
+	if (obj == NULL) {
+		c = external_fast;
+		obj = cache_find(external_fast, ct, &id);
+	}
+	if (obj == NULL || obj->status == C_OBJ_DEAD)
+		return 0;
+
+	cache_update(c, obj, id, ct);
+	return 1;
+}
+
 static int external_cache_ct_del(struct nf_conntrack *ct)
 {
 	struct cache_object *obj;
@@ -201,7 +228,7 @@ static int external_cache_ct_del(struct nf_conntrack *ct)
 	
 	obj = cache_find(external_fast, ct, &id);
 	if (obj) {
-		if(obj->owner != STATE_SYNC(channel)->current){
+		if(obj->owner != STATE_SYNC(channel)->rx_current){
 			return 0;
 		}
 		cache_del(external_fast, obj);
@@ -211,7 +238,7 @@ static int external_cache_ct_del(struct nf_conntrack *ct)
 
 	obj = cache_find(external, ct, &id);
 	if (obj) {
-		if(obj->owner != STATE_SYNC(channel)->current){
+		if(obj->owner != STATE_SYNC(channel)->rx_current){
 			return 0;
 		}
 		cache_del(external, obj);
@@ -331,6 +358,7 @@ struct external_handler external_fastcache = {
 		.new		= external_cache_ct_new,
 		.upd		= external_cache_ct_upd,
 		.del		= external_cache_ct_del,
+		.merge		= external_cache_ct_merge,
 		.dump		= external_cache_ct_dump,
 		.commit		= external_cache_ct_commit,
 		.flush		= external_cache_ct_flush,
@@ -141,6 +141,23 @@ static void external_inject_ct_upd(struct nf_conntrack *ct)
 	dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
 }
 
+static int external_inject_ct_merge(struct nf_conntrack *ct)
+{
+	if (nl_update_conntrack(inject, ct, CONFIG(commit_timeout)) != -1) {
+		external_inject_stat.upd_ok++;
+		return 1;
+	}
+
+	/* we cannot create the entry from a delta */
+	if (errno == ENOENT)
+		return 0;
+
+	external_inject_stat.upd_fail++;
+	dlog(LOG_ERR, "inject-merge: %s", strerror(errno));
+	dlog_ct(STATE(log), ct, NFCT_O_PLAIN);
+	return 1;
+}
+
 static int external_inject_ct_del(struct nf_conntrack *ct)
 {
 	if (nl_destroy_conntrack(inject, ct) == -1) {
@@ -279,6 +296,7 @@ struct external_handler external_inject = {
 		.new		= external_inject_ct_new,
 		.upd		= external_inject_ct_upd,
 		.del		= external_inject_ct_del,
+		.merge		= external_inject_ct_merge,
 		.dump		= external_inject_ct_dump,
 		.commit		= external_inject_ct_commit,
 		.flush		= external_inject_ct_flush,
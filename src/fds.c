@@ -35,6 +35,7 @@ struct fds *create_fds(void)
 		return NULL;
 
 	INIT_LIST_HEAD(&fds->list);
+	INIT_LIST_HEAD(&fds->write_list);
 
 	return fds;
 }
@@ -48,6 +49,11 @@ void destroy_fds(struct fds *fds)
 		FD_CLR(this->fd, &fds->readfds);
 		free(this);
 	}
+	list_for_each_entry_safe(this, tmp, &fds->write_list, head) {
+		list_del(&this->head);
+		FD_CLR(this->fd, &fds->writefds);
+		free(this);
+	}
 	free(fds);
 }
 
@@ -73,15 +79,16 @@ int register_fd(int fd, void (*cb)(void *data), void *data, struct fds *fds)
 	return 0;
 }
 
-int unregister_fd(int fd, struct fds *fds)
+static int __unregister_fd(int fd, struct fds *fds, struct list_head *list,
+			   fd_set *set)
 {
 	int found = 0, maxfd = -1;
 	struct fds_item *this, *tmp;
 
-	list_for_each_entry_safe(this, tmp, &fds->list, head) {
+	list_for_each_entry_safe(this, tmp, list, head) {
 		if (this->fd == fd) {
 			list_del(&this->head);
-			FD_CLR(this->fd, &fds->readfds);
+			FD_CLR(this->fd, set);
 			free(this);
 			found = 1;
 			/* ... and recalculate maxfd, see below. */
@@ -97,18 +104,64 @@ int unregister_fd(int fd, struct fds *fds)
 			maxfd = this->fd;
 		}
 	}
+	list_for_each_entry(this, &fds->write_list, head) {
+		if (maxfd < this->fd) {
+			maxfd = this->fd;
+		}
+	}
 	fds->maxfd = maxfd;
 
 	return 0;
 }
 
+int unregister_fd(int fd, struct fds *fds)
+{
+	return __unregister_fd(fd, fds, &fds->list, &fds->readfds);
+}
+
+/* Wait for fd to become writable, eg. a socket that has data to send
+ * which did not fit in its buffer. */
+int register_fd_write(int fd, void (*cb)(void *data), void *data,
+		      struct fds *fds)
+{
+	struct fds_item *item;
+
+	item = calloc(sizeof(struct fds_item), 1);
+	if (item == NULL)
+		return -1;
+
+	FD_SET(fd, &fds->writefds);
+
+	if (fd > fds->maxfd)
+		fds->maxfd = fd;
+
+	item->fd = fd;
+	item->cb = cb;
+	item->data = data;
+	list_add_tail(&item->head, &fds->write_list);
+
+	return 0;
+}
+
+int unregister_fd_write(int fd, struct fds *fds)
+{
+	return __unregister_fd(fd, fds, &fds->write_list, &fds->writefds);
+}
+
 static void select_main_step(struct timeval *next_alarm)
 {
 	int ret;
 	fd_set readfds = STATE(fds)->readfds;
+	fd_set writefds = STATE(fds)->writefds;
 	struct fds_item *cur, *tmp;
+	struct timeval busy_poll = {};
+
+	/* in low latency mode, spin instead of sleeping in select(). */
+	if (CONFIG(lowlat).busy_poll)
+		next_alarm = &busy_poll;
 
-	ret = select(STATE(fds)->maxfd + 1, &readfds, NULL, NULL, next_alarm);
+	ret = select(STATE(fds)->maxfd + 1, &readfds, &writefds, NULL,
+		     next_alarm);
 	if (ret == -1) {
 		/* interrupted syscall, retry */
 		if (errno == EINTR)
@@ -125,6 +178,10 @@ static void select_main_step(struct timeval *next_alarm)
 		if (FD_ISSET(cur->fd, &readfds))
 			cur->cb(cur->data);
 	}
+	list_for_each_entry_safe(cur, tmp, &STATE(fds)->write_list, head) {
+		if (FD_ISSET(cur->fd, &writefds))
+			cur->cb(cur->data);
+	}
 
 	sigprocmask(SIG_UNBLOCK, &STATE(block), NULL);
 }
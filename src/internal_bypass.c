@@ -118,8 +118,9 @@ static void internal_bypass_ct_event_new(struct nf_conntrack *ct, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return;
 
-	net = BUILD_NETMSG_FROM_CT(ct, NET_T_STATE_CT_NEW);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_CT_AT(multichannel_reserve(STATE_SYNC(channel)),
+					ct, NET_T_STATE_CT_NEW);
+	sync_send_event(net);
 	internal_bypass_stats.new++;
 }
 
@@ -131,8 +132,9 @@ static void internal_bypass_ct_event_upd(struct nf_conntrack *ct, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return;
 
-	net = BUILD_NETMSG_FROM_CT(ct, NET_T_STATE_CT_UPD);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_CT_AT(multichannel_reserve(STATE_SYNC(channel)),
+					ct, NET_T_STATE_CT_UPD);
+	sync_send_event(net);
 	internal_bypass_stats.upd++;
 }
 
@@ -144,8 +146,9 @@ static int internal_bypass_ct_event_del(struct nf_conntrack *ct, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return 1;
 
-	net = BUILD_NETMSG_FROM_CT(ct, NET_T_STATE_CT_DEL);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_CT_AT(multichannel_reserve(STATE_SYNC(channel)),
+					ct, NET_T_STATE_CT_DEL);
+	sync_send_event(net);
 	internal_bypass_stats.del++;
 
 	return 1;
@@ -250,8 +253,9 @@ static void internal_bypass_exp_event_new(struct nf_expect *exp, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return;
 
-	net = BUILD_NETMSG_FROM_EXP(exp, NET_T_STATE_EXP_NEW);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_EXP_AT(multichannel_reserve(STATE_SYNC(channel)),
+					exp, NET_T_STATE_EXP_NEW);
+	sync_send_event(net);
 	exp_internal_bypass_stats.new++;
 }
 
@@ -263,8 +267,9 @@ static void internal_bypass_exp_event_upd(struct nf_expect *exp, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return;
 
-	net = BUILD_NETMSG_FROM_EXP(exp, NET_T_STATE_EXP_UPD);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_EXP_AT(multichannel_reserve(STATE_SYNC(channel)),
+					exp, NET_T_STATE_EXP_UPD);
+	sync_send_event(net);
 	exp_internal_bypass_stats.upd++;
 }
 
@@ -276,8 +281,9 @@ static int internal_bypass_exp_event_del(struct nf_expect *exp, int origin)
 	if (origin != CTD_ORIGIN_NOT_ME)
 		return 1;
 
-	net = BUILD_NETMSG_FROM_EXP(exp, NET_T_STATE_EXP_DEL);
-	multichannel_send(STATE_SYNC(channel), net);
+	net = BUILD_NETMSG_FROM_EXP_AT(multichannel_reserve(STATE_SYNC(channel)),
+					exp, NET_T_STATE_EXP_DEL);
+	sync_send_event(net);
 	exp_internal_bypass_stats.del++;
 
 	return 1;
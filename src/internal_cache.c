@@ -15,19 +15,68 @@
 #include "network.h"
 #include "origin.h"
 
-static void sync_send(void *ptr, int query)
+/* hash buckets visited per purge alarm, bounds the time we block. */
+#define PURGE_STEPS	1024
+
+static struct {
+	struct alarm_block	alarm;
+	uint32_t		gen;	/* dump that we are purging against */
+	uint32_t		next;	/* next hash bucket to visit */
+} purge;
+
+/* The entries that were sent as deltas are sent in full this many seconds
+ * later at most, so a delta that was lost does not stay lost. */
+#define DELTA_REFRESH_INT	10
+
+/* hash buckets visited per refresh alarm, bounds the time we block. */
+#define REFRESH_STEPS		1024
+
+static struct {
+	struct alarm_block	alarm;
+	uint32_t		next;	/* next hash bucket to visit */
+} refresh;
+
+/* ptr is what we send about obj, obj tells the channel in striping mode */
+static void sync_send(struct cache_object *obj, void *ptr, int query)
 {
 	struct nethdr *net;
 
-	net = BUILD_NETMSG_FROM_CT(ptr, NET_T_STATE_CT_NEW);
-	multichannel_send(STATE_SYNC(channel), net);
+	/* this makes up for the deltas sent so far */
+	obj->delta = 0;
+
+	nethdr_stripe(obj);
+	net = BUILD_NETMSG_FROM_CT_AT(multichannel_reserve(STATE_SYNC(channel)),
+					ptr, NET_T_STATE_CT_NEW);
+	sync_send_event(net);
 }
 
+static void sync_send_delta(const struct cache_object *obj, int mask)
+{
+	struct nethdr *net;
+
+	nethdr_stripe(obj);
+	net = BUILD_NETMSG_FROM_CT_DELTA_AT(
+			multichannel_reserve(STATE_SYNC(channel)), obj->ptr, mask);
+	sync_send_event(net);
+}
+
+static void do_purge_alarm(struct alarm_block *a, void *data);
+static void do_refresh_alarm(struct alarm_block *a, void *data);
+
 static int internal_cache_init(void)
 {
+	unsigned int flags = STATE_SYNC(sync)->internal_cache_flags;
+
+	init_alarm(&purge.alarm, NULL, do_purge_alarm);
+	init_alarm(&refresh.alarm, NULL, do_refresh_alarm);
+	if (CONFIG(sync).delta_updates)
+		add_alarm(&refresh.alarm, DELTA_REFRESH_INT, 0);
+
+	if (CONFIG(sync).message_cache)
+		flags |= MSG;
+
 	STATE(mode)->internal->ct.data =
-		cache_create("internal", CACHE_T_CT,
-			     STATE_SYNC(sync)->internal_cache_flags,
+		cache_create("internal", CACHE_T_CT, flags,
 			     STATE_SYNC(sync)->internal_cache_extra,
 			     &cache_sync_internal_ct_ops);
 
@@ -37,8 +86,7 @@ static int internal_cache_init(void)
 	}
 
 	STATE(mode)->internal->exp.data =
-		cache_create("internal", CACHE_T_EXP,
-			STATE_SYNC(sync)->internal_cache_flags,
+		cache_create("internal", CACHE_T_EXP, flags,
 			STATE_SYNC(sync)->internal_cache_extra,
 			&cache_sync_internal_exp_ops);
 
@@ -52,6 +100,8 @@ static int internal_cache_init(void)
 
 static void internal_cache_close(void)
 {
+	del_alarm(&purge.alarm);
+	del_alarm(&refresh.alarm);
 	cache_destroy(STATE(mode)->internal->ct.data);
 	cache_destroy(STATE(mode)->internal->exp.data);
 }
@@ -78,6 +128,8 @@ static void internal_cache_ct_stats_ext(int fd)
 
 static void internal_cache_ct_populate(struct nf_conntrack *ct)
 {
+	struct cache_object *obj;
+
 	/* This is required by kernels < 2.6.20 */
 	nfct_attr_unset(ct, ATTR_ORIG_COUNTER_BYTES);
 	nfct_attr_unset(ct, ATTR_ORIG_COUNTER_PACKETS);
@@ -85,33 +137,82 @@ static void internal_cache_ct_populate(struct nf_conntrack *ct)
 	nfct_attr_unset(ct, ATTR_REPL_COUNTER_PACKETS);
 	nfct_attr_unset(ct, ATTR_USE);
 
-	cache_update_force(STATE(mode)->internal->ct.data, ct);
+	obj = cache_update_force(STATE(mode)->internal->ct.data, ct);
+	if (obj != NULL)
+		obj->gen = STATE(resync_gen);
 }
 
 static int internal_cache_ct_purge_step(void *data1, void *data2)
 {
 	struct cache_object *obj = data2;
 
-	STATE(get_retval) = 0;
-	nl_get_conntrack(STATE(get), obj->ptr);	/* modifies STATE(get_reval) */
-	if (!STATE(get_retval)) {
-		if (obj->status != C_OBJ_DEAD) {
-			cache_object_set_status(obj, C_OBJ_DEAD);
-			sync_send(obj->ptr, NET_T_STATE_CT_DEL);
-			cache_object_put(obj);
-		}
+	/* neither the dump nor any event since it started has seen this
+	 * entry, so it is gone from the kernel table. */
+	if ((int32_t)(obj->gen - purge.gen) < 0 &&
+	    obj->status != C_OBJ_DEAD) {
+		cache_object_set_status(obj, C_OBJ_DEAD);
+		sync_send(obj, obj->ptr, NET_T_STATE_CT_DEL);
+		cache_object_put(obj);
 	}
 
 	return 0;
 }
 
+static void do_purge_alarm(struct alarm_block *a, void *data)
+{
+	uint32_t next;
+
+	next = cache_iterate_limit(STATE(mode)->internal->ct.data, NULL,
+				   purge.next, PURGE_STEPS,
+				   internal_cache_ct_purge_step);
+	if (next - purge.next != PURGE_STEPS)
+		return;
+
+	purge.next = next;
+	add_alarm(&purge.alarm, 0, 1);
+}
+
+static int internal_cache_ct_refresh_step(void *data1, void *data2)
+{
+	struct cache_object *obj = data2;
+
+	if (obj->delta == 0 || obj->status == C_OBJ_DEAD)
+		return 0;
+
+	/* through the transmission queue, so FTFW resends it if lost */
+	obj->delta = 0;
+	STATE_SYNC(delta).refresh++;
+	STATE_SYNC(sync)->enqueue(obj, NET_T_STATE_CT_UPD);
+	return 0;
+}
+
+static void do_refresh_alarm(struct alarm_block *a, void *data)
+{
+	uint32_t next;
+
+	next = cache_iterate_limit(STATE(mode)->internal->ct.data, NULL,
+				   refresh.next, REFRESH_STEPS,
+				   internal_cache_ct_refresh_step);
+	if (next - refresh.next != REFRESH_STEPS) {
+		refresh.next = 0;
+		add_alarm(&refresh.alarm, DELTA_REFRESH_INT, 0);
+		return;
+	}
+
+	refresh.next = next;
+	add_alarm(&refresh.alarm, 0, 1);
+}
+
+/* called once a resync dump is over: sweep the entries that were not tagged
+ * with its generation in small steps, so we don't block the daemon. */
 static void internal_cache_ct_purge(void)
 {
-	cache_iterate(STATE(mode)->internal->ct.data, NULL,
-			internal_cache_ct_purge_step);
+	purge.gen = STATE(resync_gen);
+	purge.next = 0;
+	do_purge_alarm(&purge.alarm, NULL);
 }
 
-void cache_ct_copy(void *dst, void *src, unsigned int flags);
+int cache_ct_copy(void *dst, void *src, unsigned int flags);
 void *cache_ct_alloc(void);
 void cache_ct_free(void *ptr);
 
@@ -130,6 +231,9 @@ internal_cache_ct_resync(enum nf_conntrack_msg_type type,
 		return NFCT_CB_CONTINUE;
 	
 	obj = cache_find(STATE(mode)->internal->ct.data, ct, &id);
+	if (obj != NULL)
+		obj->gen = STATE(resync_gen);
+
 	if (obj && obj->status != C_OBJ_DEAD && (time_cached() - obj->lastupdate) > 45 && nfct_attr_is_set(obj->ptr, ATTR_TIMEOUT)) {
 		timeout = nfct_get_attr_u32(obj->ptr, ATTR_TIMEOUT);
 		/* If more than 90 seconds remain */
@@ -159,7 +263,7 @@ internal_cache_ct_resync(enum nf_conntrack_msg_type type,
 
 	switch (obj->status) {
 	case C_OBJ_NEW:
-		sync_send(obj->ptr, NET_T_STATE_CT_NEW);
+		sync_send(obj, obj->ptr, NET_T_STATE_CT_NEW);
 		break;
 	case C_OBJ_ALIVE:
 		/* Light weight resync */
@@ -174,10 +278,10 @@ internal_cache_ct_resync(enum nf_conntrack_msg_type type,
 	
 			nfct_set_attr_u32(obj2, ATTR_TIMEOUT, nfct_attr_is_set(ct, ATTR_TIMEOUT) ? nfct_get_attr_u32(ct, ATTR_TIMEOUT) : 180);
 			
-			sync_send(obj2, NET_T_STATE_CT_UPD);
+			sync_send(obj, obj2, NET_T_STATE_CT_UPD);
 			cache_ct_free(obj2);
 		}else{
-			sync_send(ct, NET_T_STATE_CT_UPD);
+			sync_send(obj, ct, NET_T_STATE_CT_UPD);
 		}
 		
 		
@@ -211,11 +315,12 @@ retry:
 			cache_object_free(obj);
 			return;
 		}
+		obj->gen = STATE(resync_gen);
 		/* only synchronize events that have been triggered by other
 		 * processes or the kernel, but don't propagate events that
 		 * have been triggered by conntrackd itself, eg. commits. */
 		if (origin == CTD_ORIGIN_NOT_ME)
-			sync_send(obj->ptr, NET_T_STATE_CT_NEW);
+			sync_send(obj, obj->ptr, NET_T_STATE_CT_NEW);
 	} else {
 		cache_del(STATE(mode)->internal->ct.data, obj);
 		cache_object_free(obj);
@@ -226,17 +331,41 @@ retry:
 static void internal_cache_ct_event_upd(struct nf_conntrack *ct, int origin)
 {
 	struct cache_object *obj;
+	int id, delta = -1;
 
 	/* this event has been triggered by a direct inject, skip */
 	if (origin == CTD_ORIGIN_INJECT)
 		return;
 
-	obj = cache_update_force(STATE(mode)->internal->ct.data, ct);
-	if (obj == NULL)
+	obj = cache_find(STATE(mode)->internal->ct.data, ct, &id);
+	if (obj != NULL && obj->status != C_OBJ_DEAD) {
+		/* the cached entry is what we have replicated so far */
+		if (CONFIG(sync).delta_updates && origin == CTD_ORIGIN_NOT_ME)
+			delta = ct_delta(obj->ptr, ct);
+
+		cache_update(STATE(mode)->internal->ct.data, obj, id, ct);
+	} else {
+		obj = cache_update_force(STATE(mode)->internal->ct.data, ct);
+		if (obj == NULL)
+			return;
+	}
+	obj->gen = STATE(resync_gen);
+
+	if (origin != CTD_ORIGIN_NOT_ME)
 		return;
 
-	if (origin == CTD_ORIGIN_NOT_ME)
-		sync_send(obj->ptr, NET_T_STATE_CT_UPD);
+	/* Even if nothing has changed, this refreshes the entry in the peer.
+	 * Every delta also carries what the previous ones did, so one that
+	 * gets lost is made up for by the next one, or by the refresh. */
+	if (delta != -1) {
+		obj->delta |= delta;
+		sync_send_delta(obj, obj->delta);
+		STATE_SYNC(delta).sent++;
+		return;
+	}
+	if (CONFIG(sync).delta_updates)
+		STATE_SYNC(delta).full++;
+	sync_send(obj, obj->ptr, NET_T_STATE_CT_UPD);
 }
 
 static int internal_cache_ct_event_del(struct nf_conntrack *ct, int origin)
@@ -256,7 +385,7 @@ static int internal_cache_ct_event_del(struct nf_conntrack *ct, int origin)
 	if (obj->status != C_OBJ_DEAD) {
 		cache_object_set_status(obj, C_OBJ_DEAD);
 		if (origin == CTD_ORIGIN_NOT_ME) {
-			sync_send(obj->ptr, NET_T_STATE_CT_DEL);
+			sync_send(obj, obj->ptr, NET_T_STATE_CT_DEL);
 		}
 		cache_object_put(obj);
 	}
@@ -297,7 +426,7 @@ static int internal_cache_exp_purge_step(void *data1, void *data2)
 	if (!STATE(get_retval)) {
 		if (obj->status != C_OBJ_DEAD) {
 			cache_object_set_status(obj, C_OBJ_DEAD);
-			sync_send(obj->ptr, NET_T_STATE_EXP_DEL);
+			sync_send(obj, obj->ptr, NET_T_STATE_EXP_DEL);
 			cache_object_put(obj);
 		}
 	}
@@ -331,10 +460,10 @@ internal_cache_exp_resync(enum nf_conntrack_msg_type type,
 
 	switch (obj->status) {
 	case C_OBJ_NEW:
-		sync_send(obj->ptr, NET_T_STATE_EXP_NEW);
+		sync_send(obj, obj->ptr, NET_T_STATE_EXP_NEW);
 		break;
 	case C_OBJ_ALIVE:
-		sync_send(obj->ptr, NET_T_STATE_EXP_UPD);
+		sync_send(obj, obj->ptr, NET_T_STATE_EXP_UPD);
 		break;
 	}
 	return NFCT_CB_CONTINUE;
@@ -363,7 +492,7 @@ retry:
 		 * processes or the kernel, but don't propagate events that
 		 * have been triggered by conntrackd itself, eg. commits. */
 		if (origin == CTD_ORIGIN_NOT_ME)
-			sync_send(obj->ptr, NET_T_STATE_EXP_NEW);
+			sync_send(obj, obj->ptr, NET_T_STATE_EXP_NEW);
 	} else {
 		cache_del(STATE(mode)->internal->exp.data, obj);
 		cache_object_free(obj);
@@ -384,7 +513,7 @@ static void internal_cache_exp_event_upd(struct nf_expect *exp, int origin)
 		return;
 
 	if (origin == CTD_ORIGIN_NOT_ME)
-		sync_send(obj->ptr, NET_T_STATE_EXP_UPD);
+		sync_send(obj, obj->ptr, NET_T_STATE_EXP_UPD);
 }
 
 static int internal_cache_exp_event_del(struct nf_expect *exp, int origin)
@@ -404,7 +533,7 @@ static int internal_cache_exp_event_del(struct nf_expect *exp, int origin)
 	if (obj->status != C_OBJ_DEAD) {
 		cache_object_set_status(obj, C_OBJ_DEAD);
 		if (origin == CTD_ORIGIN_NOT_ME) {
-			sync_send(obj->ptr, NET_T_STATE_EXP_DEL);
+			sync_send(obj, obj->ptr, NET_T_STATE_EXP_DEL);
 		}
 		cache_object_put(obj);
 	}
@@ -21,6 +21,7 @@
 #include "log.h"
 #include "helper.h"
 #include "systemd.h"
+#include "affinity.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -48,7 +49,7 @@ static const char usage_client_commands[] =
 	"  -i [ct|expect], display content of the internal cache\n"
 	"  -e [ct|expect], display the content of the external cache\n"
 	"  -k, kill conntrack daemon\n"
-	"  -s  [network|cache|runtime|link|rsqueue|queue|ct|expect], "
+	"  -s  [network|cache|runtime|link|rsqueue|peers|queue|ct|expect], "
 		"dump statistics\n"
 	"  -R [ct|expect], resync with kernel conntrack table\n"
 	"  -n, request resync with other node (only FT-FW and NOTRACK modes)\n"
@@ -279,6 +280,10 @@ int main(int argc, char *argv[])
 						 strlen(argv[i+1])) == 0) {
 					action = STATS_PROCESS;
 					i++;
+				} else if (strncmp(argv[i+1], "peers",
+						strlen(argv[i+1])) == 0) {
+					action = STATS_PEERS;
+					i++;
 				} else if (strncmp(argv[i+1], "queue",
 						strlen(argv[i+1])) == 0) {
 					action = STATS_QUEUE;
@@ -390,6 +395,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (affinity_init() == -1) {
+		close_log();
+		fprintf(stderr, "ERROR: cannot set CPU and memory placement, "
+				"please check the logfile for more info\n");
+		exit(EXIT_FAILURE);
+	}
+
 	/*
 	 * initialization process
 	 */
@@ -18,6 +18,7 @@
  * Description: multicast socket library
  */
 
+#define _GNU_SOURCE
 #include "mcast.h"
 
 #include <stdio.h>
@@ -28,6 +29,8 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <libnfnetlink/libnfnetlink.h>
 
@@ -265,6 +268,7 @@ ssize_t mcast_send(struct mcast_sock *m, const void *data, int size)
 		     0,
 		     (struct sockaddr *) &m->addr,
 		     m->sockaddr_len);
+	m->stats.syscalls++;
 	if (ret == -1) {
 		m->stats.error++;
 		return ret;
@@ -276,6 +280,43 @@ ssize_t mcast_send(struct mcast_sock *m, const void *data, int size)
 	return ret;
 }
 
+/* send every iovec as one datagram, returns how many of them were sent or
+ * -1 if the first one fails. */
+int mcast_sendv(struct mcast_sock *m, const struct iovec *iov, int n)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msg[n];
+	int ret, i;
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_name = &m->addr;
+		msg[i].msg_hdr.msg_namelen = m->sockaddr_len;
+		msg[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = sendmmsg(m->fd, msg, n, 0);
+	m->stats.syscalls++;
+	if (ret == -1) {
+		m->stats.error++;
+		return ret;
+	}
+	for (i = 0; i < ret; i++) {
+		m->stats.bytes += msg[i].msg_len;
+		m->stats.messages++;
+	}
+	return ret;
+#else
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (mcast_send(m, iov[i].iov_base, iov[i].iov_len) == -1)
+			return i > 0 ? i : -1;
+	}
+	return n;
+#endif
+}
+
 ssize_t mcast_recv(struct mcast_sock *m, void *data, int size)
 {
 	ssize_t ret;
@@ -287,6 +328,7 @@ ssize_t mcast_recv(struct mcast_sock *m, void *data, int size)
 		       0,
 		       (struct sockaddr *)&m->addr,
 		       &sin_size);
+	m->stats.syscalls++;
 	if (ret == -1) {
 		if (errno != EAGAIN)
 			m->stats.error++;
@@ -299,6 +341,48 @@ ssize_t mcast_recv(struct mcast_sock *m, void *data, int size)
 	return ret;
 }
 
+/* receive up to n datagrams without blocking, one per iovec. The length of
+ * every datagram is stored in len, and also in seg since multicast datagrams
+ * are never coalesced. Returns how many were received or -1. */
+int mcast_recvv(struct mcast_sock *m, const struct iovec *iov, int *len,
+		int *seg, int n)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msg[n];
+	int ret, i;
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_name = &m->addr;
+		msg[i].msg_hdr.msg_namelen = sizeof(m->addr);
+		msg[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = recvmmsg(m->fd, msg, n, MSG_DONTWAIT, NULL);
+	m->stats.syscalls++;
+	if (ret == -1) {
+		if (errno != EAGAIN)
+			m->stats.error++;
+		return ret;
+	}
+	for (i = 0; i < ret; i++) {
+		len[i] = seg[i] = msg[i].msg_len;
+		m->stats.bytes += msg[i].msg_len;
+		m->stats.messages++;
+	}
+	return ret;
+#else
+	ssize_t ret;
+
+	ret = mcast_recv(m, iov[0].iov_base, iov[0].iov_len);
+	if (ret == -1)
+		return -1;
+
+	len[0] = seg[0] = ret;
+	return 1;
+#endif
+}
+
 int mcast_get_fd(struct mcast_sock *m)
 {
 	return m->fd;
@@ -346,13 +430,17 @@ mcast_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
 			"%20llu Pckts sent "
 			"%20llu Pckts recv\n"
 			"%20llu Error send "
-			"%20llu Error recv\n\n",
+			"%20llu Error recv\n"
+			"%20llu Calls sent "
+			"%20llu Calls recv\n\n",
 			ifname, status, active ? "ACTIVE" : "BACKUP",
 			(unsigned long long)s->bytes,
 			(unsigned long long)r->bytes,
 			(unsigned long long)s->messages,
 			(unsigned long long)r->messages,
 			(unsigned long long)s->error,
-			(unsigned long long)r->error);
+			(unsigned long long)r->error,
+			(unsigned long long)s->syscalls,
+			(unsigned long long)r->syscalls);
 	return size;
 }
@@ -8,6 +8,8 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 #include "channel.h"
 #include "network.h"
@@ -16,7 +18,7 @@ struct multichannel *
 multichannel_open(struct channel_conf *conf, int len)
 {
 	struct multichannel *m;
-	int i, set_default_channel = 0;
+	int i, set_default_channel = 0, buffer_size = 0;
 
 	if (len <= 0 || len > MULTICHANNEL_MAX)
 		return NULL;
@@ -37,6 +39,8 @@ multichannel_open(struct channel_conf *conf, int len)
 			free(m);
 			return NULL;
 		}
+		if (conf[i].channel_relay_mode)
+			m->relay = 1;
 		if (conf[i].channel_flags & CHANNEL_F_DEFAULT) {
 			m->current = m->channel[i];
 			set_default_channel = 1;
@@ -44,14 +48,166 @@ multichannel_open(struct channel_conf *conf, int len)
 	}
 	if (!set_default_channel)
 		m->current = m->channel[0];
+	m->rx_current = m->current;
+
+	/* messages are built once in this buffer and the very same datagram
+	 * is sent through all the buffered channels, so it has to fit in the
+	 * smallest MTU. There is room for several datagrams that are sent
+	 * at once, the slack leaves room to build one more message. */
+	for (i = 0; i < len; i++) {
+		int size = channel_payload_size(m->channel[i]);
+
+		if (size > 0 && (buffer_size == 0 || size < buffer_size))
+			buffer_size = size;
+	}
+	if (buffer_size > 0) {
+		m->buffer = channel_buffer_open(buffer_size,
+				(MULTICHANNEL_STAGE_MAX - 1) * buffer_size +
+				NETMSG_MAXSIZ);
+		if (m->buffer == NULL) {
+			for (i = 0; i < len; i++)
+				channel_close(m->channel[i]);
+			free(m);
+			return NULL;
+		}
+	}
 
 	return m;
 }
 
+/* close the datagram that we are filling */
+static void multichannel_stage(struct multichannel *m)
+{
+	struct iovec *iov = &m->staged[m->staged_num++];
+
+	iov->iov_base = m->buffer->data + m->dgram;
+	iov->iov_len = m->buffer->len - m->dgram;
+	m->dgram = m->buffer->len;
+	m->closed++;
+}
+
+/* send the closed datagrams, the one that we are filling goes to the head */
+static void multichannel_stage_flush(struct multichannel *m)
+{
+	int i;
+
+	for (i = 0; i < m->channel_num; i++) {
+		if (channel_payload_size(m->channel[i]) == 0)
+			continue;
+
+		if (m->staged_num == 1) {
+			channel_send_buffer(m->channel[i],
+					    m->staged[0].iov_base,
+					    m->staged[0].iov_len);
+		} else {
+			channel_send_buffers(m->channel[i], m->staged,
+					     m->staged_num);
+		}
+	}
+	m->staged_num = 0;
+
+	memmove(m->buffer->data, m->buffer->data + m->dgram,
+		m->buffer->len - m->dgram);
+	m->buffer->len -= m->dgram;
+	m->dgram = 0;
+}
+
+static int multichannel_buffer_flush(struct multichannel *m)
+{
+	if (m->buffer == NULL || m->buffer->len == 0)
+		return 0;
+
+	if (m->buffer->len > m->dgram)
+		multichannel_stage(m);
+
+	multichannel_stage_flush(m);
+	return 1;
+}
+
+/* Returns where the next message has to be built, there is always room for
+ * NETMSG_MAXSIZ bytes. Call multichannel_commit() once the message is ready
+ * or do nothing to discard it. */
+struct nethdr *multichannel_reserve(struct multichannel *m)
+{
+	static char __net[NETMSG_MAXSIZ];
+
+	/* no buffered channels or every channel fills its own buffer, use
+	 * a scratch area. */
+	if (m->buffer == NULL || m->striping)
+		return (struct nethdr *) __net;
+
+	return (struct nethdr *) (m->buffer->data + m->buffer->len);
+}
+
+static inline void multichannel_pace(struct multichannel *m, int len)
+{
+	if (!m->pace.charge)
+		return;
+
+	m->pace.tokens -= len;
+	m->pace.stats.bytes += len;
+	m->pace.stats.messages++;
+}
+
+int multichannel_commit(struct multichannel *m, struct nethdr *net)
+{
+	int i, ret = 0, len = ntohs(net->len);
+
+	multichannel_pace(m, len);
+
+	/* the sequence number belongs to the current channel, see
+	 * multichannel_stripe(). */
+	if (m->striping)
+		return channel_send(m->current, net);
+
+	for (i = 0; i < m->channel_num; i++) {
+		/* unbuffered channels send the message right away, buffered
+		 * channels may have data from multichannel_send_allbut(),
+		 * deliver it first to avoid re-ordering. */
+		if (channel_payload_size(m->channel[i]) == 0)
+			ret |= channel_presend(m->channel[i], net);
+		else
+			ret |= channel_send_flush(m->channel[i]);
+	}
+	if (m->buffer == NULL)
+		return ret;
+
+	if (m->buffer->len - m->dgram + len > m->buffer->size &&
+	    m->buffer->len > m->dgram) {
+		/* the message does not fit, close the datagram that we have
+		 * so far and start a new one with this message. */
+		multichannel_stage(m);
+		ret = 1;
+	}
+	m->buffer->len += len;
+
+	/* larger than the buffer, it should not ever happen, but it might. */
+	if (m->buffer->len - m->dgram > m->buffer->size) {
+		multichannel_stage(m);
+		ret = 1;
+	}
+
+	/* unless we were told to wait, send the datagrams right away. Make
+	 * sure that there is room to fill one more datagram otherwise, the
+	 * next commit may close two of them. */
+	if (m->staged_num > 0 &&
+	    (!m->staging || m->staged_num > MULTICHANNEL_STAGE_MAX - 2 ||
+	     m->dgram + m->buffer->size >
+	     m->buffer->size * MULTICHANNEL_STAGE_MAX))
+		multichannel_stage_flush(m);
+
+	return ret;
+}
+
 int multichannel_send_allbut(struct multichannel *m, const struct nethdr *net, struct channel* ex)
 {
 	int ret = 0;
 	int i;
+
+	/* channels get different data from now on, avoid re-ordering. */
+	ret |= multichannel_buffer_flush(m);
+	multichannel_pace(m, ntohs(net->len));
+
 	for (i = 0; i < m->channel_num; i++) {
 		if(m->channel[i] != ex)
 			ret |= channel_presend(m->channel[i], net);
@@ -84,27 +240,204 @@ int multichannel_seqfix_allbut(struct multichannel *m, uint32_t length, struct c
 
 int multichannel_send(struct multichannel *m, const struct nethdr *net)
 {
-	int ret = 0;
-	int i;
-	for (i = 0; i < m->channel_num; i++) {
-		ret |= channel_presend(m->channel[i], net);
-	}
-	return ret;
+	struct nethdr *dst;
+
+	if (m->buffer == NULL)
+		return multichannel_commit(m, (struct nethdr *) net);
+
+	/* the message was built somewhere else, copy it once. */
+	dst = multichannel_reserve(m);
+	memcpy(dst, net, ntohs(net->len));
+
+	return multichannel_commit(m, dst);
+}
+
+/* largest datagram that fits in all the buffered channels */
+int multichannel_payload_size(struct multichannel *m)
+{
+	if (m->buffer == NULL)
+		return NETMSG_MAXSIZ;
+
+	return m->buffer->size;
+}
+
+/* Hold the datagrams that are filled up until multichannel_send_flush(), so
+ * they are sent with one syscall per channel, eg. during bulk transfers. */
+void multichannel_send_begin(struct multichannel *m)
+{
+	m->staging = 1;
 }
 
 int multichannel_send_flush(struct multichannel *m)
 {
 	int ret = 0;
 	int i;
+
+	ret |= multichannel_buffer_flush(m);
 	for (i = 0; i < m->channel_num; i++) {
 		ret |= channel_send_flush(m->channel[i]);
 	}
+	m->staging = 0;
 	return ret;
 }
 
+/* Send the datagrams that are full, the one that is being filled is held
+ * until the next flush. */
+int multichannel_send_flush_full(struct multichannel *m)
+{
+	m->staging = 0;
+	if (m->buffer == NULL || m->staged_num == 0)
+		return 0;
+
+	multichannel_stage_flush(m);
+	return 1;
+}
+
+/* Returns the bytes that are waiting in the buffers to be sent, fill is set
+ * to how full the fullest datagram being filled is, in percent. */
+int multichannel_send_held(struct multichannel *m, int *fill)
+{
+	int i, len, held = 0, max = 0;
+
+	if (m->buffer != NULL) {
+		held += m->buffer->len;
+		max = (m->buffer->len - m->dgram) * 100 / m->buffer->size;
+	}
+	for (i = 0; i < m->channel_num; i++) {
+		len = channel_send_held(m->channel[i]);
+		if (len == 0)
+			continue;
+
+		held += len;
+		len = len * 100 / channel_payload_size(m->channel[i]);
+		if (len > max)
+			max = len;
+	}
+	if (fill)
+		*fill = max;
+
+	return held;
+}
+
+/* the dedicated link cannot take more, see multichannel_set_drain_cb() */
+int multichannel_send_pending(struct multichannel *m)
+{
+	return channel_send_pending(m->current);
+}
+
+void multichannel_set_drain_cb(struct multichannel *m,
+			       void (*cb)(void *data), void *data)
+{
+	int i;
+
+	for (i = 0; i < m->channel_num; i++)
+		channel_set_drain_cb(m->channel[i], cb, data);
+}
+
 int multichannel_recv(struct multichannel *c, char *buf, int size)
 {
-	return channel_recv(c->current, buf, size);
+	return channel_recv(c->rx_current, buf, size);
+}
+
+static uint64_t timespec_diff_usecs(const struct timespec *from,
+				    const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000 +
+	       (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Pace what we send to rate bytes per second, the bucket holds 10 ms worth
+ * of tokens. The rate adapts to the feedback from the peer, see
+ * multichannel_pace_ack() and multichannel_pace_loss(). */
+void multichannel_set_pace(struct multichannel *m, uint64_t rate)
+{
+	struct multichannel_pace *p = &m->pace;
+
+	p->rate = p->max_rate = rate;
+	p->burst = rate / 100;
+	if (p->burst < 2 * NETMSG_MAXSIZ)
+		p->burst = 2 * NETMSG_MAXSIZ;
+	p->tokens = p->burst;
+	clock_gettime(CLOCK_MONOTONIC, &p->refill);
+}
+
+/* Only what is sent in between is charged to the bucket, that is, the
+ * transmission queue, since that is the only thing that can wait for
+ * tokens. Events are sent as they come. */
+void multichannel_pace_begin(struct multichannel *m)
+{
+	m->pace.charge = 1;
+}
+
+void multichannel_pace_end(struct multichannel *m)
+{
+	m->pace.charge = 0;
+}
+
+/* Returns how long (in usecs) we have to wait until we can send, zero if
+ * we can send right now. The clock is only read once the tokens run out. */
+uint32_t multichannel_pace_wait(struct multichannel *m)
+{
+	struct multichannel_pace *p = &m->pace;
+	struct timespec now;
+	uint64_t usecs, full;
+
+	if (p->rate == 0 || p->tokens > 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = timespec_diff_usecs(&p->refill, &now);
+	/* the last refill may be long ago, more than the time it takes to
+	 * fill up the bucket does not add anything. */
+	full = (p->burst - p->tokens) * 1000000 / p->rate + 1;
+	if (usecs > full)
+		usecs = full;
+	p->tokens += usecs * p->rate / 1000000;
+	if (p->tokens > p->burst)
+		p->tokens = p->burst;
+	p->refill = now;
+
+	if (p->tokens > 0)
+		return 0;
+
+	return (-p->tokens + 1) * 1000000 / p->rate + 1;
+}
+
+/* the peer got what we sent, additive increase */
+void multichannel_pace_ack(struct multichannel *m)
+{
+	struct multichannel_pace *p = &m->pace;
+
+	if (p->rate == 0 || p->rate == p->max_rate)
+		return;
+
+	p->rate += p->max_rate / MULTICHANNEL_PACE_STEPS;
+	if (p->rate > p->max_rate)
+		p->rate = p->max_rate;
+	p->stats.increase++;
+}
+
+/* the peer lost messages, multiplicative decrease. The messages that were
+ * on their way when it told us about the first loss do not count. */
+void multichannel_pace_loss(struct multichannel *m)
+{
+	struct multichannel_pace *p = &m->pace;
+	uint64_t min_rate = p->max_rate / MULTICHANNEL_PACE_STEPS;
+	struct timespec now;
+
+	if (p->rate == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (p->backoff.tv_sec != 0 &&
+	    timespec_diff_usecs(&p->backoff, &now) < MULTICHANNEL_PACE_BACKOFF)
+		return;
+
+	p->backoff = now;
+	p->rate /= 2;
+	if (p->rate < min_rate)
+		p->rate = min_rate;
+	p->stats.decrease++;
 }
 
 void multichannel_close(struct multichannel *m)
@@ -114,6 +447,7 @@ void multichannel_close(struct multichannel *m)
 	for (i = 0; i < m->channel_num; i++) {
 		channel_close(m->channel[i]);
 	}
+	channel_buffer_close(m->buffer);
 	free(m);
 }
 
@@ -129,7 +463,9 @@ multichannel_stats_extended(struct multichannel *m,
 	int i, active;
 
 	for (i = 0; i < m->channel_num; i++) {
-		if (m->current == m->channel[i]) {
+		if (m->striping) {
+			active = !(m->down & (1U << i));
+		} else if (m->current == m->channel[i]) {
 			active = 1;
 		} else {
 			active = 0;
@@ -153,9 +489,70 @@ void multichannel_set_current_channel(struct multichannel *m, int i)
 	m->current = m->channel[i];
 }
 
+/* The messages that follow were received through c. Unless striping, we
+ * also send through the link that we heard from last. In striping mode,
+ * the channel to send through is picked per object, see nethdr_stripe(). */
 void
 multichannel_change_current_channel(struct multichannel *m, struct channel *c)
 {
-	if (m->current != c)
+	m->rx_current = c;
+	if (!m->striping && m->current != c)
 		m->current = c;
 }
+
+int multichannel_get_index(struct multichannel *m, struct channel *c)
+{
+	int i;
+
+	for (i = 0; i < m->channel_num; i++) {
+		if (m->channel[i] == c)
+			return i;
+	}
+	return -1;
+}
+
+static void multichannel_update_alive(struct multichannel *m)
+{
+	int i;
+
+	m->alive_num = 0;
+	for (i = 0; i < m->channel_num; i++) {
+		if (!(m->down & (1U << i)))
+			m->alive[m->alive_num++] = m->channel[i];
+	}
+}
+
+/* Instead of sending every message through all the channels, spread them
+ * among the channels whose link is up. */
+void multichannel_set_striping(struct multichannel *m, int on)
+{
+	m->striping = on;
+	multichannel_update_alive(m);
+}
+
+/* returns 1 if the state of the link has changed */
+int multichannel_set_channel_up(struct multichannel *m, int i, int up)
+{
+	unsigned int down = m->down;
+
+	if (up)
+		m->down &= ~(1U << i);
+	else
+		m->down |= 1U << i;
+
+	if (down == m->down)
+		return 0;
+
+	multichannel_update_alive(m);
+	return 1;
+}
+
+/* channel for the messages of the object with this hash. Objects move to
+ * other channels only if the number of links that are up changes. */
+struct channel *multichannel_stripe(struct multichannel *m, uint32_t hash)
+{
+	if (!m->striping || m->alive_num == 0)
+		return m->current;
+
+	return m->alive[hash % m->alive_num];
+}
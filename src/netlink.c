@@ -66,6 +66,15 @@ struct nfct_handle *nl_init_event_handler(void)
 
 	fcntl(nfct_fd(h), F_SETFL, O_NONBLOCK);
 
+#ifdef SO_BUSY_POLL
+	if (CONFIG(lowlat).busy_poll &&
+	    setsockopt(nfct_fd(h), SOL_SOCKET, SO_BUSY_POLL,
+		       &CONFIG(lowlat).busy_poll, sizeof(int)) == -1) {
+		dlog(LOG_WARNING, "cannot set busy polling on event "
+		     "socket: %s", strerror(errno));
+	}
+#endif
+
 	/* set up socket buffer size */
 	if (CONFIG(netlink_buffer_size) &&
 	    CONFIG(netlink_buffer_size) <=
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #define NETHDR_ALIGNTO	4
 
@@ -39,11 +40,25 @@ int nethdr_size(int len)
 	return NETHDR_SIZ + len;
 }
 	
+/* Unless striping, all the channels carry the very same messages. They take
+ * their sequence number from the first channel, so the peer can tell the
+ * copies that arrive through the other links. Relayed messages are
+ * renumbered for each channel, see channel_seqfix(). */
+static inline int nethdr_seq_shared(void)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+
+	return !m->striping && !m->relay;
+}
+
 static inline void __nethdr_set(struct nethdr *net, int len)
 {
 	struct channel* current;
 	
-	current = STATE_SYNC(channel)->current;
+	if (nethdr_seq_shared())
+		current = STATE_SYNC(channel)->channel[0];
+	else
+		current = STATE_SYNC(channel)->current;
 	if (!current->seq_set_sent) {
 		current->seq_set_sent = 1;
 		current->last_seq_sent = time(NULL);
@@ -57,11 +72,23 @@ void nethdr_set(struct nethdr *net, int type)
 {
 	__nethdr_set(net, NETHDR_SIZ);
 	net->type = type;
+	net->flags = CONFIG(sync).node_id;
+}
+
+/* control messages tell the peer that we can decode compact messages and
+ * that it may drop the copies of our messages, see nethdr_seq_shared(). */
+static inline void nethdr_set_ctl_flags(struct nethdr *net)
+{
+	if (CONFIG(sync).compact_encoding != CTD_COMPACT_OFF)
+		net->flags |= NET_F_COMPACT;
+	if (nethdr_seq_shared())
+		net->flags |= NET_F_SEQ;
 }
 
 void nethdr_set_ack(struct nethdr *net)
 {
 	__nethdr_set(net, NETHDR_ACK_SIZ);
+	nethdr_set_ctl_flags(net);
 }
 
 void nethdr_set_seq(struct nethdr *net, struct channel* current){
@@ -71,43 +98,147 @@ void nethdr_set_seq(struct nethdr *net, struct channel* current){
 void nethdr_set_ctl(struct nethdr *net)
 {
 	__nethdr_set(net, NETHDR_SIZ);
+	nethdr_set_ctl_flags(net);
+}
+
+/* records of a batch have no sequence number of their own */
+void nethdr_set_rec(struct nethdr *net, int type)
+{
+	net->version	= CONNTRACKD_PROTOCOL_VERSION;
+	net->len	= NETHDR_SIZ;
+	net->type	= type;
+}
+
+/* Batch of records sent as one NET_T_STATE_BATCH message. The sequence
+ * number is taken when the first record is added, so the batch has to be
+ * flushed before any other message is built. */
+static struct {
+	struct nethdr	*net;		/* in host byte order */
+	int		size;		/* flush once we reach this size */
+} batch;
+
+int nethdr_batch_init(int size)
+{
+	/* the slack leaves room to build one more record */
+	batch.net = malloc(size + NETMSG_MAXSIZ);
+	if (batch.net == NULL)
+		return -1;
+
+	batch.net->len = 0;
+	batch.size = size;
+	return 0;
+}
+
+void nethdr_batch_fini(void)
+{
+	free(batch.net);
+}
+
+/* Returns where the next record has to be built, there is room for
+ * NETMSG_MAXSIZ bytes. Call nethdr_batch_commit() once it is ready. */
+struct nethdr *nethdr_batch_reserve(void)
+{
+	if (batch.net->len == 0)
+		return (struct nethdr *)((char *)batch.net + NETHDR_SIZ);
+
+	return (struct nethdr *)NETHDR_TAIL(batch.net);
+}
+
+/* Returns the header of the batch that carries the record. */
+struct nethdr *nethdr_batch_commit(struct nethdr *rec)
+{
+	int len = ntohs(rec->len);
+
+	if (batch.net->len > 0 && batch.net->len + len > batch.size) {
+		/* it does not fit, send what we have so far and move the
+		 * record to the head of a new batch. */
+		nethdr_batch_flush();
+		memmove((char *)batch.net + NETHDR_SIZ, rec, len);
+	}
+	if (batch.net->len == 0) {
+		nethdr_set(batch.net, NET_T_STATE_BATCH);
+	}
+	batch.net->len += len;
+	STATE_SYNC(batch).records_sent++;
+
+	return batch.net;
+}
+
+void nethdr_batch_flush(void)
+{
+	if (batch.net == NULL || batch.net->len == 0)
+		return;
+
+	HDR_HOST2NETWORK(batch.net);
+	multichannel_send(STATE_SYNC(channel), batch.net);
+	batch.net->len = 0;
+	STATE_SYNC(batch).sent++;
 }
 
 static int local_seq_set = 0;
 
+/* in multi-peer mode, every node has its own sequence numbers */
+static inline struct sync_peer *nethdr_track_peer(void)
+{
+	if (!CONFIG(sync).node_id)
+		return NULL;
+
+	return &STATE_SYNC(peers).peer[STATE_SYNC(peers).current];
+}
+
+/* If the peer sends the very same messages through all the links, see
+ * nethdr_track_shared(), they are one stream that the first channel tracks,
+ * whichever link delivers them. Relayed messages are numbered per link. */
+struct channel *nethdr_track_channel(struct channel *c)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+
+	if (m->rx_shared && !c->channel_relay_mode)
+		return m->channel[0];
+
+	return c;
+}
+
 /* this function only tracks, it does not update the last sequence received */
 int nethdr_track_seq(uint32_t seq, uint32_t *exp_seq)
 {
+	struct channel *current =
+		nethdr_track_channel(STATE_SYNC(channel)->rx_current);
+	struct sync_peer *peer = nethdr_track_peer();
+	uint32_t last_seq_recv;
 	int ret = SEQ_UNKNOWN;
 
+	last_seq_recv = peer ? peer->last_seq_recv : current->last_seq_recv;
+
 	/* netlink sequence tracking initialization */
-	if (!STATE_SYNC(channel)->current->seq_set_recv) {
+	if (!nethdr_track_is_seq_set()) {
 		ret = SEQ_UNSET;
 		goto out;
 	}
 
 	/* fast path: we received the correct sequence */
-	if (seq == STATE_SYNC(channel)->current->last_seq_recv+1) {
+	if (seq == last_seq_recv+1) {
 		ret = SEQ_IN_SYNC;
 		goto out;
 	}
 
 	/* out of sequence: some messages got lost */	
-	if (after(seq, STATE_SYNC(channel)->current->last_seq_recv+1)) {
-		STATE_SYNC(error).msg_rcv_lost +=
-					seq - STATE_SYNC(channel)->current->last_seq_recv + 1;
+	if (after(seq, last_seq_recv+1)) {
+		STATE_SYNC(error).msg_rcv_lost += seq - last_seq_recv + 1;
+		if (peer)
+			peer->lost += seq - last_seq_recv - 1;
 		ret = SEQ_AFTER;
 		goto out;
 	}
 
 	/* out of sequence: replayed/delayed packet? */
-	if (before(seq, STATE_SYNC(channel)->current->last_seq_recv+1)) {
+	if (before(seq, last_seq_recv+1)) {
 		STATE_SYNC(error).msg_rcv_before++;
 		ret = SEQ_BEFORE;
 	}
 
 out:
-	*exp_seq = STATE_SYNC(channel)->current->last_seq_recv+1;
+	*exp_seq = last_seq_recv+1;
 
 	return ret;
 }
@@ -115,8 +246,15 @@ out:
 void nethdr_track_update_seq(uint32_t seq)
 {
 	struct channel* current;
+	struct sync_peer *peer = nethdr_track_peer();
+
+	if (peer) {
+		peer->seq_set_recv = 1;
+		peer->last_seq_recv = seq;
+		return;
+	}
 	
-	current = STATE_SYNC(channel)->current;
+	current = nethdr_track_channel(STATE_SYNC(channel)->rx_current);
 	if (!current->seq_set_recv)
 		current->seq_set_recv = 1;
 
@@ -125,7 +263,96 @@ void nethdr_track_update_seq(uint32_t seq)
 
 int nethdr_track_is_seq_set()
 {
-	return STATE_SYNC(channel)->current->seq_set_recv;
+	struct sync_peer *peer = nethdr_track_peer();
+
+	if (peer)
+		return peer->seq_set_recv;
+
+	return nethdr_track_channel(STATE_SYNC(channel)->rx_current)->
+		seq_set_recv;
+}
+
+/* Unless striping, the peer sends every message through all the dedicated
+ * links with the same sequence number. Remember which links delivered the
+ * last sequence numbers, so the copies that arrive through the other links
+ * are not applied again. */
+#define DEDUP_WINDOW	1024
+
+/* one per node in multi-peer mode, since each has its own sequence */
+static struct rx_dedup {
+	int		active;		/* the peer announces NET_F_SEQ */
+	int		seq_set;
+	uint32_t	top;		/* highest sequence number seen */
+	uint16_t	mask[DEDUP_WINDOW];	/* links that delivered it */
+} rx_dedup[NET_NODE_MAX];
+
+void nethdr_track_shared(int active)
+{
+	struct rx_dedup *d = &rx_dedup[STATE_SYNC(peers).current];
+	struct multichannel *m = STATE_SYNC(channel);
+	int i;
+
+	if (active && !d->active) {
+		d->seq_set = 0;
+		memset(d->mask, 0, sizeof(d->mask));
+	}
+	d->active = active;
+
+	/* In multi-peer mode, every node is tracked on its own already.
+	 * Otherwise, the links are tracked as one stream from now on, see
+	 * nethdr_track_channel(), and the tracking starts over. */
+	if (CONFIG(sync).node_id || m->rx_shared == active)
+		return;
+
+	m->rx_shared = active;
+	for (i = 0; i < m->channel_num; i++)
+		m->channel[i]->seq_set_recv = 0;
+}
+
+/* Returns 1 if the message has already been received through another link.
+ * This is called before the sync mode sees the message, so the links are
+ * tracked as one stream and the acknowledgments only see the first copy. */
+int nethdr_track_dup(struct channel *c, uint32_t seq)
+{
+	struct rx_dedup *d = &rx_dedup[STATE_SYNC(peers).current];
+	uint16_t *mask, bit;
+	int i;
+
+	if (!d->active || c->channel_relay_mode)
+		return 0;
+
+	i = multichannel_get_index(STATE_SYNC(channel), c);
+	if (i < 0 || STATE_SYNC(channel)->channel_num < 2)
+		return 0;
+	bit = 1 << i;
+
+	if (!d->seq_set) {
+		d->seq_set = 1;
+		d->top = seq;
+	} else if (after(seq, d->top)) {
+		/* slide the window, forget what falls out of it */
+		if (seq - d->top >= DEDUP_WINDOW) {
+			memset(d->mask, 0, sizeof(d->mask));
+			d->top = seq;
+		}
+		while (d->top != seq)
+			d->mask[++d->top % DEDUP_WINDOW] = 0;
+	} else if (d->top - seq >= DEDUP_WINDOW) {
+		/* too old to tell, apply it */
+		STATE_SYNC(dedup).old++;
+		return 0;
+	}
+
+	mask = &d->mask[seq % DEDUP_WINDOW];
+	if (*mask == 0 || *mask & bit) {
+		/* first copy. If this link has already delivered it, the
+		 * peer has restarted and it is reusing sequence numbers. */
+		*mask = bit;
+		return 0;
+	}
+	*mask |= bit;
+	STATE_SYNC(dedup).dropped++;
+	return 1;
 }
 
 #include "cache.h"
@@ -147,3 +374,27 @@ int object_status_to_network_type(struct cache_object *obj)
 {
 	return status2type[obj->cache->type][obj->status];
 }
+
+/* In striping mode, the next messages go through channel c and take their
+ * sequence number from it. The pending batch belongs to the previous one. */
+void nethdr_set_channel(struct channel *c)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+
+	if (!m->striping || c == NULL || c == m->current)
+		return;
+
+	nethdr_batch_flush();
+	m->current = c;
+}
+
+/* the messages of one object always go through the same channel */
+void nethdr_stripe(const struct cache_object *obj)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+
+	if (!m->striping)
+		return;
+
+	nethdr_set_channel(multichannel_stripe(m, cache_object_hash(obj)));
+}
@@ -20,26 +20,29 @@
 #include "network.h"
 
 #include <stdlib.h>
+#include <time.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 
 #ifndef ssizeof
 #define ssizeof(x) (int)sizeof(x)
 #endif
 
-static void ct_parse_u8(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_u16(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_u32(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_u128(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_str(struct nf_conntrack *ct,
-			 const struct netattr *, void *data);
-static void ct_parse_group(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_nat_seq_adj(struct nf_conntrack *ct, int attr, void *data);
-static void ct_parse_clabel(struct nf_conntrack *ct,
-			    const struct netattr *, void *data);
+/* how the payload of each attribute is decoded, see msg2ct() */
+enum ct_parser_type {
+	CT_P_NONE = 0,
+	CT_P_U8,
+	CT_P_U16,
+	CT_P_U32,
+	CT_P_U128,
+	CT_P_GROUP,
+	CT_P_STR,
+	CT_P_LABELS,
+	CT_P_NAT_SEQ_ADJ,
+	CT_P_COMPACT,
+};
 
 struct ct_parser {
-	void 	(*parse)(struct nf_conntrack *ct, int attr, void *data);
-	void	(*parse2)(struct nf_conntrack *ct, const struct netattr *, void *);
+	uint8_t	 type;
 	uint16_t attr;
 	uint16_t size;
 	uint16_t max_size;
@@ -47,204 +50,182 @@ struct ct_parser {
 
 static struct ct_parser h[NTA_MAX] = {
 	[NTA_IPV4] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_ORIG_IPV4,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_ipv4)),
 	},
 	[NTA_IPV6] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_ORIG_IPV6,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_ipv6)),
 	},
 	[NTA_PORT] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_ORIG_PORT,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_port)),
 	},
 	[NTA_L4PROTO] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_L4PROTO,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_TCP_STATE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_TCP_STATE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_STATUS] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_STATUS,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_MARK] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_MARK,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_TIMEOUT] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_TIMEOUT,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_MASTER_IPV4] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_MASTER_IPV4,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_ipv4)),
 	},
 	[NTA_MASTER_IPV6] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_MASTER_IPV6,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_ipv6)),
 	},
 	[NTA_MASTER_L4PROTO] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_MASTER_L4PROTO,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_MASTER_PORT] = {
-		.parse	= ct_parse_group,
+		.type	= CT_P_GROUP,
 		.attr	= ATTR_GRP_MASTER_PORT,
 		.size	= NTA_SIZE(sizeof(struct nfct_attr_grp_port)),
 	},
 	[NTA_SNAT_IPV4]	= {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_SNAT_IPV4,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_DNAT_IPV4] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_DNAT_IPV4,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_SPAT_PORT]	= {
-		.parse	= ct_parse_u16,
+		.type	= CT_P_U16,
 		.attr	= ATTR_SNAT_PORT,
 		.size	= NTA_SIZE(sizeof(uint16_t)),
 	},
 	[NTA_DPAT_PORT]	= {
-		.parse	= ct_parse_u16,
+		.type	= CT_P_U16,
 		.attr	= ATTR_DNAT_PORT,
 		.size	= NTA_SIZE(sizeof(uint16_t)),
 	},
 	[NTA_NAT_SEQ_ADJ] = {
-		.parse	= ct_parse_nat_seq_adj,
+		.type	= CT_P_NAT_SEQ_ADJ,
 		.size	= NTA_SIZE(sizeof(struct nta_attr_natseqadj)),
 	},
 	[NTA_SCTP_STATE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_SCTP_STATE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_SCTP_VTAG_ORIG] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_SCTP_VTAG_ORIG,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_SCTP_VTAG_REPL] = {
-		.parse	= ct_parse_u32,
+		.type	= CT_P_U32,
 		.attr	= ATTR_SCTP_VTAG_REPL,
 		.size	= NTA_SIZE(sizeof(uint32_t)),
 	},
 	[NTA_DCCP_STATE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_DCCP_STATE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_DCCP_ROLE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_DCCP_ROLE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_ICMP_TYPE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_ICMP_TYPE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_ICMP_CODE] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_ICMP_CODE,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_ICMP_ID] = {
-		.parse	= ct_parse_u16,
+		.type	= CT_P_U16,
 		.attr	= ATTR_ICMP_ID,
 		.size	= NTA_SIZE(sizeof(uint16_t)),
 	},
 	[NTA_TCP_WSCALE_ORIG] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_TCP_WSCALE_ORIG,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_TCP_WSCALE_REPL] = {
-		.parse	= ct_parse_u8,
+		.type	= CT_P_U8,
 		.attr	= ATTR_TCP_WSCALE_REPL,
 		.size	= NTA_SIZE(sizeof(uint8_t)),
 	},
 	[NTA_HELPER_NAME] = {
-		.parse2	= ct_parse_str,
+		.type	= CT_P_STR,
 		.attr	= ATTR_HELPER_NAME,
 		.max_size = NFCT_HELPER_NAME_MAX,
 	},
 	[NTA_LABELS] = {
-		.parse2 = ct_parse_clabel,
+		.type	= CT_P_LABELS,
 		.attr	= ATTR_CONNLABELS,
 		.max_size = NTA_SIZE(NTA_LABELS_MAX_SIZE),
 	},
 #ifdef ATTR_SNAT_IPV6
 	[NTA_SNAT_IPV6]	= {
-		.parse	= ct_parse_u128,
+		.type	= CT_P_U128,
 		.attr	= ATTR_SNAT_IPV6,
 		.size	= NTA_SIZE(sizeof(uint32_t) * 4),
 	},
 #endif
 #ifdef ATTR_DNAT_IPV6
 	[NTA_DNAT_IPV6] = {
-		.parse	= ct_parse_u128,
+		.type	= CT_P_U128,
 		.attr	= ATTR_DNAT_IPV6,
 		.size	= NTA_SIZE(sizeof(uint32_t) * 4),
 	},
 #endif
+	[NTA_COMPACT_IPV4] = {
+		.type	= CT_P_COMPACT,
+		.attr	= ATTR_GRP_ORIG_IPV4,
+		.size	= NTA_SIZE(sizeof(struct nta_attr_compact) +
+				   sizeof(struct nfct_attr_grp_ipv4)),
+	},
+	[NTA_COMPACT_IPV6] = {
+		.type	= CT_P_COMPACT,
+		.attr	= ATTR_GRP_ORIG_IPV6,
+		.size	= NTA_SIZE(sizeof(struct nta_attr_compact) +
+				   sizeof(struct nfct_attr_grp_ipv6)),
+	},
+	/* not a conntrack attribute, see msg2stamp() */
+	[NTA_STAMP] = {
+		.type	= CT_P_NONE,
+		.size	= NTA_SIZE(sizeof(struct nta_attr_stamp)),
+	},
 };
 
-static void
-ct_parse_u8(struct nf_conntrack *ct, int attr, void *data)
-{
-	uint8_t *value = (uint8_t *) data;
-	nfct_set_attr_u8(ct, h[attr].attr, *value);
-}
-
-static void
-ct_parse_u16(struct nf_conntrack *ct, int attr, void *data)
-{
-	uint16_t *value = (uint16_t *) data;
-	nfct_set_attr_u16(ct, h[attr].attr, ntohs(*value));
-}
-
-static void
-ct_parse_u32(struct nf_conntrack *ct, int attr, void *data)
-{
-	uint32_t *value = (uint32_t *) data;
-	nfct_set_attr_u32(ct, h[attr].attr, ntohl(*value));
-}
-
-static void
-ct_parse_u128(struct nf_conntrack *ct, int attr, void *data)
-{
-	nfct_set_attr(ct, h[attr].attr, data);
-}
-
-static void
-ct_parse_str(struct nf_conntrack *ct, const struct netattr *attr, void *data)
-{
-	nfct_set_attr(ct, h[attr->nta_attr].attr, data);
-}
-
-static void
-ct_parse_group(struct nf_conntrack *ct, int attr, void *data)
-{
-	nfct_set_attr_grp(ct, h[attr].attr, data);
-}
-
 static void
 ct_parse_clabel(struct nf_conntrack *ct, const struct netattr *attr, void *data)
 {
@@ -301,6 +282,50 @@ ct_parse_nat_seq_adj(struct nf_conntrack *ct, int attr, void *data)
 			  ntohl(this->repl_seq_offset_after));
 }
 
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP 132
+#endif
+#ifndef IPPROTO_DCCP
+#define IPPROTO_DCCP 33
+#endif
+
+static void
+ct_parse_compact(struct nf_conntrack *ct, int attr, void *data)
+{
+	struct nta_attr_compact *this = data;
+	uint16_t present = ntohs(this->present);
+
+	nfct_set_attr_grp(ct, h[attr].attr, this->addr);
+	nfct_set_attr_u8(ct, ATTR_L4PROTO, this->l4proto);
+
+	if (present & NTA_C_STATUS)
+		nfct_set_attr_u32(ct, ATTR_STATUS, ntohl(this->status));
+	if (present & NTA_C_PORT) {
+		struct nfct_attr_grp_port port = {
+			.sport	= this->sport,
+			.dport	= this->dport,
+		};
+		nfct_set_attr_grp(ct, ATTR_GRP_ORIG_PORT, &port);
+	}
+	if (present & NTA_C_STATE) {
+		switch(this->l4proto) {
+		case IPPROTO_TCP:
+			nfct_set_attr_u8(ct, ATTR_TCP_STATE, this->state);
+			break;
+		case IPPROTO_SCTP:
+			nfct_set_attr_u8(ct, ATTR_SCTP_STATE, this->state);
+			break;
+		case IPPROTO_DCCP:
+			nfct_set_attr_u8(ct, ATTR_DCCP_STATE, this->state);
+			break;
+		}
+	}
+	if (present & NTA_C_TIMEOUT)
+		nfct_set_attr_u32(ct, ATTR_TIMEOUT, ntohl(this->timeout));
+	if (present & NTA_C_MARK)
+		nfct_set_attr_u32(ct, ATTR_MARK, ntohl(this->mark));
+}
+
 int msg2ct(struct nf_conntrack *ct, struct nethdr *net, size_t remain)
 {
 	int len;
@@ -313,6 +338,9 @@ int msg2ct(struct nf_conntrack *ct, struct nethdr *net, size_t remain)
 	attr = NETHDR_DATA(net);
 
 	while (len > ssizeof(struct netattr)) {
+		const struct ct_parser *p;
+		void *data;
+
 		ATTR_NETWORK2HOST(attr);
 		if (attr->nta_len > len)
 			return -1;
@@ -320,29 +348,72 @@ int msg2ct(struct nf_conntrack *ct, struct nethdr *net, size_t remain)
 			return -1;
 		if (attr->nta_attr >= NTA_MAX)
 			return -1;
-		if (h[attr->nta_attr].size &&
-		    attr->nta_len != h[attr->nta_attr].size)
-			return -1;
 
-		if (h[attr->nta_attr].max_size) {
-			if (attr->nta_len > h[attr->nta_attr].max_size)
-				return -1;
-			h[attr->nta_attr].parse2(ct, attr, NTA_DATA(attr));
-			attr = NTA_NEXT(attr, len);
-			continue;
-		}
+		p = &h[attr->nta_attr];
+		if (p->size && attr->nta_len != p->size)
+			return -1;
+		if (p->max_size && attr->nta_len > p->max_size)
+			return -1;
 
-		if (h[attr->nta_attr].parse == NULL) {
-			attr = NTA_NEXT(attr, len);
-			continue;
+		data = NTA_DATA(attr);
+		switch(p->type) {
+		case CT_P_U8:
+			nfct_set_attr_u8(ct, p->attr, *(uint8_t *)data);
+			break;
+		case CT_P_U16:
+			nfct_set_attr_u16(ct, p->attr,
+					  ntohs(*(uint16_t *)data));
+			break;
+		case CT_P_U32:
+			nfct_set_attr_u32(ct, p->attr,
+					  ntohl(*(uint32_t *)data));
+			break;
+		case CT_P_U128:
+		case CT_P_STR:
+			nfct_set_attr(ct, p->attr, data);
+			break;
+		case CT_P_GROUP:
+			nfct_set_attr_grp(ct, p->attr, data);
+			break;
+		case CT_P_LABELS:
+			ct_parse_clabel(ct, attr, data);
+			break;
+		case CT_P_NAT_SEQ_ADJ:
+			ct_parse_nat_seq_adj(ct, attr->nta_attr, data);
+			break;
+		case CT_P_COMPACT:
+			ct_parse_compact(ct, attr->nta_attr, data);
+			break;
+		case CT_P_NONE:
+			break;
 		}
-		h[attr->nta_attr].parse(ct, attr->nta_attr, NTA_DATA(attr));
 		attr = NTA_NEXT(attr, len);
 	}
 
 	return 0;
 }
 
+/* Returns 0 and the stamp of the message in ts, if it has one. The message
+ * has to be parsed by msg2ct() first, it leaves the attributes in host byte
+ * order. */
+int msg2stamp(struct nethdr *net, struct timespec *ts)
+{
+	int len = net->len - NETHDR_SIZ;
+	struct netattr *attr = NETHDR_DATA(net);
+
+	while (len > ssizeof(struct netattr)) {
+		if (attr->nta_attr == NTA_STAMP) {
+			struct nta_attr_stamp *s = NTA_DATA(attr);
+
+			ts->tv_sec = ntohl(s->sec);
+			ts->tv_nsec = ntohl(s->nsec);
+			return 0;
+		}
+		attr = NTA_NEXT(attr, len);
+	}
+	return -1;
+}
+
 static void exp_parse_ct_group(void *ct, int attr, void *data);
 static void exp_parse_ct_u8(void *ct, int attr, void *data);
 static void exp_parse_u32(void *exp, int attr, void *data);
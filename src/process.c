@@ -19,6 +19,7 @@
 #include <signal.h>
 #include "conntrackd.h"
 #include "process.h"
+#include "affinity.h"
 
 static LIST_HEAD(process_list);
 
@@ -48,8 +49,11 @@ int fork_process_new(int type, int flags, void (*cb)(void *data), void *data)
 
 	if (c->pid > 0)
 		list_add(&c->head, &process_list);
-	else
+	else {
 		free(c);
+		if (pid == 0)
+			affinity_child();
+	}
 
 	return pid;
 }
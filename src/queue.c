@@ -41,9 +41,28 @@ queue_create(const char *name, int max_objects, unsigned int flags)
 	INIT_LIST_HEAD(&b->head);
 	b->flags = flags;
 
+	if (flags & QUEUE_F_SEQ) {
+		uint32_t i, num = 2;
+
+		/* one slot per sequence number that may be in use */
+		while (num < (uint32_t)max_objects && num < (1U << 31))
+			num <<= 1;
+
+		b->slots = malloc(sizeof(struct list_head) * num);
+		if (b->slots == NULL) {
+			free(b);
+			return NULL;
+		}
+		for (i = 0; i < num; i++)
+			INIT_LIST_HEAD(&b->slots[i]);
+
+		b->slots_mask = num - 1;
+	}
+
 	if (flags & QUEUE_F_EVFD) {
 		b->evfd = create_evfd();
 		if (b->evfd == NULL) {
+			free(b->slots);
 			free(b);
 			return NULL;
 		}
@@ -60,6 +79,7 @@ void queue_destroy(struct queue *b)
 	list_del(&b->list);
 	if (b->flags & QUEUE_F_EVFD)
 		destroy_evfd(b->evfd);
+	free(b->slots);
 	free(b);
 }
 
@@ -67,14 +87,16 @@ void queue_stats_show(int fd)
 {
 	struct queue *this;
 	int size = 0;
-	char buf[512];
+	char buf[4096];
 
 	size += snprintf(buf+size, sizeof(buf),
 			 "allocated queue nodes:\t\t%12u\n\n",
 			 qobjects_num);
 
 	list_for_each_entry(this, &queue_list, list) {
-		size += snprintf(buf+size, sizeof(buf),
+		if (size >= (int)sizeof(buf))
+			break;
+		size += snprintf(buf+size, sizeof(buf)-size,
 				 "queue %s:\n"
 				 "current elements:\t\t%12u\n"
 				 "maximum elements:\t\t%12u\n"
@@ -84,6 +106,8 @@ void queue_stats_show(int fd)
 				 this->max_elems,
 				 this->enospc_err);
 	}
+	if (size > (int)sizeof(buf))
+		size = sizeof(buf) - 1;
 	send(fd, buf, size, 0);
 }
 
@@ -137,6 +161,32 @@ int queue_add(struct queue *b, struct queue_node *n)
 	return 1;
 }
 
+/* the node goes after the nodes of its type at the head of the queue, ahead
+ * of the others, eg. control messages are not held behind the objects. */
+int queue_add_front(struct queue *b, struct queue_node *n)
+{
+	struct list_head *pos;
+
+	if (!list_empty(&n->head))
+		return 0;
+
+	if (b->num_elems >= b->max_elems) {
+		b->enospc_err++;
+		errno = ENOSPC;
+		return -1;
+	}
+	list_for_each(pos, &b->head) {
+		if (((struct queue_node *)pos)->type != n->type)
+			break;
+	}
+	n->owner = b;
+	list_add_tail(&n->head, pos);
+	b->num_elems++;
+	if (b->evfd)
+		write_evfd(b->evfd);
+	return 1;
+}
+
 int queue_del(struct queue_node *n)
 {
 	if (list_empty(&n->head))
@@ -150,9 +200,72 @@ int queue_del(struct queue_node *n)
 	return 1;
 }
 
+/* sequence numbers are compared as in network.h, they wrap around */
+static inline int seq_before(uint32_t seq1, uint32_t seq2)
+{
+	return (int32_t)(seq1 - seq2) < 0;
+}
+
+static struct list_head *queue_slot(struct queue *b, uint32_t seq)
+{
+	return &b->slots[seq & b->slots_mask];
+}
+
+/* skip the oldest sequence numbers that have no nodes anymore, there is
+ * at least one node in the ring. */
+static void queue_seq_trim(struct queue *b)
+{
+	while (b->seq_first != b->seq_last &&
+	       list_empty(queue_slot(b, b->seq_first)))
+		b->seq_first++;
+}
+
+/* Several nodes may share one sequence number. The sequence numbers in use
+ * must fit in the ring, so a number that is too far from the oldest one
+ * fails with ENOSPC as if the queue was full. */
+int queue_add_seq(struct queue *b, struct queue_node *n, uint32_t seq)
+{
+	uint32_t first = seq, last = seq;
+
+	if (!list_empty(&n->head))
+		return 0;
+
+	if (b->num_elems > 0) {
+		queue_seq_trim(b);
+		first = b->seq_first;
+		last = b->seq_last;
+		if (seq_before(seq, first))
+			first = seq;
+		else if (seq_before(last, seq))
+			last = seq;
+	}
+	if (b->num_elems >= b->max_elems || last - first > b->slots_mask) {
+		b->enospc_err++;
+		errno = ENOSPC;
+		return -1;
+	}
+	b->seq_first = first;
+	b->seq_last = last;
+
+	n->owner = b;
+	list_add_tail(&n->head, queue_slot(b, seq));
+	b->num_elems++;
+	if (b->evfd)
+		write_evfd(b->evfd);
+	return 1;
+}
+
 struct queue_node *queue_del_head(struct queue *b)
 {
 	struct queue_node *n = (struct queue_node *) b->head.next;
+
+	if (b->slots) {
+		if (b->num_elems == 0)
+			return NULL;
+
+		queue_seq_trim(b);
+		n = (struct queue_node *) queue_slot(b, b->seq_first)->next;
+	}
 	queue_del(n);
 	return n;
 }
@@ -174,6 +287,11 @@ void queue_iterate(struct queue *b,
 	struct list_head *i, *tmp;
 	struct queue_node *n;
 
+	if (b->slots) {
+		queue_iterate_seq(b, b->seq_first, b->seq_last, data, iterate);
+		return;
+	}
+
 	list_for_each_safe(i, tmp, &b->head) {
 		n = (struct queue_node *) i;
 		if (iterate(n, data))
@@ -181,6 +299,35 @@ void queue_iterate(struct queue *b,
 	}
 }
 
+/* QUEUE_F_SEQ: iterate over the nodes with sequence numbers from..to, the
+ * cost depends on the range, not on the amount of nodes in the queue. */
+void queue_iterate_seq(struct queue *b, uint32_t from, uint32_t to,
+		       const void *data,
+		       int (*iterate)(struct queue_node *n, const void *data2))
+{
+	struct list_head *i, *tmp;
+	uint32_t seq;
+
+	if (b->num_elems == 0)
+		return;
+
+	if (seq_before(from, b->seq_first))
+		from = b->seq_first;
+	if (seq_before(b->seq_last, to))
+		to = b->seq_last;
+	if (seq_before(to, from))
+		return;
+
+	for (seq = from; ; seq++) {
+		list_for_each_safe(i, tmp, queue_slot(b, seq)) {
+			if (iterate((struct queue_node *) i, data))
+				return;
+		}
+		if (seq == to)
+			break;
+	}
+}
+
 unsigned int queue_len(const struct queue *b)
 {
 	return b->num_elems;
@@ -30,6 +30,7 @@
 #include "cidr.h"
 #include "helper.h"
 #include "stack.h"
+#include "affinity.h"
 #include <syslog.h>
 #include <sched.h>
 #include <dlfcn.h>
@@ -51,9 +52,13 @@ static void print_err(int err, const char *msg, ...);
 static void __kernel_filter_start(void);
 static void __kernel_filter_add_state(int value);
 static void __max_dedicated_links_reached(void);
+static void __shm_line_check(void);
 
 struct stack symbol_stack;
 
+/* CPUs collected by CPUAffinity and ChildCPUAffinity */
+static cpu_set_t cpu_set;
+
 enum {
 	SYMBOL_HELPER_QUEUE_NUM,
 	SYMBOL_HELPER_QUEUE_LEN,
@@ -90,6 +95,16 @@ enum {
 %token T_HELPER T_HELPER_QUEUE_NUM T_HELPER_QUEUE_LEN T_HELPER_POLICY
 %token T_HELPER_EXPECT_TIMEOUT T_HELPER_EXPECT_MAX
 %token T_SYSTEMD T_RELAYMODE
+%token T_CPU_AFFINITY T_CHILD_CPU_AFFINITY T_NUMA_NODE
+%token T_BUSY_POLL T_LATENCY_TARGET
+%token T_COMPACT_ENCODING T_DELTA_UPDATES T_BATCH_MESSAGES
+%token T_MESSAGE_CACHE T_COMPACT_EXTERNAL_CACHE T_SEGMENT_OFFLOAD
+%token T_STRIPING T_FLUSH_HOLD_TIME T_FLUSH_MIN_FILL
+%token T_XDP T_ZERO_COPY
+%token T_SHARED_MEMORY T_PEER_PATH T_RING_SIZE
+%token T_RECV_SOCKETS T_RECV_STEERING
+%token T_SELECTIVE_ACK T_PACING_RATE
+%token T_NODE_ID
 
 %token <string> T_IP T_PATH_VAL
 %token <val> T_NUMBER
@@ -605,6 +620,183 @@ udp_option: T_RELAYMODE T_OFF
 	conf.channel[conf.channel_num].channel_relay_mode = 0;
 };
 
+udp_option: T_SEGMENT_OFFLOAD T_ON
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.udp.segment_offload = 1;
+};
+
+udp_option: T_SEGMENT_OFFLOAD T_OFF
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.udp.segment_offload = 0;
+};
+
+udp_option: T_RECV_SOCKETS T_NUMBER
+{
+	__max_dedicated_links_reached();
+	if ($2 < 1 || $2 > UDP_RX_MAX) {
+		print_err(CTD_CFG_ERROR, "`ReceiveSockets' must be between "
+					 "1 and %d", UDP_RX_MAX);
+		exit(EXIT_FAILURE);
+	}
+	conf.channel[conf.channel_num].u.udp.rx_sockets = $2;
+};
+
+udp_option: T_RECV_STEERING T_STRING
+{
+	struct udp_conf *c;
+
+	__max_dedicated_links_reached();
+	c = &conf.channel[conf.channel_num].u.udp;
+	if (strcasecmp($2, "hash") == 0)
+		c->rx_steering = UDP_STEER_HASH;
+	else if (strcasecmp($2, "source") == 0)
+		c->rx_steering = UDP_STEER_SOURCE;
+	else if (strcasecmp($2, "cpu") == 0)
+		c->rx_steering = UDP_STEER_CPU;
+	else {
+		print_err(CTD_CFG_ERROR, "unknown `ReceiveSteering' `%s', "
+					 "use hash, source or cpu", $2);
+		exit(EXIT_FAILURE);
+	}
+};
+
+xdp_line : T_XDP '{' xdp_options '}'
+{
+	if (conf.channel_type_global != CHANNEL_NONE &&
+	    conf.channel_type_global != CHANNEL_XDP) {
+		print_err(CTD_CFG_ERROR, "cannot use `XDP' with other "
+					 "dedicated link protocols!");
+		exit(EXIT_FAILURE);
+	}
+	conf.channel_type_global = CHANNEL_XDP;
+	conf.channel[conf.channel_num].channel_type = CHANNEL_XDP;
+	conf.channel[conf.channel_num].channel_flags = CHANNEL_F_BUFFERED;
+	conf.channel_num++;
+};
+
+xdp_line : T_XDP T_DEFAULT '{' xdp_options '}'
+{
+	if (conf.channel_type_global != CHANNEL_NONE &&
+	    conf.channel_type_global != CHANNEL_XDP) {
+		print_err(CTD_CFG_ERROR, "cannot use `XDP' with other "
+					 "dedicated link protocols!");
+		exit(EXIT_FAILURE);
+	}
+	conf.channel_type_global = CHANNEL_XDP;
+	conf.channel[conf.channel_num].channel_type = CHANNEL_XDP;
+	conf.channel[conf.channel_num].channel_flags = CHANNEL_F_DEFAULT |
+						       CHANNEL_F_BUFFERED;
+	conf.channel_default = conf.channel_num;
+	conf.channel_num++;
+};
+
+xdp_options :
+	    | xdp_options xdp_option;
+
+xdp_option : T_IFACE T_STRING
+{
+	int idx;
+
+	__max_dedicated_links_reached();
+	strncpy(conf.channel[conf.channel_num].channel_ifname, $2, IFNAMSIZ);
+
+	idx = if_nametoindex($2);
+	if (!idx) {
+		print_err(CTD_CFG_WARN, "%s is an invalid interface", $2);
+		break;
+	}
+	conf.channel[conf.channel_num].u.xdp.ifindex = idx;
+};
+
+xdp_option : T_HELPER_QUEUE_NUM T_NUMBER
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.xdp.queue = $2;
+};
+
+xdp_option : T_ZERO_COPY T_ON
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.xdp.zerocopy = 1;
+};
+
+xdp_option : T_ZERO_COPY T_OFF
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.xdp.zerocopy = 0;
+};
+
+shm_line : T_SHARED_MEMORY '{' shm_options '}'
+{
+	if (conf.channel_type_global != CHANNEL_NONE &&
+	    conf.channel_type_global != CHANNEL_SHM) {
+		print_err(CTD_CFG_ERROR, "cannot use `SharedMemory' with other "
+					 "dedicated link protocols!");
+		exit(EXIT_FAILURE);
+	}
+	__shm_line_check();
+	conf.channel_type_global = CHANNEL_SHM;
+	conf.channel[conf.channel_num].channel_type = CHANNEL_SHM;
+	conf.channel[conf.channel_num].channel_flags = CHANNEL_F_BUFFERED |
+						       CHANNEL_F_ERRORS;
+	conf.channel_num++;
+};
+
+shm_line : T_SHARED_MEMORY T_DEFAULT '{' shm_options '}'
+{
+	if (conf.channel_type_global != CHANNEL_NONE &&
+	    conf.channel_type_global != CHANNEL_SHM) {
+		print_err(CTD_CFG_ERROR, "cannot use `SharedMemory' with other "
+					 "dedicated link protocols!");
+		exit(EXIT_FAILURE);
+	}
+	__shm_line_check();
+	conf.channel_type_global = CHANNEL_SHM;
+	conf.channel[conf.channel_num].channel_type = CHANNEL_SHM;
+	conf.channel[conf.channel_num].channel_flags = CHANNEL_F_DEFAULT |
+						       CHANNEL_F_BUFFERED |
+						       CHANNEL_F_ERRORS;
+	conf.channel_default = conf.channel_num;
+	conf.channel_num++;
+};
+
+shm_options :
+	    | shm_options shm_option;
+
+shm_option : T_PATH T_PATH_VAL
+{
+	__max_dedicated_links_reached();
+	strncpy(conf.channel[conf.channel_num].u.shm.path, $2,
+		UNIX_PATH_MAX - 1);
+};
+
+shm_option : T_PEER_PATH T_PATH_VAL
+{
+	__max_dedicated_links_reached();
+	strncpy(conf.channel[conf.channel_num].u.shm.peer_path, $2,
+		UNIX_PATH_MAX - 1);
+};
+
+shm_option : T_RING_SIZE T_NUMBER
+{
+	__max_dedicated_links_reached();
+	conf.channel[conf.channel_num].u.shm.size = $2;
+};
+
+shm_option : T_ERROR_QUEUE_LENGTH T_NUMBER
+{
+	__max_dedicated_links_reached();
+	CONFIG(channelc).error_queue_length = $2;
+};
+
+shm_option : T_IFACE T_STRING
+{
+	__max_dedicated_links_reached();
+	strncpy(conf.channel[conf.channel_num].channel_ifname, $2, IFNAMSIZ);
+};
+
 tcp_line : T_TCP '{' tcp_options '}'
 {
 	if (conf.channel_type_global != CHANNEL_NONE &&
@@ -830,6 +1022,36 @@ sync: T_SYNC '{' sync_list '}'
 		exit(EXIT_FAILURE);
 	}
 	conf.flags |= CTD_SYNC_MODE;
+
+	/* it is negotiated through the control messages, this mode does not
+	 * send any. */
+	if (conf.flags & CTD_SYNC_ALARM &&
+	    CONFIG(sync).compact_encoding == CTD_COMPACT_ON) {
+		print_err(CTD_CFG_WARN, "`CompactEncoding on' has no effect "
+					"in ALARM mode, use `force'");
+	}
+
+	if (CONFIG(sync).node_id) {
+		int i;
+
+		if (!(conf.flags & CTD_SYNC_FTFW)) {
+			print_err(CTD_CFG_ERROR, "`NodeId' requires the "
+						 "FTFW mode");
+			exit(EXIT_FAILURE);
+		}
+		if (CONFIG(sync).striping) {
+			print_err(CTD_CFG_ERROR, "cannot use both `NodeId' "
+						 "and `Striping'");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < conf.channel_num; i++) {
+			if (conf.channel[i].channel_relay_mode) {
+				print_err(CTD_CFG_ERROR, "cannot use `NodeId' "
+							 "with relay links");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
 };
 
 sync_list:
@@ -843,6 +1065,8 @@ sync_line: refreshtime
 	 | multicast_line
 	 | udp_line
 	 | tcp_line
+	 | xdp_line
+	 | shm_line
 	 | relax_transitions
 	 | delay_destroy_msgs
 	 | sync_mode_alarm
@@ -871,6 +1095,107 @@ option: T_TCP_WINDOW_TRACKING T_OFF
 	CONFIG(sync).tcp_window_tracking = 0;
 };
 
+option: T_COMPACT_ENCODING T_ON
+{
+	CONFIG(sync).compact_encoding = CTD_COMPACT_ON;
+};
+
+option: T_COMPACT_ENCODING T_OFF
+{
+	CONFIG(sync).compact_encoding = CTD_COMPACT_OFF;
+};
+
+option: T_COMPACT_ENCODING T_STRING
+{
+	if (strcasecmp($2, "force") != 0) {
+		print_err(CTD_CFG_ERROR, "unknown `CompactEncoding' value "
+					 "`%s', expecting `on', `off' or "
+					 "`force'", $2);
+		exit(EXIT_FAILURE);
+	}
+	CONFIG(sync).compact_encoding = CTD_COMPACT_FORCE;
+};
+
+option: T_DELTA_UPDATES T_ON
+{
+	CONFIG(sync).delta_updates = 1;
+};
+
+option: T_DELTA_UPDATES T_OFF
+{
+	CONFIG(sync).delta_updates = 0;
+};
+
+option: T_BATCH_MESSAGES T_ON
+{
+	CONFIG(sync).batch_messages = 1;
+};
+
+option: T_BATCH_MESSAGES T_OFF
+{
+	CONFIG(sync).batch_messages = 0;
+};
+
+option: T_MESSAGE_CACHE T_ON
+{
+	CONFIG(sync).message_cache = 1;
+};
+
+option: T_MESSAGE_CACHE T_OFF
+{
+	CONFIG(sync).message_cache = 0;
+};
+
+option: T_COMPACT_EXTERNAL_CACHE T_ON
+{
+	CONFIG(sync).compact_external_cache = 1;
+};
+
+option: T_COMPACT_EXTERNAL_CACHE T_OFF
+{
+	CONFIG(sync).compact_external_cache = 0;
+};
+
+option: T_STRIPING T_ON
+{
+	CONFIG(sync).striping = 1;
+};
+
+option: T_STRIPING T_OFF
+{
+	CONFIG(sync).striping = 0;
+};
+
+option: T_FLUSH_HOLD_TIME T_NUMBER
+{
+	CONFIG(sync).flush_hold_time = $2;
+};
+
+option: T_FLUSH_MIN_FILL T_NUMBER
+{
+	if ($2 < 1 || $2 > 100) {
+		print_err(CTD_CFG_ERROR, "`FlushMinFill' must be between "
+					 "1 and 100");
+		exit(EXIT_FAILURE);
+	}
+	CONFIG(sync).flush_min_fill = $2;
+};
+
+option: T_PACING_RATE T_NUMBER
+{
+	CONFIG(sync).pacing_rate = $2;
+};
+
+option: T_NODE_ID T_NUMBER
+{
+	if ($2 < 1 || $2 >= NET_NODE_MAX) {
+		print_err(CTD_CFG_ERROR, "`NodeId' must be between "
+					 "1 and %d", NET_NODE_MAX - 1);
+		exit(EXIT_FAILURE);
+	}
+	CONFIG(sync).node_id = $2;
+};
+
 option: T_EXPECT_SYNC T_ON
 {
 	CONFIG(flags) |= CTD_EXPECT;
@@ -945,6 +1270,7 @@ sync_mode_ftfw_line: resend_queue_size
 		   | timeout
 		   | purge
 		   | window_size
+		   | selective_ack
 		   | disable_external_cache
 		   ;
 
@@ -993,6 +1319,16 @@ window_size: T_WINDOWSIZE T_NUMBER
 	conf.window_size = $2;
 };
 
+selective_ack: T_SELECTIVE_ACK T_ON
+{
+	conf.sync.selective_ack = 1;
+};
+
+selective_ack: T_SELECTIVE_ACK T_OFF
+{
+	conf.sync.selective_ack = 0;
+};
+
 destroy_timeout: T_DESTROY_TIMEOUT T_NUMBER
 {
 	print_err(CTD_CFG_WARN, "`DestroyTimeout' is deprecated. Remove it");
@@ -1150,8 +1486,20 @@ general_line: hashsize
 	    | nice
 	    | scheduler
 	    | systemd
+	    | busy_poll
+	    | latency_target
 	    ;
 
+busy_poll : T_BUSY_POLL T_NUMBER
+{
+	conf.lowlat.busy_poll = $2;
+};
+
+latency_target : T_LATENCY_TARGET T_NUMBER
+{
+	conf.lowlat.latency_target = $2;
+};
+
 systemd: T_SYSTEMD T_ON		{ conf.systemd = 1; };
 systemd: T_SYSTEMD T_OFF	{ conf.systemd = 0; };
 
@@ -1222,6 +1570,44 @@ scheduler_line : T_PRIO T_NUMBER
 	}
 };
 
+scheduler_line : T_CPU_AFFINITY '{' cpu_list '}'
+{
+	memcpy(&conf.sched.cpu_mask, &cpu_set, sizeof(cpu_set_t));
+	memset(&cpu_set, 0, sizeof(cpu_set_t));
+};
+
+scheduler_line : T_CHILD_CPU_AFFINITY '{' cpu_list '}'
+{
+	memcpy(&conf.sched.child_cpu_mask, &cpu_set, sizeof(cpu_set_t));
+	memset(&cpu_set, 0, sizeof(cpu_set_t));
+};
+
+scheduler_line : T_NUMA_NODE T_NUMBER
+{
+	conf.sched.numa_node = $2;
+};
+
+scheduler_line : T_NUMA_NODE T_STRING
+{
+	if (strcasecmp($2, "auto") != 0) {
+		print_err(CTD_CFG_ERROR, "unknown `NUMANode' value `%s', "
+					 "expecting a number or `auto'", $2);
+		exit(EXIT_FAILURE);
+	}
+	conf.sched.numa_node = CTD_NUMA_NODE_AUTO;
+};
+
+cpu_list :
+	 | cpu_list cpu_item ;
+
+cpu_item : T_NUMBER
+{
+	if (affinity_cpu_add(&cpu_set, $1) == -1) {
+		print_err(CTD_CFG_ERROR, "CPU %d is out of range", $1);
+		exit(EXIT_FAILURE);
+	}
+};
+
 family : T_FAMILY T_STRING
 {
 	print_err(CTD_CFG_WARN, "`Family' is deprecated, ignoring");
@@ -1895,6 +2281,21 @@ static void __max_dedicated_links_reached(void)
 	}
 }
 
+static void __shm_line_check(void)
+{
+	struct channel_conf *c = &conf.channel[conf.channel_num];
+
+	__max_dedicated_links_reached();
+	if (c->u.shm.path[0] == '\0' || c->u.shm.peer_path[0] == '\0') {
+		print_err(CTD_CFG_ERROR, "`SharedMemory' needs both `Path' "
+					 "and `PeerPath'");
+		exit(EXIT_FAILURE);
+	}
+	/* there is no link in between, the loopback stands in for it */
+	if (c->channel_ifname[0] == '\0')
+		strcpy(c->channel_ifname, "lo");
+}
+
 int
 init_config(char *filename)
 {
@@ -1908,6 +2309,7 @@ init_config(char *filename)
 	CONFIG(syslog_facility) = -1;
 	CONFIG(stats).syslog_facility = -1;
 	CONFIG(netlink).subsys_id = -1;
+	CONFIG(sched).numa_node = CTD_NUMA_NODE_UNSET;
 
 	/* Initialize list of user-space helpers */
 	INIT_LIST_HEAD(&CONFIG(cthelper).list);
@@ -1961,6 +2363,10 @@ init_config(char *filename)
 	if (CONFIG(nl_overrun_resync) == 0)
 		CONFIG(nl_overrun_resync) = 30;
 
+	/* hold messages until the datagram is full, see FlushHoldTime */
+	if (CONFIG(sync).flush_min_fill == 0)
+		CONFIG(sync).flush_min_fill = 100;
+
 	/* default to 128 elements in the channel error queue */
 	if (CONFIG(channelc).error_queue_length == 0)
 		CONFIG(channelc).error_queue_length = 128;
@@ -31,6 +31,7 @@
 #include "date.h"
 #include "internal.h"
 #include "systemd.h"
+#include "affinity.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -139,7 +140,7 @@ static void uptime(char *buf, size_t bufsiz)
 
 static void dump_stats_runtime(int fd)
 {
-	char buf[1024], uptime_string[512];
+	char buf[2048], uptime_string[512];
 	int size;
 
 	uptime(uptime_string, sizeof(uptime_string));
@@ -181,6 +182,11 @@ static void dump_stats_runtime(int fd)
 			STATE(stats).local_read_failed,
 			STATE(stats).local_unknown_request);
 
+	if (size < (int)sizeof(buf))
+		size += affinity_snprintf(buf + size, sizeof(buf) - size);
+	if (size >= (int)sizeof(buf))
+		size = sizeof(buf) - 1;
+
 	send(fd, buf, size, 0);
 }
 
@@ -0,0 +1,553 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Dedicated link between two daemons that run on the same host. Each
+ * daemon owns the ring that it receives from: a memfd that is handed
+ * over to the peer, together with the eventfd that the peer writes to
+ * wake us up, through a unix socket. Datagrams never enter the kernel.
+ */
+
+#define _GNU_SOURCE
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "conntrackd.h"
+
+/* a ring can always hold a datagram of the maximum size */
+#define SHM_RING_MIN	(1 << 17)
+#define SHM_REC_HDR	sizeof(uint32_t)
+#define SHM_ALIGN(len)	(((len) + 3) & ~3U)
+
+static uint32_t shm_ring_roundup(int size)
+{
+	uint32_t n = SHM_RING_MIN;
+
+	while (n < (uint32_t)size && n < (1U << 30))
+		n <<= 1;
+
+	return n;
+}
+
+static void shm_ring_put(struct shm_ring *r, uint32_t size, uint32_t pos,
+			 const void *data, uint32_t len)
+{
+	uint32_t off = pos & (size - 1), n = size - off;
+
+	if (n > len)
+		n = len;
+
+	memcpy(r->data + off, data, n);
+	memcpy(r->data, (const char *)data + n, len - n);
+}
+
+static void shm_ring_get(struct shm_ring *r, uint32_t size, uint32_t pos,
+			 void *data, uint32_t len)
+{
+	uint32_t off = pos & (size - 1), n = size - off;
+
+	if (n > len)
+		n = len;
+
+	memcpy(data, r->data + off, n);
+	memcpy((char *)data + n, r->data, len - n);
+}
+
+/* only a daemon that runs as our user shares the ring with us */
+static int shm_peer_trusted(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return 0;
+
+	return cred.uid == geteuid();
+}
+
+static struct shm_sock *shm_sock_alloc(const char *path)
+{
+	struct shm_sock *m;
+
+	m = calloc(sizeof(struct shm_sock), 1);
+	if (m == NULL)
+		return NULL;
+
+	m->fd = m->conn_fd = m->mem_fd = m->event_fd = -1;
+	m->addr.sun_family = AF_UNIX;
+	strncpy(m->addr.sun_path, path, sizeof(m->addr.sun_path) - 1);
+	return m;
+}
+
+static void shm_sock_free(struct shm_sock *m)
+{
+	if (m->ring != NULL)
+		munmap(m->ring, m->map_len);
+	if (m->event_fd >= 0)
+		close(m->event_fd);
+	if (m->mem_fd >= 0)
+		close(m->mem_fd);
+	if (m->conn_fd >= 0)
+		close(m->conn_fd);
+	if (m->fd >= 0)
+		close(m->fd);
+	free(m);
+}
+
+struct shm_sock *shm_server_create(struct shm_conf *c)
+{
+	struct shm_sock *m;
+	mode_t mask;
+	int ret;
+
+	m = shm_sock_alloc(c->path);
+	if (m == NULL)
+		return NULL;
+
+	m->state = SHM_SERVER;
+	m->size = shm_ring_roundup(c->size);
+	m->map_len = sizeof(struct shm_ring) + m->size;
+
+	m->mem_fd = memfd_create("conntrackd", MFD_CLOEXEC);
+	if (m->mem_fd == -1)
+		goto err;
+
+	if (ftruncate(m->mem_fd, m->map_len) == -1)
+		goto err;
+
+	m->ring = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       m->mem_fd, 0);
+	if (m->ring == MAP_FAILED) {
+		m->ring = NULL;
+		goto err;
+	}
+	m->ring->size = m->size;
+
+	m->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m->event_fd == -1)
+		goto err;
+
+	m->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m->fd == -1)
+		goto err;
+
+	/* the socket is created with mode 0600, nobody else may connect */
+	unlink(c->path);
+	mask = umask(0077);
+	ret = bind(m->fd, (struct sockaddr *)&m->addr,
+		   sizeof(struct sockaddr_un));
+	umask(mask);
+	if (ret == -1)
+		goto err;
+
+	if (listen(m->fd, 1) == -1) {
+		unlink(c->path);
+		goto err;
+	}
+	return m;
+err:
+	shm_sock_free(m);
+	return NULL;
+}
+
+void shm_server_destroy(struct shm_sock *m)
+{
+	/* tell the peer to attach again once we are back */
+	__atomic_store_n(&m->ring->closed, 1, __ATOMIC_RELEASE);
+	unlink(m->addr.sun_path);
+	shm_sock_free(m);
+}
+
+/* Hand the ring over to the peer that connected. Returns the eventfd the
+ * first time so that it is added to the event loop, the ring outlives the
+ * peer, so it does not change if the peer attaches again. */
+int shm_accept(struct shm_sock *m)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+	struct iovec iov = {
+		.iov_base	= &m->size,
+		.iov_len	= sizeof(m->size),
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fd, fds[2] = { m->mem_fd, m->event_fd };
+
+	fd = accept4(m->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (!shm_peer_trusted(fd)) {
+		m->stats.error++;
+		close(fd);
+		return -1;
+	}
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+		m->stats.error++;
+		close(fd);
+		return -1;
+	}
+
+	/* keep it open, the peer finds out that we are gone if it breaks */
+	if (m->conn_fd >= 0)
+		close(m->conn_fd);
+	m->conn_fd = fd;
+
+	if (m->attached)
+		return -1;
+
+	m->attached = 1;
+	return m->event_fd;
+}
+
+static struct alarm_block shm_connect_alarm;
+static void shm_connect_alarm_cb(struct alarm_block *a, void *data) {}
+
+struct shm_sock *shm_client_create(struct shm_conf *c)
+{
+	struct shm_sock *m;
+
+	m = shm_sock_alloc(c->peer_path);
+	if (m == NULL)
+		return NULL;
+
+	m->state = SHM_CLIENT_DISCONNECTED;
+	init_alarm(&shm_connect_alarm, NULL, shm_connect_alarm_cb);
+
+	return m;
+}
+
+void shm_client_destroy(struct shm_sock *m)
+{
+	shm_sock_free(m);
+}
+
+static void shm_client_detach(struct shm_sock *m)
+{
+	if (m->ring != NULL) {
+		munmap(m->ring, m->map_len);
+		m->ring = NULL;
+	}
+	if (m->mem_fd >= 0) {
+		close(m->mem_fd);
+		m->mem_fd = -1;
+	}
+	if (m->event_fd >= 0) {
+		close(m->event_fd);
+		m->event_fd = -1;
+	}
+
+	if (m->conn_fd >= 0) {
+		close(m->conn_fd);
+		m->conn_fd = -1;
+	}
+	m->state = SHM_CLIENT_DISCONNECTED;
+}
+
+/* pick up the ring that the peer hands over once it accepts us */
+static int shm_client_attach(struct shm_sock *m)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+	uint32_t size;
+	struct iovec iov = {
+		.iov_base	= &size,
+		.iov_len	= sizeof(size),
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[2];
+	ssize_t ret;
+
+	ret = recvmsg(m->conn_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (ret == -1 && errno == EAGAIN)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (ret != sizeof(size) || cmsg == NULL ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		goto err;
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	m->mem_fd = fds[0];
+	m->event_fd = fds[1];
+
+	if (!shm_peer_trusted(m->conn_fd))
+		goto err;
+
+	if (size < SHM_RING_MIN || (size & (size - 1)))
+		goto err;
+
+	m->size = size;
+	m->map_len = sizeof(struct shm_ring) + size;
+	m->ring = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       m->mem_fd, 0);
+	if (m->ring == MAP_FAILED) {
+		m->ring = NULL;
+		goto err;
+	}
+	m->state = SHM_CLIENT_CONNECTED;
+	return 0;
+err:
+	shm_client_detach(m);
+	m->stats.error++;
+	return -1;
+}
+
+#define SHM_CONNECT_TIMEOUT	1
+
+/* returns 0 if we are attached to the ring of the peer, otherwise -1. */
+static int shm_client_connect(struct shm_sock *m)
+{
+	if (m->state == SHM_CLIENT_CONNECTED) {
+		if (!__atomic_load_n(&m->ring->closed, __ATOMIC_ACQUIRE))
+			return 0;
+
+		/* the peer went away, its ring is not read anymore. */
+		shm_client_detach(m);
+	}
+
+	if (m->state == SHM_CLIENT_DISCONNECTED) {
+		/* We rate-limit the amount of connect() calls. */
+		if (alarm_pending(&shm_connect_alarm))
+			return -1;
+
+		add_alarm(&shm_connect_alarm, SHM_CONNECT_TIMEOUT, 0);
+		m->conn_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (m->conn_fd == -1) {
+			m->stats.error++;
+			return -1;
+		}
+		if (connect(m->conn_fd, (struct sockaddr *)&m->addr,
+			    sizeof(struct sockaddr_un)) == -1) {
+			/* the peer is not there yet. */
+			close(m->conn_fd);
+			m->conn_fd = -1;
+			m->stats.error++;
+			return -1;
+		}
+		m->state = SHM_CLIENT_CONNECTING;
+	}
+	return shm_client_attach(m);
+}
+
+/* The ring is full, the peer may have died without telling: then the
+ * connection that we got the ring through is closed. */
+static void shm_client_check(struct shm_sock *m)
+{
+	char c;
+
+	if (recv(m->conn_fd, &c, sizeof(c), MSG_DONTWAIT | MSG_PEEK) == 0)
+		shm_client_detach(m);
+}
+
+ssize_t shm_send(struct shm_sock *m, const void *data, int size)
+{
+	struct iovec iov = {
+		.iov_base	= (void *)data,
+		.iov_len	= size,
+	};
+
+	return shm_sendv(m, &iov, 1) == -1 ? -1 : size;
+}
+
+/* one record per iovec, they are published at once. The peer is only
+ * woken up if it has already drained the ring, otherwise it is still
+ * busy with the records in front of ours. */
+int shm_sendv(struct shm_sock *m, const struct iovec *iov, int n)
+{
+	struct shm_ring *r;
+	uint32_t start, prod, cons, len, need;
+	uint64_t one = 1;
+	int i;
+
+	if (shm_client_connect(m) == -1)
+		return -1;
+
+	r = m->ring;
+	start = prod = r->producer;
+	cons = __atomic_load_n(&r->consumer, __ATOMIC_ACQUIRE);
+
+	for (i=0; i<n; i++) {
+		len = iov[i].iov_len;
+		need = SHM_REC_HDR + SHM_ALIGN(len);
+		if (len > m->size || need > m->size - (prod - cons)) {
+			m->stats.full++;
+			break;
+		}
+		shm_ring_put(r, m->size, prod, &len, SHM_REC_HDR);
+		shm_ring_put(r, m->size, prod + SHM_REC_HDR,
+			     iov[i].iov_base, len);
+		prod += need;
+
+		m->stats.bytes += len;
+		m->stats.messages++;
+	}
+	if (i == 0) {
+		shm_client_check(m);
+		errno = ENOBUFS;
+		return -1;
+	}
+	__atomic_store_n(&r->producer, prod, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in shm_recv(), either we see that the ring
+	 * was drained or the peer sees our records before going to sleep. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->consumer, __ATOMIC_RELAXED) == start) {
+		if (write(m->event_fd, &one, sizeof(one)) == -1)
+			m->stats.error++;
+		else
+			m->stats.wakeups++;
+	}
+	return i;
+}
+
+ssize_t shm_recv(struct shm_sock *m, void *data, int size)
+{
+	struct shm_ring *r = m->ring;
+	uint32_t prod, cons = r->consumer, len, need;
+	uint64_t count;
+
+	prod = __atomic_load_n(&r->producer, __ATOMIC_ACQUIRE);
+	if (prod == cons) {
+		/* clear the wake up before going to sleep and look again,
+		 * the peer did not wake us up if it did not see us drain. */
+		if (read(m->event_fd, &count, sizeof(count)) > 0)
+			m->stats.wakeups++;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		prod = __atomic_load_n(&r->producer, __ATOMIC_ACQUIRE);
+		if (prod == cons) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	shm_ring_get(r, m->size, cons, &len, SHM_REC_HDR);
+	need = SHM_REC_HDR + SHM_ALIGN(len);
+	if (len > m->size || need > prod - cons) {
+		/* garbage in the ring, skip everything that is in there. */
+		__atomic_store_n(&r->consumer, prod, __ATOMIC_RELEASE);
+		m->stats.error++;
+		errno = EBADMSG;
+		return -1;
+	}
+	if (len > (uint32_t)size) {
+		__atomic_store_n(&r->consumer, cons + need, __ATOMIC_RELEASE);
+		m->stats.error++;
+		errno = EMSGSIZE;
+		return -1;
+	}
+	shm_ring_get(r, m->size, cons + SHM_REC_HDR, data, len);
+	__atomic_store_n(&r->consumer, cons + need, __ATOMIC_RELEASE);
+
+	m->stats.bytes += len;
+	m->stats.messages++;
+	return len;
+}
+
+int shm_get_fd(struct shm_sock *m)
+{
+	return m->fd;
+}
+
+int shm_isset(struct shm_sock *m, fd_set *readfds)
+{
+	return m->attached ? FD_ISSET(m->event_fd, readfds) : 0;
+}
+
+int shm_accept_isset(struct shm_sock *m, fd_set *readfds)
+{
+	return FD_ISSET(m->fd, readfds);
+}
+
+int
+shm_snprintf_stats(char *buf, size_t buflen, char *ifname,
+		   struct shm_sock *client, struct shm_sock *server)
+{
+	size_t size;
+	struct shm_stats *s = &client->stats, *r = &server->stats;
+
+	size = snprintf(buf, buflen, "Shared memory traffic "
+				     "(active device=%s) "
+				     "server=%s client=%s:\n"
+				     "%20llu Bytes sent "
+				     "%20llu Bytes recv\n"
+				     "%20llu Pckts sent "
+				     "%20llu Pckts recv\n"
+				     "%20llu Error send "
+				     "%20llu Error recv\n\n",
+				     ifname,
+				     server->conn_fd >= 0 ?
+				     "attached" : "detached",
+				     client->state == SHM_CLIENT_CONNECTED ?
+				     "attached" : "detached",
+				     (unsigned long long)s->bytes,
+				     (unsigned long long)r->bytes,
+				     (unsigned long long)s->messages,
+				     (unsigned long long)r->messages,
+				     (unsigned long long)s->error,
+				     (unsigned long long)r->error);
+	return size;
+}
+
+int
+shm_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
+		    const char *status, int active,
+		    struct shm_stats *s, struct shm_stats *r)
+{
+	size_t size;
+
+	size = snprintf(buf, buflen,
+			"Shared memory traffic device=%s status=%s role=%s:\n"
+			"%20llu Bytes sent "
+			"%20llu Bytes recv\n"
+			"%20llu Pckts sent "
+			"%20llu Pckts recv\n"
+			"%20llu Error send "
+			"%20llu Error recv\n"
+			"%20llu Wakeup send "
+			"%20llu Wakeup recv\n"
+			"%20llu Ring full\n\n",
+			ifname, status, active ? "ACTIVE" : "BACKUP",
+			(unsigned long long)s->bytes,
+			(unsigned long long)r->bytes,
+			(unsigned long long)s->messages,
+			(unsigned long long)r->messages,
+			(unsigned long long)s->error,
+			(unsigned long long)r->error,
+			(unsigned long long)s->wakeups,
+			(unsigned long long)r->wakeups,
+			(unsigned long long)s->full);
+	return size;
+}
@@ -126,6 +126,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 	switch(n->type) {
 	case Q_ELEM_CTL:
 		net = queue_node_data(n);
+		nethdr_batch_flush();
 		nethdr_set_ctl(net);
 		HDR_HOST2NETWORK(net);
 		multichannel_send(STATE_SYNC(channel), net);
@@ -137,8 +138,15 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 
 		ca = (struct cache_alarm *)n;
 		type = object_status_to_network_type(ca->obj);
-		net = ca->obj->cache->ops->build_msg(ca->obj, type);
-		multichannel_send(STATE_SYNC(channel), net);
+		nethdr_stripe(ca->obj);
+		if (CONFIG(sync).batch_messages) {
+			net = ca->obj->cache->ops->build_rec(ca->obj, type,
+						nethdr_batch_reserve());
+			nethdr_batch_commit(net);
+		} else {
+			net = ca->obj->cache->ops->build_msg(ca->obj, type);
+			multichannel_send(STATE_SYNC(channel), net);
+		}
 		cache_object_put(ca->obj);
 		break;
 	}
@@ -149,6 +157,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 static void alarm_xmit(void)
 {
 	queue_iterate(STATE_SYNC(tx_queue), NULL, tx_queue_xmit);
+	nethdr_batch_flush();
 }
 
 struct sync_mode sync_alarm = {
@@ -35,12 +35,38 @@
 #define dp(...)
 #endif
 
-struct queue *rs_queue;
-static uint32_t exp_seq;
-static uint32_t window;
-static uint32_t ack_from;
-static int ack_from_set = 0;
+/* messages that wait for an acknowledgment, by sequence number. There is
+ * one queue per channel in striping mode since every channel has its own
+ * sequence. */
+static struct queue *rs_queue[MULTICHANNEL_MAX];
+static int rs_queue_num;
 static struct alarm_block alive_alarm;
+static struct alarm_block sack_alarm;
+static struct alarm_block peer_alarm;
+
+/* acknowledgment state of the messages that we receive, there is one per
+ * channel in striping mode and one per node in multi-peer mode, since each
+ * of them has its own sequence. */
+#define FTFW_RX_MAX	NET_NODE_MAX
+
+static struct ftfw_rx {
+	int		peer;		/* the node that we acknowledge */
+	uint32_t	exp_seq;
+	uint32_t	window;
+	uint32_t	ack_from;
+	int		ack_from_set;
+	/* once there is a hole, what we got from ack_from on */
+	int		sack_holes;
+	uint8_t		sack_map[NETHDR_SACK_BITS / 8];
+} rx_state[FTFW_RX_MAX];
+
+static struct {
+	uint64_t	nack_resent;	/* in the range of a nack */
+	uint64_t	sack_resent;	/* holes of a selective nack */
+	uint64_t	sack_released;	/* received according to it */
+	uint64_t	sack_sent;
+	uint64_t	sack_holes;
+} ftfw_stats;
 
 enum {
 	HELLO_INIT,
@@ -53,12 +79,96 @@ static int say_hello_back;
 /* XXX: alive message expiration configurable */
 #define ALIVE_INT 1
 
+/* the holes wait for this long (usecs) so that one selective nack asks
+ * for several of them */
+#define SACK_DELAY 10000
+
+/* a node is gone if we do not hear of it for this long */
+#define PEER_TIMEOUT (3 * ALIVE_INT)
+
 struct cache_ftfw {
 	struct queue_node	qnode;
 	struct cache_object	*obj;
 	uint32_t 		seq;
+	uint32_t		wait;		/* nodes to acknowledge it */
+	struct channel		*channel;	/* sent through */
+};
+
+/* control messages go through the channel that they refer to */
+struct ftfw_ctl {
+	struct nethdr_ack	ack;
+	uint8_t			map[NETHDR_SACK_BITS / 8]; /* follows the ack */
+	struct nethdr_node	node;	/* room for the trailer, if any */
+	int			sack;
+	int			peer;	/* the node that it acknowledges */
+	uint32_t		wait;
+	struct channel		*channel;
 };
 
+static struct ftfw_rx *ftfw_rx(struct channel *c)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	int i = 0;
+
+	if (CONFIG(sync).node_id)
+		return &rx_state[STATE_SYNC(peers).current];
+
+	if (m->striping)
+		i = multichannel_get_index(m, c);
+
+	return &rx_state[i < 0 ? 0 : i];
+}
+
+/* in striping mode, acknowledgments only refer to the channel that they
+ * were received from, see multichannel_change_current_channel(). */
+static struct queue *ftfw_rs_queue(struct channel *c)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	int i = 0;
+
+	if (m->striping && c != NULL)
+		i = multichannel_get_index(m, c);
+
+	return rs_queue[i < 0 || i >= rs_queue_num ? 0 : i];
+}
+
+static int rs_queue_in(struct queue_node *n)
+{
+	return n->owner != NULL && n->owner->flags & QUEUE_F_SEQ;
+}
+
+/* the nodes that still have to acknowledge it in multi-peer mode */
+static uint32_t *rs_queue_wait(struct queue_node *n)
+{
+	if (n->type == Q_ELEM_OBJ)
+		return &((struct cache_ftfw *)n)->wait;
+
+	return &((struct ftfw_ctl *)queue_node_data(n))->wait;
+}
+
+/* the acknowledgment refers to us, other nodes ack what others sent */
+static int ftfw_ack_is_ours(void)
+{
+	return !CONFIG(sync).node_id ||
+	       STATE_SYNC(peers).to == CONFIG(sync).node_id;
+}
+
+static uint32_t ftfw_ack_node(void)
+{
+	return CONFIG(sync).node_id ? 1U << STATE_SYNC(peers).current : 0;
+}
+
+static unsigned int rs_queue_len(void)
+{
+	unsigned int len = 0;
+	int i;
+
+	for (i = 0; i < rs_queue_num; i++)
+		len += queue_len(rs_queue[i]);
+
+	return len;
+}
+
 static void cache_ftfw_add(struct cache_object *obj, void *data)
 {
 	struct cache_ftfw *cn = data;
@@ -79,8 +189,37 @@ static struct cache_extra cache_ftfw_extra = {
 	.destroy	= cache_ftfw_del
 };
 
+/* In multi-peer mode, every peer answers our hello on its own. We keep
+ * saying hello until all the peers that we know about did. */
+static void nethdr_set_hello_peers(struct nethdr *net)
+{
+	struct sync_peer *peer;
+	int i, known = 0;
+
+	for (i = 1; i < NET_NODE_MAX; i++) {
+		peer = &STATE_SYNC(peers).peer[i];
+		if (i == CONFIG(sync).node_id || peer->seen == 0)
+			continue;
+
+		known = 1;
+		if (peer->hello != HELLO_DONE)
+			net->flags |= NET_F_HELLO;
+		if (peer->hello_back) {
+			net->flags |= NET_F_HELLO_BACK;
+			peer->hello_back = 0;
+		}
+	}
+	if (!known)
+		net->flags |= NET_F_HELLO;
+}
+
 static void nethdr_set_hello(struct nethdr *net)
 {
+	if (CONFIG(sync).node_id) {
+		nethdr_set_hello_peers(net);
+		return;
+	}
+
 	switch(hello_state) {
 	case HELLO_INIT:
 		hello_state = HELLO_SAY;
@@ -95,78 +234,248 @@ static void nethdr_set_hello(struct nethdr *net)
 	}
 }
 
-static void tx_queue_add_ctlmsg(uint32_t flags, uint32_t from, uint32_t to)
+static void tx_queue_add_ctlmsg(struct channel *c, uint32_t flags,
+				uint32_t from, uint32_t to, int peer)
 {
 	struct queue_object *qobj;
+	struct ftfw_ctl *ctl;
 	struct nethdr_ack *ack;
 
-	qobj = queue_object_new(Q_ELEM_CTL, sizeof(struct nethdr_ack));
+	qobj = queue_object_new(Q_ELEM_CTL, sizeof(struct ftfw_ctl));
 	if (qobj == NULL)
 		return;
 
-	ack		= (struct nethdr_ack *)qobj->data;
+	ctl		= (struct ftfw_ctl *)qobj->data;
+	ctl->channel	= c;
+	ctl->peer	= peer;
+	ack		= &ctl->ack;
 	ack->type 	= NET_T_CTL;
 	ack->flags	= flags;
 	ack->from	= from;
 	ack->to		= to;
 
-	if (queue_add(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
+	if (queue_add_front(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
 		queue_object_free(qobj);
 }
 
-static void tx_queue_add_ctlmsg2(uint32_t flags)
+static void tx_queue_add_sack(struct channel *c, uint32_t from, uint32_t to,
+			      const uint8_t *map, int peer)
 {
 	struct queue_object *qobj;
-	struct nethdr *ctl;
+	struct ftfw_ctl *ctl;
 
-	qobj = queue_object_new(Q_ELEM_CTL, sizeof(struct nethdr_ack));
+	qobj = queue_object_new(Q_ELEM_CTL, sizeof(struct ftfw_ctl));
 	if (qobj == NULL)
 		return;
 
-	ctl		= (struct nethdr *)qobj->data;
-	ctl->type 	= NET_T_CTL;
-	ctl->flags	= flags;
+	ctl		= (struct ftfw_ctl *)qobj->data;
+	ctl->channel	= c;
+	ctl->sack	= 1;
+	ctl->peer	= peer;
+	ctl->ack.type	= NET_T_CTL;
+	ctl->ack.flags	= NET_F_NACK;
+	ctl->ack.from	= from;
+	ctl->ack.to	= to;
+	memcpy(ctl->map, map, sizeof(ctl->map));
+
+	if (queue_add_front(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
+		queue_object_free(qobj);
+}
+
+static void tx_queue_add_ctlmsg2(struct channel *c, uint32_t flags)
+{
+	struct queue_object *qobj;
+	struct ftfw_ctl *ctl;
+
+	qobj = queue_object_new(Q_ELEM_CTL, sizeof(struct ftfw_ctl));
+	if (qobj == NULL)
+		return;
+
+	ctl		= (struct ftfw_ctl *)qobj->data;
+	ctl->channel	= c;
+	ctl->ack.type 	= NET_T_CTL;
+	ctl->ack.flags	= flags;
 
-	if (queue_add(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
+	if (queue_add_front(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
 		queue_object_free(qobj);
 }
 
+static inline int sack_test(const uint8_t *map, uint32_t i)
+{
+	return map[i / 8] & (1 << (i % 8));
+}
+
+static inline void sack_set(uint8_t *map, uint32_t i)
+{
+	map[i / 8] |= 1 << (i % 8);
+}
+
+/* acknowledge [ack_from, to], if there are holes in between then the peer
+ * resends those only. */
+static void ftfw_ack(struct channel *c, struct ftfw_rx *rx, uint32_t to)
+{
+	uint32_t i;
+
+	if (rx->sack_holes) {
+		for (i = 0; i <= to - rx->ack_from; i++) {
+			if (!sack_test(rx->sack_map, i))
+				ftfw_stats.sack_holes++;
+		}
+		ftfw_stats.sack_sent++;
+		tx_queue_add_sack(c, rx->ack_from, to, rx->sack_map,
+				  rx->peer);
+		memset(rx->sack_map, 0, sizeof(rx->sack_map));
+		rx->sack_holes = 0;
+	} else
+		tx_queue_add_ctlmsg(c, NET_F_ACK, rx->ack_from, to, rx->peer);
+
+	rx->ack_from_set = 0;
+}
+
+/* the channel to acknowledge through and the last message received for
+ * the acknowledgment state i, returns 0 if we got none so far. */
+static int ftfw_rx_last(int i, struct channel **c, uint32_t *seq)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+
+	if (CONFIG(sync).node_id) {
+		struct sync_peer *peer = &STATE_SYNC(peers).peer[i];
+
+		*c = m->current;
+		*seq = peer->last_seq_recv;
+		return peer->seq_set_recv;
+	}
+	*c = m->striping ? m->channel[i] : m->current;
+	*seq = (*c)->last_seq_recv;
+	return (*c)->seq_set_recv;
+}
+
+/* every live node gets its acknowledgment, they also tell them that we are
+ * still there. */
+static void ftfw_alive_peers(void)
+{
+	struct channel *c;
+	uint32_t seq;
+	int i, acked = 0;
+
+	for (i = 1; i < FTFW_RX_MAX; i++) {
+		if (!(STATE_SYNC(peers).live & (1U << i)) ||
+		    !rx_state[i].ack_from_set || !ftfw_rx_last(i, &c, &seq))
+			continue;
+
+		ftfw_ack(c, &rx_state[i], seq);
+		acked = 1;
+	}
+	if (!acked)
+		tx_queue_add_ctlmsg2(STATE_SYNC(channel)->current,
+				     NET_F_ALIVE);
+}
+
+static void ftfw_alive(struct channel *c)
+{
+	struct channel *t = nethdr_track_channel(c);
+	struct ftfw_rx *rx = ftfw_rx(c);
+
+	if (rx->ack_from_set && t->seq_set_recv) {
+		/* last_seq_recv contains the last update received */
+		ftfw_ack(c, rx, t->last_seq_recv);
+	} else
+		tx_queue_add_ctlmsg2(c, NET_F_ALIVE);
+}
+
 /* this function is called from the alarm framework */
 static void do_alive_alarm(struct alarm_block *a, void *data)
 {
-	if (ack_from_set && nethdr_track_is_seq_set()) {
-		/* exp_seq contains the last update received */
-		//TODO: do all channels?
-		tx_queue_add_ctlmsg(NET_F_ACK,
-				    ack_from,
-				    STATE_SYNC(channel)->current->last_seq_recv);
-		ack_from_set = 0;
+	struct multichannel *m = STATE_SYNC(channel);
+	int i;
+
+	if (CONFIG(sync).node_id)
+		ftfw_alive_peers();
+	else if (m->striping) {
+		for (i = 0; i < m->alive_num; i++)
+			ftfw_alive(m->alive[i]);
 	} else
-		tx_queue_add_ctlmsg2(NET_F_ALIVE);
+		ftfw_alive(m->current);
 
 	add_alarm(&alive_alarm, ALIVE_INT, 0);
 }
 
+/* the holes have waited for long enough, ask for them */
+static void do_sack_alarm(struct alarm_block *a, void *data)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	struct channel *c;
+	uint32_t seq;
+	int i, num;
+
+	if (CONFIG(sync).node_id)
+		num = FTFW_RX_MAX;
+	else
+		num = m->striping ? m->channel_num : 1;
+
+	for (i = 0; i < num; i++) {
+		if (rx_state[i].sack_holes && ftfw_rx_last(i, &c, &seq)) {
+			ftfw_ack(c, &rx_state[i], seq);
+			rx_state[i].window = CONFIG(window_size);
+		}
+	}
+}
+
+static void rs_queue_forget(uint32_t nodes);
+
+/* the nodes that we do not hear of anymore do not hold messages back */
+static void do_peer_alarm(struct alarm_block *a, void *data)
+{
+	uint32_t gone;
+
+	gone = sync_peer_expire(PEER_TIMEOUT);
+	if (gone)
+		rs_queue_forget(gone);
+
+	add_alarm(&peer_alarm, ALIVE_INT, 0);
+}
+
 static int ftfw_init(void)
 {
-	rs_queue = queue_create("rsqueue", CONFIG(resend_queue_size), 0);
-	if (rs_queue == NULL) {
-		dlog(LOG_ERR, "cannot create rs queue");
-		return -1;
+	char name[QUEUE_NAMELEN];
+	int i;
+
+	rs_queue_num = CONFIG(sync).striping ? CONFIG(channel_num) : 1;
+	for (i = 0; i < rs_queue_num; i++) {
+		snprintf(name, sizeof(name), i ? "rsqueue%d" : "rsqueue", i);
+		rs_queue[i] = queue_create(name, CONFIG(resend_queue_size),
+					   QUEUE_F_SEQ);
+		if (rs_queue[i] == NULL) {
+			dlog(LOG_ERR, "cannot create rs queue");
+			return -1;
+		}
 	}
 
 	init_alarm(&alive_alarm, NULL, do_alive_alarm);
 	add_alarm(&alive_alarm, ALIVE_INT, 0);
+	init_alarm(&sack_alarm, NULL, do_sack_alarm);
+	init_alarm(&peer_alarm, NULL, do_peer_alarm);
+	if (CONFIG(sync).node_id)
+		add_alarm(&peer_alarm, ALIVE_INT, 0);
 
 	/* set ack window size */
-	window = CONFIG(window_size);
+	for (i = 0; i < FTFW_RX_MAX; i++) {
+		rx_state[i].window = CONFIG(window_size);
+		rx_state[i].peer = CONFIG(sync).node_id ? i : 0;
+	}
 
 	return 0;
 }
 
 static void ftfw_kill(void)
 {
-	queue_destroy(rs_queue);
+	int i;
+
+	del_alarm(&sack_alarm);
+	del_alarm(&peer_alarm);
+
+	for (i = 0; i < rs_queue_num; i++)
+		queue_destroy(rs_queue[i]);
 }
 
 static int do_cache_to_tx(void *data1, void *data2)
@@ -174,7 +483,7 @@ static int do_cache_to_tx(void *data1, void *data2)
 	struct cache_object *obj = data2;
 	struct cache_ftfw *cn = cache_get_extra(obj);
 
-	if (queue_in(rs_queue, &cn->qnode)) {
+	if (rs_queue_in(&cn->qnode)) {
 		queue_del(&cn->qnode);
 		queue_add(STATE_SYNC(tx_queue), &cn->qnode);
 	} else {
@@ -212,11 +521,24 @@ static int rs_queue_dump(struct queue_node *n, const void *data2)
 static void ftfw_local_queue(int fd)
 {
 	char buf[512];
-	int size;
+	int size, i;
 
-	size = sprintf(buf, "resent queue (len=%u)\n", queue_len(rs_queue));
+	size = sprintf(buf, "resent queue (len=%u)\n", rs_queue_len());
 	send(fd, buf, size, 0);
-	queue_iterate(rs_queue, &fd, rs_queue_dump);
+	if (CONFIG(sync).selective_ack) {
+		size = sprintf(buf, "selective nack:\n"
+				    "%20llu Sent       %20llu Holes\n"
+				    "%20llu Resent     %20llu Released\n"
+				    "%20llu Resent by plain nack\n",
+			       (unsigned long long)ftfw_stats.sack_sent,
+			       (unsigned long long)ftfw_stats.sack_holes,
+			       (unsigned long long)ftfw_stats.sack_resent,
+			       (unsigned long long)ftfw_stats.sack_released,
+			       (unsigned long long)ftfw_stats.nack_resent);
+		send(fd, buf, size, 0);
+	}
+	for (i = 0; i < rs_queue_num; i++)
+		queue_iterate(rs_queue[i], &fd, rs_queue_dump);
 }
 
 static int ftfw_local(int fd, int type, void *data)
@@ -226,7 +548,8 @@ static int ftfw_local(int fd, int type, void *data)
 	switch(type) {
 	case REQUEST_DUMP:
 		dlog(LOG_NOTICE, "request resync");
-		tx_queue_add_ctlmsg(NET_F_RESYNC, 0, 0);
+		tx_queue_add_ctlmsg(STATE_SYNC(channel)->current,
+				    NET_F_RESYNC, 0, 0, 0);
 		break;
 	case SEND_BULK:
 		dlog(LOG_NOTICE, "sending bulk update");
@@ -243,89 +566,125 @@ static int ftfw_local(int fd, int type, void *data)
 	return ret;
 }
 
+/* the queue is iterated over the range that the peer refers to only */
 static int rs_queue_to_tx(struct queue_node *n, const void *data)
 {
-	const struct nethdr_ack *nack = data;
+	uint64_t *resent = (uint64_t *)data;
 
-	switch(n->type) {
-	case Q_ELEM_CTL: {
-		struct nethdr_ack *net = queue_node_data(n);
+	dp("resending nack'ed (seq=%u)\n", n->type == Q_ELEM_OBJ ?
+	   ((struct cache_ftfw *) n)->seq :
+	   ((struct ftfw_ctl *) queue_node_data(n))->ack.seq);
 
-		if (before(net->seq, nack->from))
-			return 0;	/* continue */
-		else if (after(net->seq, nack->to))
-			return 1;	/* break */
+	queue_del(n);
+	if (n->type == Q_ELEM_CTL)
+		queue_add_front(STATE_SYNC(tx_queue), n);
+	else
+		queue_add(STATE_SYNC(tx_queue), n);
+	(*resent)++;
+	return 0;
+}
 
-		dp("rs_queue_to_tx sq: %u fl:%u len:%u\n",
-			net->seq, net->flags, net->len);
+static int rs_queue_empty(struct queue_node *n, const void *data)
+{
+	uint64_t *released = (uint64_t *)data;
+
+	if (released != NULL)
+		(*released)++;
 
+	switch(n->type) {
+	case Q_ELEM_CTL:
 		queue_del(n);
-		queue_add(STATE_SYNC(tx_queue), n);
+		queue_object_free((struct queue_object *)n);
 		break;
-	}
 	case Q_ELEM_OBJ: {
-		struct cache_ftfw *cn;
-
-		cn = (struct cache_ftfw *) n;
-		if (before(cn->seq, nack->from))
-			return 0;
-		else if (after(cn->seq, nack->to))
-			return 1;
-
-		dp("resending nack'ed (oldseq=%u)\n", cn->seq);
+		struct cache_ftfw *cn = (struct cache_ftfw *) n;
 
 		queue_del(n);
-		queue_add(STATE_SYNC(tx_queue), n);
+		cache_object_put(cn->obj);
 		break;
 	}
 	}
 	return 0;
 }
 
-static int rs_queue_empty(struct queue_node *n, const void *data)
+/* flush the resend queues, the peer does not know about that data */
+static void rs_queue_flush(void)
 {
-	const struct nethdr_ack *h = data;
+	int i;
 
-	switch(n->type) {
-	case Q_ELEM_CTL: {
-		struct nethdr_ack *net = queue_node_data(n);
+	for (i = 0; i < rs_queue_num; i++)
+		queue_iterate(rs_queue[i], NULL, rs_queue_empty);
+}
 
-		if (h == NULL) {
-			queue_del(n);
-			queue_object_free((struct queue_object *)n);
-			return 0;
-		}
-		if (before(net->seq, h->from))
-			return 0;	/* continue */
-		else if (after(net->seq, h->to))
-			return 1;	/* break */
+struct rs_ack {
+	uint32_t	nodes;
+	uint64_t	*released;
+};
 
-		dp("remove from queue (seq=%u)\n", net->seq);
-		queue_del(n);
-		queue_object_free((struct queue_object *)n);
-		break;
-	}
-	case Q_ELEM_OBJ: {
-		struct cache_ftfw *cn;
+/* in multi-peer mode, the message goes once all the live nodes have
+ * acknowledged it. Otherwise, nodes is zero and it goes at once. */
+static int rs_queue_ack(struct queue_node *n, const void *data)
+{
+	const struct rs_ack *ack = data;
+	uint32_t *wait = rs_queue_wait(n);
 
-		cn = (struct cache_ftfw *) n;
-		if (h == NULL) {
-			queue_del(n);
-			cache_object_put(cn->obj);
-			return 0;
-		}
-		if (before(cn->seq, h->from))
-			return 0;
-		else if (after(cn->seq, h->to))
-			return 1;
+	*wait &= ~ack->nodes;
+	if (*wait & STATE_SYNC(peers).live)
+		return 0;
 
-		dp("queue: deleting from queue (seq=%u)\n", cn->seq);
-		queue_del(n);
-		cache_object_put(cn->obj);
-		break;
-	}
+	return rs_queue_empty(n, ack->released);
+}
+
+/* these nodes do not know about what we sent so far, or they are gone */
+static void rs_queue_forget(uint32_t nodes)
+{
+	struct rs_ack ack = { .nodes = nodes };
+	int i;
+
+	for (i = 0; i < rs_queue_num; i++)
+		queue_iterate(rs_queue[i], &ack, rs_queue_ack);
+}
+
+/* lag of the node, see dump_stats_peers() */
+static void ftfw_peer_acked(uint32_t seq)
+{
+	struct sync_peer *peer;
+
+	if (!CONFIG(sync).node_id)
+		return;
+
+	peer = &STATE_SYNC(peers).peer[STATE_SYNC(peers).current];
+	if (!peer->acked_set || after(seq, peer->acked_seq))
+		peer->acked_seq = seq;
+	peer->acked_set = 1;
+	clock_gettime(CLOCK_MONOTONIC, &peer->acked);
+}
+
+/* resend the holes in the range of the nack, release the rest */
+static void digest_sack(const struct nethdr_sack *sack)
+{
+	struct queue *q = ftfw_rs_queue(STATE_SYNC(channel)->rx_current);
+	uint32_t i, j, num = sack->ack.to - sack->ack.from + 1;
+	struct rs_ack ack = {
+		.nodes		= ftfw_ack_node(),
+		.released	= &ftfw_stats.sack_released,
+	};
+	int got;
+
+	for (i = 0; i < num; i = j) {
+		got = sack_test(sack->map, i);
+		for (j = i + 1; j < num && sack_test(sack->map, j) == got; j++);
+
+		if (got)
+			queue_iterate_seq(q, sack->ack.from + i,
+					  sack->ack.from + j - 1,
+					  &ack, rs_queue_ack);
+		else
+			queue_iterate_seq(q, sack->ack.from + i,
+					  sack->ack.from + j - 1,
+					  &ftfw_stats.sack_resent,
+					  rs_queue_to_tx);
 	}
-	return 0;
 }
 
 static int digest_msg(const struct nethdr *net)
@@ -335,11 +694,18 @@ static int digest_msg(const struct nethdr *net)
 
 	else if (IS_ACK(net)) {
 		const struct nethdr_ack *h = (const struct nethdr_ack *) net;
+		struct rs_ack ack = { .nodes = ftfw_ack_node() };
 
 		if (before(h->to, h->from))
 			return MSG_BAD;
 
-		queue_iterate(rs_queue, h, rs_queue_empty);
+		if (!ftfw_ack_is_ours())
+			return MSG_CTL;
+
+		queue_iterate_seq(ftfw_rs_queue(STATE_SYNC(channel)->rx_current),
+				  h->from, h->to, &ack, rs_queue_ack);
+		ftfw_peer_acked(h->to);
+		multichannel_pace_ack(STATE_SYNC(channel));
 		return MSG_CTL;
 
 	} else if (IS_NACK(net)) {
@@ -348,7 +714,20 @@ static int digest_msg(const struct nethdr *net)
 		if (before(nack->to, nack->from))
 			return MSG_BAD;
 
-		queue_iterate(rs_queue, nack, rs_queue_to_tx);
+		if (!ftfw_ack_is_ours())
+			return MSG_CTL;
+
+		multichannel_pace_loss(STATE_SYNC(channel));
+		if (net->len >= NETHDR_SACK_SIZ &&
+		    nack->to - nack->from < NETHDR_SACK_BITS) {
+			digest_sack((const struct nethdr_sack *) net);
+			ftfw_peer_acked(nack->to);
+			return MSG_CTL;
+		}
+
+		queue_iterate_seq(ftfw_rs_queue(STATE_SYNC(channel)->rx_current),
+				  nack->from, nack->to, &ftfw_stats.nack_resent,
+				  rs_queue_to_tx);
 		return MSG_CTL;
 
 	} else if (IS_RESYNC(net)) {
@@ -367,42 +746,98 @@ static int digest_msg(const struct nethdr *net)
 
 static int digest_hello(const struct nethdr *net)
 {
+	struct sync_peer *peer = NULL;
 	int ret = 0;
 
+	/* the node that sent this, see sync_peer_recv() */
+	if (CONFIG(sync).node_id)
+		peer = &STATE_SYNC(peers).peer[STATE_SYNC(peers).current];
+
 	if (IS_HELLO(net)) {
-		say_hello_back = 1;
+		if (peer)
+			peer->hello_back = 1;
+		else
+			say_hello_back = 1;
 		ret = 1;
 	}
 	if (IS_HELLO_BACK(net)) {
 		/* this is a hello back for a requested hello */
-		if (hello_state == HELLO_SAY)
+		if (peer)
+			peer->hello = HELLO_DONE;
+		else if (hello_state == HELLO_SAY)
 			hello_state = HELLO_DONE;
 	}
 
 	return ret;
 }
 
+/* record the gap in front of seq in the map instead of sending a nack at
+ * once, returns 0 if the gap does not fit in there. */
+static int ftfw_sack(struct channel *c, struct ftfw_rx *rx, uint32_t seq)
+{
+	uint32_t i;
+
+	if (rx->ack_from_set && seq - rx->ack_from >= NETHDR_SACK_BITS) {
+		ftfw_ack(c, rx, rx->exp_seq-1);
+		rx->window = CONFIG(window_size);
+	}
+
+	if (!rx->ack_from_set) {
+		if (seq - rx->exp_seq >= NETHDR_SACK_BITS)
+			return 0;
+
+		/* the map starts with the first message that we missed */
+		rx->ack_from = rx->exp_seq;
+		rx->ack_from_set = 1;
+	}
+
+	if (!rx->sack_holes) {
+		/* all that we have to acknowledge so far was received */
+		for (i = 0; i < rx->exp_seq - rx->ack_from; i++)
+			sack_set(rx->sack_map, i);
+		rx->sack_holes = 1;
+	}
+	sack_set(rx->sack_map, seq - rx->ack_from);
+
+	if (!alarm_pending(&sack_alarm))
+		add_alarm(&sack_alarm, 0, SACK_DELAY);
+
+	if (--rx->window <= 0) {
+		ftfw_ack(c, rx, seq);
+		rx->window = CONFIG(window_size);
+	}
+	return 1;
+}
+
 static int ftfw_recv(const struct nethdr *net)
 {
+	struct channel *c = STATE_SYNC(channel)->rx_current;
+	struct ftfw_rx *rx = ftfw_rx(c);
 	int ret = MSG_DATA;
 
 	if (digest_hello(net)) {
 		/* we have received a hello while we had data to acknowledge.
 		 * reset the window, the other doesn't know anthing about it. */
-		if (ack_from_set && before(net->seq, ack_from)) {
-			window = CONFIG(window_size) - 1;
-			ack_from = net->seq;
+		if (rx->ack_from_set && before(net->seq, rx->ack_from)) {
+			rx->window = CONFIG(window_size) - 1;
+			rx->ack_from = net->seq;
+			rx->sack_holes = 0;
+			memset(rx->sack_map, 0, sizeof(rx->sack_map));
 		}
 
 		/* XXX: flush the resend queues since the other does not 
 		 * know anything about that data, we are unreliable until 
-		 * the helloing finishes */
-		queue_iterate(rs_queue, NULL, rs_queue_empty);
+		 * the helloing finishes. In multi-peer mode, the others
+		 * still wait for it though. */
+		if (CONFIG(sync).node_id)
+			rs_queue_forget(ftfw_ack_node());
+		else
+			rs_queue_flush();
 
 		goto bypass;
 	}
 
-	switch (nethdr_track_seq(net->seq, &exp_seq)) {
+	switch (nethdr_track_seq(net->seq, &rx->exp_seq)) {
 	case SEQ_AFTER:
 		ret = digest_msg(net);
 		if (ret == MSG_BAD) {
@@ -410,17 +845,19 @@ static int ftfw_recv(const struct nethdr *net)
 			goto out;
 		}
 
-		if (ack_from_set) {
-			tx_queue_add_ctlmsg(NET_F_ACK, ack_from, exp_seq-1);
-			ack_from_set = 0;
-		}
+		if (CONFIG(sync).selective_ack && ftfw_sack(c, rx, net->seq))
+			break;
+
+		if (rx->ack_from_set)
+			ftfw_ack(c, rx, rx->exp_seq-1);
 
-		tx_queue_add_ctlmsg(NET_F_NACK, exp_seq, net->seq-1);
+		tx_queue_add_ctlmsg(c, NET_F_NACK, rx->exp_seq, net->seq-1,
+				    rx->peer);
 
 		/* count this message as part of the new window */
-		window = CONFIG(window_size) - 1;
-		ack_from = net->seq;
-		ack_from_set = 1;
+		rx->window = CONFIG(window_size) - 1;
+		rx->ack_from = net->seq;
+		rx->ack_from_set = 1;
 		break;
 
 	case SEQ_BEFORE:
@@ -437,16 +874,25 @@ bypass:
 			goto out;
 		}
 
-		if (!ack_from_set) {
-			ack_from_set = 1;
-			ack_from = net->seq;
+		/* the map is full, ask for the holes that it has */
+		if (rx->sack_holes &&
+		    net->seq - rx->ack_from >= NETHDR_SACK_BITS) {
+			ftfw_ack(c, rx, net->seq-1);
+			rx->window = CONFIG(window_size);
+		}
+
+		if (!rx->ack_from_set) {
+			rx->ack_from_set = 1;
+			rx->ack_from = net->seq;
 		}
 
-		if (--window <= 0) {
+		if (rx->sack_holes)
+			sack_set(rx->sack_map, net->seq - rx->ack_from);
+
+		if (--rx->window <= 0) {
 			/* received a window, send an acknowledgement */
-			tx_queue_add_ctlmsg(NET_F_ACK, ack_from, net->seq);
-			window = CONFIG(window_size);
-			ack_from_set = 0;
+			ftfw_ack(c, rx, net->seq);
+			rx->window = CONFIG(window_size);
 		}
 	}
 
@@ -457,11 +903,14 @@ out:
 	return ret;
 }
 
-static void rs_queue_purge_full(void)
+static void rs_queue_purge_full(struct queue *q)
 {
 	struct queue_node *n;
 
-	n = queue_del_head(rs_queue);
+	n = queue_del_head(q);
+	if (n == NULL)
+		return;
+
 	switch(n->type) {
 	case Q_ELEM_CTL: {
 		struct queue_object *qobj = (struct queue_object *)n;
@@ -478,21 +927,57 @@ static void rs_queue_purge_full(void)
 	}
 }
 
+/* the oldest messages make room for the new one if the queue is full */
+static void rs_queue_add(struct channel *c, struct queue_node *n, uint32_t seq)
+{
+	struct queue *q = ftfw_rs_queue(c);
+
+	*rs_queue_wait(n) = STATE_SYNC(peers).live;
+	while (queue_add_seq(q, n, seq) < 0 && errno == ENOSPC &&
+	       queue_len(q) > 0)
+		rs_queue_purge_full(q);
+}
+
+/* struct ftfw_ctl leaves room for the trailer after the message */
+static void nethdr_set_node(struct nethdr *net, int to)
+{
+	struct nethdr_node *node;
+
+	node = (struct nethdr_node *)((char *)net + net->len);
+	node->from	= CONFIG(sync).node_id;
+	node->to	= to;
+	node->__pad	= 0;
+	net->len += NETHDR_NODE_SIZ;
+}
+
 static int tx_queue_xmit(struct queue_node *n, const void *data)
 {
+	/* out of tokens, the objects wait in the queue. Control messages are
+	 * at its head, see queue_add_front(), so they have been sent. */
+	if (n->type == Q_ELEM_OBJ && multichannel_pace_wait(STATE_SYNC(channel)))
+		return 1;
+
 	queue_del(n);
 
 	switch(n->type) {
 	case Q_ELEM_CTL: {
+		struct ftfw_ctl *ctl = queue_node_data(n);
 		struct nethdr *net = queue_node_data(n);
 
+		/* the pending batch goes first, it has a lower sequence */
+		nethdr_set_channel(ctl->channel);
+		nethdr_batch_flush();
 		nethdr_set_hello(net);
 
 		if (IS_ACK(net) || IS_NACK(net) || IS_RESYNC(net)) {
 			nethdr_set_ack(net);
+			if (ctl->sack)
+				net->len = NETHDR_SACK_SIZ;
 		} else {
 			nethdr_set_ctl(net);
 		}
+		if (CONFIG(sync).node_id)
+			nethdr_set_node(net, ctl->peer);
 		HDR_HOST2NETWORK(net);
 
 		dp("tx_queue sq: %u fl:%u len:%u\n",
@@ -502,12 +987,8 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 		HDR_NETWORK2HOST(net);
 
 		if (IS_ACK(net) || IS_NACK(net) || IS_RESYNC(net)) {
-			if (queue_add(rs_queue, n) < 0) {
-				if (errno == ENOSPC) {
-					rs_queue_purge_full();
-					queue_add(rs_queue, n);
-				}
-			}
+			rs_queue_add(ctl->channel ? ctl->channel :
+				     STATE_SYNC(channel)->current, n, net->seq);
 		} else
 			queue_object_free((struct queue_object *)n);
 		break;
@@ -519,20 +1000,26 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 
 		cn = (struct cache_ftfw *)n;
 		type = object_status_to_network_type(cn->obj);
-		net = cn->obj->cache->ops->build_msg(cn->obj, type);
-		nethdr_set_hello(net);
+		nethdr_stripe(cn->obj);
+		cn->channel = STATE_SYNC(channel)->current;
+		if (CONFIG(sync).batch_messages) {
+			/* all records in a batch share its sequence number */
+			net = cn->obj->cache->ops->build_rec(cn->obj, type,
+						nethdr_batch_reserve());
+			net = nethdr_batch_commit(net);
+			nethdr_set_hello(net);
+			cn->seq = net->seq;
+		} else {
+			net = cn->obj->cache->ops->build_msg(cn->obj, type);
+			nethdr_set_hello(net);
 
-		dp("tx_list sq: %u fl:%u len:%u\n",
-	                ntohl(net->seq), net->flags, ntohs(net->len));
+			dp("tx_list sq: %u fl:%u len:%u\n",
+			   ntohl(net->seq), net->flags, ntohs(net->len));
 
-		multichannel_send(STATE_SYNC(channel), net);
-		cn->seq = ntohl(net->seq);
-		if (queue_add(rs_queue, &cn->qnode) < 0) {
-			if (errno == ENOSPC) {
-				rs_queue_purge_full();
-				queue_add(rs_queue, &cn->qnode);
-			}
+			multichannel_send(STATE_SYNC(channel), net);
+			cn->seq = ntohl(net->seq);
 		}
+		rs_queue_add(cn->channel, &cn->qnode, cn->seq);
 		/* we release the object once we get the acknowlegment */
 		break;
 	}
@@ -544,15 +1031,66 @@ static int tx_queue_xmit(struct queue_node *n, const void *data)
 static void ftfw_xmit(void)
 {
 	queue_iterate(STATE_SYNC(tx_queue), NULL, tx_queue_xmit);
+	nethdr_batch_flush();
 	add_alarm(&alive_alarm, ALIVE_INT, 0);
 	dp("tx_queue_len:%u rs_queue_len:%u\n", 
-		queue_len(tx_queue), queue_len(rs_queue));
+		queue_len(tx_queue), rs_queue_len());
+}
+
+static int rs_queue_link_down(struct queue_node *n, const void *data)
+{
+	const struct channel *c = data;
+
+	switch(n->type) {
+	case Q_ELEM_CTL: {
+		struct ftfw_ctl *ctl = queue_node_data(n);
+
+		if (ctl->channel != c)
+			return 0;
+
+		queue_del(n);
+		/* the resync request is still valid, the acknowledgments
+		 * refer to sequence numbers of the channel that went down. */
+		if (ctl->ack.flags & NET_F_RESYNC) {
+			ctl->channel = NULL;
+			queue_add_front(STATE_SYNC(tx_queue), n);
+		} else
+			queue_object_free((struct queue_object *)n);
+		break;
+	}
+	case Q_ELEM_OBJ: {
+		struct cache_ftfw *cn = (struct cache_ftfw *) n;
+
+		if (cn->channel != c)
+			return 0;
+
+		/* send it again through one of the remaining channels */
+		queue_del(n);
+		queue_add(STATE_SYNC(tx_queue), n);
+		break;
+	}
+	}
+	return 0;
+}
+
+static void ftfw_link_down(struct channel *c)
+{
+	struct ftfw_rx *rx = ftfw_rx(c);
+	int i;
+
+	for (i = 0; i < rs_queue_num; i++)
+		queue_iterate(rs_queue[i], c, rs_queue_link_down);
+
+	rx->window = CONFIG(window_size);
+	rx->ack_from_set = 0;
+	rx->sack_holes = 0;
+	memset(rx->sack_map, 0, sizeof(rx->sack_map));
 }
 
 static void ftfw_enqueue(struct cache_object *obj, int type)
 {
 	struct cache_ftfw *cn = cache_get_extra(obj);
-	if (queue_in(rs_queue, &cn->qnode)) {
+	if (rs_queue_in(&cn->qnode)) {
 		queue_del(&cn->qnode);
 		queue_add(STATE_SYNC(tx_queue), &cn->qnode);
 	} else {
@@ -571,4 +1109,5 @@ struct sync_mode sync_ftfw = {
 	.recv			= ftfw_recv,
 	.enqueue		= ftfw_enqueue,
 	.xmit			= ftfw_xmit,
+	.link_down		= ftfw_link_down,
 };
@@ -40,38 +40,42 @@
 #include <limits.h>
 #include <net/if.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 
-static struct nf_conntrack *msg2ct_alloc(struct nethdr *net, size_t remain)
+/* Messages are decoded into these objects, that are reused for every
+ * message instead of allocating new ones. The external handlers copy
+ * whatever they want to keep. */
+static struct nf_conntrack *rx_ct;
+static struct nf_expect *rx_exp;
+
+static struct nf_conntrack *msg2ct_get(struct nethdr *net, size_t remain)
 {
-	struct nf_conntrack *ct;
+	struct nf_conntrack *ct = rx_ct;
 
-	/* TODO: add stats on ENOMEM errors in the future. */
-	ct = nfct_new();
-	if (ct == NULL)
-		return NULL;
+	/* labels are the only attribute that owns memory, see msg2ct() */
+	if (nfct_attr_is_set(ct, ATTR_CONNLABELS)) {
+		nfct_bitmask_destroy((struct nfct_bitmask *)
+				     nfct_get_attr(ct, ATTR_CONNLABELS));
+	}
+	memset(ct, 0, nfct_maxsize());
 
 	if (msg2ct(ct, net, remain) == -1) {
 		STATE_SYNC(error).msg_rcv_malformed++;
 		STATE_SYNC(error).msg_rcv_bad_payload++;
-		nfct_destroy(ct);
 		return NULL;
 	}
 	return ct;
 }
 
-static struct nf_expect *msg2exp_alloc(struct nethdr *net, size_t remain)
+static struct nf_expect *msg2exp_get(struct nethdr *net, size_t remain)
 {
-	struct nf_expect *exp;
+	struct nf_expect *exp = rx_exp;
 
-	/* TODO: add stats on ENOMEM errors in the future. */
-	exp = nfexp_new();
-	if (exp == NULL)
-		return NULL;
+	memset(exp, 0, nfexp_maxsize());
 
 	if (msg2exp(exp, net, remain) == -1) {
 		STATE_SYNC(error).msg_rcv_malformed++;
 		STATE_SYNC(error).msg_rcv_bad_payload++;
-		nfexp_destroy(exp);
 		return NULL;
 	}
 	return exp;
@@ -99,14 +103,236 @@ relay_seqfix(struct channel *c, uint16_t len){
 	multichannel_seqfix_allbut(STATE_SYNC(channel), len, c);
 }
 
+/* The delta refers to an entry that we do not have, eg. we missed its new
+ * message or we have just started, and the peer only sends it in full on
+ * resyncs. ALARM mode refreshes all the entries in full anyway. */
+#define DELTA_RESYNC_INT	30
+
+static void delta_unknown(void)
+{
+	time_t now = time(NULL);
+
+	STATE_SYNC(delta).recv_unknown++;
+
+	if (STATE_SYNC(sync)->local == NULL ||
+	    now - STATE_SYNC(delta).resync_last < DELTA_RESYNC_INT)
+		return;
+
+	STATE_SYNC(delta).resync_last = now;
+	STATE_SYNC(delta).resync++;
+	STATE_SYNC(sync)->local(-1, REQUEST_DUMP, NULL);
+}
+
+static void sync_latency_apply(struct nethdr *net);
+
+/* Returns -1 if the message has not been applied, so the relayed copy has to
+ * be withdrawn. */
+static int do_state_msg(struct nethdr *net, size_t remain)
+{
+	struct nf_conntrack *ct = NULL;
+	struct nf_expect *exp;
+
+	switch(net->type) {
+	case NET_T_STATE_CT_NEW:
+		ct = msg2ct_get(net, remain);
+		if (ct == NULL)
+			return -1;
+		STATE_SYNC(external)->ct.new(ct);
+		break;
+	case NET_T_STATE_CT_UPD:
+		ct = msg2ct_get(net, remain);
+		if (ct == NULL)
+			return -1;
+		STATE_SYNC(external)->ct.upd(ct);
+		break;
+	case NET_T_STATE_CT_DELTA:
+		ct = msg2ct_get(net, remain);
+		if (ct == NULL)
+			return -1;
+		STATE_SYNC(delta).recv++;
+		if (!STATE_SYNC(external)->ct.merge(ct))
+			delta_unknown();
+		break;
+	case NET_T_STATE_CT_DEL:
+		ct = msg2ct_get(net, remain);
+		if (ct == NULL)
+			return -1;
+		if (!STATE_SYNC(external)->ct.del(ct))
+			return -1;
+		break;
+	case NET_T_STATE_EXP_NEW:
+		exp = msg2exp_get(net, remain);
+		if (exp == NULL)
+			return -1;
+		STATE_SYNC(external)->exp.new(exp);
+		break;
+	case NET_T_STATE_EXP_UPD:
+		exp = msg2exp_get(net, remain);
+		if (exp == NULL)
+			return -1;
+		STATE_SYNC(external)->exp.upd(exp);
+		break;
+	case NET_T_STATE_EXP_DEL:
+		exp = msg2exp_get(net, remain);
+		if (exp == NULL)
+			return -1;
+		STATE_SYNC(external)->exp.del(exp);
+		break;
+	default:
+		STATE_SYNC(error).msg_rcv_malformed++;
+		STATE_SYNC(error).msg_rcv_bad_type++;
+		return -1;
+	}
+	if (ct != NULL && CONFIG(lowlat).latency_target)
+		sync_latency_apply(net);
+
+	return 0;
+}
+
+/* the batch has been sequence tracked as a whole, walk its records */
+static void do_batch_msg(struct nethdr *net)
+{
+	struct nethdr *rec = (struct nethdr *)NETHDR_DATA(net);
+	int len = net->len - NETHDR_SIZ;
+
+	STATE_SYNC(batch).recv++;
+
+	while (len >= NETHDR_SIZ) {
+		int reclen = ntohs(rec->len);
+
+		if (reclen < NETHDR_SIZ || reclen > len) {
+			STATE_SYNC(error).msg_rcv_malformed++;
+			STATE_SYNC(error).msg_rcv_bad_size++;
+			return;
+		}
+		if (rec->version != CONNTRACKD_PROTOCOL_VERSION &&
+		    rec->version != CONNTRACKD_PROTOCOL_VERSION_COMPACT) {
+			STATE_SYNC(error).msg_rcv_malformed++;
+			STATE_SYNC(error).msg_rcv_bad_version++;
+			return;
+		}
+		/* no nested batches */
+		if (rec->type >= NET_T_STATE_BATCH) {
+			STATE_SYNC(error).msg_rcv_malformed++;
+			STATE_SYNC(error).msg_rcv_bad_type++;
+			return;
+		}
+		HDR_NETWORK2HOST(rec);
+		do_state_msg(rec, len);
+		STATE_SYNC(batch).records_recv++;
+
+		len -= reclen;
+		rec = (struct nethdr *)((char *)rec + reclen);
+	}
+}
+
+/* Multi-peer mode: tell the node that sent the message, see NodeId. Returns
+ * -1 if it does not say, 1 if it is our own message looped back, eg. with
+ * multicast. */
+static int sync_peer_recv(const struct nethdr *net)
+{
+	const struct nethdr_node *node;
+	struct sync_peer *peer;
+	int from, to = 0;
+
+	if (net->type == NET_T_CTL) {
+		if (net->len < NETHDR_SIZ + NETHDR_NODE_SIZ)
+			return -1;
+
+		node = (const struct nethdr_node *)
+			((const char *)net + net->len - NETHDR_NODE_SIZ);
+		from = node->from;
+		to = node->to;
+	} else
+		from = net->flags & NET_F_NODE;
+
+	if (from == 0 || from >= NET_NODE_MAX)
+		return -1;
+	if (from == CONFIG(sync).node_id)
+		return 1;
+
+	peer = &STATE_SYNC(peers).peer[from];
+	if (!(STATE_SYNC(peers).live & (1U << from))) {
+		STATE_SYNC(peers).live |= 1U << from;
+		dlog(LOG_NOTICE, "node %d joins", from);
+	}
+	peer->seen = time(NULL);
+	peer->msgs++;
+
+	STATE_SYNC(peers).current = from;
+	STATE_SYNC(peers).to = to;
+	return 0;
+}
+
+/* a peer that does not decode compact messages keeps them off for this
+ * long, control messages are sent every second. */
+#define COMPACT_HOLD	3
+
+/* We send compact messages only if the peers behind all the links that are
+ * up can decode them. Several peers may share a link, eg. with multicast,
+ * so one that cannot has to be quiet for a while before they are sent. */
+static int sync_channel_compact(void)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	time_t now = time(NULL);
+	struct channel *c;
+	int i;
+
+	for (i = 0; i < m->channel_num; i++) {
+		c = m->channel[i];
+		if (m->down & (1U << i))
+			continue;
+
+		if (c->compact_seen == 0 || now - c->tlv_seen < COMPACT_HOLD)
+			return 0;
+	}
+	return 1;
+}
+
+/* we send compact messages only if all the nodes can decode them */
+static int sync_peer_compact(void)
+{
+	int i;
+
+	for (i = 1; i < NET_NODE_MAX; i++) {
+		if (STATE_SYNC(peers).live & (1U << i) &&
+		    !STATE_SYNC(peers).peer[i].compact)
+			return 0;
+	}
+	return 1;
+}
+
+/* Returns the nodes that we have not heard of for secs seconds, they are
+ * not live anymore. */
+uint32_t sync_peer_expire(int secs)
+{
+	time_t now = time(NULL);
+	uint32_t gone = 0;
+	int i;
+
+	for (i = 1; i < NET_NODE_MAX; i++) {
+		if (!(STATE_SYNC(peers).live & (1U << i)) ||
+		    now - STATE_SYNC(peers).peer[i].seen < secs)
+			continue;
+
+		gone |= 1U << i;
+		dlog(LOG_NOTICE, "node %d is gone", i);
+	}
+	STATE_SYNC(peers).live &= ~gone;
+
+	if (gone && CONFIG(sync).compact_encoding == CTD_COMPACT_ON)
+		STATE_SYNC(compact) = sync_peer_compact();
+
+	return gone;
+}
+
 static void
 do_channel_handler_step(struct channel *c, struct nethdr *net, size_t remain)
 {
-	struct nf_conntrack *ct = NULL;
-	struct nf_expect *exp = NULL;
 	uint16_t len;
 
-	if (net->version != CONNTRACKD_PROTOCOL_VERSION) {
+	if (net->version != CONNTRACKD_PROTOCOL_VERSION &&
+	    net->version != CONNTRACKD_PROTOCOL_VERSION_COMPACT) {
 		STATE_SYNC(error).msg_rcv_malformed++;
 		STATE_SYNC(error).msg_rcv_bad_version++;
 		net->len = ntohs(net->len);
@@ -121,9 +347,43 @@ do_channel_handler_step(struct channel *c, struct nethdr *net, size_t remain)
 	}
 
 	HDR_NETWORK2HOST(net);
+
+	if (CONFIG(sync).node_id) {
+		switch (sync_peer_recv(net)) {
+		case -1:
+			STATE_SYNC(error).msg_rcv_malformed++;
+			STATE_SYNC(error).msg_rcv_bad_header++;
+			return;
+		case 1:
+			return;
+		}
+	}
+
+	/* the peer announces compact decoding in every control message,
+	 * so we fall back to TLVs as soon as it gets downgraded. */
+	if (net->type == NET_T_CTL &&
+	    CONFIG(sync).compact_encoding == CTD_COMPACT_ON) {
+		if (CONFIG(sync).node_id) {
+			STATE_SYNC(peers).peer[STATE_SYNC(peers).current].
+				compact = !!(net->flags & NET_F_COMPACT);
+			STATE_SYNC(compact) = sync_peer_compact();
+		} else {
+			if (net->flags & NET_F_COMPACT)
+				c->compact_seen = time(NULL);
+			else
+				c->tlv_seen = time(NULL);
+			STATE_SYNC(compact) = sync_channel_compact();
+		}
+	}
+
+	if (net->type == NET_T_CTL)
+		nethdr_track_shared(!!(net->flags & NET_F_SEQ));
 	
 	multichannel_change_current_channel(STATE_SYNC(channel), c);
-	
+
+	if (nethdr_track_dup(c, net->seq))
+		return;
+
 	switch (STATE_SYNC(sync)->recv(net)) {
 	case MSG_CTL:
 		return;
@@ -144,64 +404,18 @@ do_channel_handler_step(struct channel *c, struct nethdr *net, size_t remain)
 	}
 
 	switch(net->type) {
-	case NET_T_STATE_CT_NEW:
-		ct = msg2ct_alloc(net, remain);
-		if (ct == NULL)
-			goto reverse_relay;
-		STATE_SYNC(external)->ct.new(ct);
+	case NET_T_STATE_BATCH:
+		do_batch_msg(net);
 		break;
-	case NET_T_STATE_CT_UPD:
-		ct = msg2ct_alloc(net, remain);
-		if (ct == NULL)
-			goto reverse_relay;
-		STATE_SYNC(external)->ct.upd(ct);
-		break;
-	case NET_T_STATE_CT_DEL:
-		ct = msg2ct_alloc(net, remain);
-		if (ct == NULL)
-			goto reverse_relay;
-		if(!STATE_SYNC(external)->ct.del(ct)){
+	default:
+		if (do_state_msg(net, remain) == -1) {
 			reverse_relay(c, net->len);
-			goto end;
+			return;
 		}
 		break;
-	case NET_T_STATE_EXP_NEW:
-		exp = msg2exp_alloc(net, remain);
-		if (exp == NULL)
-			goto reverse_relay;
-		STATE_SYNC(external)->exp.new(exp);
-		break;
-	case NET_T_STATE_EXP_UPD:
-		exp = msg2exp_alloc(net, remain);
-		if (exp == NULL)
-			goto reverse_relay;
-		STATE_SYNC(external)->exp.upd(exp);
-		break;
-	case NET_T_STATE_EXP_DEL:
-		exp = msg2exp_alloc(net, remain);
-		if (exp == NULL)
-			goto reverse_relay;
-		STATE_SYNC(external)->exp.del(exp);
-		break;
-	default:
-		STATE_SYNC(error).msg_rcv_malformed++;
-		STATE_SYNC(error).msg_rcv_bad_type++;
-		goto end;
 	}
-	
+
 	relay_seqfix(c,net->len);
-	
-end:
-	if (ct != NULL)
-		nfct_destroy(ct);
-	if (exp != NULL)
-		nfexp_destroy(exp);
-	
-	
-	return;
-	
-reverse_relay:
-	reverse_relay(c, net->len);
 }
 
 static char __net[65536];		/* XXX: maximum MTU for IPv4 */
@@ -218,23 +432,9 @@ static int channel_stream(struct channel *m, const char *ptr, ssize_t remain)
 	return 0;
 }
 
-/* handler for messages received */
-static int channel_handler_routine(struct channel *m)
+/* parse the messages that we have received */
+static void channel_handler_parse(struct channel *m, char *ptr, ssize_t remain)
 {
-	ssize_t numbytes;
-	ssize_t remain, pending = cur - __net;
-	char *ptr = __net;
-
-	numbytes = channel_recv(m, cur, sizeof(__net) - pending);
-	if (numbytes <= 0)
-		return -1;
-
-	remain = numbytes;
-	if (pending) {
-		remain += pending;
-		cur = __net;
-	}
-
 	while (remain > 0) {
 		struct nethdr *net = (struct nethdr *) ptr;
 		int len;
@@ -288,14 +488,103 @@ static int channel_handler_routine(struct channel *m)
 		ptr += net->len;
 		remain -= net->len;
 	}
+}
+
+/* handler for messages received */
+static int channel_handler_routine(struct channel *m)
+{
+	ssize_t numbytes;
+	ssize_t remain, pending = cur - __net;
+
+	numbytes = channel_recv(m, cur, sizeof(__net) - pending);
+	if (numbytes <= 0)
+		return -1;
+
+	remain = numbytes;
+	if (pending) {
+		remain += pending;
+		cur = __net;
+	}
+	channel_handler_parse(m, __net, remain);
+	return 0;
+}
+
+/* datagrams that we pull from the socket with one single syscall */
+#define CHANNEL_RECV_BATCH	32
+
+static struct {
+	char		*data;
+	struct iovec	iov[CHANNEL_RECV_BATCH];
+	int		len[CHANNEL_RECV_BATCH];
+	int		seg[CHANNEL_RECV_BATCH];
+} rx_batch;
+
+static int channel_recv_batch_init(struct multichannel *m)
+{
+	int i, size = 0;
+
+	/* one slot per datagram, large enough for the biggest one */
+	for (i=0; i<m->channel_num; i++) {
+		if (channel_recv_size(m->channel[i]) > size)
+			size = channel_recv_size(m->channel[i]);
+	}
+	if (size <= 0 || size > (int)sizeof(__net))
+		size = sizeof(__net);
+
+	rx_batch.data = malloc(size * CHANNEL_RECV_BATCH);
+	if (rx_batch.data == NULL)
+		return -1;
+
+	for (i=0; i<CHANNEL_RECV_BATCH; i++) {
+		rx_batch.iov[i].iov_base = rx_batch.data + i * size;
+		rx_batch.iov[i].iov_len = size;
+	}
 	return 0;
 }
 
+/* handler for datagrams received, returns how many of them we got */
+static int channel_handler_batch(struct channel *m, int max)
+{
+	int i, ret, off, len, seg;
+	char *ptr;
+
+	if (max > CHANNEL_RECV_BATCH)
+		max = CHANNEL_RECV_BATCH;
+
+	ret = channel_recvv(m, rx_batch.iov, rx_batch.len, rx_batch.seg, max);
+	if (ret <= 0)
+		return -1;
+
+	for (i=0; i<ret; i++) {
+		ptr = rx_batch.iov[i].iov_base;
+		len = rx_batch.len[i];
+		seg = rx_batch.seg[i] > 0 ? rx_batch.seg[i] : len;
+
+		/* coalesced datagrams are parsed one by one, so a malformed
+		 * one does not take the ones behind it down. */
+		for (off=0; off<len; off+=seg) {
+			channel_handler_parse(m, ptr + off,
+				off + seg > len ? len - off : seg);
+		}
+	}
+	return ret;
+}
+
 /* handler for messages received */
 static void channel_handler(void *data)
 {
 	struct channel *c = data;
-	int k;
+	int k, ret;
+
+	if (channel_type(c) == CHANNEL_T_DATAGRAM) {
+		for (k=0; k<CONFIG(event_iterations_limit); k+=ret) {
+			ret = channel_handler_batch(c,
+				CONFIG(event_iterations_limit) - k);
+			if (ret == -1)
+				break;
+		}
+		return;
+	}
 
 	for (k=0; k<CONFIG(event_iterations_limit); k++) {
 		if (channel_handler_routine(c) == -1) {
@@ -304,6 +593,45 @@ static void channel_handler(void *data)
 	}
 }
 
+/* channels that receive through several sockets, each one of them gets
+ * its own callback that tells the channel which one is ready. */
+static struct channel_rx {
+	struct channel	*c;
+	int		i;
+} rx_socks[MULTICHANNEL_MAX * CHANNEL_RX_MAX];
+static int rx_socks_num;
+
+static void channel_rx_handler(void *data)
+{
+	struct channel_rx *rx = data;
+
+	channel_rx_set(rx->c, rx->i);
+	channel_handler(rx->c);
+}
+
+static int channel_rx_register(struct channel *c)
+{
+	struct channel_rx *rx;
+	int i, fd;
+
+	if (channel_rx_fd(c, 1) == -1)
+		return register_fd(channel_get_fd(c), channel_handler, c,
+				   STATE(fds));
+
+	for (i=0; i<CHANNEL_RX_MAX && (fd = channel_rx_fd(c, i)) != -1; i++) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		rx = &rx_socks[rx_socks_num++];
+		rx->c = c;
+		rx->i = i;
+		if (register_fd(fd, channel_rx_handler, rx, STATE(fds)) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void tx_queue_wakeup(void *data);
+
 /* select a new interface candidate in a round robin basis */
 static void interface_candidate(void)
 {
@@ -318,6 +646,8 @@ static void interface_candidate(void)
 		nlif_get_ifflags(STATE_SYNC(interface), idx, &flags);
 		if (flags & (IFF_RUNNING | IFF_UP)) {
 			multichannel_set_current_channel(STATE_SYNC(channel), i);
+			/* the old link may be stuck with data to deliver */
+			tx_queue_wakeup(NULL);
 			dlog(LOG_NOTICE, "device `%s' becomes "
 					 "dedicated link", 
 					 if_indextoname(idx, buf));
@@ -327,12 +657,44 @@ static void interface_candidate(void)
 	dlog(LOG_ERR, "no dedicated links available!");
 }
 
+/* in striping mode, spread the messages among the links that are up */
+static void interface_striping(void)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	unsigned int flags;
+	char buf[IFNAMSIZ];
+	int i, idx, up;
+
+	for (i=0; i<m->channel_num; i++) {
+		idx = multichannel_get_ifindex(m, i);
+		nlif_get_ifflags(STATE_SYNC(interface), idx, &flags);
+		up = (flags & IFF_RUNNING) && (flags & IFF_UP);
+		if (!multichannel_set_channel_up(m, i, up))
+			continue;
+
+		dlog(LOG_NOTICE, "device `%s' %s striping",
+		     if_indextoname(idx, buf), up ? "joins" : "leaves");
+
+		/* what went through it has to go through the other ones */
+		if (!up && STATE_SYNC(sync)->link_down)
+			STATE_SYNC(sync)->link_down(m->channel[i]);
+	}
+	if (m->alive_num == 0)
+		dlog(LOG_ERR, "no dedicated links available!");
+
+	tx_queue_wakeup(NULL);
+}
+
 static void interface_handler(void *data)
 {
 	int idx = multichannel_get_current_ifindex(STATE_SYNC(channel));
 	unsigned int flags;
 
 	nlif_catch(STATE_SYNC(interface));
+	if (STATE_SYNC(channel)->striping) {
+		interface_striping();
+		return;
+	}
 	nlif_get_ifflags(STATE_SYNC(interface), idx, &flags);
 	if (!(flags & IFF_RUNNING) || !(flags & IFF_UP))
 		interface_candidate();
@@ -393,12 +755,284 @@ static void channel_accept_cb(void *data)
 	register_fd(fd, channel_handler, c, STATE(fds));
 }
 
+static uint32_t timespec_diff_usecs(const struct timespec *from,
+				    const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000 +
+	       (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* account the time since the oldest unflushed event was received */
+void sync_latency_flush(void)
+{
+	struct timespec now;
+	uint32_t usecs;
+
+	if (STATE_SYNC(latency).pending.tv_sec == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = timespec_diff_usecs(&STATE_SYNC(latency).pending, &now);
+
+	STATE_SYNC(latency).samples++;
+	STATE_SYNC(latency).total += usecs;
+	if (usecs > STATE_SYNC(latency).max)
+		STATE_SYNC(latency).max = usecs;
+	if (CONFIG(lowlat).latency_target &&
+	    usecs > (uint32_t)CONFIG(lowlat).latency_target)
+		STATE_SYNC(latency).over_target++;
+
+	STATE_SYNC(latency).pending.tv_sec = 0;
+}
+
+/* account the time since the peer received the event of this message, the
+ * clocks of the nodes have to be in sync for this to make sense. */
+static void sync_latency_apply(struct nethdr *net)
+{
+	struct timespec stamp, now;
+	int64_t usecs;
+
+	if (msg2stamp(net, &stamp) == -1)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	usecs = (int64_t)(now.tv_sec - stamp.tv_sec) * 1000000 +
+		(now.tv_nsec - stamp.tv_nsec) / 1000;
+	if (usecs < 0)
+		return;
+
+	STATE_SYNC(apply).samples++;
+	STATE_SYNC(apply).total += usecs;
+	if (usecs > STATE_SYNC(apply).max)
+		STATE_SYNC(apply).max = usecs;
+	if (usecs > CONFIG(lowlat).latency_target)
+		STATE_SYNC(apply).over_target++;
+}
+
+/* upper bounds of the histogram buckets, the last one takes the rest */
+static const uint32_t flush_size_max[SYNC_FLUSH_HIST - 1] = {
+	256, 512, 1024, 1500, 4096, 9000, 16384,
+};
+static const uint32_t flush_hold_max[SYNC_FLUSH_HIST - 1] = {
+	10, 50, 100, 250, 500, 1000, 5000,
+};
+
+static int flush_hist(const uint32_t *max, uint32_t value)
+{
+	int i;
+
+	for (i = 0; i < SYNC_FLUSH_HIST - 1; i++) {
+		if (value <= max[i])
+			break;
+	}
+	return i;
+}
+
+static int flush_timerfd = -1;
+static int flush_timer_armed;
+
+static void flush_timer_set(uint32_t usecs)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec		= usecs / 1000000,
+			.tv_nsec	= (usecs % 1000000) * 1000,
+		},
+	};
+
+	/* a zero timeout disarms the timer */
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1000;
+
+	timerfd_settime(flush_timerfd, 0, &its, NULL);
+	flush_timer_armed = 1;
+}
+
+/* send everything that is held in the buffers */
+static void sync_flush_all(int held)
+{
+	struct timespec now;
+	uint32_t usecs = 0;
+
+	multichannel_send_flush(STATE_SYNC(channel));
+	sync_latency_flush();
+
+	if (flush_timer_armed) {
+		struct itimerspec its = {};
+
+		timerfd_settime(flush_timerfd, 0, &its, NULL);
+		flush_timer_armed = 0;
+	}
+
+	/* the messages were not held if they are flushed right away */
+	if (held != 0 && STATE_SYNC(flush).since.tv_sec != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usecs = timespec_diff_usecs(&STATE_SYNC(flush).since, &now);
+	}
+	STATE_SYNC(flush).since.tv_sec = 0;
+	if (held == 0)
+		return;
+
+	STATE_SYNC(flush).size[flush_hist(flush_size_max, held)]++;
+	STATE_SYNC(flush).hold[flush_hist(flush_hold_max, usecs)]++;
+}
+
+/* Unless FlushHoldTime is set, send everything that is held in the buffers.
+ * Otherwise, the datagram that is being filled is held until it reaches
+ * FlushMinFill or until its oldest message has waited for FlushHoldTime. */
+static void sync_flush(void)
+{
+	uint32_t hold_time = CONFIG(sync).flush_hold_time;
+	struct timespec now;
+	uint32_t usecs;
+	int held, fill;
+
+	held = multichannel_send_held(STATE_SYNC(channel), &fill);
+	if (hold_time == 0 || held == 0) {
+		sync_flush_all(held);
+		return;
+	}
+	if (fill >= CONFIG(sync).flush_min_fill) {
+		STATE_SYNC(flush).fill++;
+		sync_flush_all(held);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* the datagram that held the oldest message filled up and left, the
+	 * one that is being filled now is younger than that. */
+	if (STATE_SYNC(flush).since.tv_sec != 0 &&
+	    STATE_SYNC(flush).closed != STATE_SYNC(channel)->closed) {
+		STATE_SYNC(flush).since.tv_sec = 0;
+		flush_timer_armed = 0;
+	}
+	if (STATE_SYNC(flush).since.tv_sec == 0) {
+		STATE_SYNC(flush).since = now;
+		STATE_SYNC(flush).closed = STATE_SYNC(channel)->closed;
+	}
+
+	usecs = timespec_diff_usecs(&STATE_SYNC(flush).since, &now);
+	if (usecs >= hold_time) {
+		STATE_SYNC(flush).timer++;
+		sync_flush_all(held);
+		return;
+	}
+
+	/* the datagrams that are full do not have to wait */
+	multichannel_send_flush_full(STATE_SYNC(channel));
+	if (!flush_timer_armed)
+		flush_timer_set(hold_time - usecs);
+}
+
+static void flush_timer_cb(void *data)
+{
+	uint64_t expirations;
+
+	if (read(flush_timerfd, &expirations, sizeof(expirations)) == -1)
+		return;
+
+	flush_timer_armed = 0;
+	sync_flush();
+}
+
+static int flush_timer_init(void)
+{
+	if (CONFIG(sync).flush_hold_time == 0)
+		return 0;
+
+	flush_timerfd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (flush_timerfd == -1)
+		return -1;
+
+	return register_fd(flush_timerfd, flush_timer_cb, NULL, STATE(fds));
+}
+
+/* send a message that results from a kernel event, it has been built in
+ * place at multichannel_reserve() so there is no copy. */
+void sync_send_event(struct nethdr *net)
+{
+	/* let the peers measure the event to apply latency, expectation
+	 * messages have attributes of their own. */
+	if (STATE(event_real).tv_sec &&
+	    (net->type <= NET_T_STATE_CT_DEL ||
+	     net->type == NET_T_STATE_CT_DELTA))
+		nethdr_stamp(net, &STATE(event_real));
+
+	multichannel_commit(STATE_SYNC(channel), net);
+
+	/* remember when the oldest event in the buffers was received, events
+	 * that do not come from ctnetlink (eg. purge) are not accounted. */
+	if (STATE_SYNC(latency).pending.tv_sec == 0)
+		STATE_SYNC(latency).pending = STATE(event_ts);
+
+	/* low latency mode: do not wait for the buffer to fill up. */
+	if (CONFIG(lowlat).busy_poll) {
+		sync_flush_all(multichannel_send_held(STATE_SYNC(channel),
+						      NULL));
+	} else if (CONFIG(sync).flush_hold_time) {
+		sync_flush();
+	}
+}
+
+static int tx_queue_stopped;
+static struct alarm_block pace_alarm;
+
+static void tx_queue_stop(void)
+{
+	unregister_fd(queue_get_eventfd(STATE_SYNC(tx_queue)), STATE(fds));
+	tx_queue_stopped = 1;
+}
+
 static void tx_queue_cb(void *data)
 {
+	uint32_t usecs;
+
+	/* bulk transfers fill up many datagrams, send them in one go. */
+	multichannel_send_begin(STATE_SYNC(channel));
+	multichannel_pace_begin(STATE_SYNC(channel));
 	STATE_SYNC(sync)->xmit();
+	multichannel_pace_end(STATE_SYNC(channel));
 
 	/* flush pending messages */
-	multichannel_send_flush(STATE_SYNC(channel));
+	sync_flush();
+
+	/* the dedicated link cannot take more by now, leave the messages in
+	 * the queue until it has delivered what it has taken. */
+	if (multichannel_send_pending(STATE_SYNC(channel)) > 0 &&
+	    !tx_queue_stopped) {
+		tx_queue_stop();
+		return;
+	}
+
+	/* we are out of tokens, go on once the bucket has some again. */
+	usecs = multichannel_pace_wait(STATE_SYNC(channel));
+	if (usecs > 0 && queue_len(STATE_SYNC(tx_queue)) > 0 &&
+	    !tx_queue_stopped) {
+		tx_queue_stop();
+		STATE_SYNC(channel)->pace.stats.stalls++;
+		add_alarm(&pace_alarm, usecs / 1000000, usecs % 1000000);
+	}
+}
+
+static void tx_queue_wakeup(void *data)
+{
+	if (!tx_queue_stopped)
+		return;
+
+	/* either the link has drained or the bucket has tokens again,
+	 * tx_queue_cb() checks both anyway. */
+	del_alarm(&pace_alarm);
+
+	register_fd(queue_get_eventfd(STATE_SYNC(tx_queue)), tx_queue_cb,
+		    NULL, STATE(fds));
+	tx_queue_stopped = 0;
+}
+
+static void do_pace_alarm(struct alarm_block *a, void *data)
+{
+	tx_queue_wakeup(NULL);
 }
 
 static int init_sync(void)
@@ -412,6 +1046,16 @@ static int init_sync(void)
 	}
 	memset(state.sync, 0, sizeof(struct ct_sync_state));
 
+	if (CONFIG(sync).compact_encoding == CTD_COMPACT_FORCE)
+		STATE_SYNC(compact) = 1;
+
+	rx_ct = nfct_new();
+	rx_exp = nfexp_new();
+	if (rx_ct == NULL || rx_exp == NULL) {
+		dlog(LOG_ERR, "can't allocate memory for received messages");
+		return -1;
+	}
+
 	if (CONFIG(flags) & CTD_SYNC_FTFW)
 		STATE_SYNC(sync) = &sync_ftfw;
 	else if (CONFIG(flags) & CTD_SYNC_ALARM)
@@ -458,6 +1102,19 @@ static int init_sync(void)
 		dlog(LOG_ERR, "can't open channel socket");
 		return -1;
 	}
+	if (CONFIG(sync).batch_messages &&
+	    nethdr_batch_init(multichannel_payload_size(STATE_SYNC(channel)))
+	    == -1) {
+		dlog(LOG_ERR, "can't allocate memory for message batches");
+		return -1;
+	}
+	if (channel_recv_batch_init(STATE_SYNC(channel)) == -1) {
+		dlog(LOG_ERR, "can't allocate memory for receive buffers");
+		return -1;
+	}
+	multichannel_set_drain_cb(STATE_SYNC(channel), tx_queue_wakeup, NULL);
+	if (CONFIG(sync).striping)
+		multichannel_set_striping(STATE_SYNC(channel), 1);
 	for (i=0; i<STATE_SYNC(channel)->channel_num; i++) {
 		int fd = channel_get_fd(STATE_SYNC(channel)->channel[i]);
 		fcntl(fd, F_SETFL, O_NONBLOCK);
@@ -469,9 +1126,11 @@ static int init_sync(void)
 					STATE(fds));
 			break;
 		case CHANNEL_T_DATAGRAM:
-			register_fd(fd, channel_handler,
-					STATE_SYNC(channel)->channel[i],
-					STATE(fds));
+			if (channel_rx_register(STATE_SYNC(channel)->channel[i])
+			    == -1) {
+				dlog(LOG_ERR, "can't register receive sockets");
+				return -1;
+			}
 			break;
 		}
 	}
@@ -494,6 +1153,18 @@ static int init_sync(void)
 			tx_queue_cb, NULL, STATE(fds)) == -1)
 		return -1;
 
+	if (flush_timer_init() == -1) {
+		dlog(LOG_ERR, "cannot create flush timer: %s",
+		     strerror(errno));
+		return -1;
+	}
+
+	init_alarm(&pace_alarm, NULL, do_pace_alarm);
+	if (CONFIG(sync).pacing_rate)
+		multichannel_set_pace(STATE_SYNC(channel),
+				      (uint64_t)CONFIG(sync).pacing_rate *
+				      1000000 / 8);
+
 	STATE_SYNC(commit).h = nfct_open(CONFIG(netlink).subsys_id, 0);
 	if (STATE_SYNC(commit).h == NULL) {
 		dlog(LOG_ERR, "can't create handler to commit");
@@ -526,10 +1197,13 @@ static void kill_sync(void)
 	STATE_SYNC(external)->close();
 
 	multichannel_close(STATE_SYNC(channel));
+	free(rx_batch.data);
 
 	nlif_close(STATE_SYNC(interface));
 
 	queue_destroy(STATE_SYNC(tx_queue));
+	if (flush_timerfd != -1)
+		close(flush_timerfd);
 
 	channel_end();
 
@@ -539,6 +1213,10 @@ static void kill_sync(void)
 
 	if (STATE_SYNC(sync)->kill)
 		STATE_SYNC(sync)->kill();
+
+	nfct_destroy(rx_ct);
+	nfexp_destroy(rx_exp);
+	nethdr_batch_fini();
 }
 
 static void dump_stats_sync(int fd)
@@ -555,9 +1233,132 @@ static void dump_stats_sync(int fd)
 	send(fd, buf, size, 0);
 }
 
+static int flush_hist_snprintf(char *buf, size_t size, const char *name,
+			       const uint32_t *max, const uint64_t *hist)
+{
+	int i, len;
+
+	len = snprintf(buf, size, "\t%s:\n", name);
+	for (i = 0; i < SYNC_FLUSH_HIST; i++) {
+		len += snprintf(buf + len, size - len,
+				"\t\t%s %5u:\t\t%20llu\n",
+				i < SYNC_FLUSH_HIST - 1 ? "<=" : " >",
+				max[i < SYNC_FLUSH_HIST - 1 ? i : i - 1],
+				(unsigned long long)hist[i]);
+	}
+	return len;
+}
+
+static void dump_stats_flush(int fd)
+{
+	char buf[2048];
+	int size;
+
+	size = snprintf(buf, sizeof(buf),
+			"flush policy (hold time %u usecs, min fill %u%%):\n"
+			"\t\tOn min fill:\t\t%20llu\n"
+			"\t\tOn hold time:\t\t%20llu\n",
+			CONFIG(sync).flush_hold_time,
+			CONFIG(sync).flush_min_fill,
+			(unsigned long long)STATE_SYNC(flush).fill,
+			(unsigned long long)STATE_SYNC(flush).timer);
+	size += flush_hist_snprintf(buf + size, sizeof(buf) - size,
+				    "size (in bytes)", flush_size_max,
+				    STATE_SYNC(flush).size);
+	size += flush_hist_snprintf(buf + size, sizeof(buf) - size,
+				    "hold time (in usecs)", flush_hold_max,
+				    STATE_SYNC(flush).hold);
+	size += snprintf(buf + size, sizeof(buf) - size, "\n");
+
+	send(fd, buf, size, 0);
+}
+
+static void dump_stats_peers(int fd)
+{
+	struct multichannel *m = STATE_SYNC(channel);
+	struct sync_peer *peer;
+	struct timespec now;
+	char buf[1024];
+	uint32_t last_seq_sent;
+	int i, size;
+
+	if (!CONFIG(sync).node_id)
+		return;
+
+	/* there is no striping, so all the channels share the sequence */
+	last_seq_sent = m->channel[0]->last_seq_sent - 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	size = snprintf(buf, sizeof(buf), "peers of node %d:\n",
+			CONFIG(sync).node_id);
+	send(fd, buf, size, 0);
+
+	for (i = 1; i < NET_NODE_MAX; i++) {
+		peer = &STATE_SYNC(peers).peer[i];
+		if (peer->msgs == 0)
+			continue;
+
+		size = snprintf(buf, sizeof(buf),
+				"\tnode %d:\t\t\t%20s\n"
+				"\t\tMessages:\t\t%20llu\n"
+				"\t\tLost:\t\t\t%20llu\n",
+				i, STATE_SYNC(peers).live & (1U << i) ?
+				"LIVE" : "GONE",
+				(unsigned long long)peer->msgs,
+				(unsigned long long)peer->lost);
+		if (peer->acked_set) {
+			size += snprintf(buf + size, sizeof(buf) - size,
+				"\t\tLag (in messages):\t%20u\n"
+				"\t\tLast ack (msecs ago):\t%20llu\n",
+				last_seq_sent - peer->acked_seq,
+				(unsigned long long)
+				((now.tv_sec - peer->acked.tv_sec) * 1000LL +
+				 (now.tv_nsec - peer->acked.tv_nsec) / 1000000));
+		}
+		send(fd, buf, size, 0);
+	}
+	send(fd, "\n", 1, 0);
+}
+
+static void dump_stats_pace(int fd)
+{
+	struct multichannel_pace *p = &STATE_SYNC(channel)->pace;
+	uint64_t delay = 0;
+	char buf[1024];
+	int size;
+
+	if (p->rate == 0)
+		return;
+
+	/* estimated from the average message size, the queued messages
+	 * still have to be built. */
+	if (p->stats.messages)
+		delay = (uint64_t)queue_len(STATE_SYNC(tx_queue)) *
+			(p->stats.bytes / p->stats.messages) * 1000000 /
+			p->rate;
+
+	size = snprintf(buf, sizeof(buf),
+			"pacing (max rate %u Mbit/s):\n"
+			"\t\tRate (in kbit/s):\t%20llu\n"
+			"\t\tQueueing delay (usecs):\t%20llu\n"
+			"\t\tQueued messages:\t%20u\n"
+			"\t\tOut of tokens:\t\t%20llu\n"
+			"\t\tIncrease:\t\t%20llu\n"
+			"\t\tDecrease:\t\t%20llu\n\n",
+			CONFIG(sync).pacing_rate,
+			(unsigned long long)(p->rate * 8 / 1000),
+			(unsigned long long)delay,
+			queue_len(STATE_SYNC(tx_queue)),
+			(unsigned long long)p->stats.stalls,
+			(unsigned long long)p->stats.increase,
+			(unsigned long long)p->stats.decrease);
+
+	send(fd, buf, size, 0);
+}
+
 static void dump_stats_sync_extended(int fd)
 {
-	char buf[512];
+	char buf[4096];
 	int size;
 
 	size = snprintf(buf, sizeof(buf),
@@ -571,11 +1372,42 @@ static void dump_stats_sync_extended(int fd)
 			"\t\tTruncated message:\t%20u\n"
 			"\t\tBad message size:\t%20u\n"
 			"\tsend:\n"
-			"\t\tMalformed messages:\t%20u\n\n"
+			"\t\tMalformed messages:\t%20u\n"
+			"\t\tEncoding:\t\t%20s\n\n"
 			"sequence tracking statistics:\n"
 			"\trecv:\n"
 			"\t\tPackets lost:\t\t%20llu\n"
-			"\t\tPackets before:\t\t%20llu\n\n",
+			"\t\tPackets before:\t\t%20llu\n\n"
+			"event to wire latency (in usecs):\n"
+			"\t\tSamples:\t\t%20llu\n"
+			"\t\tAverage:\t\t%20llu\n"
+			"\t\tMaximum:\t\t%20u\n"
+			"\t\tOver target (%u):\t%20u\n\n"
+			"event to apply latency (in usecs):\n"
+			"\t\tSamples:\t\t%20llu\n"
+			"\t\tAverage:\t\t%20llu\n"
+			"\t\tMaximum:\t\t%20u\n"
+			"\t\tOver target (%u):\t%20u\n\n"
+			"delta updates:\n"
+			"\tsend:\n"
+			"\t\tDelta:\t\t\t%20llu\n"
+			"\t\tFull:\t\t\t%20llu\n"
+			"\t\tRefreshed in full:\t%20llu\n"
+			"\trecv:\n"
+			"\t\tDelta:\t\t\t%20llu\n"
+			"\t\tUnknown entry:\t\t%20u\n"
+			"\t\tResyncs requested:\t%20u\n\n"
+			"batch messages:\n"
+			"\tsend:\n"
+			"\t\tMessages:\t\t%20llu\n"
+			"\t\tRecords:\t\t%20llu\n"
+			"\trecv:\n"
+			"\t\tMessages:\t\t%20llu\n"
+			"\t\tRecords:\t\t%20llu\n\n"
+			"redundant links:\n"
+			"\trecv:\n"
+			"\t\tDuplicates dropped:\t%20llu\n"
+			"\t\tOut of window:\t\t%20llu\n\n",
 			(unsigned long long)STATE_SYNC(error).msg_rcv_malformed,
 			STATE_SYNC(error).msg_rcv_bad_version,
 			STATE_SYNC(error).msg_rcv_bad_header,
@@ -584,10 +1416,39 @@ static void dump_stats_sync_extended(int fd)
 			STATE_SYNC(error).msg_rcv_truncated,
 			STATE_SYNC(error).msg_rcv_bad_size,
 			STATE_SYNC(error).msg_snd_malformed,
+			STATE_SYNC(compact) ? "compact" : "tlv",
 			(unsigned long long)STATE_SYNC(error).msg_rcv_lost,
-			(unsigned long long)STATE_SYNC(error).msg_rcv_before);
+			(unsigned long long)STATE_SYNC(error).msg_rcv_before,
+			(unsigned long long)STATE_SYNC(latency).samples,
+			(unsigned long long)(STATE_SYNC(latency).samples ?
+				STATE_SYNC(latency).total /
+				STATE_SYNC(latency).samples : 0),
+			STATE_SYNC(latency).max,
+			CONFIG(lowlat).latency_target,
+			STATE_SYNC(latency).over_target,
+			(unsigned long long)STATE_SYNC(apply).samples,
+			(unsigned long long)(STATE_SYNC(apply).samples ?
+				STATE_SYNC(apply).total /
+				STATE_SYNC(apply).samples : 0),
+			STATE_SYNC(apply).max,
+			CONFIG(lowlat).latency_target,
+			STATE_SYNC(apply).over_target,
+			(unsigned long long)STATE_SYNC(delta).sent,
+			(unsigned long long)STATE_SYNC(delta).full,
+			(unsigned long long)STATE_SYNC(delta).refresh,
+			(unsigned long long)STATE_SYNC(delta).recv,
+			STATE_SYNC(delta).recv_unknown,
+			STATE_SYNC(delta).resync,
+			(unsigned long long)STATE_SYNC(batch).sent,
+			(unsigned long long)STATE_SYNC(batch).records_sent,
+			(unsigned long long)STATE_SYNC(batch).recv,
+			(unsigned long long)STATE_SYNC(batch).records_recv,
+			(unsigned long long)STATE_SYNC(dedup).dropped,
+			(unsigned long long)STATE_SYNC(dedup).old);
 
 	send(fd, buf, size, 0);
+	dump_stats_flush(fd);
+	dump_stats_pace(fd);
 }
 
 static int local_commit(int fd)
@@ -695,6 +1556,9 @@ static int local_handler_sync(int fd, int type, void *data)
 		dump_stats_sync_extended(fd);
 		multichannel_stats(STATE_SYNC(channel), fd);
 		break;
+	case STATS_PEERS:
+		dump_stats_peers(fd);
+		break;
 	case STATS_CACHE:
 		STATE(mode)->internal->ct.stats_ext(fd);
 		STATE_SYNC(external)->ct.stats_ext(fd);
@@ -72,7 +72,7 @@ static void tx_queue_add_ctlmsg(uint32_t flags, uint32_t from, uint32_t to)
 	ack->from	= from;
 	ack->to		= to;
 
-	if (queue_add(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
+	if (queue_add_front(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
 		queue_object_free(qobj);
 }
 
@@ -213,9 +213,16 @@ static int notrack_recv(const struct nethdr *net)
 
 static int tx_queue_xmit(struct queue_node *n, const void *data2)
 {
+	/* out of tokens, the objects wait in the queue. Control messages are
+	 * at its head, see queue_add_front(), so they have been sent. */
+	if (n->type == Q_ELEM_OBJ && multichannel_pace_wait(STATE_SYNC(channel)))
+		return 1;
+
 	switch (n->type) {
 	case Q_ELEM_CTL: {
 		struct nethdr *net = queue_node_data(n);
+
+		nethdr_batch_flush();
 		if (IS_RESYNC(net))
 			nethdr_set_ack(net);
 		else
@@ -233,9 +240,15 @@ static int tx_queue_xmit(struct queue_node *n, const void *data2)
 
 		cn = (struct cache_notrack *)n;
 		type = object_status_to_network_type(cn->obj);
-		net = cn->obj->cache->ops->build_msg(cn->obj, type);
-
-		multichannel_send(STATE_SYNC(channel), net);
+		nethdr_stripe(cn->obj);
+		if (CONFIG(sync).batch_messages) {
+			net = cn->obj->cache->ops->build_rec(cn->obj, type,
+						nethdr_batch_reserve());
+			nethdr_batch_commit(net);
+		} else {
+			net = cn->obj->cache->ops->build_msg(cn->obj, type);
+			multichannel_send(STATE_SYNC(channel), net);
+		}
 		queue_del(n);
 		cache_object_put(cn->obj);
 		break;
@@ -247,6 +260,7 @@ static int tx_queue_xmit(struct queue_node *n, const void *data2)
 static void notrack_xmit(void)
 {
 	queue_iterate(STATE_SYNC(tx_queue), NULL, tx_queue_xmit);
+	nethdr_batch_flush();
 	add_alarm(&alive_alarm, ALIVE_INT, 0);
 }
 
@@ -270,7 +284,7 @@ static void tx_queue_add_ctlmsg2(uint32_t flags)
 	ctl->type	= NET_T_CTL;
 	ctl->flags	= flags;
 
-	if (queue_add(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
+	if (queue_add_front(STATE_SYNC(tx_queue), &qobj->qnode) < 0)
 		queue_object_free(qobj);
 }
 
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/uio.h>
 
 #include "conntrackd.h"
 #include "fds.h"
@@ -205,6 +206,9 @@ tcp_client_init(struct tcp_sock *m, struct tcp_conf *c)
 static struct alarm_block tcp_connect_alarm;
 static void tcp_connect_alarm_cb(struct alarm_block *a, void *data) {}
 
+/* the send queue can hold at least one buffer of the largest size */
+#define TCP_SNDQ_MIN	65536
+
 struct tcp_sock *tcp_client_create(struct tcp_conf *c)
 {
 	struct tcp_sock *m;
@@ -220,14 +224,27 @@ struct tcp_sock *tcp_client_create(struct tcp_conf *c)
 		return NULL;
 	}
 
+	/* as large as the socket buffer, that is what we can send in one go */
+	m->sndq.size = c->sndbuf > TCP_SNDQ_MIN ? c->sndbuf : TCP_SNDQ_MIN;
+	m->sndq.data = malloc(m->sndq.size);
+	if (m->sndq.data == NULL) {
+		close(m->fd);
+		free(m);
+		return NULL;
+	}
+
 	init_alarm(&tcp_connect_alarm, NULL, tcp_connect_alarm_cb);
 
 	return m;
 }
 
+static void tcp_sndq_wait(struct tcp_sock *m, int on);
+
 void tcp_client_destroy(struct tcp_sock *m)
 {
+	tcp_sndq_wait(m, 0);
 	close(m->fd);
+	free(m->sndq.data);
 	free(m);
 }
 
@@ -268,59 +285,204 @@ int tcp_accept(struct tcp_sock *m)
 
 #define TCP_CONNECT_TIMEOUT	1
 
-ssize_t tcp_send(struct tcp_sock *m, const void *data, int size)
+/* returns 0 if we are connected, otherwise -1. */
+static int tcp_client_connect(struct tcp_sock *m)
 {
-	ssize_t ret = 0;
+	if (m->state == TCP_CLIENT_CONNECTED)
+		return 0;
 
-	switch(m->state) {
-	case TCP_CLIENT_DISCONNECTED:
-		/* We rate-limit the amount of connect() calls. */
-		if (alarm_pending(&tcp_connect_alarm)) {
-			ret = -1;
-			break;
-		}
-		add_alarm(&tcp_connect_alarm, TCP_CONNECT_TIMEOUT, 0);
-		ret = connect(m->fd, (struct sockaddr *)&m->addr,
-			      m->sockaddr_len);
-		if (ret == -1) {
-			if (errno == EINPROGRESS || errno == EALREADY) {
-				/* connection in progress or already trying. */
-				m->state = TCP_CLIENT_DISCONNECTED;
-			} else if (errno == ECONNREFUSED) {
-				/* connection refused. */
-				m->state = TCP_CLIENT_DISCONNECTED;
-				m->stats.error++;
-			} else {
-				/* unexpected error, give up. */
-				m->state = TCP_CLIENT_DISCONNECTED;
-				m->stats.error++;
-			}
-			break;
-		} else {
-			/* we got connected :) */
-			m->state = TCP_CLIENT_CONNECTED;
+	/* We rate-limit the amount of connect() calls. */
+	if (alarm_pending(&tcp_connect_alarm))
+		return -1;
+
+	add_alarm(&tcp_connect_alarm, TCP_CONNECT_TIMEOUT, 0);
+	if (connect(m->fd, (struct sockaddr *)&m->addr,
+		    m->sockaddr_len) == -1) {
+		if (errno == EINPROGRESS || errno == EALREADY) {
+			/* connection in progress or already trying. */
+			return -1;
+		} else if (errno != EISCONN) {
+			/* connection refused or unexpected error. */
+			m->stats.error++;
+			return -1;
 		}
-	case TCP_CLIENT_CONNECTED:
-		ret = sendto(m->fd, data, size, 0,
-			     (struct sockaddr *) &m->addr, m->sockaddr_len);
+		/* the connection in progress has been established. */
+	}
+	/* we got connected :) */
+	m->state = TCP_CLIENT_CONNECTED;
+	return 0;
+}
+
+/* The connection is broken, start over again with a new socket. Whatever
+ * is left in the send queue is lost: the peer would take the remaining
+ * bytes of a half-sent message as the beginning of a new one. */
+static void tcp_client_reset(struct tcp_sock *m)
+{
+	tcp_sndq_wait(m, 0);
+	m->sndq.head = m->sndq.len = 0;
+
+	close(m->fd);
+	tcp_client_init(m, m->conf);
+	m->state = TCP_CLIENT_DISCONNECTED;
+	m->stats.error++;
+
+	/* nothing pending anymore, let the sender go on. */
+	if (m->drain_cb)
+		m->drain_cb(m->drain_data);
+}
+
+static void tcp_sndq_push(struct tcp_sndq *q, const char *data, size_t len)
+{
+	size_t tail = (q->head + q->len) % q->size;
+	size_t n = len < q->size - tail ? len : q->size - tail;
+
+	memcpy(q->data + tail, data, n);
+	memcpy(q->data, data + n, len - n);
+	q->len += len;
+}
+
+/* returns 0 if the send queue is empty, 1 if there is still data pending or
+ * -1 if the connection is broken. */
+static int tcp_sndq_flush(struct tcp_sock *m)
+{
+	struct tcp_sndq *q = &m->sndq;
+	struct iovec iov[2];
+	ssize_t ret;
+	int n = 1;
+
+	if (q->len == 0)
+		return 0;
+
+	iov[0].iov_base = q->data + q->head;
+	iov[0].iov_len = q->len;
+	if (q->head + q->len > q->size) {
+		iov[0].iov_len = q->size - q->head;
+		iov[1].iov_base = q->data;
+		iov[1].iov_len = q->len - iov[0].iov_len;
+		n = 2;
+	}
+	ret = writev(m->fd, iov, n);
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+
+		tcp_client_reset(m);
+		return -1;
+	}
+	m->stats.bytes += ret;
+	q->head = (q->head + ret) % q->size;
+	q->len -= ret;
+	if (q->len > 0)
+		return 1;
+
+	q->head = 0;
+	tcp_sndq_wait(m, 0);
+	return 0;
+}
+
+static void tcp_client_writable_cb(void *data)
+{
+	struct tcp_sock *m = data;
+
+	if (tcp_sndq_flush(m) == 0 && m->drain_cb)
+		m->drain_cb(m->drain_data);
+}
+
+static void tcp_sndq_wait(struct tcp_sock *m, int on)
+{
+	if (m->sndq.wait == on)
+		return;
+
+	if (on) {
+		if (register_fd_write(m->fd, tcp_client_writable_cb, m,
+				      STATE(fds)) == -1)
+			return;
+	} else {
+		unregister_fd_write(m->fd, STATE(fds));
+	}
+	m->sndq.wait = on;
+}
+
+/* Send every buffer in one go. Buffers are either taken as a whole or not
+ * at all, so the stream framing is never broken: what does not fit in the
+ * socket is queued and sent once it becomes writable. Returns how many
+ * buffers were taken or -1 if none, errno is EAGAIN if the send queue is
+ * full. */
+int tcp_sendv(struct tcp_sock *m, const struct iovec *iov, int n)
+{
+	ssize_t ret;
+	size_t done;
+	int i;
+
+	if (tcp_client_connect(m) == -1)
+		return -1;
+
+	/* keep the order, anything that is still queued goes first. */
+	if (tcp_sndq_flush(m) == -1)
+		return -1;
+
+	if (m->sndq.len > 0) {
+		ret = 0;
+	} else {
+		ret = writev(m->fd, iov, n);
 		if (ret == -1) {
-			if (errno == EPIPE || errno == ECONNRESET) {
-				close(m->fd);
-				tcp_client_init(m, m->conf);
-				m->state = TCP_CLIENT_DISCONNECTED;
-				m->stats.error++;
-			} else {
-				m->stats.error++;
+			if (errno != EAGAIN && errno != EINTR) {
+				tcp_client_reset(m);
 				return -1;
 			}
+			ret = 0;
 		}
+		m->stats.bytes += ret;
 	}
 
-	if (ret >= 0) {
-		m->stats.bytes += ret;
+	for (i = 0, done = ret; i < n; i++) {
+		if (done >= iov[i].iov_len) {
+			done -= iov[i].iov_len;
+			m->stats.messages++;
+			continue;
+		}
+		/* the tail of a buffer that was partially sent always fits,
+		 * the send queue was empty. */
+		if (done == 0 && m->sndq.len + iov[i].iov_len > m->sndq.size)
+			break;
+
+		tcp_sndq_push(&m->sndq, (char *)iov[i].iov_base + done,
+			      iov[i].iov_len - done);
+		done = 0;
 		m->stats.messages++;
+		m->stats.queued++;
 	}
-	return ret;
+	if (m->sndq.len > 0)
+		tcp_sndq_wait(m, 1);
+
+	if (i == 0) {
+		m->stats.full++;
+		errno = EAGAIN;
+		return -1;
+	}
+	return i;
+}
+
+ssize_t tcp_send(struct tcp_sock *m, const void *data, int size)
+{
+	struct iovec iov = {
+		.iov_base	= (void *)data,
+		.iov_len	= size,
+	};
+
+	return tcp_sendv(m, &iov, 1) == -1 ? -1 : size;
+}
+
+size_t tcp_send_pending(struct tcp_sock *m)
+{
+	return m->sndq.len;
+}
+
+/* cb is called every time the send queue becomes empty. */
+void tcp_set_drain_cb(struct tcp_sock *m, void (*cb)(void *data), void *data)
+{
+	m->drain_cb = cb;
+	m->drain_data = data;
 }
 
 ssize_t tcp_recv(struct tcp_sock *m, void *data, int size)
@@ -417,13 +579,17 @@ tcp_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
 			"%20llu Pckts sent "
 			"%20llu Pckts recv\n"
 			"%20llu Error send "
-			"%20llu Error recv\n\n",
+			"%20llu Error recv\n"
+			"%20llu Queue send "
+			"%20llu Queue full\n\n",
 			ifname, status, active ? "ACTIVE" : "BACKUP",
 			(unsigned long long)s->bytes,
 			(unsigned long long)r->bytes,
 			(unsigned long long)s->messages,
 			(unsigned long long)r->messages,
 			(unsigned long long)s->error,
-			(unsigned long long)r->error);
+			(unsigned long long)r->error,
+			(unsigned long long)s->queued,
+			(unsigned long long)s->full);
 	return size;
 }
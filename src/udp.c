@@ -7,6 +7,7 @@
  * (at your option) any later version.
  */
 
+#define _GNU_SOURCE
 #include "udp.h"
 
 #include <stdio.h>
@@ -17,13 +18,118 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
 #include <limits.h>
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+/* limits of one single segmentation offload send, see UDP_MAX_SEGMENTS */
+#define UDP_GSO_MAX_SEGS	64
+#define UDP_GSO_MAX_LEN		65507
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT	15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+/* one of the receive sockets, they all share the same address and port. */
+static int udp_server_socket(struct udp_sock *m, struct udp_conf *conf)
+{
+	int fd, yes = 1;
+	socklen_t socklen = sizeof(int);
+
+	fd = socket(conf->ipproto, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+				sizeof(int)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	if (m->rx_num > 1 &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes,
+		       sizeof(int)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+
+	if (conf->rcvbuf &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &conf->rcvbuf,
+				sizeof(int)) == -1) {
+		/* not supported in linux kernel < 2.6.14 */
+		if (errno != ENOPROTOOPT) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &conf->rcvbuf, &socklen);
+
+	/* not supported in linux kernel < 5.0, we can live without it. */
+	if (conf->segment_offload &&
+	    setsockopt(fd, SOL_UDP, UDP_GRO, &yes, sizeof(int)) == 0)
+		m->gro = 1;
+
+	if (bind(fd, (struct sockaddr *) &m->addr, m->sockaddr_len) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* The kernel picks the socket with the index that this program returns,
+ * packets from the same peer always go through the same socket so that
+ * they are still handled in order. The program sees the UDP payload, the
+ * IP header is reached through SKF_NET_OFF. */
+static int udp_server_steer(struct udp_sock *m, struct udp_conf *conf)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, m->rx_num),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len	= sizeof(code) / sizeof(code[0]),
+		.filter	= code,
+	};
+
+	switch(conf->rx_steering) {
+	case UDP_STEER_SOURCE:
+		/* source address, the last 32 bits of it for IPv6 */
+		code[0].k = SKF_NET_OFF + (conf->ipproto == AF_INET ? 12 : 20);
+		break;
+	case UDP_STEER_CPU:
+		code[0].k = SKF_AD_OFF + SKF_AD_CPU;
+		break;
+	default:
+		return 0;
+	}
+
+	/* the program applies to all the sockets bound to the port */
+	return setsockopt(m->rx_fd[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &prog, sizeof(prog));
+}
+
 struct udp_sock *udp_server_create(struct udp_conf *conf)
 {
-	int yes = 1;
 	struct udp_sock *m;
-	socklen_t socklen = sizeof(int);
+	int i;
 
 	m = calloc(sizeof(struct udp_sock), 1);
 	if (m == NULL)
@@ -46,48 +152,34 @@ struct udp_sock *udp_server_create(struct udp_conf *conf)
 		break;
 	}
 
-	m->fd = socket(conf->ipproto, SOCK_DGRAM, 0);
-	if (m->fd == -1) {
-		free(m);
-		return NULL;
-	}
-
-	if (setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &yes,
-				sizeof(int)) == -1) {
-		close(m->fd);
-		free(m);
-		return NULL;
-	}
+	m->rx_num = conf->rx_sockets > 1 ? conf->rx_sockets : 1;
+	if (m->rx_num > UDP_RX_MAX)
+		m->rx_num = UDP_RX_MAX;
 
-#ifndef SO_RCVBUFFORCE
-#define SO_RCVBUFFORCE 33
-#endif
-
-	if (conf->rcvbuf &&
-	    setsockopt(m->fd, SOL_SOCKET, SO_RCVBUFFORCE, &conf->rcvbuf,
-				sizeof(int)) == -1) {
-		/* not supported in linux kernel < 2.6.14 */
-		if (errno != ENOPROTOOPT) {
-			close(m->fd);
+	for (i = 0; i < m->rx_num; i++) {
+		m->rx_fd[i] = udp_server_socket(m, conf);
+		if (m->rx_fd[i] == -1) {
+			while (--i >= 0)
+				close(m->rx_fd[i]);
 			free(m);
 			return NULL;
 		}
 	}
+	m->fd = m->rx_fd[0];
 
-	getsockopt(m->fd, SOL_SOCKET, SO_RCVBUF, &conf->rcvbuf, &socklen);
-
-	if (bind(m->fd, (struct sockaddr *) &m->addr, m->sockaddr_len) == -1) {
-		close(m->fd);
-		free(m);
-		return NULL;
-	}
+	/* not supported in linux kernel < 4.5, the kernel hashes instead. */
+	if (m->rx_num > 1 && udp_server_steer(m, conf) == 0)
+		m->rx_steering = conf->rx_steering;
 
 	return m;
 }
 
 void udp_server_destroy(struct udp_sock *m)
 {
-	close(m->fd);
+	int i;
+
+	for (i = 0; i < m->rx_num; i++)
+		close(m->rx_fd[i]);
 	free(m);
 }
 
@@ -157,9 +249,22 @@ struct udp_sock *udp_client_create(struct udp_conf *conf)
 	if (ret == -1) {
 		close(m->fd);
 		free(m);
-		m = NULL;
+		return NULL;
 	}
 
+#ifdef HAVE_SENDMMSG
+	/* segmentation offload requires UDP checksums, and it is not
+	 * supported in linux kernel < 4.18, we can live without it. */
+	if (conf->segment_offload && !conf->checksum) {
+		int gso_size;
+
+		socklen = sizeof(int);
+		if (getsockopt(m->fd, SOL_UDP, UDP_SEGMENT, &gso_size,
+			       &socklen) == 0)
+			m->gso = 1;
+	}
+#endif
+
 	return m;
 }
 
@@ -179,6 +284,7 @@ ssize_t udp_send(struct udp_sock *m, const void *data, int size)
 		     0,
 		     (struct sockaddr *) &m->addr,
 		     m->sockaddr_len);
+	m->stats.syscalls++;
 	if (ret == -1) {
 		m->stats.error++;
 		return ret;
@@ -190,34 +296,242 @@ ssize_t udp_send(struct udp_sock *m, const void *data, int size)
 	return ret;
 }
 
+#ifdef HAVE_SENDMMSG
+/* consecutive datagrams of the same size are passed to the kernel as one
+ * single buffer that is split at datagram boundaries, the last one in every
+ * run may be shorter. */
+static int udp_sendv_gso(struct udp_sock *m, const struct iovec *iov, int n)
+{
+	struct mmsghdr msg[n];
+	char ctl[n][CMSG_SPACE(sizeof(uint16_t))];
+	int segs[n];
+	int ret, i, j, k, len;
+
+	memset(msg, 0, sizeof(msg));
+	memset(ctl, 0, sizeof(ctl));
+	for (i = 0, k = 0; i < n; i = j, k++) {
+		size_t size = iov[i].iov_len;
+
+		len = size;
+		for (j = i + 1; j < n && j - i < UDP_GSO_MAX_SEGS; j++) {
+			if (iov[j].iov_len > size ||
+			    len + iov[j].iov_len > UDP_GSO_MAX_LEN)
+				break;
+
+			len += iov[j].iov_len;
+			if (iov[j].iov_len < size) {
+				j++;
+				break;
+			}
+		}
+		msg[k].msg_hdr.msg_name = &m->addr;
+		msg[k].msg_hdr.msg_namelen = m->sockaddr_len;
+		msg[k].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msg[k].msg_hdr.msg_iovlen = j - i;
+		segs[k] = j - i;
+
+		if (segs[k] > 1) {
+			struct cmsghdr *cmsg;
+			uint16_t gso_size = size;
+
+			msg[k].msg_hdr.msg_control = ctl[k];
+			msg[k].msg_hdr.msg_controllen = sizeof(ctl[k]);
+			cmsg = CMSG_FIRSTHDR(&msg[k].msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+		}
+	}
+	ret = sendmmsg(m->fd, msg, k, 0);
+	m->stats.syscalls++;
+	if (ret == -1)
+		return ret;
+
+	for (i = 0, j = 0; i < ret; i++) {
+		m->stats.bytes += msg[i].msg_len;
+		m->stats.messages += segs[i];
+		j += segs[i];
+	}
+	return j;
+}
+#endif
+
+/* send every iovec as one datagram, returns how many of them were sent or
+ * -1 if the first one fails. */
+int udp_sendv(struct udp_sock *m, const struct iovec *iov, int n)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msg[n];
+	int ret, i;
+
+	if (m->gso) {
+		ret = udp_sendv_gso(m, iov, n);
+		if (ret != -1 || (errno != EIO && errno != EINVAL)) {
+			if (ret == -1)
+				m->stats.error++;
+			return ret;
+		}
+		/* this route cannot offload segmentation, stop trying. */
+		m->gso = 0;
+	}
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_name = &m->addr;
+		msg[i].msg_hdr.msg_namelen = m->sockaddr_len;
+		msg[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = sendmmsg(m->fd, msg, n, 0);
+	m->stats.syscalls++;
+	if (ret == -1) {
+		m->stats.error++;
+		return ret;
+	}
+	for (i = 0; i < ret; i++) {
+		m->stats.bytes += msg[i].msg_len;
+		m->stats.messages++;
+	}
+	return ret;
+#else
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (udp_send(m, iov[i].iov_base, iov[i].iov_len) == -1)
+			return i > 0 ? i : -1;
+	}
+	return n;
+#endif
+}
+
 ssize_t udp_recv(struct udp_sock *m, void *data, int size)
 {
 	ssize_t ret;
 	socklen_t sin_size = sizeof(struct sockaddr_in);
 
-        ret = recvfrom(m->fd,
+        ret = recvfrom(m->rx_fd[m->rx_cur],
 		       data, 
 		       size,
-		       0,
+		       MSG_TRUNC,
 		       (struct sockaddr *)&m->addr,
 		       &sin_size);
+	m->stats.syscalls++;
 	if (ret == -1) {
 		if (errno != EAGAIN)
 			m->stats.error++;
 		return ret;
 	}
+	/* larger than what we expect, eg. the peer has a larger MTU. Drop
+	 * it, it is not malformed though. */
+	if (ret > size) {
+		m->stats.truncated++;
+		return 0;
+	}
 
 	m->stats.bytes += ret;
 	m->stats.messages++;
+	m->rx_messages[m->rx_cur]++;
 
 	return ret;
 }
 
+#ifdef HAVE_RECVMMSG
+/* segment size of a datagram that the kernel may have coalesced */
+static int udp_gro_size(struct msghdr *msg, int len)
+{
+	struct cmsghdr *cmsg;
+	int gso_size;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+		if (gso_size > 0 && gso_size < len)
+			return gso_size;
+	}
+	return len;
+}
+#endif
+
+/* receive up to n datagrams without blocking, one per iovec. The length of
+ * every datagram is stored in len. If the kernel has coalesced several
+ * datagrams into one, seg stores the size of the original datagrams, the
+ * last one may be shorter. Returns how many were received or -1. */
+int udp_recvv(struct udp_sock *m, const struct iovec *iov, int *len,
+	      int *seg, int n)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msg[n];
+	char ctl[n][CMSG_SPACE(sizeof(int))];
+	int ret, i, segs;
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_name = &m->addr;
+		msg[i].msg_hdr.msg_namelen = sizeof(m->addr);
+		msg[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		if (m->gro) {
+			msg[i].msg_hdr.msg_control = ctl[i];
+			msg[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+		}
+	}
+	ret = recvmmsg(m->rx_fd[m->rx_cur], msg, n, MSG_DONTWAIT, NULL);
+	m->stats.syscalls++;
+	if (ret == -1) {
+		if (errno != EAGAIN)
+			m->stats.error++;
+		return ret;
+	}
+	for (i = 0; i < ret; i++) {
+		if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			m->stats.truncated++;
+			len[i] = seg[i] = 0;
+			continue;
+		}
+		len[i] = seg[i] = msg[i].msg_len;
+		if (m->gro)
+			seg[i] = udp_gro_size(&msg[i].msg_hdr, len[i]);
+
+		segs = seg[i] ? (len[i] + seg[i] - 1) / seg[i] : 1;
+
+		m->stats.bytes += len[i];
+		m->stats.messages += segs;
+		m->rx_messages[m->rx_cur] += segs;
+	}
+	return ret;
+#else
+	ssize_t ret;
+
+	ret = udp_recv(m, iov[0].iov_base, iov[0].iov_len);
+	if (ret == -1)
+		return -1;
+
+	len[0] = seg[0] = ret;
+	return 1;
+#endif
+}
+
 int udp_get_fd(struct udp_sock *m)
 {
 	return m->fd;
 }
 
+/* returns the i-th receive socket, -1 if there is no such socket */
+int udp_get_rx_fd(struct udp_sock *m, int i)
+{
+	return i < m->rx_num ? m->rx_fd[i] : -1;
+}
+
+/* the next receive calls read from the i-th socket */
+void udp_set_rx(struct udp_sock *m, int i)
+{
+	if (i < m->rx_num)
+		m->rx_cur = i;
+}
+
 int udp_isset(struct udp_sock *m, fd_set *readfds)
 {
 	return FD_ISSET(m->fd, readfds);
@@ -260,13 +574,47 @@ udp_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
 			"%20llu Pckts sent "
 			"%20llu Pckts recv\n"
 			"%20llu Error send "
-			"%20llu Error recv\n\n",
+			"%20llu Error recv\n"
+			"%20llu Calls sent "
+			"%20llu Calls recv\n"
+			"%20s            "
+			"%20llu Trunc recv\n\n",
 			ifname, status, active ? "ACTIVE" : "BACKUP",
 			(unsigned long long)s->bytes,
 			(unsigned long long)r->bytes,
 			(unsigned long long)s->messages,
 			(unsigned long long)r->messages,
 			(unsigned long long)s->error,
-			(unsigned long long)r->error);
+			(unsigned long long)r->error,
+			(unsigned long long)s->syscalls,
+			(unsigned long long)r->syscalls,
+			"",
+			(unsigned long long)r->truncated);
 	return size;
 }
+
+int udp_snprintf_rx(char *buf, size_t buflen, struct udp_sock *m)
+{
+	static const char *steering[] = {
+		[UDP_STEER_HASH]	= "hash",
+		[UDP_STEER_SOURCE]	= "source",
+		[UDP_STEER_CPU]		= "cpu",
+	};
+	int i, ret;
+	size_t size;
+
+	size = snprintf(buf, buflen, "UDP receive sockets=%d steering=%s:\n",
+			m->rx_num, steering[m->rx_steering]);
+	for (i = 0; i < m->rx_num && size < buflen; i++) {
+		ret = snprintf(buf + size, buflen - size,
+			       "%20llu Pckts recv socket %d\n",
+			       (unsigned long long)m->rx_messages[i], i);
+		if (ret < 0)
+			break;
+		size += ret;
+	}
+	if (size < buflen)
+		size += snprintf(buf + size, buflen - size, "\n");
+
+	return size < buflen ? size : buflen - 1;
+}
@@ -0,0 +1,600 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Dedicated link over an AF_XDP socket: state messages are sent as raw
+ * ethernet frames that bypass the IP stack. A tiny XDP program redirects
+ * the frames with our ethertype to the socket, anything else goes through.
+ */
+
+#define _GNU_SOURCE
+#include "xdp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_IF_XDP_H
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/rtnetlink.h>
+#include <libmnl/libmnl.h>
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+/* half of the frames are used to receive, the other half to send */
+#define XDP_FRAME_NUM	4096
+#define XDP_RING_SIZE	(XDP_FRAME_NUM / 2)
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_map_create(struct xdp_sock *m)
+{
+	union bpf_attr attr;
+	uint32_t key = m->queue;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = m->queue + 1;
+
+	m->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (m->map_fd == -1)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = m->map_fd;
+	attr.key = (uint64_t)(unsigned long)&key;
+	attr.value = (uint64_t)(unsigned long)&m->fd;
+
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+#define BPF_INSN(c, d, s, o, i)						\
+	((struct bpf_insn) {						\
+		.code = (c), .dst_reg = (d), .src_reg = (s),		\
+		.off = (o), .imm = (i)					\
+	})
+
+/* if (eth->h_proto == XDP_ETHERTYPE && ctx->rx_queue_index == queue)
+ *	return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ * return XDP_PASS;
+ *
+ * The map only has our queue, the frames that arrive on the other queues go
+ * to the stack instead of being dropped.
+ */
+static int xdp_prog_load(struct xdp_sock *m)
+{
+	struct bpf_insn prog[] = {
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			 offsetof(struct xdp_md, data), 0),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+			 offsetof(struct xdp_md, data_end), 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2,
+			 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0,
+			 0, ETH_HLEN),
+		/* truncated frame, goto pass */
+		BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3,
+			 9, 0),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			 offsetof(struct ethhdr, h_proto), 0),
+		/* not ours, goto pass */
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0,
+			 7, htons(XDP_ETHERTYPE)),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			 offsetof(struct xdp_md, rx_queue_index), 0),
+		/* another queue, goto pass */
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0,
+			 5, m->queue),
+		BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1,
+			 BPF_PSEUDO_MAP_FD, 0, m->map_fd),
+		BPF_INSN(0, 0, 0, 0, 0),
+		/* the flags are the action if the lookup fails */
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0,
+			 0, XDP_PASS),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* pass: */
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0,
+			 0, XDP_PASS),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(unsigned long)"GPL";
+
+	m->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	return m->prog_fd == -1 ? -1 : 0;
+}
+
+/* attach the program to the interface, fd -1 detaches it */
+static int xdp_link_set(int ifindex, int fd, uint32_t flags)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct mnl_socket *nl;
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifm;
+	struct nlattr *nest;
+	int ret;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_SETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_seq = time(NULL);
+
+	ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+	ifm->ifi_family = AF_UNSPEC;
+	ifm->ifi_index = ifindex;
+
+	nest = mnl_attr_nest_start(nlh, IFLA_XDP);
+	mnl_attr_put_u32(nlh, IFLA_XDP_FD, fd);
+	if (flags)
+		mnl_attr_put_u32(nlh, IFLA_XDP_FLAGS, flags);
+	mnl_attr_nest_end(nlh, nest);
+
+	nl = mnl_socket_open(NETLINK_ROUTE);
+	if (nl == NULL)
+		return -1;
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0 ||
+	    mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+		mnl_socket_close(nl);
+		return -1;
+	}
+	ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+	if (ret > 0) {
+		ret = mnl_cb_run(buf, ret, nlh->nlmsg_seq,
+				 mnl_socket_get_portid(nl), NULL, NULL);
+	}
+	mnl_socket_close(nl);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int xdp_ring_map(struct xdp_sock *m, struct xdp_ring *r,
+			const struct xdp_ring_offset *off, size_t desc_size,
+			off_t pgoff)
+{
+	r->size = XDP_RING_SIZE;
+	r->map_len = off->desc + r->size * desc_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, m->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+	r->producer = (uint32_t *)((char *)r->map + off->producer);
+	r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+	r->desc = (char *)r->map + off->desc;
+	return 0;
+}
+
+static void xdp_ring_unmap(struct xdp_ring *r)
+{
+	if (r->map)
+		munmap(r->map, r->map_len);
+}
+
+/* MTU and hardware address of the interface */
+static int xdp_link_info(struct xdp_sock *m, int *mtu)
+{
+	struct ifreq ifr;
+	int fd, ret = -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (if_indextoname(m->ifindex, ifr.ifr_name) == NULL)
+		return -1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (ioctl(fd, SIOCGIFMTU, &ifr) == -1)
+		goto out;
+	*mtu = ifr.ifr_mtu;
+
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+		goto out;
+
+	/* the link is dedicated, so we send to everyone on it */
+	memset(m->eth.h_dest, 0xff, ETH_ALEN);
+	memcpy(m->eth.h_source, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	m->eth.h_proto = htons(XDP_ETHERTYPE);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int xdp_umem_create(struct xdp_sock *m)
+{
+	struct xdp_umem_reg reg = {};
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	int size = XDP_RING_SIZE;
+	uint64_t *fill;
+	int i;
+
+	m->umem_len = (size_t)XDP_FRAME_NUM * m->frame_size;
+	m->umem = mmap(NULL, m->umem_len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (m->umem == MAP_FAILED) {
+		m->umem = NULL;
+		return -1;
+	}
+
+	reg.addr = (uint64_t)(unsigned long)m->umem;
+	reg.len = m->umem_len;
+	reg.chunk_size = m->frame_size;
+	if (setsockopt(m->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1)
+		return -1;
+
+	if (setsockopt(m->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+		       &size, sizeof(size)) == -1 ||
+	    setsockopt(m->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+		       &size, sizeof(size)) == -1 ||
+	    setsockopt(m->fd, SOL_XDP, XDP_RX_RING,
+		       &size, sizeof(size)) == -1 ||
+	    setsockopt(m->fd, SOL_XDP, XDP_TX_RING,
+		       &size, sizeof(size)) == -1)
+		return -1;
+
+	if (getsockopt(m->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+		return -1;
+
+	if (xdp_ring_map(m, &m->fill, &off.fr, sizeof(uint64_t),
+			 XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+	    xdp_ring_map(m, &m->comp, &off.cr, sizeof(uint64_t),
+			 XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+	    xdp_ring_map(m, &m->rx, &off.rx, sizeof(struct xdp_desc),
+			 XDP_PGOFF_RX_RING) == -1 ||
+	    xdp_ring_map(m, &m->tx, &off.tx, sizeof(struct xdp_desc),
+			 XDP_PGOFF_TX_RING) == -1)
+		return -1;
+
+	/* the first half of the frames is given to the kernel to receive */
+	fill = m->fill.desc;
+	for (i = 0; i < XDP_RING_SIZE; i++)
+		fill[i] = (uint64_t)i * m->frame_size;
+	__atomic_store_n(m->fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+
+	m->tx_free = calloc(XDP_RING_SIZE, sizeof(uint64_t));
+	if (m->tx_free == NULL)
+		return -1;
+
+	for (i = 0; i < XDP_RING_SIZE; i++) {
+		m->tx_free[m->tx_free_num++] =
+			(uint64_t)(XDP_RING_SIZE + i) * m->frame_size;
+	}
+	return 0;
+}
+
+struct xdp_sock *xdp_sock_create(struct xdp_conf *conf)
+{
+	struct sockaddr_xdp addr = {};
+	struct xdp_sock *m;
+	int mtu;
+
+	m = calloc(sizeof(struct xdp_sock), 1);
+	if (m == NULL)
+		return NULL;
+
+	m->fd = m->prog_fd = m->map_fd = -1;
+	m->ifindex = conf->ifindex;
+	m->queue = conf->queue;
+
+	if (xdp_link_info(m, &mtu) == -1)
+		goto err;
+
+	/* chunks are 2048 or 4096 bytes long in aligned mode, the kernel
+	 * leaves some headroom in front of the frames that it receives. */
+	m->frame_size = XDP_PACKET_HEADROOM + ETH_HLEN + mtu > 2048 ?
+			4096 : 2048;
+	if (XDP_PACKET_HEADROOM + ETH_HLEN + mtu > m->frame_size) {
+		errno = EMSGSIZE;
+		goto err;
+	}
+
+	m->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (m->fd == -1)
+		goto err;
+
+	if (xdp_umem_create(m) == -1)
+		goto err;
+
+	addr.sxdp_family = AF_XDP;
+	addr.sxdp_ifindex = m->ifindex;
+	addr.sxdp_queue_id = m->queue;
+	addr.sxdp_flags = conf->zerocopy ? XDP_ZEROCOPY : XDP_COPY;
+	if (bind(m->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		goto err;
+
+	if (xdp_map_create(m) == -1 || xdp_prog_load(m) == -1)
+		goto err;
+
+	/* zero-copy needs driver support, copy mode works everywhere, eg.
+	 * generic XDP on veth. Do not replace someone else's program. */
+	m->link_flags = conf->zerocopy ? XDP_FLAGS_DRV_MODE : 0;
+	if (xdp_link_set(m->ifindex, m->prog_fd,
+			 m->link_flags | XDP_FLAGS_UPDATE_IF_NOEXIST) == -1) {
+		m->link_flags = ~0U;
+		goto err;
+	}
+	return m;
+err:
+	xdp_sock_destroy(m);
+	return NULL;
+}
+
+void xdp_sock_destroy(struct xdp_sock *m)
+{
+	if (m->prog_fd != -1) {
+		if (m->link_flags != ~0U)
+			xdp_link_set(m->ifindex, -1, m->link_flags);
+		close(m->prog_fd);
+	}
+	if (m->map_fd != -1)
+		close(m->map_fd);
+
+	xdp_ring_unmap(&m->fill);
+	xdp_ring_unmap(&m->comp);
+	xdp_ring_unmap(&m->rx);
+	xdp_ring_unmap(&m->tx);
+	if (m->fd != -1)
+		close(m->fd);
+	if (m->umem)
+		munmap(m->umem, m->umem_len);
+	free(m->tx_free);
+	free(m);
+}
+
+/* the frames that the kernel has sent can be used again */
+static void xdp_tx_complete(struct xdp_sock *m)
+{
+	uint64_t *comp = m->comp.desc;
+	uint32_t cons, prod;
+
+	cons = *m->comp.consumer;
+	prod = __atomic_load_n(m->comp.producer, __ATOMIC_ACQUIRE);
+	for (; cons != prod; cons++)
+		m->tx_free[m->tx_free_num++] = comp[cons & (m->comp.size - 1)];
+
+	__atomic_store_n(m->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+int xdp_sendv(struct xdp_sock *m, const struct iovec *iov, int n)
+{
+	struct xdp_desc *tx = m->tx.desc;
+	uint32_t prod, cons;
+	int i;
+
+	xdp_tx_complete(m);
+
+	prod = *m->tx.producer;
+	cons = __atomic_load_n(m->tx.consumer, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		struct xdp_desc *desc;
+		char *frame;
+		uint64_t addr;
+
+		if (iov[i].iov_len + ETH_HLEN > (size_t)m->frame_size) {
+			errno = EMSGSIZE;
+			break;
+		}
+		/* the kernel has not sent the previous frames yet */
+		if (m->tx_free_num == 0 || prod - cons == m->tx.size) {
+			errno = ENOBUFS;
+			break;
+		}
+		addr = m->tx_free[--m->tx_free_num];
+		frame = m->umem + addr;
+		memcpy(frame, &m->eth, ETH_HLEN);
+		memcpy(frame + ETH_HLEN, iov[i].iov_base, iov[i].iov_len);
+
+		desc = &tx[prod++ & (m->tx.size - 1)];
+		desc->addr = addr;
+		desc->len = ETH_HLEN + iov[i].iov_len;
+		desc->options = 0;
+
+		m->stats_send.bytes += iov[i].iov_len;
+		m->stats_send.messages++;
+	}
+	if (i == 0) {
+		m->stats_send.error++;
+		return -1;
+	}
+	__atomic_store_n(m->tx.producer, prod, __ATOMIC_RELEASE);
+
+	/* in copy mode, the frames are sent from this syscall */
+	m->stats_send.syscalls++;
+	if (sendto(m->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+	    errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+		m->stats_send.error++;
+
+	return i;
+}
+
+ssize_t xdp_send(struct xdp_sock *m, const void *data, int size)
+{
+	struct iovec iov = {
+		.iov_base	= (void *)data,
+		.iov_len	= size,
+	};
+
+	if (xdp_sendv(m, &iov, 1) == -1)
+		return -1;
+
+	return size;
+}
+
+int xdp_recvv(struct xdp_sock *m, const struct iovec *iov, int *len,
+	      int *seg, int n)
+{
+	struct xdp_desc *rx = m->rx.desc;
+	uint64_t *fill = m->fill.desc;
+	uint32_t cons, prod, fill_prod;
+	int i = 0;
+
+	cons = *m->rx.consumer;
+	prod = __atomic_load_n(m->rx.producer, __ATOMIC_ACQUIRE);
+	fill_prod = *m->fill.producer;
+	while (cons != prod && i < n) {
+		const struct xdp_desc *desc = &rx[cons++ & (m->rx.size - 1)];
+		int size = desc->len - ETH_HLEN;
+
+		if (size <= 0 || (size_t)size > iov[i].iov_len) {
+			m->stats_recv.error++;
+		} else {
+			memcpy(iov[i].iov_base,
+			       m->umem + desc->addr + ETH_HLEN, size);
+			len[i] = seg[i] = size;
+			m->stats_recv.bytes += size;
+			m->stats_recv.messages++;
+			i++;
+		}
+		/* give the frame back to the kernel */
+		fill[fill_prod++ & (m->fill.size - 1)] =
+			desc->addr & ~((uint64_t)m->frame_size - 1);
+	}
+	__atomic_store_n(m->fill.producer, fill_prod, __ATOMIC_RELEASE);
+	__atomic_store_n(m->rx.consumer, cons, __ATOMIC_RELEASE);
+
+	if (i == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return i;
+}
+
+#else /* HAVE_LINUX_IF_XDP_H */
+
+struct xdp_sock *xdp_sock_create(struct xdp_conf *conf)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void xdp_sock_destroy(struct xdp_sock *m)
+{
+}
+
+int xdp_sendv(struct xdp_sock *m, const struct iovec *iov, int n)
+{
+	return -1;
+}
+
+ssize_t xdp_send(struct xdp_sock *m, const void *data, int size)
+{
+	return -1;
+}
+
+int xdp_recvv(struct xdp_sock *m, const struct iovec *iov, int *len,
+	      int *seg, int n)
+{
+	return -1;
+}
+
+#endif /* HAVE_LINUX_IF_XDP_H */
+
+ssize_t xdp_recv(struct xdp_sock *m, void *data, int size)
+{
+	struct iovec iov = {
+		.iov_base	= data,
+		.iov_len	= size,
+	};
+	int len, seg;
+
+	if (xdp_recvv(m, &iov, &len, &seg, 1) == -1)
+		return -1;
+
+	return len;
+}
+
+int xdp_get_fd(struct xdp_sock *m)
+{
+	return m->fd;
+}
+
+int xdp_isset(struct xdp_sock *m, fd_set *readfds)
+{
+	return FD_ISSET(m->fd, readfds);
+}
+
+int
+xdp_snprintf_stats(char *buf, size_t buflen, char *ifname,
+		   struct xdp_stats *s, struct xdp_stats *r)
+{
+	size_t size;
+
+	size = snprintf(buf, buflen, "XDP traffic (active device=%s):\n"
+				     "%20llu Bytes sent "
+				     "%20llu Bytes recv\n"
+				     "%20llu Pckts sent "
+				     "%20llu Pckts recv\n"
+				     "%20llu Error send "
+				     "%20llu Error recv\n\n",
+				     ifname,
+				     (unsigned long long)s->bytes,
+				     (unsigned long long)r->bytes,
+				     (unsigned long long)s->messages,
+				     (unsigned long long)r->messages,
+				     (unsigned long long)s->error,
+				     (unsigned long long)r->error);
+	return size;
+}
+
+int
+xdp_snprintf_stats2(char *buf, size_t buflen, const char *ifname,
+		    const char *status, int active,
+		    struct xdp_stats *s, struct xdp_stats *r)
+{
+	size_t size;
+
+	size = snprintf(buf, buflen,
+			"XDP traffic device=%s status=%s role=%s:\n"
+			"%20llu Bytes sent "
+			"%20llu Bytes recv\n"
+			"%20llu Pckts sent "
+			"%20llu Pckts recv\n"
+			"%20llu Error send "
+			"%20llu Error recv\n"
+			"%20llu Calls sent\n\n",
+			ifname, status, active ? "ACTIVE" : "BACKUP",
+			(unsigned long long)s->bytes,
+			(unsigned long long)r->bytes,
+			(unsigned long long)s->messages,
+			(unsigned long long)r->messages,
+			(unsigned long long)s->error,
+			(unsigned long long)r->error,
+			(unsigned long long)s->syscalls);
+	return size;
+}
@@ -0,0 +1,185 @@
+#!/bin/bash
+#
+# Bulk synchronization through the dedicated link, see conntrackd.conf(5).
+# Node A gets conntrack entries created through ctnetlink, then it sends
+# them all at once to node B. The nodes run in two network namespaces on
+# this host and they are connected through a veth pair. This reports how
+# long it takes until B has got them, and the CPU time both daemons spend
+# on it. Run it once per channel type to compare them. The shared memory
+# rings do not go through the veth pair, which leaves the cost of the
+# protocol alone.
+#
+# usage: bench-channel.sh [udp|xdp|shm] [entries]
+#
+
+CHANNEL=${1:-udp}
+ENTRIES=${2:-20000}
+
+case $CHANNEL in
+udp|xdp|shm)
+	;;
+*)
+	echo "usage: $0 [udp|xdp|shm] [entries]"
+	exit 1
+	;;
+esac
+
+CONNTRACKD=${CONNTRACKD:-../../src/conntrackd}
+[ -x $CONNTRACKD ] || CONNTRACKD=conntrackd
+
+if [ $(id -u) -ne 0 ]
+then
+	echo "Run this benchmark as root"
+	exit 1
+fi
+
+DIR=$(mktemp -d)
+
+cleanup()
+{
+	for n in a b
+	do
+		ip netns exec ct-bench-$n $CONNTRACKD -C $DIR/$n.conf -k \
+			2>/dev/null
+		ip netns del ct-bench-$n 2>/dev/null
+	done
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+# node, its address, the address of the peer, the peer
+channel()
+{
+	case $CHANNEL in
+	udp)
+		cat <<EOF
+	UDP {
+		IPv4_address $2
+		IPv4_Destination_Address $3
+		Port 3780
+		Interface veth-$1
+		Checksum on
+	}
+EOF
+		;;
+	xdp)
+		cat <<EOF
+	XDP {
+		Interface veth-$1
+		QueueNum 0
+	}
+EOF
+		;;
+	shm)
+		cat <<EOF
+	SharedMemory {
+		Path $DIR/$1.shm
+		PeerPath $DIR/$4.shm
+	}
+EOF
+		;;
+	esac
+}
+
+conf()
+{
+	cat > $DIR/$1.conf <<EOF
+Sync {
+	Mode NOTRACK {
+	}
+$(channel $1 $2 $3 $4)
+}
+General {
+	HashSize 32768
+	HashLimit 262144
+	LogFile $DIR/$1.log
+	Syslog off
+	LockFile $DIR/$1.lock
+	UNIX {
+		Path $DIR/$1.ctl
+	}
+	NetlinkBufferSize 2097152
+	NetlinkBufferSizeMaxGrowth 8388608
+	Filter From Userspace {
+		Address Ignore {
+			IPv4_address 127.0.0.1
+			IPv4_address 10.255.0.0/24
+		}
+	}
+}
+EOF
+}
+
+ip netns add ct-bench-a || exit 1
+ip netns add ct-bench-b || exit 1
+ip link add veth-a netns ct-bench-a type veth peer name veth-b \
+	netns ct-bench-b || exit 1
+
+for n in a b
+do
+	ip -n ct-bench-$n link set lo up
+	ip -n ct-bench-$n link set veth-$n up
+done
+ip -n ct-bench-a addr add 10.255.0.1/24 dev veth-a
+ip -n ct-bench-b addr add 10.255.0.2/24 dev veth-b
+
+conf a 10.255.0.1 10.255.0.2 b
+conf b 10.255.0.2 10.255.0.1 a
+
+for n in a b
+do
+	ip netns exec ct-bench-$n $CONNTRACKD -C $DIR/$n.conf -d || exit 1
+done
+sleep 1
+
+for i in $(seq 1 $ENTRIES)
+do
+	ip netns exec ct-bench-a conntrack -I -p udp \
+		-s 192.0.$((i / 250 % 250 + 2)).$((i % 250 + 1)) \
+		-d 198.51.100.1 --sport $((i % 60000 + 1024)) --dport 53 \
+		-t 600 >/dev/null 2>&1
+done
+sleep 1
+
+# messages that node B has applied to its external cache so far
+applied()
+{
+	ip netns exec ct-bench-b $CONNTRACKD -C $DIR/b.conf -s cache | \
+		awk '/^cache / { f = ($2 == "external:") }
+		     f && /connections (created|updated)/ { n += $3 }
+		     END { print n + 0 }'
+}
+
+# CPU time in clock ticks of the daemon of the node
+cpu()
+{
+	local pid=$(pgrep -f "conntrackd -C $DIR/$1.conf -d")
+
+	awk '{ print $14 + $15 }' /proc/$pid/stat
+}
+
+before=$(applied)
+cpu_a=$(cpu a)
+cpu_b=$(cpu b)
+start=$(date +%s%N)
+
+ip netns exec ct-bench-a $CONNTRACKD -C $DIR/a.conf -B
+
+while [ $(($(applied) - before)) -lt $ENTRIES ]
+do
+	if [ $((($(date +%s%N) - start) / 1000000000)) -gt 60 ]
+	then
+		echo "node B got $(($(applied) - before)) of $ENTRIES"
+		exit 1
+	fi
+	sleep 0.01
+done
+
+elapsed=$((($(date +%s%N) - start) / 1000000))
+hz=$(getconf CLK_TCK)
+cpu_a=$((($(cpu a) - cpu_a) * 1000 / hz))
+cpu_b=$((($(cpu b) - cpu_b) * 1000 / hz))
+
+echo "$CHANNEL: $ENTRIES entries in ${elapsed}ms" \
+     "cpu A: ${cpu_a}ms cpu B: ${cpu_b}ms" \
+     "($((cpu_b * 1000000 / ENTRIES))ns per entry on B)"
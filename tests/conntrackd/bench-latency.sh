@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# Event to apply latency of the low latency mode over a veth pair between
+# two network namespaces on this host, see BusyPoll and LatencyTarget in
+# conntrackd.conf(5). Node A gets conntrack entries created through
+# ctnetlink, node B reports how long they took to get to its external
+# cache. Both namespaces share the clock, so the latency is exact.
+#
+# usage: bench-latency.sh [entries] [target usecs] [busy poll usecs]
+#
+
+ENTRIES=${1:-1000}
+TARGET=${2:-100}
+BUSY_POLL=${3:-50}
+
+CONNTRACKD=${CONNTRACKD:-../../src/conntrackd}
+[ -x $CONNTRACKD ] || CONNTRACKD=conntrackd
+
+if [ $(id -u) -ne 0 ]
+then
+	echo "Run this benchmark as root"
+	exit 1
+fi
+
+DIR=$(mktemp -d)
+
+cleanup()
+{
+	for n in a b
+	do
+		ip netns exec ct-bench-$n $CONNTRACKD -C $DIR/$n.conf -k \
+			2>/dev/null
+		ip netns del ct-bench-$n 2>/dev/null
+	done
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+# node, its address, the address of the peer
+conf()
+{
+	cat > $DIR/$1.conf <<EOF
+Sync {
+	Mode NOTRACK {
+	}
+	UDP {
+		IPv4_address $2
+		IPv4_Destination_Address $3
+		Port 3780
+		Interface veth-$1
+		Checksum on
+	}
+}
+General {
+	HashSize 32768
+	HashLimit 131072
+	LogFile $DIR/$1.log
+	Syslog off
+	LockFile $DIR/$1.lock
+	UNIX {
+		Path $DIR/$1.ctl
+	}
+	NetlinkBufferSize 2097152
+	NetlinkBufferSizeMaxGrowth 8388608
+	BusyPoll $BUSY_POLL
+	LatencyTarget $TARGET
+	Filter From Userspace {
+		Address Ignore {
+			IPv4_address 127.0.0.1
+			IPv4_address 10.255.0.0/24
+		}
+	}
+}
+EOF
+}
+
+ip netns add ct-bench-a || exit 1
+ip netns add ct-bench-b || exit 1
+ip link add veth-a netns ct-bench-a type veth peer name veth-b \
+	netns ct-bench-b || exit 1
+
+for n in a b
+do
+	ip -n ct-bench-$n link set lo up
+	ip -n ct-bench-$n link set veth-$n up
+done
+ip -n ct-bench-a addr add 10.255.0.1/24 dev veth-a
+ip -n ct-bench-b addr add 10.255.0.2/24 dev veth-b
+
+conf a 10.255.0.1 10.255.0.2
+conf b 10.255.0.2 10.255.0.1
+
+for n in a b
+do
+	ip netns exec ct-bench-$n $CONNTRACKD -C $DIR/$n.conf -d || exit 1
+done
+sleep 1
+
+for i in $(seq 1 $ENTRIES)
+do
+	ip netns exec ct-bench-a conntrack -I -p udp \
+		-s 192.0.2.$((i % 250 + 1)) -d 198.51.100.1 \
+		--sport $((i % 60000 + 1024)) --dport 53 -t 60 \
+		>/dev/null 2>&1
+done
+sleep 1
+
+ip netns exec ct-bench-b $CONNTRACKD -C $DIR/b.conf -s network > $DIR/stats
+
+stat()
+{
+	awk -v key="$1" '/event to apply latency/ { f = 1 }
+			 f && index($0, key) { print $NF; exit }' $DIR/stats
+}
+
+samples=$(stat Samples)
+average=$(stat Average)
+maximum=$(stat Maximum)
+over=$(stat "Over target")
+
+echo "entries: $ENTRIES samples: $samples average: ${average}us" \
+     "maximum: ${maximum}us over ${TARGET}us: $over"
+
+[ -n "$samples" ] && [ "$samples" -gt 0 ] && [ "$average" -le $TARGET ]
@@ -0,0 +1,151 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Cost of the ACK and NACK handling of the FTFW resend queue with many
+ * outstanding messages, list against QUEUE_F_SEQ ring. The callbacks walk
+ * the queue like rs_queue_empty() and rs_queue_to_tx() do.
+ *
+ * gcc -O2 -I../../include -I../.. bench-queue.c -o bench-queue
+ * ./bench-queue [outstanding entries] [ranges]
+ */
+
+#include "../../src/event.c"
+#include "../../src/queue.c"
+
+#include <time.h>
+
+#define WINDOW	300	/* default ACKWindowSize */
+
+struct node {
+	struct queue_node	qnode;
+	uint32_t		seq;
+};
+
+struct range {
+	uint32_t	from;
+	uint32_t	to;
+	uint32_t	hits;
+};
+
+static int nack_cb(struct queue_node *n, const void *data)
+{
+	struct range *r = (struct range *)data;
+	uint32_t seq = ((struct node *)n)->seq;
+
+	if (seq_before(seq, r->from))
+		return 0;
+	if (seq_before(r->to, seq))
+		return 1;
+
+	r->hits++;
+	return 0;
+}
+
+static int ack_cb(struct queue_node *n, const void *data)
+{
+	int ret = nack_cb(n, data);
+
+	if (ret == 0 && !seq_before(((struct node *)n)->seq,
+				    ((struct range *)data)->from))
+		queue_del(n);
+
+	return ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct queue *fill(struct node *nodes, uint32_t num, int seq)
+{
+	struct queue *q;
+	uint32_t i;
+
+	q = queue_create("bench", num, seq ? QUEUE_F_SEQ : 0);
+	if (q == NULL) {
+		perror("queue_create");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < num; i++) {
+		queue_node_init(&nodes[i].qnode, Q_ELEM_OBJ);
+		nodes[i].seq = i;
+		if (seq)
+			queue_add_seq(q, &nodes[i].qnode, i);
+		else
+			queue_add(q, &nodes[i].qnode);
+	}
+	return q;
+}
+
+static void
+walk(struct queue *q, const uint32_t *from, int num, int seq,
+     int (*cb)(struct queue_node *n, const void *data), const char *what)
+{
+	double start, elapsed;
+	uint32_t hits = 0;
+	int i;
+
+	start = now();
+	for (i = 0; i < num; i++) {
+		struct range r = {
+			.from	= from[i],
+			.to	= from[i] + WINDOW - 1,
+		};
+		if (seq)
+			queue_iterate_seq(q, r.from, r.to, &r, cb);
+		else
+			queue_iterate(q, &r, cb);
+		hits += r.hits;
+	}
+	elapsed = now() - start;
+
+	printf("%-5s %-4s: %8d ranges %10u messages %12.0f ns/range\n",
+	       seq ? "ring" : "list", what, num, hits, elapsed * 1e9 / num);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t num = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	int ranges = argc > 2 ? atoi(argv[2]) : 1000;
+	struct node *nodes;
+	uint32_t *from;
+	int i, seq;
+
+	if (num < WINDOW) {
+		fprintf(stderr, "at least %d entries\n", WINDOW);
+		return EXIT_FAILURE;
+	}
+	nodes = calloc(num, sizeof(*nodes));
+	from = calloc(ranges, sizeof(*from));
+	if (nodes == NULL || from == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	/* the same random windows for both, eg. the oldest ones were lost */
+	srandom(1);
+	for (i = 0; i < ranges; i++)
+		from[i] = (random() % (num / WINDOW)) * WINDOW;
+
+	printf("%u outstanding messages, window of %d\n", num, WINDOW);
+	for (seq = 0; seq <= 1; seq++) {
+		struct queue *q = fill(nodes, num, seq);
+
+		walk(q, from, ranges, seq, nack_cb, "nack");
+		walk(q, from, ranges, seq, ack_cb, "ack");
+		queue_destroy(q);
+	}
+	free(from);
+	free(nodes);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * CPU that the receiving side spends per datagram of the UDP channel, one
+ * recv() per datagram against recvmmsg() batches as channel_handler() in
+ * sync-mode.c does. A child process sends bursts through the loopback
+ * address, only the time spent draining the socket counts.
+ *
+ * gcc -O2 -I../../include -I../.. bench-recv.c -o bench-recv
+ * ./bench-recv [datagrams] [burst] [size] [port]
+ */
+
+#define HAVE_RECVMMSG 1
+#include "../../src/udp.c"
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define BATCH	32	/* as CHANNEL_RECV_BATCH */
+#define MTU	1500
+
+static double cpu(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a burst of datagrams every time that the parent asks for it */
+static void flood(struct udp_conf *conf, int rx, int tx, int burst, int size)
+{
+	struct udp_sock *c;
+	char buf[MTU] = {};
+	int i;
+
+	c = udp_client_create(conf);
+	if (c == NULL) {
+		perror("udp_client_create");
+		_exit(EXIT_FAILURE);
+	}
+	while (read(rx, buf, 1) == 1) {
+		for (i = 0; i < burst; i++)
+			udp_send(c, buf, size);
+		if (write(tx, buf, 1) != 1)
+			break;
+	}
+	udp_client_destroy(c);
+	_exit(EXIT_SUCCESS);
+}
+
+/* what the burst left in the socket, until it is empty */
+static uint64_t drain(struct udp_sock *m, int batch)
+{
+	static char buf[BATCH][MTU];
+	struct iovec iov[BATCH];
+	int len[BATCH], seg[BATCH];
+	uint64_t num = 0;
+	int i, ret;
+
+	for (i = 0; i < BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = MTU;
+	}
+	do {
+		if (batch)
+			ret = udp_recvv(m, iov, len, seg, BATCH);
+		else
+			ret = udp_recv(m, buf[0], MTU) < 0 ? -1 : 1;
+		if (ret > 0)
+			num += ret;
+	} while (ret > 0);
+
+	return num;
+}
+
+static void
+run(struct udp_conf *conf, int num, int burst, int size, int batch)
+{
+	int go[2], done[2], i;
+	struct udp_sock *m;
+	uint64_t received = 0;
+	double start, elapsed = 0;
+	char c = 0;
+	pid_t pid;
+
+	m = udp_server_create(conf);
+	if (m == NULL || pipe(go) == -1 || pipe(done) == -1) {
+		perror("setup");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(m->fd, F_SETFL, O_NONBLOCK);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		close(go[1]);
+		close(done[0]);
+		flood(conf, go[0], done[1], burst, size);
+	}
+	close(go[0]);
+	close(done[1]);
+
+	for (i = 0; i < num / burst; i++) {
+		if (write(go[1], &c, 1) != 1 || read(done[0], &c, 1) != 1)
+			break;
+
+		start = cpu();
+		received += drain(m, batch);
+		elapsed += cpu() - start;
+	}
+	close(go[1]);
+	waitpid(pid, NULL, 0);
+	close(done[0]);
+
+	printf("%-8s: %10llu received %10llu syscalls %8.0f ns/datagram\n",
+	       batch ? "recvmmsg" : "recv", (unsigned long long)received,
+	       (unsigned long long)m->stats.syscalls,
+	       received ? elapsed * 1e9 / received : 0.0);
+
+	udp_server_destroy(m);
+}
+
+int main(int argc, char *argv[])
+{
+	int num = argc > 1 ? atoi(argv[1]) : 1000000;
+	int burst = argc > 2 ? atoi(argv[2]) : 128;
+	int size = argc > 3 ? atoi(argv[3]) : 200;
+	struct udp_conf conf = {
+		.ipproto	= AF_INET,
+		.reuseaddr	= 1,
+		.checksum	= 1,
+		.port		= argc > 4 ? atoi(argv[4]) : 37800,
+		.rcvbuf		= 8 * 1024 * 1024,
+	};
+
+	if (size > MTU || burst <= 0) {
+		fprintf(stderr, "at most %d bytes, bursts of one at least\n",
+			MTU);
+		return EXIT_FAILURE;
+	}
+	inet_aton("127.0.0.1", &conf.server.ipv4.inet_addr);
+	inet_aton("127.0.0.1", &conf.client.inet_addr);
+
+	printf("%d datagrams of %d bytes through the loopback, bursts of %d\n",
+	       num, size, burst);
+	run(&conf, num, burst, size, 0);
+	run(&conf, num, burst, size, 1);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Recovery of FTFW over a lossy link, plain nack against selective nack:
+ * how long it takes until the peer got every object, in the time of the
+ * alarms and the delay of the link, and how much goes through it again.
+ *
+ * gcc -O2 -I../../include -I../.. bench-sack.c -o bench-sack
+ * ./bench-sack [objects] [loss percentage]...
+ */
+
+#include "ftfw-loop.h"
+
+static void run(uint32_t objects, int loss, int sack)
+{
+	uint64_t resent, dups = 0;
+	uint32_t i;
+	int rounds;
+
+	loop_init(sack, objects);
+	if (loop_hello() < 0) {
+		fprintf(stderr, "no hello\n");
+		exit(EXIT_FAILURE);
+	}
+	loop.sent = loop.bytes = loop.usecs = 0;
+
+	loop.loss = loss;
+	loop_enqueue();
+	rounds = loop_run(1000000);
+	if (rounds < 0) {
+		fprintf(stderr, "it does not recover\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < objects; i++)
+		dups += loop.delivered[i] - 1;
+	resent = ftfw_stats.nack_resent + ftfw_stats.sack_resent;
+
+	printf("%3d%% %-5s: %8.1f ms %6d rounds %8llu resent %8llu twice "
+	       "%10llu bytes (%.2fx)\n",
+	       loss, sack ? "sack" : "nack", loop.usecs / 1000.0, rounds,
+	       (unsigned long long)resent, (unsigned long long)dups,
+	       (unsigned long long)loop.bytes,
+	       (double)loop.bytes / (objects * (NETHDR_SIZ + LOOP_PAYLOAD)));
+
+	loop_fini();
+}
+
+int main(int argc, char *argv[])
+{
+	static const int losses[] = { 1, 5, 10, 20 };
+	uint32_t objects = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+	int i, sack;
+
+	printf("%u objects, %d bytes each, %d usecs to cross the link\n",
+	       objects, NETHDR_SIZ + LOOP_PAYLOAD, LOOP_DELAY);
+
+	if (argc > 2) {
+		for (i = 2; i < argc; i++) {
+			for (sack = 0; sack <= 1; sack++)
+				run(objects, atoi(argv[i]), sack);
+		}
+		return EXIT_SUCCESS;
+	}
+	for (i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+		for (sack = 0; sack <= 1; sack++)
+			run(objects, losses[i], sack);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FTFW through a lossy loopback link: the node receives what it sends, so
+ * its acknowledgments refer to its own messages, as those of a peer would.
+ * The alarms only go off when the link is idle and time is virtual, see
+ * loop_run(). The rest of the daemon is stubbed out.
+ */
+#ifndef _FTFW_LOOP_H_
+#define _FTFW_LOOP_H_
+
+#include "../../src/event.c"
+#include "../../src/queue.c"
+#include "../../src/network.c"
+#include "../../src/sync-ftfw.c"
+
+#include <arpa/inet.h>
+#include <limits.h>
+
+#define LOOP_PAYLOAD	120	/* about a TCP entry, see ct2msg() */
+#define LOOP_MSG_MAX	256
+#define LOOP_DELAY	100	/* usecs that it takes to cross the link */
+
+struct ct_conf conf;
+struct ct_state state;
+struct ct_general_state st;
+static struct ct_sync_state sync_state;
+
+static struct channel channel0;
+static struct multichannel mchannel;
+
+struct loop_msg {
+	char	buf[LOOP_MSG_MAX];
+};
+
+static struct {
+	struct loop_msg		*wire;		/* sent, in host byte order */
+	int			wire_num;
+	int			wire_max;
+	int			loss;		/* percentage that is dropped */
+
+	struct cache_object	**obj;
+	uint32_t		*id;
+	uint32_t		*delivered;	/* times that it got there */
+	uint32_t		objects;
+	uint32_t		released;
+
+	uint64_t		usecs;
+	uint64_t		sent;
+	uint64_t		bytes;
+	uint64_t		dropped;
+} loop;
+
+void init_alarm(struct alarm_block *t, void *data,
+		void (*fcn)(struct alarm_block *a, void *data))
+{
+	memset(t, 0, sizeof(*t));
+	t->data = data;
+	t->function = fcn;
+}
+
+void add_alarm(struct alarm_block *alarm, unsigned long sc, unsigned long usc)
+{
+	alarm->tv.tv_sec = sc;
+	alarm->tv.tv_usec = usc;
+}
+
+void del_alarm(struct alarm_block *alarm)
+{
+	alarm->tv.tv_sec = alarm->tv.tv_usec = 0;
+}
+
+int alarm_pending(struct alarm_block *alarm)
+{
+	return alarm->tv.tv_sec || alarm->tv.tv_usec;
+}
+
+void dlog(int priority, const char *format, ...)
+{
+}
+
+void cache_iterate(struct cache *c, void *data,
+		   int (*iterate)(void *data1, void *data2))
+{
+}
+
+void *cache_get_extra(struct cache_object *obj)
+{
+	return obj->data;
+}
+
+void cache_object_get(struct cache_object *obj)
+{
+	obj->refcnt++;
+}
+
+/* the peer acknowledged it */
+int cache_object_put(struct cache_object *obj)
+{
+	loop.released++;
+	return --obj->refcnt == 0;
+}
+
+uint32_t cache_object_hash(const struct cache_object *obj)
+{
+	return 0;
+}
+
+int multichannel_get_index(struct multichannel *m, struct channel *c)
+{
+	return 0;
+}
+
+struct channel *multichannel_stripe(struct multichannel *m, uint32_t hash)
+{
+	return m->current;
+}
+
+uint32_t multichannel_pace_wait(struct multichannel *m)
+{
+	return 0;
+}
+
+void multichannel_pace_ack(struct multichannel *m)
+{
+}
+
+void multichannel_pace_loss(struct multichannel *m)
+{
+}
+
+uint32_t sync_peer_expire(int secs)
+{
+	return 0;
+}
+
+/* what is dropped is decided once it is delivered, see loop_deliver() */
+int multichannel_send(struct multichannel *m, const struct nethdr *net)
+{
+	struct nethdr *copy;
+	int len = ntohs(net->len);
+
+	if (loop.wire_num == loop.wire_max) {
+		loop.wire_max = loop.wire_max ? loop.wire_max * 2 : 64;
+		loop.wire = realloc(loop.wire,
+				    loop.wire_max * sizeof(struct loop_msg));
+		if (loop.wire == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	copy = (struct nethdr *)loop.wire[loop.wire_num++].buf;
+	memcpy(copy, net, len);
+	HDR_NETWORK2HOST(copy);
+
+	loop.sent++;
+	loop.bytes += len;
+	return 0;
+}
+
+/* the data of the message is the number of the object */
+static struct nethdr *loop_build_msg(const struct cache_object *obj, int type)
+{
+	static char buf[LOOP_MSG_MAX];
+	struct nethdr *net = (struct nethdr *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	nethdr_set(net, type);
+	memcpy(NETHDR_DATA(net), obj->ptr, sizeof(uint32_t));
+	net->len += LOOP_PAYLOAD;
+	HDR_HOST2NETWORK(net);
+	return net;
+}
+
+static struct cache_ops loop_ops = {
+	.build_msg	= loop_build_msg,
+};
+
+static struct cache loop_cache = {
+	.type		= CACHE_T_CT,
+	.ops		= &loop_ops,
+};
+
+static void loop_init(int selective_ack, uint32_t objects)
+{
+	uint32_t i;
+
+	memset(&loop, 0, sizeof(loop));
+	memset(&sync_state, 0, sizeof(sync_state));
+	memset(&channel0, 0, sizeof(channel0));
+	memset(&mchannel, 0, sizeof(mchannel));
+	memset(rx_state, 0, sizeof(rx_state));
+	memset(&ftfw_stats, 0, sizeof(ftfw_stats));
+	hello_state = HELLO_INIT;
+	say_hello_back = 0;
+	srandom(1);
+
+	CONFIG(sync).selective_ack = selective_ack;
+	CONFIG(window_size) = 300;
+	CONFIG(resend_queue_size) = 131072;
+
+	mchannel.channel_num = 1;
+	mchannel.channel[0] = &channel0;
+	mchannel.current = mchannel.rx_current = &channel0;
+	state.sync = &sync_state;
+	STATE_SYNC(channel) = &mchannel;
+	STATE_SYNC(tx_queue) = queue_create("txqueue", INT_MAX, 0);
+	if (STATE_SYNC(tx_queue) == NULL || ftfw_init() < 0) {
+		perror("init");
+		exit(EXIT_FAILURE);
+	}
+
+	loop.objects = objects;
+	loop.obj = calloc(objects, sizeof(struct cache_object *));
+	loop.id = calloc(objects, sizeof(uint32_t));
+	loop.delivered = calloc(objects, sizeof(uint32_t));
+	if (loop.obj == NULL || loop.id == NULL || loop.delivered == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < objects; i++) {
+		loop.obj[i] = calloc(1, sizeof(struct cache_object) +
+					sizeof(struct cache_ftfw));
+		if (loop.obj[i] == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		loop.id[i] = i;
+		loop.obj[i]->ptr = &loop.id[i];
+		loop.obj[i]->cache = &loop_cache;
+		loop.obj[i]->status = C_OBJ_ALIVE;
+		loop.obj[i]->refcnt = 1;	/* the one of the cache */
+		cache_ftfw_extra.add(loop.obj[i],
+				     cache_get_extra(loop.obj[i]));
+	}
+}
+
+static void loop_fini(void)
+{
+	uint32_t i;
+
+	ftfw_kill();
+	queue_destroy(STATE_SYNC(tx_queue));
+	for (i = 0; i < loop.objects; i++)
+		free(loop.obj[i]);
+	free(loop.obj);
+	free(loop.id);
+	free(loop.delivered);
+	free(loop.wire);
+}
+
+/* the alarm goes off once the time that it was set for has passed */
+static int loop_alarm(struct alarm_block *a)
+{
+	if (!alarm_pending(a))
+		return 0;
+
+	loop.usecs += a->tv.tv_sec * 1000000ULL + a->tv.tv_usec;
+	del_alarm(a);
+	a->function(a, a->data);
+	return 1;
+}
+
+static void loop_deliver(void)
+{
+	struct nethdr *net;
+	uint32_t id;
+	int i, num = loop.wire_num;
+
+	/* what we get may make us send more, that goes in the next round */
+	loop.wire_num = 0;
+	loop.usecs += LOOP_DELAY;
+
+	for (i = 0; i < num; i++) {
+		net = (struct nethdr *)loop.wire[i].buf;
+		if (random() % 100 < loop.loss) {
+			loop.dropped++;
+			continue;
+		}
+		if (ftfw_recv(net) == MSG_DATA && IS_DATA(net)) {
+			memcpy(&id, NETHDR_DATA(net), sizeof(id));
+			loop.delivered[id]++;
+		}
+	}
+}
+
+/* say hello without losses, otherwise that flushes the resend queue */
+static int loop_hello(void)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (hello_state == HELLO_DONE && !say_hello_back)
+			return 0;
+
+		loop_alarm(&alive_alarm);
+		ftfw_xmit();
+		loop_deliver();
+	}
+	return -1;
+}
+
+static void loop_enqueue(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < loop.objects; i++)
+		ftfw_enqueue(loop.obj[i], 0);
+}
+
+static int loop_done(void)
+{
+	uint32_t i;
+
+	if (loop.released < loop.objects)
+		return 0;
+
+	for (i = 0; i < loop.objects; i++) {
+		if (loop.delivered[i] == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* returns the rounds that it takes until every object got there and was
+ * acknowledged, -1 if that takes more than max. */
+static int loop_run(int max)
+{
+	int rounds;
+
+	for (rounds = 0; rounds < max; rounds++) {
+		if (loop_done())
+			return rounds;
+
+		ftfw_xmit();
+		if (loop.wire_num == 0) {
+			/* the link is idle until the next alarm */
+			if (!loop_alarm(&sack_alarm))
+				loop_alarm(&alive_alarm);
+			continue;
+		}
+		loop_deliver();
+	}
+	return -1;
+}
+
+#endif
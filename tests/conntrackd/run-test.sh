@@ -0,0 +1,24 @@
+#!/bin/bash
+#
+# Unit tests of the daemon internals, they do not need root. Run them from
+# this directory once the tree has been configured.
+#
+
+CFLAGS="-Wall -I../../include -I../.."
+LIBS="-lnetfilter_conntrack -lnfnetlink -lmnl"
+ok=0
+bad=0
+
+for t in test-*.c
+do
+	gcc $CFLAGS $t -o ${t%.c} $LIBS || exit 1
+	if ./${t%.c}
+	then
+		ok=$((ok+1))
+	else
+		bad=$((bad+1))
+	fi
+done
+
+echo "OK: $ok BAD: $bad"
+[ $bad -eq 0 ]
@@ -0,0 +1,163 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Entries go through the compact encoding and come back the same, and
+ * the message is smaller than with the TLVs.
+ */
+
+#include "../../src/build.c"
+#include "../../src/parse.c"
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+struct ct_conf conf;
+struct ct_state state;
+struct ct_general_state st;
+static struct ct_sync_state sync_state;
+
+static char buf[4096];
+
+static struct nf_conntrack *ct_tcp(int family)
+{
+	struct nf_conntrack *ct = nfct_new();
+	struct in6_addr src, dst;
+
+	nfct_set_attr_u8(ct, ATTR_L3PROTO, family);
+	nfct_set_attr_u8(ct, ATTR_REPL_L3PROTO, family);
+	if (family == AF_INET) {
+		nfct_set_attr_u32(ct, ATTR_IPV4_SRC, inet_addr("10.0.0.1"));
+		nfct_set_attr_u32(ct, ATTR_IPV4_DST, inet_addr("10.0.0.2"));
+		nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC,
+				  inet_addr("10.0.0.2"));
+		nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST,
+				  inet_addr("10.0.0.1"));
+	} else {
+		inet_pton(AF_INET6, "2001:db8::1", &src);
+		inet_pton(AF_INET6, "2001:db8::2", &dst);
+		nfct_set_attr(ct, ATTR_IPV6_SRC, &src);
+		nfct_set_attr(ct, ATTR_IPV6_DST, &dst);
+		nfct_set_attr(ct, ATTR_REPL_IPV6_SRC, &dst);
+		nfct_set_attr(ct, ATTR_REPL_IPV6_DST, &src);
+	}
+	nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+	nfct_set_attr_u8(ct, ATTR_REPL_L4PROTO, IPPROTO_TCP);
+	nfct_set_attr_u16(ct, ATTR_PORT_SRC, htons(1024));
+	nfct_set_attr_u16(ct, ATTR_PORT_DST, htons(80));
+	nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, htons(80));
+	nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, htons(1024));
+	nfct_set_attr_u32(ct, ATTR_STATUS, IPS_CONFIRMED | IPS_ASSURED);
+	nfct_set_attr_u8(ct, ATTR_TCP_STATE, TCP_CONNTRACK_ESTABLISHED);
+	nfct_set_attr_u32(ct, ATTR_TIMEOUT, 300);
+	nfct_set_attr_u32(ct, ATTR_MARK, 7);
+	return ct;
+}
+
+/* the attributes that the compact block carries */
+static int ct_same(const struct nf_conntrack *a, const struct nf_conntrack *b)
+{
+	static const int attrs[] = {
+		ATTR_L4PROTO, ATTR_PORT_SRC, ATTR_PORT_DST, ATTR_STATUS,
+		ATTR_TCP_STATE, ATTR_TIMEOUT, ATTR_MARK,
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		if (!nfct_attr_is_set(b, attrs[i]))
+			return 0;
+	}
+	if (nfct_get_attr_u8(a, ATTR_L3PROTO) == AF_INET) {
+		if (nfct_get_attr_u32(a, ATTR_IPV4_SRC) !=
+		    nfct_get_attr_u32(b, ATTR_IPV4_SRC) ||
+		    nfct_get_attr_u32(a, ATTR_IPV4_DST) !=
+		    nfct_get_attr_u32(b, ATTR_IPV4_DST))
+			return 0;
+	} else {
+		if (!nfct_attr_is_set(b, ATTR_IPV6_SRC) ||
+		    memcmp(nfct_get_attr(a, ATTR_IPV6_SRC),
+			   nfct_get_attr(b, ATTR_IPV6_SRC), 16) ||
+		    memcmp(nfct_get_attr(a, ATTR_IPV6_DST),
+			   nfct_get_attr(b, ATTR_IPV6_DST), 16))
+			return 0;
+	}
+	return nfct_get_attr_u8(a, ATTR_L4PROTO) ==
+	       nfct_get_attr_u8(b, ATTR_L4PROTO) &&
+	       nfct_get_attr_u16(a, ATTR_PORT_SRC) ==
+	       nfct_get_attr_u16(b, ATTR_PORT_SRC) &&
+	       nfct_get_attr_u16(a, ATTR_PORT_DST) ==
+	       nfct_get_attr_u16(b, ATTR_PORT_DST) &&
+	       nfct_get_attr_u32(a, ATTR_STATUS) ==
+	       nfct_get_attr_u32(b, ATTR_STATUS) &&
+	       nfct_get_attr_u8(a, ATTR_TCP_STATE) ==
+	       nfct_get_attr_u8(b, ATTR_TCP_STATE) &&
+	       nfct_get_attr_u32(a, ATTR_TIMEOUT) ==
+	       nfct_get_attr_u32(b, ATTR_TIMEOUT) &&
+	       nfct_get_attr_u32(a, ATTR_MARK) ==
+	       nfct_get_attr_u32(b, ATTR_MARK);
+}
+
+/* the message is left in buf, msg2ct() converts it to host byte order */
+static struct nethdr *build(const struct nf_conntrack *ct, int compact)
+{
+	struct nethdr *net = (struct nethdr *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	net->version = CONNTRACKD_PROTOCOL_VERSION;
+	net->type = NET_T_STATE_CT_NEW;
+	net->len = NETHDR_SIZ;
+
+	STATE_SYNC(compact) = compact;
+	ct2msg(ct, net);
+	return net;
+}
+
+static void test_family(int family)
+{
+	struct nf_conntrack *ct = ct_tcp(family), *out = nfct_new();
+	struct nethdr *net;
+	int tlv, compact;
+
+	net = build(ct, 0);
+	tlv = net->len;
+	test_check(msg2ct(out, net, net->len) == 0);
+	test_check(ct_same(ct, out));
+
+	memset(out, 0, nfct_maxsize());
+	net = build(ct, 1);
+	compact = net->len;
+	test_check(net->version == CONNTRACKD_PROTOCOL_VERSION_COMPACT);
+	test_check(msg2ct(out, net, net->len) == 0);
+	test_check(ct_same(ct, out));
+	test_check(compact < tlv);
+
+	/* the mark is not set, so it is not present in the block */
+	nfct_attr_unset(ct, ATTR_MARK);
+	memset(out, 0, nfct_maxsize());
+	net = build(ct, 1);
+	test_check(msg2ct(out, net, net->len) == 0);
+	test_check(!nfct_attr_is_set(out, ATTR_MARK));
+
+	/* a block that does not fit in the message is rejected */
+	net = build(ct, 1);
+	net->len = NETHDR_SIZ + 8;
+	test_check(msg2ct(out, net, net->len) == -1);
+
+	nfct_destroy(ct);
+	nfct_destroy(out);
+}
+
+int main(void)
+{
+	state.sync = &sync_state;
+
+	test_family(AF_INET);
+	test_family(AF_INET6);
+
+	return test_end("compact encoding");
+}
@@ -0,0 +1,181 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Copies of the messages that the peer sends through all the redundant
+ * links, see nethdr_track_dup(): only the first one is applied.
+ */
+
+#include "../../src/network.c"
+#include "test.h"
+
+struct ct_conf conf;
+struct ct_state state;
+struct ct_general_state st;
+static struct ct_sync_state sync_state;
+
+static struct channel links[3];
+static struct multichannel mchannel;
+
+int multichannel_get_index(struct multichannel *m, struct channel *c)
+{
+	int i;
+
+	for (i = 0; i < m->channel_num; i++) {
+		if (m->channel[i] == c)
+			return i;
+	}
+	return -1;
+}
+
+int multichannel_send(struct multichannel *m, const struct nethdr *net)
+{
+	return 0;
+}
+
+struct channel *multichannel_stripe(struct multichannel *m, uint32_t hash)
+{
+	return m->current;
+}
+
+uint32_t cache_object_hash(const struct cache_object *obj)
+{
+	return 0;
+}
+
+static void setup(int channel_num)
+{
+	int i;
+
+	memset(&sync_state, 0, sizeof(sync_state));
+	memset(&mchannel, 0, sizeof(mchannel));
+	memset(links, 0, sizeof(links));
+	memset(rx_dedup, 0, sizeof(rx_dedup));
+	CONFIG(sync).node_id = 0;
+
+	mchannel.channel_num = channel_num;
+	for (i = 0; i < channel_num; i++) {
+		mchannel.channel[i] = &links[i];
+		links[i].seq_set_recv = 1;
+	}
+	mchannel.current = mchannel.rx_current = &links[0];
+	state.sync = &sync_state;
+	STATE_SYNC(channel) = &mchannel;
+}
+
+static int copy(int i, uint32_t seq)
+{
+	return nethdr_track_dup(&links[i], seq);
+}
+
+static void test_shared(void)
+{
+	setup(3);
+
+	/* until the peer says that it numbers the copies alike */
+	test_check(copy(0, 10) == 0 && copy(1, 10) == 0);
+
+	nethdr_track_shared(1);
+	test_check(mchannel.rx_shared == 1);
+	test_check(!links[0].seq_set_recv && !links[1].seq_set_recv);
+	test_check(nethdr_track_channel(&links[2]) == &links[0]);
+
+	test_check(copy(0, 10) == 0);
+	test_check(copy(1, 10) == 1);
+	test_check(copy(2, 10) == 1);
+	test_check(STATE_SYNC(dedup).dropped == 2);
+
+	/* the copy may arrive first through any link */
+	test_check(copy(2, 11) == 0);
+	test_check(copy(0, 11) == 1);
+
+	/* through the same link again, the peer has restarted */
+	test_check(copy(0, 10) == 0);
+	test_check(copy(1, 10) == 1);
+
+	/* relayed messages are numbered per link */
+	links[1].channel_relay_mode = 1;
+	test_check(copy(1, 11) == 0);
+	links[1].channel_relay_mode = 0;
+
+	nethdr_track_shared(0);
+	test_check(mchannel.rx_shared == 0);
+	test_check(nethdr_track_channel(&links[2]) == &links[2]);
+	test_check(copy(1, 11) == 0);
+}
+
+static void test_window(void)
+{
+	setup(2);
+	nethdr_track_shared(1);
+
+	test_check(copy(0, 100) == 0);
+	test_check(copy(0, 100 + DEDUP_WINDOW - 1) == 0);
+	test_check(copy(1, 100) == 1);
+
+	/* it slid past 100, what we know about it is gone */
+	test_check(copy(0, 100 + DEDUP_WINDOW) == 0);
+	test_check(copy(1, 100) == 0);
+	test_check(STATE_SYNC(dedup).old == 1);
+
+	/* a leap forgets it all */
+	test_check(copy(0, 100 + 4 * DEDUP_WINDOW) == 0);
+	test_check(copy(1, 99 + 4 * DEDUP_WINDOW) == 0);
+	test_check(copy(1, 100 + 4 * DEDUP_WINDOW) == 1);
+
+	/* the sequence numbers wrap around */
+	setup(2);
+	nethdr_track_shared(1);
+	test_check(copy(0, 0xfffffffeU) == 0);
+	test_check(copy(0, 1) == 0);
+	test_check(copy(1, 0xffffffffU) == 0);
+	test_check(copy(1, 0xfffffffeU) == 1);
+	test_check(copy(1, 1) == 1);
+	test_check(copy(0, 0xffffffffU) == 1);
+}
+
+/* one link, there is nothing to drop */
+static void test_single(void)
+{
+	setup(1);
+	nethdr_track_shared(1);
+
+	test_check(copy(0, 5) == 0 && copy(0, 5) == 0);
+	test_check(STATE_SYNC(dedup).dropped == 0);
+}
+
+/* in multi-peer mode, every node has its own sequence */
+static void test_peers(void)
+{
+	setup(2);
+	CONFIG(sync).node_id = 1;
+
+	STATE_SYNC(peers).current = 2;
+	nethdr_track_shared(1);
+	test_check(mchannel.rx_shared == 0);
+	test_check(copy(0, 7) == 0);
+
+	STATE_SYNC(peers).current = 3;
+	test_check(copy(1, 7) == 0);
+	nethdr_track_shared(1);
+	test_check(copy(1, 7) == 0);
+	test_check(copy(0, 7) == 1);
+
+	STATE_SYNC(peers).current = 2;
+	test_check(copy(1, 7) == 1);
+	test_check(STATE_SYNC(dedup).dropped == 2);
+}
+
+int main(void)
+{
+	test_shared();
+	test_window();
+	test_single();
+	test_peers();
+
+	return test_end("redundant link copies");
+}
@@ -0,0 +1,169 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Delta updates: one of them gets lost, the peer still ends up with the
+ * entry that we have, see internal_cache_ct_event_upd().
+ */
+
+#include "../../src/build.c"
+#include "../../src/parse.c"
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+struct ct_conf conf;
+struct ct_state state;
+struct ct_general_state st;
+static struct ct_sync_state sync_state;
+
+static char buf[4096];
+
+/* the internal cache entry, and the attributes sent as deltas since it
+ * was sent in full, as in struct cache_object. */
+static struct {
+	struct nf_conntrack	*ct;
+	uint16_t		delta;
+} obj;
+
+static struct nf_conntrack *peer;
+
+static struct nf_conntrack *ct_tcp(void)
+{
+	struct nf_conntrack *ct = nfct_new();
+
+	nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
+	nfct_set_attr_u32(ct, ATTR_IPV4_SRC, inet_addr("10.0.0.1"));
+	nfct_set_attr_u32(ct, ATTR_IPV4_DST, inet_addr("10.0.0.2"));
+	nfct_set_attr_u8(ct, ATTR_REPL_L3PROTO, AF_INET);
+	nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, inet_addr("10.0.0.2"));
+	nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, inet_addr("10.0.0.1"));
+	nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+	nfct_set_attr_u8(ct, ATTR_REPL_L4PROTO, IPPROTO_TCP);
+	nfct_set_attr_u16(ct, ATTR_PORT_SRC, htons(1024));
+	nfct_set_attr_u16(ct, ATTR_PORT_DST, htons(80));
+	nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, htons(80));
+	nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, htons(1024));
+	nfct_set_attr_u32(ct, ATTR_STATUS, IPS_CONFIRMED);
+	nfct_set_attr_u8(ct, ATTR_TCP_STATE, TCP_CONNTRACK_SYN_RECV);
+	nfct_set_attr_u32(ct, ATTR_TIMEOUT, 60);
+	nfct_set_attr_u32(ct, ATTR_MARK, 7);
+	return ct;
+}
+
+static struct nethdr *msg_new(int type)
+{
+	struct nethdr *net = (struct nethdr *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	net->version = CONNTRACKD_PROTOCOL_VERSION;
+	net->type = type;
+	net->len = NETHDR_SIZ;
+	return net;
+}
+
+/* the peer applies what it gets, as the ct.merge() handlers do */
+static void deliver(struct nethdr *net)
+{
+	struct nf_conntrack *ct = nfct_new();
+
+	test_check(msg2ct(ct, net, net->len) == 0);
+	nfct_copy(peer, ct, NFCT_CP_META);
+	nfct_destroy(ct);
+}
+
+static struct nethdr *send_full(void)
+{
+	struct nethdr *net = msg_new(NET_T_STATE_CT_UPD);
+
+	ct2msg(obj.ct, net);
+	obj.delta = 0;
+	return net;
+}
+
+/* an update event, the entry changes as set up by the caller */
+static struct nethdr *send_event(struct nf_conntrack *ct)
+{
+	struct nethdr *net = msg_new(NET_T_STATE_CT_DELTA);
+	int delta;
+
+	delta = ct_delta(obj.ct, ct);
+	test_check(delta != -1);
+	nfct_copy(obj.ct, ct, NFCT_CP_META);
+
+	obj.delta |= delta;
+	ct2msg_delta(obj.ct, net, obj.delta);
+	return net;
+}
+
+static int converged(void)
+{
+	return nfct_get_attr_u32(peer, ATTR_STATUS) ==
+	       nfct_get_attr_u32(obj.ct, ATTR_STATUS) &&
+	       nfct_get_attr_u8(peer, ATTR_TCP_STATE) ==
+	       nfct_get_attr_u8(obj.ct, ATTR_TCP_STATE) &&
+	       nfct_get_attr_u32(peer, ATTR_TIMEOUT) ==
+	       nfct_get_attr_u32(obj.ct, ATTR_TIMEOUT) &&
+	       nfct_get_attr_u32(peer, ATTR_MARK) ==
+	       nfct_get_attr_u32(obj.ct, ATTR_MARK);
+}
+
+static void test_lost_delta(int compact)
+{
+	struct nf_conntrack *ct;
+
+	STATE_SYNC(compact) = compact;
+	obj.ct = ct_tcp();
+	obj.delta = 0;
+	peer = nfct_new();
+	ct = nfct_new();
+
+	deliver(send_full());
+	test_check(converged());
+
+	/* delivered */
+	nfct_copy(ct, obj.ct, NFCT_CP_OVERRIDE);
+	nfct_set_attr_u32(ct, ATTR_MARK, 8);
+	deliver(send_event(ct));
+	test_check(converged());
+
+	/* lost, the next delta carries it too */
+	nfct_set_attr_u32(ct, ATTR_STATUS, IPS_CONFIRMED | IPS_SEEN_REPLY);
+	send_event(ct);
+	test_check(!converged());
+
+	nfct_set_attr_u8(ct, ATTR_TCP_STATE, TCP_CONNTRACK_ESTABLISHED);
+	nfct_set_attr_u32(ct, ATTR_TIMEOUT, 300);
+	deliver(send_event(ct));
+	test_check(obj.delta & NTA_C_STATUS);
+	test_check(converged());
+
+	/* lost, and no event follows: the refresh sends it in full */
+	nfct_set_attr_u32(ct, ATTR_MARK, 9);
+	send_event(ct);
+	test_check(!converged());
+	test_check(obj.delta != 0);
+
+	deliver(send_full());
+	test_check(obj.delta == 0);
+	test_check(converged());
+
+	nfct_destroy(ct);
+	nfct_destroy(peer);
+	nfct_destroy(obj.ct);
+}
+
+int main(void)
+{
+	state.sync = &sync_state;
+
+	test_lost_delta(0);
+	test_lost_delta(1);
+
+	return test_end("delta updates");
+}
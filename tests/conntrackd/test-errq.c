@@ -0,0 +1,175 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The error queue of a channel: datagrams that could not be delivered go
+ * again, in order, before anything else. The oldest make room once it is
+ * full, and the ring still works once head and tail wrap around.
+ */
+
+#include "../../src/channel.c"
+#include "test.h"
+
+#include <limits.h>
+
+struct ct_conf conf;
+
+struct channel_ops channel_mcast, channel_udp, channel_tcp, channel_xdp,
+		   channel_shm;
+
+void nethdr_set_seq(struct nethdr *net, struct channel *current)
+{
+}
+
+/* the link, it is down while fail is set */
+static struct {
+	int	fail;
+	uint32_t id[16];	/* first message of the datagrams delivered */
+	int	num;
+} link_state;
+
+static int fake_send(void *channel, const void *data, int len)
+{
+	if (link_state.fail)
+		return -1;
+
+	if (link_state.num < 16)
+		link_state.id[link_state.num++] =
+			((const struct nethdr *)data)->seq;
+	return len;
+}
+
+static struct channel_ops fake_ops = {
+	.send	= fake_send,
+};
+
+static struct nethdr *msg(char *buf, int id, int len)
+{
+	struct nethdr *net = (struct nethdr *)buf;
+
+	memset(buf, 0, len);
+	net->seq = id;
+	net->len = htons(len);
+	return net;
+}
+
+static void enqueue(struct channel *c, int id, int len)
+{
+	char buf[256];
+
+	__channel_enqueue_errors(c, (char *)msg(buf, id, len), len);
+}
+
+static void retry(struct channel *c)
+{
+	memset(&link_state, 0, sizeof(link_state));
+	test_check(channel_handle_errors(c) == 0);
+}
+
+static void test_size(void)
+{
+	struct channel_errq *q;
+
+	q = channel_errq_open(100, 3);
+	test_check(q != NULL && q->num == 4 && q->mask == 3);
+	channel_errq_close(q);
+
+	q = channel_errq_open(100, 4);
+	test_check(q != NULL && q->num == 4);
+	channel_errq_close(q);
+
+	q = channel_errq_open(100, 5);
+	test_check(q != NULL && q->num == 8 && q->mask == 7);
+	channel_errq_close(q);
+}
+
+static void test_ring(void)
+{
+	struct channel c = { .ops = &fake_ops };
+	struct channel_errq *q;
+	int i;
+
+	c.errq = q = channel_errq_open(100, 4);
+
+	/* full, the oldest ones go */
+	for (i = 0; i < 6; i++)
+		enqueue(&c, i, 40);
+	test_check(q->head - q->tail == 4);
+	test_check(q->stats.queued == 6 && q->stats.dropped == 2);
+
+	retry(&c);
+	test_check(link_state.num == 4);
+	test_check(link_state.id[0] == 2 && link_state.id[3] == 5);
+	test_check(q->stats.retried == 4 && q->head == q->tail);
+
+	/* larger than a slot */
+	enqueue(&c, 6, 101);
+	test_check(q->head == q->tail && q->stats.dropped == 3);
+
+	/* still down, it stops at the first one and keeps the rest */
+	enqueue(&c, 7, 40);
+	enqueue(&c, 8, 40);
+	link_state.fail = 1;
+	test_check(channel_handle_errors(&c) == 1);
+	test_check(q->head - q->tail == 2);
+
+	retry(&c);
+	test_check(link_state.num == 2);
+	test_check(link_state.id[0] == 7 && link_state.id[1] == 8);
+
+	/* head and tail wrap around */
+	q->head = q->tail = UINT_MAX - 1;
+	for (i = 0; i < 5; i++)
+		enqueue(&c, 10 + i, 40);
+	test_check(q->head == 3 && q->head - q->tail == 4);
+
+	retry(&c);
+	test_check(link_state.num == 4);
+	test_check(link_state.id[0] == 11 && link_state.id[3] == 14);
+
+	channel_errq_close(q);
+}
+
+/* what the buffer could not deliver goes before the next datagrams */
+static void test_send(void)
+{
+	struct channel c = {
+		.ops		= &fake_ops,
+		.channel_flags	= CHANNEL_F_BUFFERED | CHANNEL_F_ERRORS,
+	};
+	char buf[64];
+
+	c.buffer = channel_buffer_open(100, 0);
+	c.errq = channel_errq_open(100, 4);
+
+	memset(&link_state, 0, sizeof(link_state));
+	link_state.fail = 1;
+	channel_send(&c, msg(buf, 1, 60));
+	channel_send(&c, msg(buf, 2, 60));
+	test_check(c.errq->head - c.errq->tail == 1);
+
+	link_state.fail = 0;
+	channel_send(&c, msg(buf, 3, 60));
+	test_check(link_state.num == 2);
+	test_check(link_state.id[0] == 1 && link_state.id[1] == 2);
+	test_check(c.errq->head == c.errq->tail);
+
+	channel_send_flush(&c);
+	test_check(link_state.num == 3 && link_state.id[2] == 3);
+
+	channel_errq_close(c.errq);
+	channel_buffer_close(c.buffer);
+}
+
+int main(void)
+{
+	test_size();
+	test_ring();
+	test_send();
+
+	return test_end("channel error queue");
+}
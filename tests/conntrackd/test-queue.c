@@ -0,0 +1,145 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The QUEUE_F_SEQ ring of the FTFW resend queue: ranges, sequence numbers
+ * that wrap around, and the oldest ones being skipped once released.
+ */
+
+#include "../../src/event.c"
+#include "../../src/queue.c"
+#include "test.h"
+
+struct node {
+	struct queue_node	qnode;
+	uint32_t		seq;
+};
+
+struct walk {
+	uint32_t	seq[16];
+	int		num;
+	int		stop;	/* stop after this many nodes, if not zero */
+};
+
+static int walk_cb(struct queue_node *n, const void *data)
+{
+	struct walk *w = (struct walk *)data;
+
+	w->seq[w->num++] = ((struct node *)n)->seq;
+	return w->stop && w->num == w->stop;
+}
+
+static struct node *node_new(uint32_t seq)
+{
+	struct node *n = calloc(1, sizeof(*n));
+
+	queue_node_init(&n->qnode, Q_ELEM_OBJ);
+	n->seq = seq;
+	return n;
+}
+
+static int add(struct queue *q, struct node *n)
+{
+	return queue_add_seq(q, &n->qnode, n->seq);
+}
+
+static void test_range(void)
+{
+	struct queue *q = queue_create("test", 8, QUEUE_F_SEQ);
+	struct node *n[8];
+	struct walk w = {};
+	int i;
+
+	test_check(q != NULL);
+	test_check(q->slots_mask == 7);
+
+	for (i = 0; i < 6; i++) {
+		n[i] = node_new(100 + i);
+		test_check(add(q, n[i]) == 1);
+	}
+	test_check(queue_len(q) == 6);
+
+	queue_iterate_seq(q, 102, 103, &w, walk_cb);
+	test_check(w.num == 2 && w.seq[0] == 102 && w.seq[1] == 103);
+
+	/* out of the queue range, only what is in use is walked */
+	memset(&w, 0, sizeof(w));
+	queue_iterate_seq(q, 50, 1000, &w, walk_cb);
+	test_check(w.num == 6 && w.seq[0] == 100 && w.seq[5] == 105);
+
+	/* the callback stops the walk */
+	memset(&w, 0, sizeof(w));
+	w.stop = 3;
+	queue_iterate(q, &w, walk_cb);
+	test_check(w.num == 3 && w.seq[2] == 102);
+
+	/* 108 does not fit in the ring while 100 is in use */
+	n[6] = node_new(108);
+	test_check(add(q, n[6]) == -1 && errno == ENOSPC);
+
+	/* once 100 and 101 are released, queue_seq_trim() makes room */
+	test_check(queue_del(&n[0]->qnode) == 1);
+	test_check(queue_del(&n[1]->qnode) == 1);
+	test_check(add(q, n[6]) == 1);
+	test_check(q->seq_first == 102 && q->seq_last == 108);
+
+	/* several nodes may share a sequence number */
+	n[7] = node_new(104);
+	test_check(add(q, n[7]) == 1);
+	memset(&w, 0, sizeof(w));
+	queue_iterate_seq(q, 104, 104, &w, walk_cb);
+	test_check(w.num == 2 && w.seq[0] == 104 && w.seq[1] == 104);
+
+	/* the oldest goes first */
+	test_check(queue_del_head(q) == &n[2]->qnode);
+	test_check(queue_len(q) == 5);
+
+	while (queue_del_head(q) != NULL)
+		;
+	test_check(queue_len(q) == 0);
+
+	for (i = 0; i < 8; i++)
+		free(n[i]);
+	queue_destroy(q);
+}
+
+static void test_wrap(void)
+{
+	struct queue *q = queue_create("test", 8, QUEUE_F_SEQ);
+	struct node *n[4];
+	struct walk w = {};
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		n[i] = node_new(0xfffffffeU + i);
+		test_check(add(q, n[i]) == 1);
+	}
+	queue_iterate_seq(q, 0xfffffffeU, 1, &w, walk_cb);
+	test_check(w.num == 4);
+	test_check(w.seq[0] == 0xfffffffeU && w.seq[3] == 1);
+
+	/* nodes added out of order are walked in sequence order */
+	queue_del(&n[0]->qnode);
+	test_check(add(q, n[0]) == 1);
+	memset(&w, 0, sizeof(w));
+	queue_iterate(q, &w, walk_cb);
+	test_check(w.num == 4 && w.seq[0] == 0xfffffffeU && w.seq[3] == 1);
+
+	for (i = 0; i < 4; i++) {
+		queue_del(&n[i]->qnode);
+		free(n[i]);
+	}
+	queue_destroy(q);
+}
+
+int main(void)
+{
+	test_range();
+	test_wrap();
+
+	return test_end("sequence indexed queue");
+}
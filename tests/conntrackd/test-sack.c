@@ -0,0 +1,195 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Selective nack of FTFW: the map of what we got, the holes that the peer
+ * resends according to it, and a lossy link that it recovers from.
+ */
+
+#include "ftfw-loop.h"
+#include "test.h"
+
+static int recv_seq(uint32_t seq)
+{
+	struct nethdr net = {
+		.version	= CONNTRACKD_PROTOCOL_VERSION,
+		.type		= NET_T_STATE_CT_UPD,
+		.len		= NETHDR_SIZ,
+		.seq		= seq,
+	};
+
+	return ftfw_recv(&net);
+}
+
+/* the messages that got through, except those in skip */
+static void recv_range(uint32_t from, uint32_t to, uint32_t skip)
+{
+	uint32_t seq;
+
+	for (seq = from; seq <= to; seq++) {
+		if (seq != skip)
+			test_check(recv_seq(seq) == MSG_DATA);
+	}
+}
+
+static struct nethdr *sent(int i)
+{
+	return (struct nethdr *)loop.wire[i].buf;
+}
+
+/* map bits that are set, but should not, and the other way around */
+static int map_wrong(const struct nethdr_sack *sack, uint32_t num,
+		     const uint32_t *holes, int holes_num)
+{
+	uint32_t i;
+	int j, hole, wrong = 0;
+
+	for (i = 0; i < num; i++) {
+		for (hole = 0, j = 0; j < holes_num; j++)
+			hole |= holes[j] == sack->ack.from + i;
+
+		if ((sack_test(sack->map, i) != 0) == hole)
+			wrong++;
+	}
+	return wrong;
+}
+
+static int tx_queue_id(struct queue_node *n, const void *data)
+{
+	uint32_t *ids = (uint32_t *)data;
+	struct cache_ftfw *cn = (struct cache_ftfw *)n;
+
+	if (n->type == Q_ELEM_OBJ)
+		ids[ids[0]++ + 1] = *(uint32_t *)cn->obj->ptr;
+	return 0;
+}
+
+static void test_holes(void)
+{
+	static const uint32_t holes[] = { 4, 7 };
+	struct nethdr_sack sack;
+	uint32_t ids[4] = {};
+	uint32_t i;
+
+	loop_init(1, 10);
+	recv_range(1, 6, 4);
+	recv_range(8, 10, 0);
+
+	/* the holes wait, so that one nack asks for all of them */
+	ftfw_xmit();
+	test_check(loop.wire_num == 0);
+	test_check(loop_alarm(&sack_alarm));
+	ftfw_xmit();
+	test_check(loop.wire_num == 1);
+	test_check(IS_NACK(sent(0)) && sent(0)->len == NETHDR_SACK_SIZ);
+
+	memcpy(&sack, sent(0), sizeof(sack));
+	test_check(sack.ack.from == 1 && sack.ack.to == 10);
+	test_check(map_wrong(&sack, 10, holes, 2) == 0);
+	test_check(ftfw_stats.sack_sent == 1 && ftfw_stats.sack_holes == 2);
+
+	/* we sent those ten, the peer gets the holes again only */
+	rs_queue_flush();
+	for (i = 0; i < 10; i++) {
+		struct cache_ftfw *cn = cache_get_extra(loop.obj[i]);
+
+		cache_object_get(loop.obj[i]);
+		rs_queue_add(&channel0, &cn->qnode, i + 1);
+	}
+	test_check(digest_msg((struct nethdr *)&sack) == MSG_CTL);
+	test_check(ftfw_stats.sack_resent == 2);
+	test_check(ftfw_stats.sack_released == 8 && loop.released == 8);
+	test_check(queue_len(rs_queue[0]) == 0);
+
+	queue_iterate(STATE_SYNC(tx_queue), ids, tx_queue_id);
+	test_check(ids[0] == 2 && ids[1] == 3 && ids[2] == 6);
+
+	loop_fini();
+}
+
+/* the map covers NETHDR_SACK_BITS messages, then it goes at once */
+static void test_full(void)
+{
+	static const uint32_t holes[] = { 4 };
+	struct nethdr_sack sack;
+
+	loop_init(1, 0);
+	recv_range(1, NETHDR_SACK_BITS + 10, 4);
+	ftfw_xmit();
+	test_check(loop.wire_num == 1);
+	test_check(IS_NACK(sent(0)) && sent(0)->len == NETHDR_SACK_SIZ);
+
+	memcpy(&sack, sent(0), sizeof(sack));
+	test_check(sack.ack.from == 1 && sack.ack.to == NETHDR_SACK_BITS);
+	test_check(map_wrong(&sack, NETHDR_SACK_BITS, holes, 1) == 0);
+	test_check(sack_alarm.tv.tv_usec == SACK_DELAY);
+
+	/* nothing is missing since then */
+	loop.wire_num = 0;
+	test_check(loop_alarm(&sack_alarm));
+	ftfw_xmit();
+	test_check(loop.wire_num == 0);
+
+	loop_fini();
+}
+
+/* a gap that does not fit in the map gets a plain nack */
+static void test_far(void)
+{
+	const struct nethdr_ack *ack;
+
+	loop_init(1, 0);
+	recv_range(1, 2, 0);
+	test_check(recv_seq(NETHDR_SACK_BITS + 100) == MSG_DATA);
+	ftfw_xmit();
+	test_check(loop.wire_num == 2);
+
+	ack = (const struct nethdr_ack *)sent(0);
+	test_check(IS_ACK(sent(0)) && ack->from == 1 && ack->to == 2);
+	ack = (const struct nethdr_ack *)sent(1);
+	test_check(IS_NACK(sent(1)) && sent(1)->len == NETHDR_ACK_SIZ);
+	test_check(ack->from == 3 && ack->to == NETHDR_SACK_BITS + 99);
+	test_check(ftfw_stats.sack_sent == 0);
+
+	loop_fini();
+}
+
+/* every object gets there in the end, with and without the map */
+static void test_lossy(void)
+{
+	uint32_t i, missing;
+	int sack;
+
+	for (sack = 0; sack <= 1; sack++) {
+		loop_init(sack, 1000);
+		test_check(loop_hello() == 0);
+
+		loop.loss = 10;
+		loop_enqueue();
+		test_check(loop_run(10000) > 0);
+		test_check(loop.dropped > 0);
+
+		for (i = 0, missing = 0; i < loop.objects; i++)
+			missing += loop.delivered[i] == 0;
+		test_check(missing == 0);
+		test_check(loop.released == loop.objects);
+		test_check(sack ? ftfw_stats.sack_resent > 0 :
+				  ftfw_stats.sack_sent == 0);
+
+		loop_fini();
+	}
+}
+
+int main(void)
+{
+	test_holes();
+	test_full();
+	test_far();
+	test_lossy();
+
+	return test_end("selective nack");
+}
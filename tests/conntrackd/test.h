@@ -0,0 +1,37 @@
+/*
+ * (C) 2026 by agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Unit tests of the daemon internals. Each test includes the sources that
+ * it checks, so their static functions can be tested as well.
+ */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_ok, test_bad;
+
+#define test_check(cond)						\
+({									\
+	if (cond)							\
+		test_ok++;						\
+	else {								\
+		test_bad++;						\
+		printf("%s:%d: %s ^----- BAD\n",			\
+		       __FILE__, __LINE__, #cond);			\
+	}								\
+})
+
+static inline int test_end(const char *name)
+{
+	printf("%s: OK: %d BAD: %d\n", name, test_ok, test_bad);
+	return test_bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif